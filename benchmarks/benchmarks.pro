@@ -0,0 +1,3 @@
+# Benchmarks for syncd; see the comment at the top of each benchmark's main.cpp.
+TEMPLATE = subdirs
+SUBDIRS = loopback filesync soak tlshandshake
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Deliberately free of Qt and stdlib.h: they declare malloc() and friends
+// with exception specifications that our definitions can't match.
+#include <limits.h> // for __GLIBC__
+#include <stddef.h>
+
+// Us
+#include "allocationcounter.h"
+
+static unsigned long long allocationCount = 0;
+static unsigned long long allocationBytes = 0;
+
+static inline void countAllocation(size_t size)
+{
+    __sync_fetch_and_add(&allocationCount, 1ULL);
+    __sync_fetch_and_add(&allocationBytes, (unsigned long long)size);
+}
+
+#if defined(__GLIBC__)
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+// definitions in the executable take precedence over libc's, for every
+// library in the process
+void *malloc(size_t size)
+{
+    countAllocation(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    countAllocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    countAllocation(size);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+}
+
+bool AllocationCounter::isAvailable()
+{
+    return true;
+}
+#else
+bool AllocationCounter::isAvailable()
+{
+    return false;
+}
+#endif
+
+unsigned long long AllocationCounter::allocations()
+{
+    return __sync_fetch_and_add(&allocationCount, 0ULL);
+}
+
+unsigned long long AllocationCounter::allocatedBytes()
+{
+    return __sync_fetch_and_add(&allocationBytes, 0ULL);
+}
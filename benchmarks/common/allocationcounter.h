@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ALLOCATIONCOUNTER_H
+#define ALLOCATIONCOUNTER_H
+
+/*! Counts heap allocations made by the whole process, including those made
+ * inside Qt, by interposing malloc() and friends.
+ *
+ * Only available with glibc; elsewhere isAvailable() returns false and the
+ * counts stay at zero.
+ */
+class AllocationCounter
+{
+public:
+    static bool isAvailable();
+    static unsigned long long allocations();
+    static unsigned long long allocatedBytes();
+};
+
+#endif // ALLOCATIONCOUNTER_H
@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QCoreApplication>
+#include <QDesktopServices>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHostAddress>
+#include <QList>
+
+// Saesu
+#include <sobject.h>
+
+// Posix
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Us
+#include "benchmarkprocess.h"
+#include "syncprotocol.h"
+
+ProcessCounters::ProcessCounters()
+    : readCalls(0)
+    , writeCalls(0)
+    , userMicroseconds(0)
+    , systemMicroseconds(0)
+    , peakRssKb(0)
+{
+}
+
+/*! Returns CLOCK_MONOTONIC in nanoseconds, which is comparable between
+ * processes.
+ */
+qint64 BenchmarkProcess::monotonicTime()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return qint64(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+ProcessCounters BenchmarkProcess::counters()
+{
+    ProcessCounters counters;
+
+    // read with stdio rather than QFile, so as not to allocate
+    FILE *io = fopen("/proc/self/io", "r");
+    if (io) {
+        char line[128];
+        unsigned long long value;
+
+        while (fgets(line, sizeof(line), io)) {
+            if (sscanf(line, "syscr: %llu", &value) == 1)
+                counters.readCalls = value;
+            else if (sscanf(line, "syscw: %llu", &value) == 1)
+                counters.writeCalls = value;
+        }
+
+        fclose(io);
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        counters.userMicroseconds = quint64(usage.ru_utime.tv_sec) * 1000000 + usage.ru_utime.tv_usec;
+        counters.systemMicroseconds = quint64(usage.ru_stime.tv_sec) * 1000000 + usage.ru_stime.tv_usec;
+        counters.peakRssKb = usage.ru_maxrss;
+    }
+
+    return counters;
+}
+
+/*! Returns the resident set size right now, as opposed to its peak.
+ */
+quint64 BenchmarkProcess::residentKb()
+{
+    unsigned long long size = 0;
+    unsigned long long resident = 0;
+
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+        return 0;
+
+    if (fscanf(statm, "%llu %llu", &size, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+
+    return resident * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+/*! Returns how many file descriptors this process has open, or -1 if that
+ * can't be found out.
+ */
+int BenchmarkProcess::openFileCount()
+{
+    DIR *fds = opendir("/proc/self/fd");
+    if (!fds)
+        return -1;
+
+    int count = 0;
+    while (struct dirent *entry = readdir(fds)) {
+        if (entry->d_name[0] != '.')
+            count++;
+    }
+    closedir(fds);
+
+    // not counting the one used to list them
+    return count - 1;
+}
+
+/*! Returns a socket listening on an ephemeral loopback port, which is
+ * stored in \a port, or -1 on failure.
+ *
+ * Sockets are bound before forking, so every node knows every port up
+ * front.
+ */
+int BenchmarkProcess::listenOnLoopback(quint16 *port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+
+    socklen_t length = sizeof(address);
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) < 0 ||
+        listen(fd, 64) < 0 ||
+        getsockname(fd, reinterpret_cast<struct sockaddr *>(&address), &length) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    *port = ntohs(address.sin_port);
+    return fd;
+}
+
+void BenchmarkProcess::removeTree(const QString &path)
+{
+    QDir dir(path);
+    foreach (const QFileInfo &info, dir.entryInfoList(QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot)) {
+        if (info.isDir() && !info.isSymLink())
+            removeTree(info.filePath());
+        else
+            QFile::remove(info.filePath());
+    }
+    dir.rmdir(path);
+}
+
+/*! Points this process' home, settings and data at \a home, and makes it
+ * the working directory, so nodes keep their files apart.
+ *
+ * Must be called before the application object is created.
+ */
+bool BenchmarkProcess::isolate(const QByteArray &home)
+{
+    mkdir(home.constData(), 0700);
+    setenv("HOME", home.constData(), 1);
+    setenv("XDG_DATA_HOME", (home + "/.local/share").constData(), 1);
+    setenv("XDG_CONFIG_HOME", (home + "/.config").constData(), 1);
+    return chdir(home.constData()) == 0;
+}
+
+/*! Registers what main.cpp registers for syncd.
+ */
+void BenchmarkProcess::registerMetaTypes()
+{
+    qRegisterMetaType<QHostAddress>("QHostAddress");
+    qRegisterMetaType<QList<SObject> >("QList<SObject>");
+    qRegisterMetaType<QList<SObjectLocalId> >("QList<SObjectLocalId>");
+    qRegisterMetaType<SyncFrame>("SyncFrame");
+    qRegisterMetaType<QList<SyncFrame> >("QList<SyncFrame>");
+}
+
+/*! Creates an (empty) database for each of \a clouds where CloudRegistry
+ * looks for them; the data itself comes from MockStore.
+ */
+void BenchmarkProcess::createClouds(const QStringList &clouds)
+{
+    QCoreApplication *a = QCoreApplication::instance();
+    const QString orgName = a->organizationName();
+    const QString appName = a->applicationName();
+
+    a->setOrganizationName(QLatin1String("saesu"));
+    a->setApplicationName(QLatin1String("clouds"));
+
+    const QString databasePath = QDesktopServices::storageLocation(QDesktopServices::DataLocation);
+
+    a->setOrganizationName(orgName);
+    a->setApplicationName(appName);
+
+    QDir().mkpath(databasePath);
+    foreach (const QString &cloudName, clouds) {
+        QFile database(databasePath + QLatin1Char('/') + cloudName);
+        database.open(QIODevice::WriteOnly);
+    }
+}
+
+/*! Waits until \a deadline for any of \a fds to become readable, storing
+ * their indexes in \a readable; negative fds are skipped. Returns false on
+ * timeout, or if there's nothing left to wait for.
+ */
+bool BenchmarkProcess::waitForReports(const QVector<int> &fds, qint64 deadline, QVector<int> *readable)
+{
+    QVector<struct pollfd> pollFds;
+    QVector<int> owners;
+    for (int i = 0; i < fds.count(); ++i) {
+        if (fds.at(i) < 0)
+            continue;
+
+        struct pollfd fd;
+        fd.fd = fds.at(i);
+        fd.events = POLLIN;
+        fd.revents = 0;
+        pollFds.append(fd);
+        owners.append(i);
+    }
+
+    if (pollFds.isEmpty())
+        return false;
+
+    const int timeout = qMax<qint64>(0, (deadline - monotonicTime()) / 1000000);
+    int ready = poll(pollFds.data(), pollFds.count(), timeout);
+    if (ready < 0 && errno == EINTR)
+        return true;
+    if (ready <= 0)
+        return false;
+
+    for (int i = 0; i < pollFds.count(); ++i) {
+        if (pollFds.at(i).revents)
+            readable->append(owners.at(i));
+    }
+
+    return true;
+}
+
+/*! Reads one report of \a size bytes from \a reportFd, closing it if the
+ * node has gone.
+ */
+bool BenchmarkProcess::readReport(int *reportFd, void *report, size_t size)
+{
+    if (read(*reportFd, report, size) == ssize_t(size))
+        return true;
+
+    // the node has exited, or died
+    close(*reportFd);
+    *reportFd = -1;
+    return false;
+}
+
+void BenchmarkProcess::sendCommand(int node, int controlFd, char command)
+{
+    if (controlFd >= 0 && write(controlFd, &command, 1) != 1)
+        fprintf(stderr, "couldn't signal node %d\n", node);
+}
+
+void BenchmarkProcess::stopNode(pid_t pid, int *controlFd, bool finished)
+{
+    if (*controlFd >= 0) {
+        close(*controlFd);
+        *controlFd = -1;
+    }
+
+    if (!finished)
+        kill(pid, SIGKILL);
+    waitpid(pid, 0, 0);
+}
+
+/*! Reads the coordinator's next command from \a controlFd; if it has gone
+ * away, that's taken as 'q'.
+ */
+char BenchmarkProcess::readCommand(int controlFd)
+{
+    char command;
+    if (read(controlFd, &command, sizeof(command)) != sizeof(command))
+        return 'q';
+
+    return command;
+}
+
+bool BenchmarkProcess::writeReport(int reportFd, const void *report, size_t size)
+{
+    return write(reportFd, report, size) == ssize_t(size);
+}
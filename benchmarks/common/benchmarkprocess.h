@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BENCHMARKPROCESS_H
+#define BENCHMARKPROCESS_H
+
+// Qt
+#include <QByteArray>
+#include <QMap>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+// Posix
+#include <limits.h>
+#include <sys/types.h>
+
+/*! What the kernel counts for this process.
+ */
+struct ProcessCounters
+{
+    ProcessCounters();
+
+    // read and write family system calls, from /proc/self/io
+    quint64 readCalls;
+    quint64 writeCalls;
+
+    quint64 userMicroseconds;
+    quint64 systemMicroseconds;
+    quint64 peakRssKb;
+};
+
+/*! A node process, as seen by the coordinator that forked it.
+ *
+ * \c Report is the fixed size report the node writes back; it must have a
+ * \c kind member, and a \c Final kind sent as the node quits.
+ */
+template <typename Report>
+struct NodeProcess
+{
+    NodeProcess() : pid(-1), controlFd(-1), reportFd(-1), latest() {}
+
+    bool hasReported(int kind) const { return reports.contains(kind); }
+    bool isFinished() const { return hasReported(Report::Final); }
+
+    pid_t pid;
+    int controlFd; // single byte commands to the node
+    int reportFd;  // reports from the node
+
+    Report latest;
+    QMap<int, Report> reports; // the latest of each kind
+};
+
+/*! Plumbing shared by the benchmarks, each of which runs its nodes as
+ * separate processes so they can't share any state by accident.
+ */
+class BenchmarkProcess
+{
+public:
+    static qint64 monotonicTime();
+    static ProcessCounters counters();
+    static quint64 residentKb();
+    static int openFileCount();
+
+    static int listenOnLoopback(quint16 *port);
+    static void removeTree(const QString &path);
+
+    static bool isolate(const QByteArray &home);
+    static void registerMetaTypes();
+    static void createClouds(const QStringList &clouds);
+
+    // coordinator side
+    template <typename Report>
+    static bool readReports(QVector<NodeProcess<Report> > &nodes, qint64 deadline);
+    template <typename Report>
+    static void sendCommand(const QVector<NodeProcess<Report> > &nodes, char command);
+    template <typename Report>
+    static void stopNodes(QVector<NodeProcess<Report> > &nodes);
+
+    // node side
+    static char readCommand(int controlFd);
+    template <typename Report>
+    static bool writeReport(int reportFd, const Report &report);
+
+private:
+    static bool waitForReports(const QVector<int> &fds, qint64 deadline, QVector<int> *readable);
+    static bool readReport(int *reportFd, void *report, size_t size);
+    static void sendCommand(int node, int controlFd, char command);
+    static void stopNode(pid_t pid, int *controlFd, bool finished);
+    static bool writeReport(int reportFd, const void *report, size_t size);
+};
+
+/*! Waits until \a deadline for reports from any of \a nodes, returning false
+ * on timeout or once every node has closed its end.
+ */
+template <typename Report>
+bool BenchmarkProcess::readReports(QVector<NodeProcess<Report> > &nodes, qint64 deadline)
+{
+    QVector<int> fds;
+    for (int i = 0; i < nodes.count(); ++i)
+        fds.append(nodes.at(i).reportFd);
+
+    QVector<int> readable;
+    if (!waitForReports(fds, deadline, &readable))
+        return false;
+
+    foreach (int i, readable) {
+        NodeProcess<Report> &node = nodes[i];
+        Report report;
+        if (!readReport(&node.reportFd, &report, sizeof(report)))
+            continue;
+
+        node.latest = report;
+        node.reports.insert(report.kind, report);
+    }
+
+    return true;
+}
+
+template <typename Report>
+void BenchmarkProcess::sendCommand(const QVector<NodeProcess<Report> > &nodes, char command)
+{
+    for (int i = 0; i < nodes.count(); ++i)
+        sendCommand(i, nodes.at(i).controlFd, command);
+}
+
+/*! Asks \a nodes to quit, giving them a few seconds to send their final
+ * reports before they're killed, and reaps them.
+ */
+template <typename Report>
+void BenchmarkProcess::stopNodes(QVector<NodeProcess<Report> > &nodes)
+{
+    sendCommand(nodes, 'q');
+    const qint64 quitDeadline = monotonicTime() + 10 * qint64(1000000000);
+    while (readReports(nodes, quitDeadline))
+        ;
+
+    for (int i = 0; i < nodes.count(); ++i)
+        stopNode(nodes.at(i).pid, &nodes[i].controlFd, nodes.at(i).isFinished());
+}
+
+template <typename Report>
+bool BenchmarkProcess::writeReport(int reportFd, const Report &report)
+{
+    // smaller than PIPE_BUF, so written in one go and never interleaved
+    Q_ASSERT(sizeof(Report) <= PIPE_BUF);
+    return writeReport(reportFd, &report, sizeof(report));
+}
+
+#endif // BENCHMARKPROCESS_H
@@ -0,0 +1,73 @@
+# Builds syncd's synchronisation code against an in-memory stand-in for
+# libsaesu (see saesu/), so benchmarks run without real storage.
+
+QT += network
+CONFIG += console
+CONFIG -= app_bundle
+
+MOC_DIR = ./.moc/
+OBJECTS_DIR = ./.obj/
+
+SYNCD_SRC = $$PWD/../../src
+
+INCLUDEPATH += $$PWD $$PWD/saesu $$SYNCD_SRC
+DEPENDPATH += $$PWD $$PWD/saesu $$SYNCD_SRC
+
+SOURCES += $$SYNCD_SRC/syncmanagersynchroniser.cpp \
+    $$SYNCD_SRC/syncmanager.cpp \
+    $$SYNCD_SRC/syncserver.cpp \
+    $$SYNCD_SRC/syncworkerpool.cpp \
+    $$SYNCD_SRC/fileassembler.cpp \
+    $$SYNCD_SRC/filetransfer.cpp \
+    $$SYNCD_SRC/objectspool.cpp \
+    $$SYNCD_SRC/cloudregistry.cpp \
+    $$SYNCD_SRC/framescheduler.cpp \
+    $$SYNCD_SRC/transfercoordinator.cpp \
+    $$SYNCD_SRC/blockindex.cpp \
+    $$SYNCD_SRC/memorygovernor.cpp \
+    $$SYNCD_SRC/bandwidthlimiter.cpp \
+    $$SYNCD_SRC/syncprotocol.cpp \
+    $$SYNCD_SRC/synctls.cpp \
+    $$SYNCD_SRC/syncmetrics.cpp \
+    $$SYNCD_SRC/syncstatistics.cpp \
+    $$SYNCD_SRC/transferparameters.cpp \
+    $$PWD/saesu/saesumock.cpp \
+    $$PWD/allocationcounter.cpp \
+    $$PWD/benchmarkprocess.cpp
+
+HEADERS += $$SYNCD_SRC/syncmanagersynchroniser.h \
+    $$SYNCD_SRC/syncmanager.h \
+    $$SYNCD_SRC/syncserver.h \
+    $$SYNCD_SRC/syncworkerpool.h \
+    $$SYNCD_SRC/fileassembler.h \
+    $$SYNCD_SRC/filetransfer.h \
+    $$SYNCD_SRC/objectspool.h \
+    $$SYNCD_SRC/cloudregistry.h \
+    $$SYNCD_SRC/framescheduler.h \
+    $$SYNCD_SRC/transfercoordinator.h \
+    $$SYNCD_SRC/blockindex.h \
+    $$SYNCD_SRC/memorygovernor.h \
+    $$SYNCD_SRC/bandwidthlimiter.h \
+    $$SYNCD_SRC/syncprotocol.h \
+    $$SYNCD_SRC/syncmessages.h \
+    $$SYNCD_SRC/synctls.h \
+    $$SYNCD_SRC/syncmetrics.h \
+    $$SYNCD_SRC/syncstatistics.h \
+    $$SYNCD_SRC/transferparameters.h \
+    $$PWD/saesu/mockstore.h \
+    $$PWD/saesu/sobjectmanager.h \
+    $$PWD/saesu/sabstractobjectrequest.h \
+    $$PWD/saesu/sobjectfetchrequest.h \
+    $$PWD/saesu/sobjectsaverequest.h \
+    $$PWD/saesu/sobjectremoverequest.h \
+    $$PWD/saesu/sdeletelistfetchrequest.h \
+    $$PWD/saesu/sipcchannel.h \
+    $$PWD/allocationcounter.h \
+    $$PWD/benchmarkprocess.h
+
+# spans of time spent synchronising, see src/synctrace.h
+CONFIG(tracing) {
+    DEFINES += SYNCD_TRACING
+    SOURCES += $$SYNCD_SRC/synctrace.cpp
+    HEADERS += $$SYNCD_SRC/synctrace.h
+}
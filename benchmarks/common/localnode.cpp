@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Us
+#include "localnode.h"
+#include "syncadvertiser.h"
+
+static QByteArray currentNodeId;
+
+// stands in for the one in syncadvertiser.cpp
+QByteArray SyncAdvertiser::localNodeId()
+{
+    return currentNodeId;
+}
+
+/*! Sets the node id the synchronisers introduce this process with.
+ */
+void LocalNode::setId(const QByteArray &nodeId)
+{
+    currentNodeId = nodeId;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stand-in for the Bonjour record type, used by the benchmarks.
+
+#ifndef BONJOURRECORD_H
+#define BONJOURRECORD_H
+
+// Qt
+#include <QMetaType>
+#include <QString>
+
+class BonjourRecord
+{
+public:
+    BonjourRecord() {}
+    BonjourRecord(const QString &name, const QString &regType, const QString &domain)
+        : serviceName(name)
+        , registeredType(regType)
+        , replyDomain(domain)
+    {}
+
+    bool operator==(const BonjourRecord &other) const
+    {
+        return serviceName == other.serviceName &&
+               registeredType == other.registeredType &&
+               replyDomain == other.replyDomain;
+    }
+
+    QString serviceName;
+    QString registeredType;
+    QString replyDomain;
+};
+
+Q_DECLARE_METATYPE(BonjourRecord)
+
+#endif // BONJOURRECORD_H
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stand-in for the Bonjour service browser, used by the benchmarks.
+
+#ifndef BONJOURSERVICEBROWSER_H
+#define BONJOURSERVICEBROWSER_H
+
+// Qt
+#include <QList>
+#include <QObject>
+#include <QString>
+
+// Saesu
+#include "bonjourrecord.h"
+
+/*! Never finds anything; benchmarks connect their peers themselves.
+ */
+class BonjourServiceBrowser : public QObject
+{
+    Q_OBJECT
+public:
+    explicit BonjourServiceBrowser(QObject *parent = 0) : QObject(parent) {}
+
+    void browseForServiceType(const QString &serviceType) { Q_UNUSED(serviceType); }
+
+signals:
+    void currentBonjourRecordsChanged(const QList<BonjourRecord> &list);
+};
+
+#endif // BONJOURSERVICEBROWSER_H
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stand-in for the Bonjour service resolver, used by the benchmarks.
+
+#ifndef BONJOURSERVICERESOLVER_H
+#define BONJOURSERVICERESOLVER_H
+
+// Qt
+#include <QHostInfo>
+#include <QObject>
+
+// Saesu
+#include "bonjourrecord.h"
+
+/*! Never resolves anything, as nothing is ever found.
+ */
+class BonjourServiceResolver : public QObject
+{
+    Q_OBJECT
+public:
+    explicit BonjourServiceResolver(QObject *parent = 0) : QObject(parent) {}
+
+    void resolveBonjourRecord(const BonjourRecord &record) { Q_UNUSED(record); }
+
+signals:
+    void bonjourRecordResolved(const QHostInfo &hostInfo, int port);
+};
+
+#endif // BONJOURSERVICERESOLVER_H
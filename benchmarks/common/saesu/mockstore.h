@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stand-in for libsaesu's storage, used by the benchmarks.
+
+#ifndef MOCKSTORE_H
+#define MOCKSTORE_H
+
+// Qt
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+// Saesu
+#include "sobject.h"
+
+class SObjectManager;
+
+/*! Keeps every cloud in memory, in place of the databases libsaesu uses.
+ *
+ * Seed the clouds with addObject() and addTombstone() before syncd's
+ * classes are created. Like the real storage, it must only be used from
+ * the main thread.
+ */
+class MockStore
+{
+public:
+    static void addObject(const QString &cloudName, const SObject &object);
+    static void addTombstone(const QString &cloudName, const SObjectLocalId &id);
+
+    static int objectCount(const QString &cloudName);
+    static quint64 revision();
+    static qint64 lastChangeTime();
+    static QByteArray digest();
+
+    // for SObjectManager and the requests
+    static void registerManager(SObjectManager *manager);
+    static void unregisterManager(SObjectManager *manager);
+    static QList<SObject> fetch(const QString &cloudName, const QList<SObjectLocalId> &ids, bool filtered);
+    static QList<SObjectLocalId> deleteList(const QString &cloudName);
+    static void save(const QString &cloudName, const QList<SObject> &objects, bool keepVersions);
+    static void remove(const QString &cloudName, const QList<SObjectLocalId> &ids);
+};
+
+#endif // MOCKSTORE_H
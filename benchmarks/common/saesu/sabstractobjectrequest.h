@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stand-in for libsaesu's request base class, used by the benchmarks.
+
+#ifndef SABSTRACTOBJECTREQUEST_H
+#define SABSTRACTOBJECTREQUEST_H
+
+// Qt
+#include <QObject>
+#include <QString>
+
+class SObjectManager;
+
+/*! Requests complete asynchronously, from the event loop, like the real
+ * ones do.
+ */
+class SAbstractObjectRequest : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SAbstractObjectRequest(QObject *parent = 0);
+
+    void start(SObjectManager *manager);
+
+signals:
+    void finished();
+
+protected:
+    virtual void run(const QString &cloudName) = 0;
+
+private slots:
+    void complete();
+
+private:
+    QString mCloudName;
+};
+
+#endif // SABSTRACTOBJECTREQUEST_H
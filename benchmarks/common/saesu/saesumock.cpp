@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QDateTime>
+#include <QHash>
+#include <QMap>
+#include <QSet>
+#include <QtEndian>
+
+// Posix
+#include <time.h>
+
+// Saesu
+#include "mockstore.h"
+#include "sdeletelistfetchrequest.h"
+#include "sobjectfetchrequest.h"
+#include "sobjectmanager.h"
+#include "sobjectremoverequest.h"
+#include "sobjectsaverequest.h"
+
+struct MockCloud
+{
+    QMap<SObjectLocalId, SObject> objects;
+    QList<SObjectLocalId> deleteList;
+    QSet<SObjectLocalId> deleted;
+    QList<SObjectManager *> managers;
+};
+
+struct MockStoreData
+{
+    MockStoreData() : revision(0), lastChangeTime(0) {}
+
+    void changed()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        revision++;
+        lastChangeTime = qint64(now.tv_sec) * 1000000000 + now.tv_nsec;
+    }
+
+    QMap<QString, MockCloud> clouds;
+    quint64 revision;
+    qint64 lastChangeTime;
+};
+
+Q_GLOBAL_STATIC(MockStoreData, storeData)
+
+void MockStore::addObject(const QString &cloudName, const SObject &object)
+{
+    storeData()->clouds[cloudName].objects.insert(object.id().localId(), object);
+    storeData()->changed();
+}
+
+void MockStore::addTombstone(const QString &cloudName, const SObjectLocalId &id)
+{
+    MockCloud &cloud = storeData()->clouds[cloudName];
+    cloud.objects.remove(id);
+
+    if (!cloud.deleted.contains(id)) {
+        cloud.deleted.insert(id);
+        cloud.deleteList.append(id);
+    }
+
+    storeData()->changed();
+}
+
+int MockStore::objectCount(const QString &cloudName)
+{
+    return storeData()->clouds.value(cloudName).objects.count();
+}
+
+/*! Returns a number that changes whenever any cloud changes.
+ */
+quint64 MockStore::revision()
+{
+    return storeData()->revision;
+}
+
+/*! Returns when the store last changed, in nanoseconds of CLOCK_MONOTONIC,
+ * so that changes can be timed across processes.
+ */
+qint64 MockStore::lastChangeTime()
+{
+    return storeData()->lastChangeTime;
+}
+
+/*! Returns a hash over the ids and versions of every object in every cloud,
+ * which is equal on two stores exactly when they hold the same objects.
+ */
+QByteArray MockStore::digest()
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+
+    QMap<QString, MockCloud>::ConstIterator cit = storeData()->clouds.constBegin();
+    for (; cit != storeData()->clouds.constEnd(); ++cit) {
+        hash.addData(cit.key().toUtf8());
+
+        foreach (const SObject &object, cit->objects) {
+            const quint64 lastSaved = qToBigEndian<quint64>(object.lastSaved());
+
+            hash.addData(object.id().localId().toByteArray());
+            hash.addData(object.hash());
+            hash.addData(reinterpret_cast<const char *>(&lastSaved), sizeof(lastSaved));
+        }
+    }
+
+    return hash.result();
+}
+
+void MockStore::registerManager(SObjectManager *manager)
+{
+    storeData()->clouds[manager->cloudName()].managers.append(manager);
+}
+
+void MockStore::unregisterManager(SObjectManager *manager)
+{
+    storeData()->clouds[manager->cloudName()].managers.removeAll(manager);
+}
+
+QList<SObject> MockStore::fetch(const QString &cloudName, const QList<SObjectLocalId> &ids, bool filtered)
+{
+    const MockCloud &cloud = storeData()->clouds[cloudName];
+
+    if (!filtered)
+        return cloud.objects.values();
+
+    QList<SObject> objects;
+    foreach (const SObjectLocalId &id, ids) {
+        QMap<SObjectLocalId, SObject>::ConstIterator it = cloud.objects.constFind(id);
+        if (it != cloud.objects.constEnd())
+            objects.append(*it);
+    }
+
+    return objects;
+}
+
+QList<SObjectLocalId> MockStore::deleteList(const QString &cloudName)
+{
+    return storeData()->clouds[cloudName].deleteList;
+}
+
+void MockStore::save(const QString &cloudName, const QList<SObject> &objects, bool keepVersions)
+{
+    MockCloud &cloud = storeData()->clouds[cloudName];
+    QList<SObjectLocalId> added;
+    QList<SObjectLocalId> updated;
+
+    foreach (SObject object, objects) {
+        const SObjectLocalId id = object.id().localId();
+
+        if (!keepVersions)
+            object.setLastSaved(QDateTime::currentMSecsSinceEpoch());
+
+        if (cloud.objects.contains(id))
+            updated.append(id);
+        else
+            added.append(id);
+
+        cloud.objects.insert(id, object);
+    }
+
+    storeData()->changed();
+
+    foreach (SObjectManager *manager, cloud.managers) {
+        if (!added.isEmpty())
+            emit manager->objectsAdded(added);
+        if (!updated.isEmpty())
+            emit manager->objectsUpdated(updated);
+    }
+}
+
+void MockStore::remove(const QString &cloudName, const QList<SObjectLocalId> &ids)
+{
+    MockCloud &cloud = storeData()->clouds[cloudName];
+    QList<SObjectLocalId> removed;
+
+    foreach (const SObjectLocalId &id, ids) {
+        if (cloud.objects.remove(id))
+            removed.append(id);
+
+        if (!cloud.deleted.contains(id)) {
+            cloud.deleted.insert(id);
+            cloud.deleteList.append(id);
+        }
+    }
+
+    storeData()->changed();
+
+    if (removed.isEmpty())
+        return;
+
+    foreach (SObjectManager *manager, cloud.managers)
+        emit manager->objectsRemoved(removed);
+}
+
+SObjectManager::SObjectManager(const QString &cloudName, QObject *parent)
+    : QObject(parent)
+    , mCloudName(cloudName)
+{
+    MockStore::registerManager(this);
+}
+
+SObjectManager::~SObjectManager()
+{
+    MockStore::unregisterManager(this);
+}
+
+QString SObjectManager::cloudName() const
+{
+    return mCloudName;
+}
+
+SAbstractObjectRequest::SAbstractObjectRequest(QObject *parent)
+    : QObject(parent)
+{
+}
+
+void SAbstractObjectRequest::start(SObjectManager *manager)
+{
+    mCloudName = manager->cloudName();
+    QMetaObject::invokeMethod(this, "complete", Qt::QueuedConnection);
+}
+
+void SAbstractObjectRequest::complete()
+{
+    run(mCloudName);
+    emit finished();
+}
+
+SObjectFetchRequest::SObjectFetchRequest(QObject *parent)
+    : SAbstractObjectRequest(parent)
+    , mFiltered(false)
+{
+}
+
+void SObjectFetchRequest::setFilter(const SObjectLocalIdFilter &filter)
+{
+    mFiltered = true;
+    mFilter = filter;
+}
+
+QList<SObject> SObjectFetchRequest::objects() const
+{
+    return mObjects;
+}
+
+void SObjectFetchRequest::run(const QString &cloudName)
+{
+    mObjects = MockStore::fetch(cloudName, mFilter.ids(), mFiltered);
+}
+
+SObjectSaveRequest::SObjectSaveRequest(QObject *parent)
+    : SAbstractObjectRequest(parent)
+    , mSaveHint(NoHint)
+{
+}
+
+void SObjectSaveRequest::add(const SObject &object)
+{
+    mObjects.append(object);
+}
+
+void SObjectSaveRequest::setSaveHint(SaveHint hint)
+{
+    mSaveHint = hint;
+}
+
+void SObjectSaveRequest::run(const QString &cloudName)
+{
+    MockStore::save(cloudName, mObjects, mSaveHint == ObjectFromSync);
+}
+
+SObjectRemoveRequest::SObjectRemoveRequest(QObject *parent)
+    : SAbstractObjectRequest(parent)
+{
+}
+
+void SObjectRemoveRequest::setObjectIds(const QList<SObjectLocalId> &ids)
+{
+    mIds = ids;
+}
+
+void SObjectRemoveRequest::run(const QString &cloudName)
+{
+    MockStore::remove(cloudName, mIds);
+}
+
+SDeleteListFetchRequest::SDeleteListFetchRequest(QObject *parent)
+    : SAbstractObjectRequest(parent)
+{
+}
+
+QList<SObjectLocalId> SDeleteListFetchRequest::objectIds() const
+{
+    return mIds;
+}
+
+void SDeleteListFetchRequest::run(const QString &cloudName)
+{
+    mIds = MockStore::deleteList(cloudName);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stand-in for libsaesu's sipcchannel.h, used by the benchmarks.
+
+#ifndef SIPCCHANNEL_H
+#define SIPCCHANNEL_H
+
+// Qt
+#include <QByteArray>
+#include <QObject>
+#include <QString>
+
+/*! Drops everything sent on it, and never receives anything; the
+ * benchmarks have nobody listening.
+ */
+class SIpcChannel : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SIpcChannel(const QString &channelName, QObject *parent = 0)
+        : QObject(parent)
+        , mChannelName(channelName)
+    {}
+
+    bool sendMessage(const QByteArray &method, const QByteArray &data)
+    {
+        Q_UNUSED(method);
+        Q_UNUSED(data);
+        return true;
+    }
+
+signals:
+    void received(const QByteArray &method, const QByteArray &data);
+
+private:
+    QString mChannelName;
+};
+
+#endif // SIPCCHANNEL_H
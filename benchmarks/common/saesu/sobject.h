@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stand-in for libsaesu's sobject.h, used by the benchmarks.
+//
+// Objects are an id, an opaque payload, and the hash and save time of that
+// payload; that's all syncd looks at.
+
+#ifndef SOBJECT_H
+#define SOBJECT_H
+
+// Qt
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QDataStream>
+
+// Saesu
+#include "sobjectid.h"
+
+class SObject
+{
+public:
+    SObject() : mLastSaved(0) {}
+
+    SObjectId id() const { return mId; }
+    void setId(const SObjectId &id) { mId = id; }
+
+    QByteArray payload() const { return mPayload; }
+    void setPayload(const QByteArray &payload)
+    {
+        mPayload = payload;
+        mHash = QCryptographicHash::hash(payload, QCryptographicHash::Sha1);
+    }
+
+    QByteArray hash() const { return mHash; }
+
+    qint64 lastSaved() const { return mLastSaved; }
+    void setLastSaved(qint64 lastSaved) { mLastSaved = lastSaved; }
+
+private:
+    friend QDataStream &operator>>(QDataStream &stream, SObject &object);
+
+    SObjectId mId;
+    QByteArray mPayload;
+    QByteArray mHash;
+    qint64 mLastSaved;
+};
+
+inline QDataStream &operator<<(QDataStream &stream, const SObject &object)
+{
+    return stream << object.id().localId() << object.hash() << object.lastSaved() << object.payload();
+}
+
+inline QDataStream &operator>>(QDataStream &stream, SObject &object)
+{
+    SObjectLocalId localId;
+    stream >> localId >> object.mHash >> object.mLastSaved >> object.mPayload;
+    object.mId = SObjectId(localId);
+    return stream;
+}
+
+#endif // SOBJECT_H
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stand-in for libsaesu's sobjectfetchrequest.h, used by the benchmarks.
+
+#ifndef SOBJECTFETCHREQUEST_H
+#define SOBJECTFETCHREQUEST_H
+
+// Qt
+#include <QList>
+
+// Saesu
+#include "sabstractobjectrequest.h"
+#include "sobject.h"
+#include "sobjectlocalidfilter.h"
+
+class SObjectFetchRequest : public SAbstractObjectRequest
+{
+    Q_OBJECT
+public:
+    explicit SObjectFetchRequest(QObject *parent = 0);
+
+    void setFilter(const SObjectLocalIdFilter &filter);
+    QList<SObject> objects() const;
+
+protected:
+    void run(const QString &cloudName);
+
+private:
+    bool mFiltered;
+    SObjectLocalIdFilter mFilter;
+    QList<SObject> mObjects;
+};
+
+#endif // SOBJECTFETCHREQUEST_H
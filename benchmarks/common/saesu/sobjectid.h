@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stand-in for libsaesu's sobjectid.h, used by the benchmarks.
+
+#ifndef SOBJECTID_H
+#define SOBJECTID_H
+
+// Qt
+#include <QByteArray>
+#include <QDataStream>
+#include <QDebug>
+#include <QHash>
+
+class SObjectLocalId
+{
+public:
+    SObjectLocalId() {}
+    explicit SObjectLocalId(const QByteArray &uuid) : mUuid(uuid) {}
+
+    QByteArray toByteArray() const { return mUuid; }
+
+    bool operator==(const SObjectLocalId &other) const { return mUuid == other.mUuid; }
+    bool operator!=(const SObjectLocalId &other) const { return mUuid != other.mUuid; }
+    bool operator<(const SObjectLocalId &other) const { return mUuid < other.mUuid; }
+
+private:
+    QByteArray mUuid;
+};
+
+inline uint qHash(const SObjectLocalId &id)
+{
+    return qHash(id.toByteArray());
+}
+
+inline QDataStream &operator<<(QDataStream &stream, const SObjectLocalId &id)
+{
+    return stream << id.toByteArray();
+}
+
+inline QDataStream &operator>>(QDataStream &stream, SObjectLocalId &id)
+{
+    QByteArray uuid;
+    stream >> uuid;
+    id = SObjectLocalId(uuid);
+    return stream;
+}
+
+inline QDebug operator<<(QDebug debug, const SObjectLocalId &id)
+{
+    return debug << id.toByteArray().toHex();
+}
+
+class SObjectId
+{
+public:
+    SObjectId() {}
+    explicit SObjectId(const SObjectLocalId &localId) : mLocalId(localId) {}
+
+    SObjectLocalId localId() const { return mLocalId; }
+
+private:
+    SObjectLocalId mLocalId;
+};
+
+#endif // SOBJECTID_H
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stand-in for libsaesu's sobjectmanager.h, used by the benchmarks.
+
+#ifndef SOBJECTMANAGER_H
+#define SOBJECTMANAGER_H
+
+// Qt
+#include <QList>
+#include <QObject>
+#include <QString>
+
+// Saesu
+#include "sobjectid.h"
+
+/*! A handle on one cloud in MockStore. Every manager of a cloud is told
+ * about changes made through any of them.
+ */
+class SObjectManager : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SObjectManager(const QString &cloudName, QObject *parent = 0);
+    virtual ~SObjectManager();
+
+    QString cloudName() const;
+
+signals:
+    void objectsAdded(const QList<SObjectLocalId> &ids);
+    void objectsUpdated(const QList<SObjectLocalId> &ids);
+    void objectsRemoved(const QList<SObjectLocalId> &ids);
+
+private:
+    friend class MockStore;
+
+    QString mCloudName;
+};
+
+#endif // SOBJECTMANAGER_H
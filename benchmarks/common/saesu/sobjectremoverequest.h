@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stand-in for libsaesu's sobjectremoverequest.h, used by the benchmarks.
+
+#ifndef SOBJECTREMOVEREQUEST_H
+#define SOBJECTREMOVEREQUEST_H
+
+// Qt
+#include <QList>
+
+// Saesu
+#include "sabstractobjectrequest.h"
+#include "sobjectid.h"
+
+class SObjectRemoveRequest : public SAbstractObjectRequest
+{
+    Q_OBJECT
+public:
+    explicit SObjectRemoveRequest(QObject *parent = 0);
+
+    void setObjectIds(const QList<SObjectLocalId> &ids);
+
+protected:
+    void run(const QString &cloudName);
+
+private:
+    QList<SObjectLocalId> mIds;
+};
+
+#endif // SOBJECTREMOVEREQUEST_H
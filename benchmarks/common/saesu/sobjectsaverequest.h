@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stand-in for libsaesu's sobjectsaverequest.h, used by the benchmarks.
+
+#ifndef SOBJECTSAVEREQUEST_H
+#define SOBJECTSAVEREQUEST_H
+
+// Qt
+#include <QList>
+
+// Saesu
+#include "sabstractobjectrequest.h"
+#include "sobject.h"
+
+class SObjectSaveRequest : public SAbstractObjectRequest
+{
+    Q_OBJECT
+public:
+    enum SaveHint
+    {
+        NoHint,
+
+        // keep the hash and save time the object came with
+        ObjectFromSync
+    };
+
+    explicit SObjectSaveRequest(QObject *parent = 0);
+
+    void add(const SObject &object);
+    void setSaveHint(SaveHint hint);
+
+protected:
+    void run(const QString &cloudName);
+
+private:
+    QList<SObject> mObjects;
+    SaveHint mSaveHint;
+};
+
+#endif // SOBJECTSAVEREQUEST_H
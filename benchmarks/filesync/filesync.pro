@@ -0,0 +1,13 @@
+TEMPLATE = app
+TARGET = syncd-bench-filesync
+
+include(../common/common.pri)
+
+SOURCES += main.cpp \
+    ../common/localnode.cpp \
+    filesyncnode.cpp \
+    fileworkload.cpp
+
+HEADERS += ../common/localnode.h \
+    filesyncnode.h \
+    fileworkload.h
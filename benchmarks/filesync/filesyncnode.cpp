@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QCoreApplication>
+#include <QFile>
+#include <QHostAddress>
+#include <QSocketNotifier>
+
+// Posix
+#include <string.h>
+#include <sys/stat.h>
+
+// Us
+#include "filesyncnode.h"
+#include "localnode.h"
+#include "syncmanagersynchroniser.h"
+#include "syncstatistics.h"
+
+static quint64 inodeOf(const QString &fileName)
+{
+    struct stat info;
+    if (stat(QFile::encodeName(fileName).constData(), &info) != 0)
+        return 0;
+
+    return info.st_ino;
+}
+
+FileSyncNode::FileSyncNode(Role role, int listenSocket, quint16 sourcePort, const QString &fileName,
+                           int controlFd, int reportFd)
+    : QObject()
+    , mRole(role)
+    , mSourcePort(sourcePort)
+    , mFileName(fileName)
+    , mReportFd(reportFd)
+    , mControl(new QSocketNotifier(controlFd, QSocketNotifier::Read, this))
+    , mOriginalInode(0)
+{
+    // the target has the lower id, so its connection is the one kept
+    LocalNode::setId(QByteArray("filesync-") + QByteArray::number(role));
+
+    if (role == Source) {
+        connect(&mServer, SIGNAL(newSocketDescriptor(int)), SLOT(onNewConnection(int)));
+        if (!mServer.setSocketDescriptor(listenSocket))
+            qFatal("Source couldn't listen: %s", qPrintable(mServer.errorString()));
+    }
+
+    connect(mControl, SIGNAL(activated(int)), SLOT(onControl()));
+
+    mFileTimer.setInterval(5);
+    connect(&mFileTimer, SIGNAL(timeout()), SLOT(checkFile()));
+
+    QTimer::singleShot(0, this, SLOT(sendReady()));
+}
+
+void FileSyncNode::sendReady()
+{
+    sendReport(FileSyncReport::Ready);
+}
+
+void FileSyncNode::onNewConnection(int socketDescriptor)
+{
+    SyncManagerSynchroniser *syncer = new SyncManagerSynchroniser(socketDescriptor);
+    mWorkers.assign(syncer);
+    QMetaObject::invokeMethod(syncer, "acceptConnection", Qt::QueuedConnection);
+}
+
+void FileSyncNode::onHandshakeReceived(const QByteArray &peerNodeId)
+{
+    Q_UNUSED(peerNodeId);
+    QMetaObject::invokeMethod(sender(), "beginSync", Qt::QueuedConnection);
+}
+
+void FileSyncNode::onControl()
+{
+    const char command = BenchmarkProcess::readCommand(mControl->socket());
+
+    if (command == 'g') {
+        mStartCounters = BenchmarkProcess::counters();
+
+        if (mRole == Target) {
+            mOriginalInode = inodeOf(mFileName);
+            mFileTimer.start();
+
+            SyncManagerSynchroniser *syncer = new SyncManagerSynchroniser;
+            connect(syncer, SIGNAL(handshakeReceived(QByteArray)), SLOT(onHandshakeReceived(QByteArray)));
+            mWorkers.assign(syncer);
+            QMetaObject::invokeMethod(syncer, "connectToHost", Qt::QueuedConnection,
+                                      Q_ARG(QHostAddress, QHostAddress(QHostAddress::LocalHost)),
+                                      Q_ARG(int, mSourcePort));
+        }
+    } else if (command == 'q') {
+        mControl->setEnabled(false);
+        mFileTimer.stop();
+        sendReport(FileSyncReport::Final);
+        QCoreApplication::quit();
+    }
+}
+
+/*! The new version is assembled next to the file and renamed over it, so
+ * the file is done when its inode changes.
+ */
+void FileSyncNode::checkFile()
+{
+    const quint64 inode = inodeOf(mFileName);
+    if (inode == 0 || inode == mOriginalInode)
+        return;
+
+    mFileTimer.stop();
+    sendReport(FileSyncReport::Done);
+}
+
+void FileSyncNode::sendReport(FileSyncReport::Kind kind)
+{
+    const SyncStatistics statistics = SyncStatistics::total();
+    const ProcessCounters counters = BenchmarkProcess::counters();
+
+    FileSyncReport report;
+    memset(&report, 0, sizeof(report));
+    report.kind = kind;
+    report.role = mRole;
+    report.time = BenchmarkProcess::monotonicTime();
+    report.framesSent = statistics.framesSent;
+    report.bytesSent = statistics.bytesSent;
+    report.framesReceived = statistics.framesReceived;
+    report.bytesReceived = statistics.bytesReceived;
+    report.bytesHashed = statistics.bytesHashed;
+    report.hashingNanoseconds = statistics.hashingNanoseconds;
+    report.readCalls = counters.readCalls - mStartCounters.readCalls;
+    report.writeCalls = counters.writeCalls - mStartCounters.writeCalls;
+    report.userMicroseconds = counters.userMicroseconds - mStartCounters.userMicroseconds;
+    report.systemMicroseconds = counters.systemMicroseconds - mStartCounters.systemMicroseconds;
+    report.peakRssKb = counters.peakRssKb;
+
+    if (!BenchmarkProcess::writeReport(mReportFd, report))
+        qWarning("Node %d couldn't report", int(mRole));
+}
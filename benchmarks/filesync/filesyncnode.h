@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILESYNCNODE_H
+#define FILESYNCNODE_H
+
+// Qt
+#include <QObject>
+#include <QString>
+#include <QTimer>
+
+// Us
+#include "benchmarkprocess.h"
+#include "syncserver.h"
+#include "syncworkerpool.h"
+
+class QSocketNotifier;
+
+/*! What a node process tells the coordinator; written to a pipe as is, as
+ * both ends are the same binary.
+ */
+struct FileSyncReport
+{
+    enum Kind
+    {
+        // set up, waiting for the go ahead
+        Ready = 1,
+
+        // the file has been replaced (target only)
+        Done,
+
+        // final counters, sent when told to stop
+        Final
+    };
+
+    qint32 kind;
+    qint32 role;
+
+    // when (CLOCK_MONOTONIC) this was sent
+    qint64 time;
+
+    // counted since synchronisation started
+    quint64 framesSent;
+    quint64 bytesSent;
+    quint64 framesReceived;
+    quint64 bytesReceived;
+    quint64 bytesHashed;
+    quint64 hashingNanoseconds;
+    quint64 readCalls;
+    quint64 writeCalls;
+    quint64 userMicroseconds;
+    quint64 systemMicroseconds;
+
+    quint64 peakRssKb;
+};
+
+/*! Runs one side of a file transfer, in its own process.
+ *
+ * The source shares the file and waits for the target to connect; the
+ * target has an older version of it, connects when told to go, and reports
+ * once the new version has been moved into place.
+ *
+ * Control commands arrive as single bytes: 'g' to start, and 'q' to report
+ * and quit.
+ */
+class FileSyncNode : public QObject
+{
+    Q_OBJECT
+public:
+    enum Role
+    {
+        Target,
+        Source
+    };
+
+    FileSyncNode(Role role, int listenSocket, quint16 sourcePort, const QString &fileName,
+                 int controlFd, int reportFd);
+
+private slots:
+    void onNewConnection(int socketDescriptor);
+    void onHandshakeReceived(const QByteArray &peerNodeId);
+    void onControl();
+    void checkFile();
+    void sendReady();
+
+private:
+    void sendReport(FileSyncReport::Kind kind);
+
+    Role mRole;
+    quint16 mSourcePort;
+    QString mFileName;
+    int mReportFd;
+
+    SyncServer mServer;
+    SyncWorkerPool mWorkers;
+    QSocketNotifier *mControl;
+
+    // the target watches for the file to be replaced
+    QTimer mFileTimer;
+    quint64 mOriginalInode;
+
+    // counters when synchronisation started
+    ProcessCounters mStartCounters;
+};
+
+#endif // FILESYNCNODE_H
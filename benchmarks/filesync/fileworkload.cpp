@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QFile>
+
+// Us
+#include "fileworkload.h"
+
+// how much is generated and written at once
+static const qint64 chunkSize = 1024 * 1024;
+
+static quint64 mix(quint64 x)
+{
+    // splitmix64
+    x += Q_UINT64_C(0x9e3779b97f4a7c15);
+    x = (x ^ (x >> 30)) * Q_UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * Q_UINT64_C(0x94d049bb133111eb);
+    return x ^ (x >> 31);
+}
+
+/*! Writes \a length bytes of the stream identified by \a stream to \a file,
+ * at its current position.
+ */
+static bool writeStream(QFile *file, quint64 stream, qint64 length)
+{
+    QByteArray chunk(int(chunkSize), Qt::Uninitialized);
+    quint64 word = 0;
+
+    while (length > 0) {
+        const int size = int(qMin(length, chunkSize));
+
+        for (int i = 0; i < size; i += sizeof(quint64)) {
+            const quint64 value = mix(stream ^ mix(word++));
+            qMemCopy(chunk.data() + i, &value, qMin<int>(sizeof(value), size - i));
+        }
+
+        if (file->write(chunk.constData(), size) != size)
+            return false;
+
+        length -= size;
+    }
+
+    return true;
+}
+
+FileWorkloadOptions::FileWorkloadOptions()
+    : fileSize(16 * 1024 * 1024)
+    , mutation(Overwrite)
+    , change(64 * 1024)
+    , regions(16)
+    , seed(1)
+{
+}
+
+bool FileWorkloadOptions::mutationFromName(const QString &name, Mutation *mutation)
+{
+    for (int i = Append; i <= Truncate; ++i) {
+        if (name == nameOf(Mutation(i))) {
+            *mutation = Mutation(i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+QString FileWorkloadOptions::nameOf(Mutation mutation)
+{
+    switch (mutation) {
+    case Append:
+        return QLatin1String("append");
+    case Insert:
+        return QLatin1String("insert");
+    case Overwrite:
+        return QLatin1String("overwrite");
+    case Truncate:
+        return QLatin1String("truncate");
+    }
+
+    return QString();
+}
+
+FileWorkload::FileWorkload(const FileWorkloadOptions &options)
+    : mOptions(options)
+{
+    if (mOptions.mutation == FileWorkloadOptions::Truncate)
+        mOptions.change = qMin(mOptions.change, mOptions.fileSize);
+    mOptions.regions = qMax(mOptions.regions, 1);
+}
+
+bool FileWorkload::writeOriginal(const QString &fileName) const
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    return writeStream(&file, mOptions.seed, mOptions.fileSize);
+}
+
+bool FileWorkload::writeMutated(const QString &fileName) const
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    // new content comes from streams of its own, so it can't match anything
+    // in the original
+    const quint64 newStream = mix(mOptions.seed) + 1;
+
+    switch (mOptions.mutation) {
+    case FileWorkloadOptions::Append:
+        return writeStream(&file, mOptions.seed, mOptions.fileSize) &&
+               writeStream(&file, newStream, mOptions.change);
+
+    case FileWorkloadOptions::Insert:
+        return writeStream(&file, newStream, mOptions.change) &&
+               writeStream(&file, mOptions.seed, mOptions.fileSize);
+
+    case FileWorkloadOptions::Overwrite: {
+        if (!writeStream(&file, mOptions.seed, mOptions.fileSize))
+            return false;
+
+        QList<QPair<qint64, qint64> > regions = overwrittenRegions();
+        for (int i = 0; i < regions.count(); ++i) {
+            if (!file.seek(regions.at(i).first) ||
+                !writeStream(&file, newStream + i, regions.at(i).second))
+                return false;
+        }
+
+        return true;
+    }
+
+    case FileWorkloadOptions::Truncate:
+        return writeStream(&file, mOptions.seed, mOptions.fileSize - mOptions.change);
+    }
+
+    return false;
+}
+
+qint64 FileWorkload::mutatedSize() const
+{
+    switch (mOptions.mutation) {
+    case FileWorkloadOptions::Append:
+    case FileWorkloadOptions::Insert:
+        return mOptions.fileSize + mOptions.change;
+    case FileWorkloadOptions::Overwrite:
+        return mOptions.fileSize;
+    case FileWorkloadOptions::Truncate:
+        return mOptions.fileSize - mOptions.change;
+    }
+
+    return mOptions.fileSize;
+}
+
+qint64 FileWorkload::idealDelta() const
+{
+    switch (mOptions.mutation) {
+    case FileWorkloadOptions::Append:
+    case FileWorkloadOptions::Insert:
+        return mOptions.change;
+    case FileWorkloadOptions::Truncate:
+        return 0;
+    case FileWorkloadOptions::Overwrite:
+        break;
+    }
+
+    // regions may overlap, so count the bytes they cover
+    QList<QPair<qint64, qint64> > regions = overwrittenRegions();
+    qSort(regions);
+
+    qint64 covered = 0;
+    qint64 end = 0;
+    for (int i = 0; i < regions.count(); ++i) {
+        const qint64 start = qMax(regions.at(i).first, end);
+        const qint64 regionEnd = regions.at(i).first + regions.at(i).second;
+        if (regionEnd > start)
+            covered += regionEnd - start;
+        end = qMax(end, regionEnd);
+    }
+
+    return covered;
+}
+
+QList<QPair<qint64, qint64> > FileWorkload::overwrittenRegions() const
+{
+    QList<QPair<qint64, qint64> > regions;
+
+    const qint64 change = qMin(mOptions.change, mOptions.fileSize);
+    const qint64 regionSize = change / mOptions.regions;
+    if (regionSize <= 0)
+        return regions;
+
+    for (int i = 0; i < mOptions.regions; ++i) {
+        const quint64 random = mix(mOptions.seed ^ mix(quint64(i) + 0x5245474e)); // "REGN"
+        const qint64 offset = qint64(random % quint64(mOptions.fileSize - regionSize + 1));
+        regions.append(qMakePair(offset, regionSize));
+    }
+
+    return regions;
+}
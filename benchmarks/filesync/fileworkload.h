@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILEWORKLOAD_H
+#define FILEWORKLOAD_H
+
+// Qt
+#include <QList>
+#include <QPair>
+#include <QString>
+
+struct FileWorkloadOptions
+{
+    enum Mutation
+    {
+        // bytes added at the end
+        Append,
+
+        // bytes added at the start, shifting everything after them
+        Insert,
+
+        // bytes replaced in place, spread over a number of regions
+        Overwrite,
+
+        // bytes removed from the end
+        Truncate
+    };
+
+    FileWorkloadOptions();
+
+    static bool mutationFromName(const QString &name, Mutation *mutation);
+    static QString nameOf(Mutation mutation);
+
+    qint64 fileSize;
+    Mutation mutation;
+    qint64 change;
+    int regions;
+    quint64 seed;
+};
+
+/*! Generates an original file, and a mutated version of it, from the
+ * options alone.
+ *
+ * The ideal delta is the number of bytes in the mutated file that can't be
+ * found in the original, i.e. what a perfect delta transfer would send.
+ */
+class FileWorkload
+{
+public:
+    explicit FileWorkload(const FileWorkloadOptions &options);
+
+    bool writeOriginal(const QString &fileName) const;
+    bool writeMutated(const QString &fileName) const;
+
+    qint64 mutatedSize() const;
+    qint64 idealDelta() const;
+
+private:
+    // offset and length of each overwritten region
+    QList<QPair<qint64, qint64> > overwrittenRegions() const;
+
+    FileWorkloadOptions mOptions;
+};
+
+#endif // FILEWORKLOAD_H
@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures synchronising one changed file between two syncd nodes: how
+// many bytes cross the wire compared to an ideal delta, how much CPU time
+// goes into hashing, how many read and write system calls are made, and how
+// long it takes.
+//
+// The target starts with an original file, the source with a mutated copy
+// of it; each node runs in its own process, talking over loopback TCP.
+//
+// With --global-rate or --peer-rate, both nodes limit their bandwidth (in
+// bytes per second), and the rate the source achieved is compared to it.
+//
+// Usage: syncd-bench-filesync [--size BYTES] [--mutation append|insert|overwrite|truncate]
+//            [--change BYTES] [--regions N] [--block-size BYTES] [--hash md4|md5|sha1]
+//            [--global-rate BYTES] [--peer-rate BYTES] [--seed N] [--timeout SECONDS]
+//
+// Sizes and rates may be given with a k, m or g suffix.
+
+// Qt
+#include <QCoreApplication>
+#include <QFile>
+#include <QSettings>
+#include <QStringList>
+#include <QVector>
+
+// Posix
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Us
+#include "benchmarkprocess.h"
+#include "cloudregistry.h"
+#include "filesyncnode.h"
+#include "fileworkload.h"
+
+static const char sharedFileName[] = "shared.bin";
+
+struct Options
+{
+    Options() : blockSize(4096), hash(QLatin1String("sha1")), globalRate(0), peerRate(0), timeout(300) {}
+
+    FileWorkloadOptions workload;
+    qint64 blockSize;
+    QString hash;
+    qint64 globalRate;
+    qint64 peerRate;
+    int timeout;
+};
+
+typedef NodeProcess<FileSyncReport> FileSyncProcess;
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "usage: %s [--size BYTES] [--mutation append|insert|overwrite|truncate]\n"
+                    "           [--change BYTES] [--regions N] [--block-size BYTES] [--hash md4|md5|sha1]\n"
+                    "           [--global-rate BYTES] [--peer-rate BYTES] [--seed N] [--timeout SECONDS]\n",
+            program);
+    exit(2);
+}
+
+static qint64 parseSize(const QByteArray &value, bool *ok)
+{
+    QByteArray number = value.toLower();
+    qint64 multiplier = 1;
+
+    if (number.endsWith('k'))
+        multiplier = Q_INT64_C(1024);
+    else if (number.endsWith('m'))
+        multiplier = Q_INT64_C(1024) * 1024;
+    else if (number.endsWith('g'))
+        multiplier = Q_INT64_C(1024) * 1024 * 1024;
+
+    if (multiplier != 1)
+        number.chop(1);
+
+    return number.toLongLong(ok) * multiplier;
+}
+
+static bool parseOptions(int argc, char **argv, Options *options)
+{
+    for (int i = 1; i < argc; ++i) {
+        const QByteArray name = argv[i];
+        if (i + 1 >= argc)
+            return false;
+
+        const QByteArray value = argv[++i];
+        bool ok = false;
+
+        if (name == "--size")
+            options->workload.fileSize = parseSize(value, &ok);
+        else if (name == "--mutation")
+            ok = FileWorkloadOptions::mutationFromName(QString::fromLatin1(value), &options->workload.mutation);
+        else if (name == "--change")
+            options->workload.change = parseSize(value, &ok);
+        else if (name == "--regions")
+            options->workload.regions = value.toInt(&ok);
+        else if (name == "--block-size")
+            options->blockSize = parseSize(value, &ok);
+        else if (name == "--hash")
+            ok = (options->hash = QString::fromLatin1(value)) == QLatin1String("md4") ||
+                 options->hash == QLatin1String("md5") || options->hash == QLatin1String("sha1");
+        else if (name == "--global-rate")
+            options->globalRate = parseSize(value, &ok);
+        else if (name == "--peer-rate")
+            options->peerRate = parseSize(value, &ok);
+        else if (name == "--seed")
+            options->workload.seed = value.toULongLong(&ok);
+        else if (name == "--timeout")
+            options->timeout = value.toInt(&ok);
+
+        if (!ok)
+            return false;
+    }
+
+    return options->workload.fileSize > 0 && options->workload.change >= 0 &&
+           options->workload.regions > 0 && options->blockSize >= 512 &&
+           options->blockSize <= 1024 * 1024 && options->globalRate >= 0 &&
+           options->peerRate >= 0 && options->timeout > 0;
+}
+
+static int runNode(int argc, char **argv, FileSyncNode::Role role, const Options &options,
+                   const QByteArray &home, int listenSocket, quint16 sourcePort,
+                   int controlFd, int reportFd)
+{
+    if (!BenchmarkProcess::isolate(home))
+        return 1;
+
+    QCoreApplication a(argc, argv);
+    a.setOrganizationName(QLatin1String("saesu"));
+    a.setApplicationName(QLatin1String("syncd"));
+
+    BenchmarkProcess::registerMetaTypes();
+
+    // only the source offers the file, which the target takes into its
+    // home; both use the same parameters, though only the source's matter
+    QSettings settings;
+    settings.setValue(QLatin1String("files/shared"),
+                      role == FileSyncNode::Source ? QStringList(QLatin1String(sharedFileName)) : QStringList());
+    if (role == FileSyncNode::Target)
+        settings.setValue(QLatin1String("files/receiveRoot"), QLatin1String("."));
+    settings.setValue(QLatin1String("transfer/blockSize"), options.blockSize);
+    settings.setValue(QLatin1String("transfer/hashAlgorithm"), options.hash);
+    settings.setValue(QLatin1String("bandwidth/globalRate"), options.globalRate);
+    settings.setValue(QLatin1String("bandwidth/peerRate"), options.peerRate);
+    settings.sync();
+
+    CloudRegistry::instance();
+
+    FileSyncNode node(role, listenSocket, sourcePort, QLatin1String(sharedFileName), controlFd, reportFd);
+    return a.exec();
+}
+
+static bool sameContents(const QString &first, const QString &second)
+{
+    QFile a(first);
+    QFile b(second);
+    if (!a.open(QIODevice::ReadOnly) || !b.open(QIODevice::ReadOnly) || a.size() != b.size())
+        return false;
+
+    while (!a.atEnd()) {
+        if (a.read(1024 * 1024) != b.read(1024 * 1024))
+            return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, &options))
+        usage(argv[0]);
+
+    // a node dying must not take the coordinator with it
+    signal(SIGPIPE, SIG_IGN);
+
+    char rootTemplate[] = "/tmp/syncd-bench-XXXXXX";
+    if (!mkdtemp(rootTemplate)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    const QByteArray root = rootTemplate;
+
+    QVector<QByteArray> homes;
+    homes.append(root + "/target");
+    homes.append(root + "/source");
+
+    // written up front, so generating them isn't measured
+    const FileWorkload workload(options.workload);
+    mkdir(homes.at(FileSyncNode::Target).constData(), 0700);
+    mkdir(homes.at(FileSyncNode::Source).constData(), 0700);
+
+    const QString targetFile = QFile::decodeName(homes.at(FileSyncNode::Target) + '/' + sharedFileName);
+    const QString sourceFile = QFile::decodeName(homes.at(FileSyncNode::Source) + '/' + sharedFileName);
+    if (!workload.writeOriginal(targetFile) || !workload.writeMutated(sourceFile)) {
+        fprintf(stderr, "couldn't write the files in %s\n", rootTemplate);
+        BenchmarkProcess::removeTree(QFile::decodeName(root));
+        return 1;
+    }
+
+    quint16 sourcePort = 0;
+    const int listenSocket = BenchmarkProcess::listenOnLoopback(&sourcePort);
+    if (listenSocket < 0) {
+        perror("listen");
+        return 1;
+    }
+
+    QVector<FileSyncProcess> nodes(2);
+    for (int i = 0; i < nodes.count(); ++i) {
+        int control[2];
+        int report[2];
+        if (pipe(control) < 0 || pipe(report) < 0) {
+            perror("pipe");
+            return 1;
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+
+        if (pid == 0) {
+            // only keep what this node needs
+            close(control[1]);
+            close(report[0]);
+            for (int j = 0; j < i; ++j) {
+                close(nodes.at(j).controlFd);
+                close(nodes.at(j).reportFd);
+            }
+
+            const FileSyncNode::Role role = FileSyncNode::Role(i);
+            if (role != FileSyncNode::Source)
+                close(listenSocket);
+
+            _exit(runNode(argc, argv, role, options, homes.at(i),
+                          role == FileSyncNode::Source ? listenSocket : -1, sourcePort,
+                          control[0], report[1]));
+        }
+
+        close(control[0]);
+        close(report[1]);
+        nodes[i].pid = pid;
+        nodes[i].controlFd = control[1];
+        nodes[i].reportFd = report[0];
+    }
+
+    close(listenSocket);
+
+    printf("size=%lld mutation=%s change=%lld regions=%d block_size=%lld hash=%s global_rate=%lld peer_rate=%lld seed=%llu\n",
+           options.workload.fileSize, qPrintable(FileWorkloadOptions::nameOf(options.workload.mutation)),
+           options.workload.change, options.workload.regions, options.blockSize,
+           qPrintable(options.hash), options.globalRate, options.peerRate, options.workload.seed);
+
+    // both nodes report once their event loops are running
+    const qint64 readyDeadline = BenchmarkProcess::monotonicTime() + qint64(options.timeout) * 1000000000;
+    bool ready = false;
+    while (!ready && BenchmarkProcess::readReports(nodes, readyDeadline))
+        ready = nodes.at(0).hasReported(FileSyncReport::Ready) && nodes.at(1).hasReported(FileSyncReport::Ready);
+
+    bool done = false;
+    const qint64 startTime = BenchmarkProcess::monotonicTime();
+
+    if (ready) {
+        BenchmarkProcess::sendCommand(nodes, 'g');
+
+        const qint64 deadline = startTime + qint64(options.timeout) * 1000000000;
+        while (!done && BenchmarkProcess::readReports(nodes, deadline))
+            done = nodes.at(FileSyncNode::Target).hasReported(FileSyncReport::Done);
+    } else {
+        fprintf(stderr, "nodes didn't start within %d seconds\n", options.timeout);
+    }
+
+    BenchmarkProcess::stopNodes(nodes);
+
+    const bool verified = done && sameContents(targetFile, sourceFile);
+    BenchmarkProcess::removeTree(QFile::decodeName(root));
+
+    if (!done) {
+        fprintf(stderr, "the file wasn't transferred within %d seconds\n", options.timeout);
+        return 1;
+    }
+
+    if (!verified) {
+        fprintf(stderr, "the transferred file doesn't match the source\n");
+        return 1;
+    }
+
+    printf("%-7s %10s %12s %10s %12s %12s %12s %10s %10s %10s %10s %10s\n", "node",
+           "frames_tx", "bytes_tx", "frames_rx", "bytes_rx", "hashed", "hash_cpu_ms",
+           "reads", "writes", "user_ms", "sys_ms", "peak_rss_kb");
+
+    quint64 wireBytes = 0;
+    quint64 hashingNanoseconds = 0;
+    for (int i = 0; i < nodes.count(); ++i) {
+        const FileSyncReport &report = nodes.at(i).latest;
+        printf("%-7s %10llu %12llu %10llu %12llu %12llu %12.3f %10llu %10llu %10.3f %10.3f %10llu\n",
+               i == FileSyncNode::Source ? "source" : "target",
+               report.framesSent, report.bytesSent, report.framesReceived, report.bytesReceived,
+               report.bytesHashed, report.hashingNanoseconds / 1e6, report.readCalls, report.writeCalls,
+               report.userMicroseconds / 1e3, report.systemMicroseconds / 1e3, report.peakRssKb);
+
+        wireBytes += report.bytesSent;
+        hashingNanoseconds += report.hashingNanoseconds;
+    }
+
+    const qint64 idealDelta = workload.idealDelta();
+    printf("ideal_delta_bytes=%lld\n", idealDelta);
+    printf("wire_bytes=%llu\n", wireBytes);
+    if (idealDelta > 0)
+        printf("wire_to_ideal=%.3f\n", double(wireBytes) / idealDelta);
+    printf("hash_cpu_ms=%.3f\n", hashingNanoseconds / 1e6);
+    const qint64 wallNanoseconds = nodes.at(FileSyncNode::Target).reports.value(FileSyncReport::Done).time - startTime;
+    printf("wall_ms=%.3f\n", wallNanoseconds / 1e6);
+
+    // the tighter of the two limits is the one the source should run at
+    qint64 configuredRate = options.globalRate;
+    if (options.peerRate > 0 && (configuredRate == 0 || options.peerRate < configuredRate))
+        configuredRate = options.peerRate;
+
+    if (configuredRate > 0 && wallNanoseconds > 0) {
+        const double achievedRate = nodes.at(FileSyncNode::Source).latest.bytesSent * 1e9 / wallNanoseconds;
+        printf("configured_rate=%lld\n", configuredRate);
+        printf("achieved_rate=%.0f\n", achievedRate);
+        printf("rate_error_pct=%.2f\n", (achievedRate - configuredRate) * 100.0 / configuredRate);
+    }
+    return 0;
+}
@@ -0,0 +1,13 @@
+TEMPLATE = app
+TARGET = syncd-bench-loopback
+
+include(../common/common.pri)
+
+SOURCES += main.cpp \
+    ../common/localnode.cpp \
+    loopbacknode.cpp \
+    workload.cpp
+
+HEADERS += ../common/localnode.h \
+    loopbacknode.h \
+    workload.h
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QCoreApplication>
+#include <QHostAddress>
+#include <QSocketNotifier>
+
+// Posix
+#include <string.h>
+
+// Us
+#include "allocationcounter.h"
+#include "benchmarkprocess.h"
+#include "localnode.h"
+#include "loopbacknode.h"
+#include "mockstore.h"
+#include "syncmanager.h"
+#include "syncmanagersynchroniser.h"
+#include "syncstatistics.h"
+
+LoopbackNode::LoopbackNode(int index, int listenSocket, const QList<quint16> &peerPorts,
+                           const QStringList &clouds, int controlFd, int reportFd)
+    : QObject()
+    , mIndex(index)
+    , mPeerPorts(peerPorts)
+    , mClouds(clouds)
+    , mReportFd(reportFd)
+    , mControl(new QSocketNotifier(controlFd, QSocketNotifier::Read, this))
+    , mReportedRevision(0)
+    , mStartAllocations(0)
+    , mStartAllocatedBytes(0)
+{
+    LocalNode::setId(nodeId(index));
+
+    connect(&mServer, SIGNAL(newSocketDescriptor(int)), SLOT(onNewConnection(int)));
+    if (!mServer.setSocketDescriptor(listenSocket))
+        qFatal("Node %d couldn't listen: %s", index, qPrintable(mServer.errorString()));
+
+    connect(mControl, SIGNAL(activated(int)), SLOT(onControl()));
+
+    mReadyTimer.setInterval(10);
+    connect(&mReadyTimer, SIGNAL(timeout()), SLOT(checkReady()));
+    mReadyTimer.start();
+
+    mProgressTimer.setInterval(20);
+    connect(&mProgressTimer, SIGNAL(timeout()), SLOT(reportProgress()));
+}
+
+/*! Returns the node id of node \a index. Ids sort in index order, so the
+ * lower numbered node of each pair is the one whose connection is kept.
+ */
+QByteArray LoopbackNode::nodeId(int index)
+{
+    return QString::fromLatin1("node-%1").arg(index, 4, 10, QLatin1Char('0')).toLatin1();
+}
+
+void LoopbackNode::onNewConnection(int socketDescriptor)
+{
+    SyncManagerSynchroniser *syncer = new SyncManagerSynchroniser(socketDescriptor);
+    mWorkers.assign(syncer);
+    QMetaObject::invokeMethod(syncer, "acceptConnection", Qt::QueuedConnection);
+}
+
+void LoopbackNode::connectToPeers()
+{
+    foreach (quint16 port, mPeerPorts) {
+        SyncManagerSynchroniser *syncer = new SyncManagerSynchroniser;
+        connect(syncer, SIGNAL(handshakeReceived(QByteArray)), SLOT(onHandshakeReceived(QByteArray)));
+        mWorkers.assign(syncer);
+        QMetaObject::invokeMethod(syncer, "connectToHost", Qt::QueuedConnection,
+                                  Q_ARG(QHostAddress, QHostAddress(QHostAddress::LocalHost)),
+                                  Q_ARG(int, port));
+    }
+}
+
+void LoopbackNode::onHandshakeReceived(const QByteArray &peerNodeId)
+{
+    Q_UNUSED(peerNodeId);
+    QMetaObject::invokeMethod(sender(), "beginSync", Qt::QueuedConnection);
+}
+
+/*! Waits for every cloud to be loaded, so that the measurement doesn't
+ * include reading the store.
+ */
+void LoopbackNode::checkReady()
+{
+    foreach (const QString &cloudName, mClouds) {
+        SyncManager *manager = SyncManager::instance(cloudName);
+
+        if (manager->objectHash().count() != MockStore::objectCount(cloudName) ||
+            manager->deleteList().count() != MockStore::deleteList(cloudName).count())
+            return;
+    }
+
+    mReadyTimer.stop();
+    sendReport(NodeReport::Ready);
+}
+
+void LoopbackNode::onControl()
+{
+    const char command = BenchmarkProcess::readCommand(mControl->socket());
+
+    if (command == 'g') {
+        mStartAllocations = AllocationCounter::allocations();
+        mStartAllocatedBytes = AllocationCounter::allocatedBytes();
+        mProgressTimer.start();
+        connectToPeers();
+    } else if (command == 'q') {
+        mControl->setEnabled(false);
+        mProgressTimer.stop();
+        sendReport(NodeReport::Final);
+        QCoreApplication::quit();
+    }
+}
+
+void LoopbackNode::reportProgress()
+{
+    if (MockStore::revision() == mReportedRevision)
+        return;
+
+    mReportedRevision = MockStore::revision();
+    sendReport(NodeReport::Progress);
+}
+
+void LoopbackNode::sendReport(NodeReport::Kind kind)
+{
+    const SyncStatistics statistics = SyncStatistics::total();
+    const QByteArray digest = MockStore::digest();
+
+    NodeReport report;
+    memset(&report, 0, sizeof(report));
+    report.kind = kind;
+    report.node = mIndex;
+    memcpy(report.digest, digest.constData(), qMin<int>(digest.size(), sizeof(report.digest)));
+    report.changedAt = MockStore::lastChangeTime();
+    report.framesSent = statistics.framesSent;
+    report.bytesSent = statistics.bytesSent;
+    report.framesReceived = statistics.framesReceived;
+    report.bytesReceived = statistics.bytesReceived;
+    report.allocations = AllocationCounter::allocations() - mStartAllocations;
+    report.allocatedBytes = AllocationCounter::allocatedBytes() - mStartAllocatedBytes;
+    report.peakRssKb = BenchmarkProcess::counters().peakRssKb;
+
+    if (!BenchmarkProcess::writeReport(mReportFd, report))
+        qWarning("Node %d couldn't report", mIndex);
+}
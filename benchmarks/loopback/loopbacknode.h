@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LOOPBACKNODE_H
+#define LOOPBACKNODE_H
+
+// Qt
+#include <QList>
+#include <QObject>
+#include <QStringList>
+#include <QTimer>
+
+// Us
+#include "syncserver.h"
+#include "syncworkerpool.h"
+
+class QSocketNotifier;
+
+/*! What a node process tells the coordinator; written to a pipe as is, as
+ * both ends are the same binary.
+ */
+struct NodeReport
+{
+    enum Kind
+    {
+        // every cloud is loaded, waiting for the go ahead
+        Ready = 1,
+
+        // the store changed
+        Progress,
+
+        // final counters, sent when told to stop
+        Final
+    };
+
+    qint32 kind;
+    qint32 node;
+
+    // digest of the node's store, and when (CLOCK_MONOTONIC) it last changed
+    char digest[20];
+    qint64 changedAt;
+
+    // counted since synchronisation started
+    quint64 framesSent;
+    quint64 bytesSent;
+    quint64 framesReceived;
+    quint64 bytesReceived;
+    quint64 allocations;
+    quint64 allocatedBytes;
+
+    quint64 peakRssKb;
+};
+
+/*! Runs synchronisation for one node of the benchmark, in its own process.
+ *
+ * Connections are set up much like SyncAdvertiser does, except that peers
+ * are given instead of discovered, and each pair of nodes only connects
+ * once, from the lower numbered node.
+ *
+ * Control commands arrive as single bytes: 'g' to start connecting, and
+ * 'q' to report and quit.
+ */
+class LoopbackNode : public QObject
+{
+    Q_OBJECT
+public:
+    LoopbackNode(int index, int listenSocket, const QList<quint16> &peerPorts,
+                 const QStringList &clouds, int controlFd, int reportFd);
+
+    static QByteArray nodeId(int index);
+
+private slots:
+    void onNewConnection(int socketDescriptor);
+    void onHandshakeReceived(const QByteArray &peerNodeId);
+    void onControl();
+    void checkReady();
+    void reportProgress();
+
+private:
+    void connectToPeers();
+    void sendReport(NodeReport::Kind kind);
+
+    int mIndex;
+    QList<quint16> mPeerPorts;
+    QStringList mClouds;
+    int mReportFd;
+
+    SyncServer mServer;
+    SyncWorkerPool mWorkers;
+    QSocketNotifier *mControl;
+    QTimer mReadyTimer;
+    QTimer mProgressTimer;
+    quint64 mReportedRevision;
+
+    // counters when synchronisation started
+    quint64 mStartAllocations;
+    quint64 mStartAllocatedBytes;
+};
+
+#endif // LOOPBACKNODE_H
@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures how long a set of syncd nodes take to converge, and what it costs
+// them in frames, bytes and allocations.
+//
+// Every node runs syncd's own synchronisation code in a separate process,
+// talking over loopback TCP, with clouds held in memory by MockStore. The
+// coordinator (this process) seeds nothing itself: nodes derive their
+// contents from the workload options, so runs are repeatable for a seed.
+//
+// The nodes can't share a process: SyncManager, CloudRegistry and
+// MockStore are per-process singletons, each node needs its own node id
+// (LocalNode), and its own QSettings and HOME. Separate processes also mean
+// the allocation and RSS figures are each node's own.
+//
+// Usage: syncd-bench-loopback [--nodes N] [--clouds N] [--objects N]
+//            [--payload BYTES] [--divergence FRACTION] [--tombstones N]
+//            [--seed N] [--timeout SECONDS]
+
+// Qt
+#include <QCoreApplication>
+#include <QVector>
+
+// Posix
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Us
+#include "allocationcounter.h"
+#include "benchmarkprocess.h"
+#include "cloudregistry.h"
+#include "loopbacknode.h"
+#include "mockstore.h"
+#include "workload.h"
+
+typedef NodeProcess<NodeReport> LoopbackProcess;
+
+// opened before forking, so every node knows its peers' ports
+struct LoopbackListener
+{
+    LoopbackListener() : socket(-1), port(0) {}
+
+    int socket;
+    quint16 port;
+};
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "usage: %s [--nodes N] [--clouds N] [--objects N] [--payload BYTES]\n"
+                    "           [--divergence FRACTION] [--tombstones N] [--seed N] [--timeout SECONDS]\n",
+            program);
+    exit(2);
+}
+
+static bool parseOptions(int argc, char **argv, WorkloadOptions *options, int *timeout)
+{
+    for (int i = 1; i < argc; ++i) {
+        const QByteArray name = argv[i];
+        if (i + 1 >= argc)
+            return false;
+
+        const QByteArray value = argv[++i];
+        bool ok = false;
+
+        if (name == "--nodes")
+            options->nodes = value.toInt(&ok);
+        else if (name == "--clouds")
+            options->clouds = value.toInt(&ok);
+        else if (name == "--objects")
+            options->objects = value.toInt(&ok);
+        else if (name == "--payload")
+            options->payloadSize = value.toInt(&ok);
+        else if (name == "--divergence")
+            options->divergence = value.toDouble(&ok);
+        else if (name == "--tombstones")
+            options->tombstones = value.toInt(&ok);
+        else if (name == "--seed")
+            options->seed = value.toULongLong(&ok);
+        else if (name == "--timeout")
+            *timeout = value.toInt(&ok);
+
+        if (!ok)
+            return false;
+    }
+
+    return options->nodes >= 2 && options->clouds >= 1 && options->objects >= 0 &&
+           options->payloadSize >= 0 && options->divergence >= 0 && options->divergence <= 1 &&
+           options->tombstones >= 0 && options->tombstones <= options->objects && *timeout > 0;
+}
+
+static int runNode(int argc, char **argv, int index, const WorkloadOptions &options,
+                   const QByteArray &root, const QVector<LoopbackProcess> &nodes,
+                   const QVector<LoopbackListener> &listeners)
+{
+    if (!BenchmarkProcess::isolate(root + "/node-" + QByteArray::number(index)))
+        return 1;
+
+    Workload workload(options);
+    workload.seedNode(index);
+
+    QCoreApplication a(argc, argv);
+    a.setOrganizationName(QLatin1String("saesu"));
+    a.setApplicationName(QLatin1String("syncd"));
+
+    BenchmarkProcess::registerMetaTypes();
+
+    BenchmarkProcess::createClouds(workload.cloudNames());
+    CloudRegistry::instance();
+
+    QList<quint16> peerPorts;
+    for (int peer = index + 1; peer < listeners.count(); ++peer)
+        peerPorts.append(listeners.at(peer).port);
+
+    LoopbackNode node(index, listeners.at(index).socket, peerPorts, workload.cloudNames(),
+                      nodes.at(index).controlFd, nodes.at(index).reportFd);
+    return a.exec();
+}
+
+int main(int argc, char **argv)
+{
+    WorkloadOptions options;
+    int timeout = 60;
+    if (!parseOptions(argc, argv, &options, &timeout))
+        usage(argv[0]);
+
+    // a node dying must not take the coordinator with it
+    signal(SIGPIPE, SIG_IGN);
+
+    char rootTemplate[] = "/tmp/syncd-bench-XXXXXX";
+    if (!mkdtemp(rootTemplate)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    const QByteArray root = rootTemplate;
+
+    QVector<LoopbackProcess> nodes(options.nodes);
+    QVector<LoopbackListener> listeners(options.nodes);
+    for (int i = 0; i < listeners.count(); ++i) {
+        listeners[i].socket = BenchmarkProcess::listenOnLoopback(&listeners[i].port);
+        if (listeners.at(i).socket < 0) {
+            perror("listen");
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < nodes.count(); ++i) {
+        int control[2];
+        int report[2];
+        if (pipe(control) < 0 || pipe(report) < 0) {
+            perror("pipe");
+            return 1;
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+
+        if (pid == 0) {
+            // only keep what this node needs
+            close(control[1]);
+            close(report[0]);
+            for (int j = 0; j < nodes.count(); ++j) {
+                if (j != i)
+                    close(listeners.at(j).socket);
+                if (nodes.at(j).controlFd >= 0)
+                    close(nodes.at(j).controlFd);
+                if (nodes.at(j).reportFd >= 0)
+                    close(nodes.at(j).reportFd);
+            }
+
+            nodes[i].controlFd = control[0];
+            nodes[i].reportFd = report[1];
+            _exit(runNode(argc, argv, i, options, root, nodes, listeners));
+        }
+
+        close(control[0]);
+        close(report[1]);
+        nodes[i].pid = pid;
+        nodes[i].controlFd = control[1];
+        nodes[i].reportFd = report[0];
+    }
+
+    for (int i = 0; i < listeners.count(); ++i)
+        close(listeners.at(i).socket);
+
+    Workload(options).seedExpected();
+    const QByteArray expectedDigest = MockStore::digest();
+
+    printf("nodes=%d clouds=%d objects=%d payload=%d divergence=%g tombstones=%d seed=%llu\n",
+           options.nodes, options.clouds, options.objects, options.payloadSize,
+           options.divergence, options.tombstones, options.seed);
+    if (!AllocationCounter::isAvailable())
+        printf("allocation counting is not available on this platform\n");
+
+    // loading the clouds isn't part of the measurement
+    const qint64 loadDeadline = BenchmarkProcess::monotonicTime() + qint64(timeout) * 1000000000;
+    bool allReady = false;
+    while (!allReady && BenchmarkProcess::readReports(nodes, loadDeadline)) {
+        allReady = true;
+        foreach (const LoopbackProcess &node, nodes)
+            allReady = allReady && node.hasReported(NodeReport::Ready);
+    }
+
+    bool converged = false;
+    qint64 startTime = BenchmarkProcess::monotonicTime();
+    qint64 convergedTime = 0;
+
+    if (allReady) {
+        BenchmarkProcess::sendCommand(nodes, 'g');
+
+        const qint64 deadline = startTime + qint64(timeout) * 1000000000;
+        while (!converged && BenchmarkProcess::readReports(nodes, deadline)) {
+            converged = true;
+            convergedTime = startTime;
+            foreach (const LoopbackProcess &node, nodes) {
+                converged = converged && QByteArray(node.latest.digest, sizeof(node.latest.digest)) == expectedDigest;
+                convergedTime = qMax(convergedTime, node.latest.changedAt);
+            }
+        }
+    } else {
+        fprintf(stderr, "nodes didn't finish loading within %d seconds\n", timeout);
+    }
+
+    BenchmarkProcess::stopNodes(nodes);
+
+    BenchmarkProcess::removeTree(QString::fromLocal8Bit(root));
+
+    if (!converged) {
+        fprintf(stderr, "nodes didn't converge within %d seconds\n", timeout);
+        return 1;
+    }
+
+    NodeReport total;
+    memset(&total, 0, sizeof(total));
+
+    printf("%-6s %10s %12s %10s %12s %12s %14s %10s\n", "node", "frames_tx", "bytes_tx",
+           "frames_rx", "bytes_rx", "allocations", "alloc_bytes", "peak_rss_kb");
+    for (int i = 0; i < nodes.count(); ++i) {
+        const NodeReport &report = nodes.at(i).latest;
+        printf("%-6d %10llu %12llu %10llu %12llu %12llu %14llu %10llu\n", i,
+               report.framesSent, report.bytesSent, report.framesReceived, report.bytesReceived,
+               report.allocations, report.allocatedBytes, report.peakRssKb);
+
+        total.framesSent += report.framesSent;
+        total.bytesSent += report.bytesSent;
+        total.framesReceived += report.framesReceived;
+        total.bytesReceived += report.bytesReceived;
+        total.allocations += report.allocations;
+        total.allocatedBytes += report.allocatedBytes;
+        total.peakRssKb = qMax(total.peakRssKb, report.peakRssKb);
+    }
+    printf("%-6s %10llu %12llu %10llu %12llu %12llu %14llu %10llu\n", "total",
+           total.framesSent, total.bytesSent, total.framesReceived, total.bytesReceived,
+           total.allocations, total.allocatedBytes, total.peakRssKb);
+
+    printf("converged_ms=%.3f\n", (convergedTime - startTime) / 1e6);
+    return 0;
+}
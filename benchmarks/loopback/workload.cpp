@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QCryptographicHash>
+
+// Posix
+#include <string.h>
+
+// Us
+#include "mockstore.h"
+#include "workload.h"
+
+// object timestamps; only their order matters
+static const qint64 baseTimestamp = Q_INT64_C(1300000000000);
+
+static quint64 mix(quint64 x)
+{
+    // splitmix64
+    x += Q_UINT64_C(0x9e3779b97f4a7c15);
+    x = (x ^ (x >> 30)) * Q_UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * Q_UINT64_C(0x94d049bb133111eb);
+    return x ^ (x >> 31);
+}
+
+WorkloadOptions::WorkloadOptions()
+    : nodes(2)
+    , clouds(1)
+    , objects(1000)
+    , payloadSize(256)
+    , divergence(0.1)
+    , tombstones(0)
+    , seed(1)
+{
+}
+
+Workload::Workload(const WorkloadOptions &options)
+    : mOptions(options)
+{
+}
+
+QStringList Workload::cloudNames() const
+{
+    QStringList names;
+    for (int cloud = 0; cloud < mOptions.clouds; ++cloud)
+        names.append(QString::fromLatin1("cloud-%1").arg(cloud));
+
+    return names;
+}
+
+/*! Returns a pseudo-random number for \a variant of an object; the base
+ * version is variant -1, and each node's own version has the node's index.
+ */
+quint64 Workload::random(int cloud, int object, int variant, int salt) const
+{
+    quint64 x = mix(mOptions.seed);
+    x = mix(x ^ quint64(cloud));
+    x = mix(x ^ quint64(object));
+    return mix(x ^ (quint64(variant + 1) << 8) ^ quint64(salt));
+}
+
+Workload::ObjectState Workload::stateOf(int cloud, int object, int node) const
+{
+    if (object < mOptions.tombstones)
+        return object % mOptions.nodes == node ? Deleted : BaseVersion;
+
+    if (random(cloud, object, node, 0) % 1000000 < quint64(mOptions.divergence * 1000000))
+        return random(cloud, object, node, 1) & 1 ? OwnVersion : Absent;
+
+    return BaseVersion;
+}
+
+SObjectLocalId Workload::idOf(int cloud, int object) const
+{
+    const QByteArray name = QString::fromLatin1("%1/%2").arg(cloud).arg(object).toLatin1();
+    return SObjectLocalId(QCryptographicHash::hash(name, QCryptographicHash::Sha1).left(16));
+}
+
+SObject Workload::versionOf(int cloud, int object, int variant) const
+{
+    QByteArray payload(mOptions.payloadSize, Qt::Uninitialized);
+    quint64 state = random(cloud, object, variant, 3);
+
+    for (int i = 0; i < payload.size(); i += sizeof(quint64)) {
+        state = mix(state);
+        memcpy(payload.data() + i, &state, qMin<int>(sizeof(quint64), payload.size() - i));
+    }
+
+    SObject version;
+    version.setId(SObjectId(idOf(cloud, object)));
+    version.setPayload(payload);
+
+    if (variant < 0)
+        version.setLastSaved(baseTimestamp);
+    else
+        version.setLastSaved(baseTimestamp + 1 + random(cloud, object, variant, 2) % 100000);
+
+    return version;
+}
+
+/*! Fills the store with what \a node starts out with.
+ */
+void Workload::seedNode(int node) const
+{
+    const QStringList names = cloudNames();
+
+    for (int cloud = 0; cloud < mOptions.clouds; ++cloud) {
+        for (int object = 0; object < mOptions.objects; ++object) {
+            switch (stateOf(cloud, object, node)) {
+            case BaseVersion:
+                MockStore::addObject(names.at(cloud), versionOf(cloud, object, -1));
+                break;
+            case OwnVersion:
+                MockStore::addObject(names.at(cloud), versionOf(cloud, object, node));
+                break;
+            case Deleted:
+                MockStore::addTombstone(names.at(cloud), idOf(cloud, object));
+                break;
+            case Absent:
+                break;
+            }
+        }
+    }
+}
+
+/*! Fills the store with what every node should have once synchronised:
+ * deletions win, otherwise the newest version does, and versions saved at
+ * the same time are ordered by hash.
+ */
+void Workload::seedExpected() const
+{
+    const QStringList names = cloudNames();
+
+    for (int cloud = 0; cloud < mOptions.clouds; ++cloud) {
+        for (int object = mOptions.tombstones; object < mOptions.objects; ++object) {
+            bool found = false;
+            SObject newest;
+
+            for (int node = 0; node < mOptions.nodes; ++node) {
+                SObject candidate;
+
+                switch (stateOf(cloud, object, node)) {
+                case BaseVersion:
+                    candidate = versionOf(cloud, object, -1);
+                    break;
+                case OwnVersion:
+                    candidate = versionOf(cloud, object, node);
+                    break;
+                default:
+                    continue;
+                }
+
+                if (!found || candidate.lastSaved() > newest.lastSaved() ||
+                    (candidate.lastSaved() == newest.lastSaved() && candidate.hash() > newest.hash())) {
+                    newest = candidate;
+                    found = true;
+                }
+            }
+
+            if (found)
+                MockStore::addObject(names.at(cloud), newest);
+        }
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+// Qt
+#include <QStringList>
+
+// Saesu
+#include <sobject.h>
+
+struct WorkloadOptions
+{
+    WorkloadOptions();
+
+    int nodes;
+    int clouds;
+    int objects;
+    int payloadSize;
+
+    // fraction of objects each node is missing, or has its own version of
+    double divergence;
+
+    // objects deleted on one node, which the others still have
+    int tombstones;
+
+    quint64 seed;
+};
+
+/*! Generates the initial contents of every node's clouds, and what they
+ * should all look like once synchronised.
+ *
+ * Everything is derived from the options, so each node process can seed
+ * itself, and the coordinator can work out the expected result, without
+ * exchanging any data.
+ */
+class Workload
+{
+public:
+    explicit Workload(const WorkloadOptions &options);
+
+    QStringList cloudNames() const;
+
+    void seedNode(int node) const;
+    void seedExpected() const;
+
+private:
+    enum ObjectState
+    {
+        Absent,
+        BaseVersion,
+        OwnVersion,
+        Deleted
+    };
+
+    ObjectState stateOf(int cloud, int object, int node) const;
+    SObjectLocalId idOf(int cloud, int object) const;
+    SObject versionOf(int cloud, int object, int variant) const;
+    quint64 random(int cloud, int object, int variant, int salt) const;
+
+    WorkloadOptions mOptions;
+};
+
+#endif // WORKLOAD_H
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Us
+#include "latencyhistogram.h"
+
+// each power of two is split into this many buckets
+static const int subBucketBits = 5;
+static const int subBuckets = 1 << subBucketBits;
+
+// about 50 days; anything longer is clamped
+static const int maximumExponent = 42;
+static const int bucketCount = (maximumExponent - subBucketBits + 1) * subBuckets;
+
+LatencyHistogram::LatencyHistogram()
+    : mBuckets(bucketCount)
+    , mCount(0)
+    , mMaximum(0)
+{
+}
+
+int LatencyHistogram::bucketOf(qint64 microseconds)
+{
+    if (microseconds < subBuckets)
+        return int(qMax<qint64>(microseconds, 0));
+
+    const quint64 value = qMin<quint64>(microseconds, (Q_UINT64_C(1) << maximumExponent) - 1);
+    const int exponent = 63 - __builtin_clzll(value);
+    const int subBucket = int(value >> (exponent - subBucketBits)) & (subBuckets - 1);
+
+    return (exponent - subBucketBits + 1) * subBuckets + subBucket;
+}
+
+qint64 LatencyHistogram::upperBoundOf(int bucket)
+{
+    if (bucket < subBuckets)
+        return bucket;
+
+    const int exponent = bucket / subBuckets + subBucketBits - 1;
+    const int subBucket = bucket % subBuckets;
+
+    return ((qint64(subBuckets + subBucket) + 1) << (exponent - subBucketBits)) - 1;
+}
+
+void LatencyHistogram::record(qint64 microseconds)
+{
+    mBuckets[bucketOf(microseconds)]++;
+    mCount++;
+    mMaximum = qMax(mMaximum, microseconds);
+}
+
+void LatencyHistogram::add(const LatencyHistogram &other)
+{
+    for (int i = 0; i < bucketCount; ++i)
+        mBuckets[i] += other.mBuckets.at(i);
+
+    mCount += other.mCount;
+    mMaximum = qMax(mMaximum, other.mMaximum);
+}
+
+void LatencyHistogram::clear()
+{
+    mBuckets.fill(0);
+    mCount = 0;
+    mMaximum = 0;
+}
+
+quint64 LatencyHistogram::count() const
+{
+    return mCount;
+}
+
+/*! Returns the latency that \a fraction (0 to 1) of the samples are at or
+ * below, or 0 if there are none.
+ */
+qint64 LatencyHistogram::percentile(double fraction) const
+{
+    if (mCount == 0)
+        return 0;
+
+    const quint64 rank = qMax<quint64>(1, quint64(fraction * mCount + 0.5));
+    quint64 seen = 0;
+
+    for (int i = 0; i < bucketCount; ++i) {
+        seen += mBuckets.at(i);
+        if (seen >= rank)
+            return qMin(upperBoundOf(i), mMaximum);
+    }
+
+    return mMaximum;
+}
+
+qint64 LatencyHistogram::maximum() const
+{
+    return mMaximum;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+// Qt
+#include <QVector>
+
+/*! Counts latencies, in microseconds, in buckets about 3% wide, so that
+ * percentiles can be kept for hours of samples in constant space.
+ *
+ * Values below 32us are exact; larger ones are reported as the upper bound
+ * of their bucket.
+ */
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void record(qint64 microseconds);
+    void add(const LatencyHistogram &other);
+    void clear();
+
+    quint64 count() const;
+    qint64 percentile(double fraction) const;
+    qint64 maximum() const;
+
+private:
+    static int bucketOf(qint64 microseconds);
+    static qint64 upperBoundOf(int bucket);
+
+    QVector<quint64> mBuckets;
+    quint64 mCount;
+    qint64 mMaximum;
+};
+
+#endif // LATENCYHISTOGRAM_H
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Us
+#include "benchmarkprocess.h"
+#include "latencyrecorder.h"
+
+LatencyRecorder::Interval::Interval()
+    : livePeers(0)
+    , changes(0)
+    , deliveries(0)
+    , connectFailures(0)
+    , disconnects(0)
+    , stalled(0)
+{
+}
+
+LatencyRecorder::LatencyRecorder(int peerCount)
+    : mPerPeer(peerCount)
+{
+}
+
+/*! Marks \a peer as synchronising, so it is expected to receive changes
+ * made from now on.
+ */
+void LatencyRecorder::peerJoined(int peer)
+{
+    QMutexLocker locker(&mLock);
+    mLivePeers.insert(peer);
+}
+
+/*! Stops waiting for \a peer to receive anything.
+ */
+void LatencyRecorder::peerLeft(int peer)
+{
+    QMutexLocker locker(&mLock);
+    if (!mLivePeers.remove(peer))
+        return;
+
+    mInterval.disconnects++;
+
+    QHash<SObjectLocalId, QList<PendingChange> >::Iterator it = mPending.begin();
+    while (it != mPending.end()) {
+        QList<PendingChange>::Iterator change = it->begin();
+        while (change != it->end()) {
+            change->outstanding.remove(peer);
+            if (change->outstanding.isEmpty())
+                change = it->erase(change);
+            else
+                ++change;
+        }
+
+        if (it->isEmpty())
+            it = mPending.erase(it);
+        else
+            ++it;
+    }
+}
+
+void LatencyRecorder::connectFailed(int peer)
+{
+    Q_UNUSED(peer);
+
+    QMutexLocker locker(&mLock);
+    mInterval.connectFailures++;
+}
+
+QList<int> LatencyRecorder::livePeers() const
+{
+    QMutexLocker locker(&mLock);
+    return mLivePeers.toList();
+}
+
+/*! Records that \a origin saved version \a lastSaved of \a id just now.
+ */
+void LatencyRecorder::changed(int origin, const SObjectLocalId &id, qint64 lastSaved)
+{
+    const qint64 now = BenchmarkProcess::monotonicTime() / 1000;
+
+    QMutexLocker locker(&mLock);
+    mInterval.changes++;
+
+    PendingChange change;
+    change.lastSaved = lastSaved;
+    change.madeAt = now;
+    change.outstanding = mLivePeers;
+    change.outstanding.remove(origin);
+
+    if (!change.outstanding.isEmpty())
+        mPending[id].append(change);
+}
+
+/*! Records that \a peer now has version \a lastSaved of \a id, which covers
+ * every older version of it as well.
+ */
+void LatencyRecorder::received(int peer, const SObjectLocalId &id, qint64 lastSaved)
+{
+    const qint64 now = BenchmarkProcess::monotonicTime() / 1000;
+
+    QMutexLocker locker(&mLock);
+
+    QHash<SObjectLocalId, QList<PendingChange> >::Iterator it = mPending.find(id);
+    if (it == mPending.end())
+        return;
+
+    QList<PendingChange>::Iterator change = it->begin();
+    while (change != it->end()) {
+        if (change->lastSaved <= lastSaved && change->outstanding.remove(peer)) {
+            const qint64 latency = now - change->madeAt;
+            mInterval.deliveries++;
+            mInterval.latencies.record(latency);
+            mTotal.record(latency);
+            mPerPeer[peer].record(latency);
+        }
+
+        if (change->outstanding.isEmpty())
+            change = it->erase(change);
+        else
+            ++change;
+    }
+
+    if (it->isEmpty())
+        mPending.erase(it);
+}
+
+/*! Returns what happened since the last call, and starts a new interval.
+ */
+LatencyRecorder::Interval LatencyRecorder::takeInterval(qint64 stallMicroseconds)
+{
+    const qint64 now = BenchmarkProcess::monotonicTime() / 1000;
+
+    QMutexLocker locker(&mLock);
+
+    Interval interval = mInterval;
+    interval.livePeers = mLivePeers.count();
+
+    QHash<SObjectLocalId, QList<PendingChange> >::ConstIterator it = mPending.constBegin();
+    for (; it != mPending.constEnd(); ++it) {
+        foreach (const PendingChange &change, *it) {
+            if (now - change.madeAt > stallMicroseconds)
+                interval.stalled++;
+        }
+    }
+
+    mInterval = Interval();
+    return interval;
+}
+
+LatencyHistogram LatencyRecorder::total() const
+{
+    QMutexLocker locker(&mLock);
+    return mTotal;
+}
+
+QVector<LatencyHistogram> LatencyRecorder::perPeer() const
+{
+    QMutexLocker locker(&mLock);
+    return mPerPeer;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LATENCYRECORDER_H
+#define LATENCYRECORDER_H
+
+// Qt
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QSet>
+#include <QVector>
+
+// Saesu
+#include <sobjectid.h>
+
+// Us
+#include "latencyhistogram.h"
+
+/*! Follows every change made by a virtual peer until each of the other
+ * peers that were connected at the time has it, or a newer version of the
+ * same object.
+ *
+ * Peers report from their own threads, so everything is locked.
+ */
+class LatencyRecorder
+{
+public:
+    struct Interval
+    {
+        Interval();
+
+        int livePeers;
+        quint64 changes;
+        quint64 deliveries;
+        quint64 connectFailures;
+        quint64 disconnects;
+
+        // changes still not everywhere after the stall timeout
+        int stalled;
+
+        LatencyHistogram latencies;
+    };
+
+    explicit LatencyRecorder(int peerCount);
+
+    void peerJoined(int peer);
+    void peerLeft(int peer);
+    void connectFailed(int peer);
+    QList<int> livePeers() const;
+
+    void changed(int origin, const SObjectLocalId &id, qint64 lastSaved);
+    void received(int peer, const SObjectLocalId &id, qint64 lastSaved);
+
+    Interval takeInterval(qint64 stallMicroseconds);
+    LatencyHistogram total() const;
+    QVector<LatencyHistogram> perPeer() const;
+
+private:
+    struct PendingChange
+    {
+        qint64 lastSaved;
+        qint64 madeAt;
+        QSet<int> outstanding;
+    };
+
+    mutable QMutex mLock;
+    QSet<int> mLivePeers;
+    QHash<SObjectLocalId, QList<PendingChange> > mPending;
+
+    Interval mInterval;
+    LatencyHistogram mTotal;
+    QVector<LatencyHistogram> mPerPeer;
+};
+
+#endif // LATENCYRECORDER_H
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Finds out how many peers syncd can serve, and how well, by running it
+// against hundreds of virtual peers for as long as it takes.
+//
+// syncd's own SyncAdvertiser runs in this process, with Bonjour stubbed out
+// and its store held in memory by MockStore. Virtual peers (see VirtualPeer)
+// connect to it over loopback TCP at a steady rate, and random peers change
+// random objects at the configured rate. Every interval, it prints how long
+// changes take to reach every other peer, along with CPU, memory and file
+// descriptor use.
+//
+// The first --hostile peers instead ask for every object over and over and
+// never read the replies, to see that syncd stays within its memory budget
+// (memory/budget and memory/rssCeiling) and keeps serving everyone else.
+//
+// Usage: syncd-bench-soak [--peers N] [--connect-rate PEERS_PER_SECOND]
+//            [--change-rate CHANGES_PER_SECOND] [--clouds N] [--objects N]
+//            [--payload BYTES] [--duration TIME] [--report-interval TIME]
+//            [--stall-timeout TIME] [--hostile N] [--seed N]
+//
+// Times are in seconds, or may be given with an s, m or h suffix.
+
+// Qt
+#include <QCoreApplication>
+#include <QSettings>
+#include <QStringList>
+
+// Saesu
+#include <sobject.h>
+
+// Posix
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+// Us
+#include "benchmarkprocess.h"
+#include "cloudregistry.h"
+#include "mockstore.h"
+#include "simulator.h"
+#include "syncadvertiser.h"
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "usage: %s [--peers N] [--connect-rate PEERS_PER_SECOND]\n"
+                    "           [--change-rate CHANGES_PER_SECOND] [--clouds N] [--objects N]\n"
+                    "           [--payload BYTES] [--duration TIME] [--report-interval TIME]\n"
+                    "           [--stall-timeout TIME] [--hostile N] [--seed N]\n",
+            program);
+    exit(2);
+}
+
+// returns milliseconds
+static qint64 parseTime(const QByteArray &value, bool *ok)
+{
+    QByteArray number = value.toLower();
+    qint64 multiplier = 1000;
+
+    if (number.endsWith('h'))
+        multiplier = 60 * 60 * 1000;
+    else if (number.endsWith('m'))
+        multiplier = 60 * 1000;
+
+    if (number.endsWith('h') || number.endsWith('m') || number.endsWith('s'))
+        number.chop(1);
+
+    return qint64(number.toDouble(ok) * multiplier);
+}
+
+static bool parseOptions(int argc, char **argv, SimulatorOptions *options)
+{
+    for (int i = 1; i < argc; ++i) {
+        const QByteArray name = argv[i];
+        if (i + 1 >= argc)
+            return false;
+
+        const QByteArray value = argv[++i];
+        bool ok = false;
+
+        if (name == "--peers")
+            options->peers = value.toInt(&ok);
+        else if (name == "--connect-rate")
+            options->connectRate = value.toInt(&ok);
+        else if (name == "--change-rate")
+            options->changeRate = value.toDouble(&ok);
+        else if (name == "--clouds")
+            options->clouds = value.toInt(&ok);
+        else if (name == "--objects")
+            options->objects = value.toInt(&ok);
+        else if (name == "--payload")
+            options->payloadSize = value.toInt(&ok);
+        else if (name == "--duration")
+            options->duration = parseTime(value, &ok);
+        else if (name == "--report-interval")
+            options->reportInterval = parseTime(value, &ok);
+        else if (name == "--stall-timeout")
+            options->stallTimeout = parseTime(value, &ok);
+        else if (name == "--hostile")
+            options->hostilePeers = value.toInt(&ok);
+        else if (name == "--seed")
+            options->seed = value.toULongLong(&ok);
+
+        if (!ok)
+            return false;
+    }
+
+    return options->peers > 0 && options->connectRate > 0 && options->changeRate >= 0 &&
+           options->clouds > 0 && options->objects > 0 && options->payloadSize >= 0 &&
+           options->duration > 0 && options->reportInterval > 0 && options->stallTimeout > 0 &&
+           options->hostilePeers >= 0 && options->hostilePeers <= options->peers;
+}
+
+int main(int argc, char **argv)
+{
+    SimulatorOptions options;
+    if (!parseOptions(argc, argv, &options))
+        usage(argv[0]);
+
+    // both ends of every connection are in this process
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    char rootTemplate[] = "/tmp/syncd-bench-XXXXXX";
+    if (!mkdtemp(rootTemplate) || !BenchmarkProcess::isolate(rootTemplate)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    QStringList clouds;
+    for (int cloud = 0; cloud < options.clouds; ++cloud) {
+        clouds.append(QString::fromLatin1("cloud-%1").arg(cloud));
+
+        for (int object = 0; object < options.objects; ++object) {
+            SObject seed;
+            seed.setId(SObjectId(SObjectLocalId(Simulator::objectId(cloud, object))));
+            seed.setPayload(QByteArray(options.payloadSize, 's'));
+            seed.setLastSaved(Q_INT64_C(1300000000000));
+            MockStore::addObject(clouds.last(), seed);
+        }
+    }
+
+    int result;
+    {
+        QCoreApplication a(argc, argv);
+        a.setOrganizationName(QLatin1String("saesu"));
+        a.setApplicationName(QLatin1String("syncd"));
+
+        BenchmarkProcess::registerMetaTypes();
+
+        // sorts after every virtual peer, so their connections are kept;
+        // and there are no files to offer
+        QSettings settings;
+        settings.setValue(QLatin1String("nodeId"), QByteArray("~syncd"));
+        settings.setValue(QLatin1String("files/shared"), QStringList());
+        settings.sync();
+
+        BenchmarkProcess::createClouds(clouds);
+        CloudRegistry::instance();
+
+        SyncAdvertiser advertiser;
+
+        printf("peers=%d connect_rate=%d change_rate=%g clouds=%d objects=%d payload=%d duration_s=%.1f hostile=%d port=%d\n",
+               options.peers, options.connectRate, options.changeRate, options.clouds, options.objects,
+               options.payloadSize, options.duration / 1000.0, options.hostilePeers, advertiser.serverPort());
+
+        Simulator simulator(options, advertiser.serverPort(), clouds);
+        simulator.start();
+
+        result = a.exec();
+    }
+
+    BenchmarkProcess::removeTree(QString::fromLocal8Bit(rootTemplate));
+    return result;
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QCoreApplication>
+
+// Posix
+#include <limits.h>
+#include <stdio.h>
+
+// Us
+#include "memorygovernor.h"
+#include "simulator.h"
+#include "syncstatistics.h"
+#include "virtualpeer.h"
+
+// how often changes are made; the rate is kept up by making several at once
+static const int changeTick = 10;
+
+SimulatorOptions::SimulatorOptions()
+    : peers(200)
+    , connectRate(20)
+    , changeRate(20)
+    , clouds(1)
+    , objects(200)
+    , payloadSize(256)
+    , duration(60 * 1000)
+    , reportInterval(10 * 1000)
+    , stallTimeout(30 * 1000)
+    , hostilePeers(0)
+    , seed(1)
+{
+}
+
+Simulator::Simulator(const SimulatorOptions &options, quint16 port, const QStringList &clouds)
+    : QObject()
+    , mOptions(options)
+    , mPort(port)
+    , mClouds(clouds)
+    , mRecorder(options.peers)
+    , mRandomState(options.seed)
+    , mChangesOwed(0)
+    , mLastChangeTick(0)
+    , mLastReport(0)
+{
+    connect(&mConnectTimer, SIGNAL(timeout()), SLOT(connectPeers()));
+    connect(&mChangeTimer, SIGNAL(timeout()), SLOT(makeChanges()));
+    connect(&mReportTimer, SIGNAL(timeout()), SLOT(report()));
+}
+
+Simulator::~Simulator()
+{
+    // peers live on, unreachable, in their threads until the process exits
+}
+
+quint64 Simulator::random()
+{
+    // splitmix64
+    quint64 x = (mRandomState += Q_UINT64_C(0x9e3779b97f4a7c15));
+    x = (x ^ (x >> 30)) * Q_UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * Q_UINT64_C(0x94d049bb133111eb);
+    return x ^ (x >> 31);
+}
+
+void Simulator::start()
+{
+    mClock.start();
+    mLastCounters = BenchmarkProcess::counters();
+
+    mConnectTimer.start(qMax(1, 1000 / qMax(mOptions.connectRate, 1)));
+    mChangeTimer.start(changeTick);
+    mReportTimer.start(int(mOptions.reportInterval));
+    QTimer::singleShot(int(qMin<qint64>(mOptions.duration, INT_MAX)), this, SLOT(finish()));
+
+    printf("%8s %6s %6s %6s %8s %10s %9s %9s %9s %9s %7s %7s %9s %9s %6s %10s %10s\n",
+           "time_s", "peers", "failed", "lost", "changes", "delivered", "p50_ms", "p90_ms", "p99_ms",
+           "max_ms", "stalled", "cpu_pct", "rss_kb", "held_kb", "fds", "frames_tx", "frames_rx");
+    fflush(stdout);
+}
+
+void Simulator::connectPeers()
+{
+    // at most one timer interval's worth at a time
+    const int batch = qMax(1, mOptions.connectRate * mConnectTimer.interval() / 1000);
+
+    for (int i = 0; i < batch && mPeers.count() < mOptions.peers; ++i) {
+        const bool hostile = mPeers.count() < mOptions.hostilePeers;
+        VirtualPeer *peer = new VirtualPeer(mPeers.count(), mPort, mClouds, mOptions.payloadSize, hostile,
+                                            &mRecorder);
+        mPeerThreads.assign(peer);
+        QMetaObject::invokeMethod(peer, "start", Qt::QueuedConnection);
+        mPeers.append(peer);
+    }
+
+    if (mPeers.count() == mOptions.peers)
+        mConnectTimer.stop();
+}
+
+void Simulator::makeChanges()
+{
+    const qint64 now = mClock.elapsed();
+    mChangesOwed += (now - mLastChangeTick) * mOptions.changeRate / 1000;
+    mLastChangeTick = now;
+
+    if (mChangesOwed < 1)
+        return;
+
+    const QList<int> livePeers = mRecorder.livePeers();
+    if (livePeers.isEmpty()) {
+        mChangesOwed = 0;
+        return;
+    }
+
+    for (; mChangesOwed >= 1; mChangesOwed -= 1) {
+        VirtualPeer *peer = mPeers.at(livePeers.at(int(random() % livePeers.count())));
+        const int cloud = int(random() % mClouds.count());
+        const int object = int(random() % qMax(mOptions.objects, 1));
+
+        QMetaObject::invokeMethod(peer, "makeChange", Qt::QueuedConnection,
+                                  Q_ARG(int, cloud), Q_ARG(QByteArray, objectId(cloud, object)));
+    }
+}
+
+/*! Returns the id of \a object in \a cloud; changes pick from the same
+ * ids syncd's store is seeded with.
+ */
+QByteArray Simulator::objectId(int cloud, int object)
+{
+    return QString::fromLatin1("soak-%1-%2").arg(cloud).arg(object).toLatin1();
+}
+
+void Simulator::report()
+{
+    const qint64 now = mClock.elapsed();
+    const LatencyRecorder::Interval interval = mRecorder.takeInterval(mOptions.stallTimeout * 1000);
+    const ProcessCounters counters = BenchmarkProcess::counters();
+    const SyncStatistics statistics = SyncStatistics::total();
+
+    const quint64 cpuMicroseconds = (counters.userMicroseconds + counters.systemMicroseconds) -
+                                    (mLastCounters.userMicroseconds + mLastCounters.systemMicroseconds);
+    const double cpuPercent = now > mLastReport ? cpuMicroseconds / 10.0 / (now - mLastReport) : 0;
+
+    printf("%8.1f %6d %6llu %6llu %8llu %10llu %9.3f %9.3f %9.3f %9.3f %7d %7.1f %9llu %9lld %6d %10llu %10llu\n",
+           now / 1000.0, interval.livePeers, interval.connectFailures, interval.disconnects,
+           interval.changes, interval.deliveries,
+           interval.latencies.percentile(0.5) / 1000.0, interval.latencies.percentile(0.9) / 1000.0,
+           interval.latencies.percentile(0.99) / 1000.0, interval.latencies.maximum() / 1000.0,
+           interval.stalled, cpuPercent, BenchmarkProcess::residentKb(), MemoryGovernor::used() / 1024,
+           BenchmarkProcess::openFileCount(),
+           statistics.framesSent, statistics.framesReceived);
+    fflush(stdout);
+
+    mLastCounters = counters;
+    mLastReport = now;
+}
+
+void Simulator::finish()
+{
+    mConnectTimer.stop();
+    mChangeTimer.stop();
+    mReportTimer.stop();
+    report();
+
+    const LatencyHistogram total = mRecorder.total();
+    printf("\ndeliveries=%llu p50_ms=%.3f p90_ms=%.3f p99_ms=%.3f p999_ms=%.3f max_ms=%.3f\n",
+           total.count(), total.percentile(0.5) / 1000.0, total.percentile(0.9) / 1000.0,
+           total.percentile(0.99) / 1000.0, total.percentile(0.999) / 1000.0, total.maximum() / 1000.0);
+
+    // how evenly peers are served: the spread of each peer's own p99
+    QList<QPair<qint64, int> > peerP99s;
+    const QVector<LatencyHistogram> perPeer = mRecorder.perPeer();
+    for (int i = 0; i < perPeer.count(); ++i) {
+        if (perPeer.at(i).count() > 0)
+            peerP99s.append(qMakePair(perPeer.at(i).percentile(0.99), i));
+    }
+
+    if (!peerP99s.isEmpty()) {
+        qSort(peerP99s);
+        printf("peer_p99_ms: best=%.3f median=%.3f worst=%.3f (peer %d)\n",
+               peerP99s.first().first / 1000.0, peerP99s.at(peerP99s.count() / 2).first / 1000.0,
+               peerP99s.last().first / 1000.0, peerP99s.last().second);
+    }
+
+    const ProcessCounters counters = BenchmarkProcess::counters();
+    printf("cpu_user_s=%.3f cpu_sys_s=%.3f peak_rss_kb=%llu\n",
+           counters.userMicroseconds / 1e6, counters.systemMicroseconds / 1e6, counters.peakRssKb);
+    fflush(stdout);
+
+    QCoreApplication::quit();
+}
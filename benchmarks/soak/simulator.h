@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+// Qt
+#include <QElapsedTimer>
+#include <QList>
+#include <QObject>
+#include <QStringList>
+#include <QTimer>
+
+// Us
+#include "benchmarkprocess.h"
+#include "latencyrecorder.h"
+#include "syncworkerpool.h"
+
+class VirtualPeer;
+
+struct SimulatorOptions
+{
+    SimulatorOptions();
+
+    int peers;
+    int connectRate;
+    double changeRate;
+    int clouds;
+    int objects;
+    int payloadSize;
+    qint64 duration;
+    qint64 reportInterval;
+    qint64 stallTimeout;
+    int hostilePeers;
+    quint64 seed;
+};
+
+/*! Brings virtual peers up against syncd at a steady rate, has random
+ * peers change random objects at the configured rate, and prints what it
+ * costs at every interval.
+ */
+class Simulator : public QObject
+{
+    Q_OBJECT
+public:
+    Simulator(const SimulatorOptions &options, quint16 port, const QStringList &clouds);
+    virtual ~Simulator();
+
+    void start();
+
+    static QByteArray objectId(int cloud, int object);
+
+private slots:
+    void connectPeers();
+    void makeChanges();
+    void report();
+    void finish();
+
+private:
+    quint64 random();
+
+    SimulatorOptions mOptions;
+    quint16 mPort;
+    QStringList mClouds;
+    LatencyRecorder mRecorder;
+    SyncWorkerPool mPeerThreads;
+    QList<VirtualPeer *> mPeers;
+    quint64 mRandomState;
+
+    QElapsedTimer mClock;
+    QTimer mConnectTimer;
+    QTimer mChangeTimer;
+    QTimer mReportTimer;
+    double mChangesOwed;
+    qint64 mLastChangeTick;
+
+    // for CPU usage over each interval
+    ProcessCounters mLastCounters;
+    qint64 mLastReport;
+};
+
+#endif // SIMULATOR_H
@@ -0,0 +1,24 @@
+TEMPLATE = app
+TARGET = syncd-bench-soak
+
+include(../common/common.pri)
+
+# the real thing, with Bonjour stubbed out
+SOURCES += $$SYNCD_SRC/syncadvertiser.cpp \
+    $$SYNCD_SRC/peerconnectionmanager.cpp
+HEADERS += $$SYNCD_SRC/syncadvertiser.h \
+    $$SYNCD_SRC/peerconnectionmanager.h \
+    ../common/saesu/bonjourservicebrowser.h \
+    ../common/saesu/bonjourserviceresolver.h \
+    ../common/saesu/bonjourserviceregister.h
+
+SOURCES += main.cpp \
+    latencyhistogram.cpp \
+    latencyrecorder.cpp \
+    simulator.cpp \
+    virtualpeer.cpp
+
+HEADERS += latencyhistogram.h \
+    latencyrecorder.h \
+    simulator.h \
+    virtualpeer.h
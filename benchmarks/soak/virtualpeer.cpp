@@ -0,0 +1,378 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QDataStream>
+#include <QDateTime>
+#include <QHostAddress>
+#include <QTcpSocket>
+#include <QtEndian>
+
+// Us
+#include "latencyrecorder.h"
+#include "syncmessages.h"
+#include "virtualpeer.h"
+
+// how many times a hostile peer asks for each object
+static const int floodRepeats = 64;
+
+static bool isNewer(qint64 lastSaved, const QByteArray &hash, const SObject &known)
+{
+    // the same rule SyncManager uses to pick between versions
+    if (lastSaved != known.lastSaved())
+        return lastSaved > known.lastSaved();
+
+    return hash > known.hash();
+}
+
+VirtualPeer::VirtualPeer(int index, quint16 port, const QStringList &clouds, int payloadSize, bool hostile,
+                         LatencyRecorder *recorder)
+    : QObject()
+    , mIndex(index)
+    , mPort(port)
+    , mClouds(clouds)
+    , mPayloadSize(payloadSize)
+    , mHostile(hostile)
+    , mFlooding(false)
+    , mRecorder(recorder)
+    , mSocket(new QTcpSocket(this))
+    , mBytesExpected(0)
+    , mJoined(false)
+    , mChanges(0)
+    , mStreamSize(0)
+{
+    connect(mSocket, SIGNAL(connected()), SLOT(onConnected()));
+    connect(mSocket, SIGNAL(readyRead()), SLOT(onReadyRead()));
+    connect(mSocket, SIGNAL(error(QAbstractSocket::SocketError)), SLOT(onError(QAbstractSocket::SocketError)));
+}
+
+/*! Returns the node id of peer \a index; '~' sorts after these, so syncd
+ * is given that as the first character of its id.
+ */
+QByteArray VirtualPeer::nodeId(int index)
+{
+    return QString::fromLatin1("peer-%1").arg(index, 5, 10, QLatin1Char('0')).toLatin1();
+}
+
+void VirtualPeer::start()
+{
+    mSocket->connectToHost(QHostAddress(QHostAddress::LocalHost), mPort);
+}
+
+void VirtualPeer::onConnected()
+{
+    HelloMessage hello;
+    hello.version = syncProtocolVersion;
+    hello.nodeId = nodeId(mIndex);
+    writeFrame(encodeMessage(hello));
+
+    // as the initiator, we go first; syncd starts once it has seen this
+    CurrentTimeMessage currentTime;
+    currentTime.currentTime = QDateTime::currentMSecsSinceEpoch();
+    writeFrame(encodeMessage(currentTime));
+}
+
+void VirtualPeer::onError(QAbstractSocket::SocketError error)
+{
+    Q_UNUSED(error);
+
+    if (mHostile) {
+        // syncd dropping us is what we were after
+        mSocket->abort();
+        return;
+    }
+
+    if (mJoined)
+        mRecorder->peerLeft(mIndex);
+    else
+        mRecorder->connectFailed(mIndex);
+
+    mJoined = false;
+    mSocket->abort();
+}
+
+void VirtualPeer::writeFrame(const SyncFrame &frame)
+{
+    if (frame.bytes.isEmpty())
+        return;
+
+    for (QHash<quint32, QString>::ConstIterator it = frame.names.constBegin(); it != frame.names.constEnd(); ++it) {
+        if (mDeclaredNames.contains(it.key()))
+            continue;
+
+        DeclareNameMessage declaration;
+        declaration.handle = it.key();
+        declaration.name = it.value();
+        mSocket->write(encodeMessage(declaration).bytes);
+
+        mDeclaredNames.insert(it.key());
+    }
+
+    mSocket->write(frame.bytes);
+}
+
+void VirtualPeer::onReadyRead()
+{
+    while (!mFlooding) {
+        if (mBytesExpected == 0) {
+            if (mSocket->bytesAvailable() < qint64(sizeof(quint32)))
+                return;
+
+            mSocket->read(reinterpret_cast<char *>(&mBytesExpected), sizeof(mBytesExpected));
+            mBytesExpected = qFromBigEndian<quint32>(mBytesExpected);
+        }
+
+        if (mSocket->bytesAvailable() < mBytesExpected)
+            return;
+
+        const QByteArray bytes = mSocket->read(mBytesExpected);
+        mBytesExpected = 0;
+        processFrame(bytes);
+    }
+}
+
+void VirtualPeer::processFrame(const QByteArray &bytes)
+{
+    if (bytes.isEmpty())
+        return;
+
+    WireReader reader(bytes, sizeof(quint8));
+
+    switch (quint8(bytes.at(0))) {
+    case HelloMessage::Token: {
+        HelloMessage message;
+        if (decodeMessage(reader, mPeerNames, message))
+            processHello(message);
+        break;
+    }
+    case DeclareNameMessage::Token: {
+        DeclareNameMessage message;
+        if (decodeMessage(reader, mPeerNames, message))
+            processDeclareName(message);
+        break;
+    }
+    case CurrentTimeMessage::Token:
+        // syncd has started synchronising with us
+        if (!mJoined && !mHostile) {
+            mJoined = true;
+            mRecorder->peerJoined(mIndex);
+        }
+        break;
+    case ObjectListMessage::Token: {
+        ObjectListMessage message;
+        if (decodeMessage(reader, mPeerNames, message))
+            processObjectList(message);
+        break;
+    }
+    case ObjectRequestMessage::Token: {
+        ObjectRequestMessage message;
+        if (decodeMessage(reader, mPeerNames, message))
+            processObjectRequest(message);
+        break;
+    }
+    case ObjectReplyMessage::Token: {
+        ObjectReplyMessage message;
+        if (decodeMessage(reader, mPeerNames, message))
+            processObjectReply(message);
+        break;
+    }
+    case ObjectStreamMessage::Token: {
+        ObjectStreamMessage message;
+        if (decodeMessage(reader, mPeerNames, message))
+            processObjectStream(message);
+        break;
+    }
+    case ObjectChunkMessage::Token: {
+        ObjectChunkMessage message;
+        if (decodeMessage(reader, mPeerNames, message))
+            processObjectChunk(message);
+        break;
+    }
+    case FragmentMessage::Token: {
+        FragmentMessage message;
+        if (!decodeMessage(reader, mPeerNames, message) || message.stream >= FrameScheduler::StreamCount)
+            break;
+
+        QByteArray &partialFrame = mPartialFrames[message.stream];
+        partialFrame.append(message.piece);
+
+        if (message.final) {
+            const QByteArray frame = partialFrame;
+            partialFrame.clear();
+            processFrame(frame);
+        }
+        break;
+    }
+    default:
+        // deletions and files aren't simulated
+        break;
+    }
+}
+
+void VirtualPeer::processHello(const HelloMessage &message)
+{
+    if (message.version != syncProtocolVersion)
+        qWarning("Peer %d: syncd speaks protocol version %llu", mIndex, message.version);
+}
+
+void VirtualPeer::processDeclareName(const DeclareNameMessage &message)
+{
+    mPeerNames.insert(quint32(message.handle), message.name);
+}
+
+void VirtualPeer::processObjectList(const ObjectListMessage &message)
+{
+    if (mHostile) {
+        flood(message);
+        return;
+    }
+
+    const QHash<SObjectLocalId, SObject> &objects = mObjects[message.cloudName.value];
+
+    foreach (const ObjectListEntry &entry, message.objects) {
+        QHash<SObjectLocalId, SObject>::ConstIterator it = objects.constFind(entry.id);
+
+        if (it == objects.constEnd() || isNewer(entry.lastSaved, entry.hash, *it)) {
+            ObjectRequestMessage request;
+            request.cloudName = message.cloudName;
+            request.id = entry.id;
+            writeFrame(encodeMessage(request));
+        } else if (entry.lastSaved == it->lastSaved() && entry.hash == it->hash()) {
+            mRecorder->received(mIndex, entry.id, entry.lastSaved);
+        }
+    }
+}
+
+void VirtualPeer::processObjectRequest(const ObjectRequestMessage &message)
+{
+    const QHash<SObjectLocalId, SObject> &objects = mObjects[message.cloudName.value];
+
+    QHash<SObjectLocalId, SObject>::ConstIterator it = objects.constFind(message.id);
+    if (it == objects.constEnd())
+        return;
+
+    ObjectReplyMessage reply;
+    reply.cloudName = message.cloudName;
+    reply.id = message.id;
+    reply.object = *it;
+    writeFrame(encodeMessage(reply));
+}
+
+void VirtualPeer::processObjectReply(const ObjectReplyMessage &message)
+{
+    QHash<SObjectLocalId, SObject> &objects = mObjects[message.cloudName.value];
+    const SObject &object = message.object;
+
+    QHash<SObjectLocalId, SObject>::Iterator it = objects.find(message.id);
+    if (it != objects.end() && !isNewer(object.lastSaved(), object.hash(), *it))
+        return;
+
+    objects.insert(message.id, object);
+    mRecorder->received(mIndex, message.id, object.lastSaved());
+}
+
+void VirtualPeer::processObjectStream(const ObjectStreamMessage &message)
+{
+    // syncd spools to disk; we're only measuring it, so memory will do
+    mStreamCloudName = message.cloudName.value;
+    mStreamId = message.id;
+    mStreamSize = message.size;
+    mStreamBytes.clear();
+}
+
+void VirtualPeer::processObjectChunk(const ObjectChunkMessage &message)
+{
+    if (mStreamCloudName.isEmpty())
+        return;
+
+    if (message.piece.isEmpty() || quint64(mStreamBytes.size() + message.piece.size()) > mStreamSize) {
+        // syncd gave up on the object
+        mStreamCloudName.clear();
+        mStreamBytes.clear();
+        return;
+    }
+
+    mStreamBytes.append(message.piece);
+    if (quint64(mStreamBytes.size()) < mStreamSize)
+        return;
+
+    ObjectReplyMessage reply;
+    reply.cloudName.value = mStreamCloudName;
+    reply.id = mStreamId;
+
+    QDataStream stream(mStreamBytes);
+    stream >> reply.object;
+
+    mStreamCloudName.clear();
+    mStreamBytes.clear();
+
+    if (stream.status() == QDataStream::Ok)
+        processObjectReply(reply);
+}
+
+/*! Asks for every object in \a message over and over, and stops reading
+ * what syncd sends back, like a peer trying to run it out of memory.
+ */
+void VirtualPeer::flood(const ObjectListMessage &message)
+{
+    mFlooding = true;
+    mSocket->setReadBufferSize(1);
+
+    for (int i = 0; i < floodRepeats; ++i) {
+        foreach (const ObjectListEntry &entry, message.objects) {
+            ObjectRequestMessage request;
+            request.cloudName = message.cloudName;
+            request.id = entry.id;
+            writeFrame(encodeMessage(request));
+        }
+    }
+}
+
+/*! Saves a new version of object \a id in \a cloud, and tells syncd.
+ */
+void VirtualPeer::makeChange(int cloud, const QByteArray &id)
+{
+    if (!mJoined)
+        return;
+
+    const QString &cloudName = mClouds.at(cloud);
+    const SObjectLocalId localId(id);
+    QHash<SObjectLocalId, SObject> &objects = mObjects[cloudName];
+
+    // content only needs to differ between versions
+    QByteArray payload(mPayloadSize, char(mIndex));
+    const quint64 stamp = (quint64(mIndex) << 40) | ++mChanges;
+    qMemCopy(payload.data(), &stamp, qMin<int>(sizeof(stamp), payload.size()));
+
+    SObject object;
+    object.setId(SObjectId(localId));
+    object.setPayload(payload);
+    object.setLastSaved(qMax(QDateTime::currentMSecsSinceEpoch(), objects.value(localId).lastSaved() + 1));
+    objects.insert(localId, object);
+
+    mRecorder->changed(mIndex, localId, object.lastSaved());
+
+    ObjectListEntry entry;
+    entry.id = localId;
+    entry.hash = object.hash();
+    entry.lastSaved = object.lastSaved();
+    entry.originNodeId = QString::fromLatin1(nodeId(mIndex));
+
+    ObjectListMessage list;
+    list.cloudName = cloudName;
+    list.objects.append(entry);
+    writeFrame(encodeMessage(list));
+}
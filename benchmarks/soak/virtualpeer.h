@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VIRTUALPEER_H
+#define VIRTUALPEER_H
+
+// Qt
+#include <QAbstractSocket>
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QStringList>
+
+// Saesu
+#include <sobject.h>
+
+// Us
+#include "framescheduler.h"
+#include "syncprotocol.h"
+
+class LatencyRecorder;
+class QTcpSocket;
+
+struct HelloMessage;
+struct DeclareNameMessage;
+struct ObjectListMessage;
+struct ObjectRequestMessage;
+struct ObjectReplyMessage;
+struct ObjectStreamMessage;
+struct ObjectChunkMessage;
+
+/*! A peer that speaks just enough of the protocol to synchronise objects
+ * with syncd, keeping its clouds in memory.
+ *
+ * Hundreds of these fit in one process, where as many full nodes would not.
+ * They connect to syncd (their node ids sort below its id, so syncd keeps
+ * their connections), fetch every newer version they are told about, and
+ * make changes when asked to.
+ *
+ * Hostile peers don't take part; once told about the objects of a cloud,
+ * they ask for all of them over and over and stop reading.
+ */
+class VirtualPeer : public QObject
+{
+    Q_OBJECT
+public:
+    VirtualPeer(int index, quint16 port, const QStringList &clouds, int payloadSize, bool hostile,
+                LatencyRecorder *recorder);
+
+    static QByteArray nodeId(int index);
+
+public slots:
+    void start();
+    void makeChange(int cloud, const QByteArray &id);
+
+private slots:
+    void onConnected();
+    void onReadyRead();
+    void onError(QAbstractSocket::SocketError error);
+
+private:
+    void writeFrame(const SyncFrame &frame);
+    void processFrame(const QByteArray &bytes);
+
+    void processHello(const HelloMessage &message);
+    void processDeclareName(const DeclareNameMessage &message);
+    void processObjectList(const ObjectListMessage &message);
+    void processObjectRequest(const ObjectRequestMessage &message);
+    void processObjectReply(const ObjectReplyMessage &message);
+    void processObjectStream(const ObjectStreamMessage &message);
+    void processObjectChunk(const ObjectChunkMessage &message);
+    void flood(const ObjectListMessage &message);
+
+    int mIndex;
+    quint16 mPort;
+    QStringList mClouds;
+    int mPayloadSize;
+    bool mHostile;
+    bool mFlooding;
+    LatencyRecorder *mRecorder;
+
+    QTcpSocket *mSocket;
+    quint32 mBytesExpected;
+    bool mJoined;
+    quint64 mChanges;
+
+    QSet<quint32> mDeclaredNames;
+    QHash<quint32, QString> mPeerNames;
+    QByteArray mPartialFrames[FrameScheduler::StreamCount];
+
+    // the object being streamed to us, collected in memory
+    QString mStreamCloudName;
+    SObjectLocalId mStreamId;
+    quint64 mStreamSize;
+    QByteArray mStreamBytes;
+
+    // cloud name -> objects
+    QHash<QString, QHash<SObjectLocalId, SObject> > mObjects;
+};
+
+#endif // VIRTUALPEER_H
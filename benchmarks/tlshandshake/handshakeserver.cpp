@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QSslSocket>
+
+// Posix
+#include <stdio.h>
+
+// Us
+#include "handshakeserver.h"
+#include "synctls.h"
+
+HandshakeServer::HandshakeServer(int listenSocket, QObject *parent)
+    : QObject(parent)
+{
+    connect(&mServer, SIGNAL(newSocketDescriptor(int)), SLOT(onNewConnection(int)));
+
+    if (!mServer.setSocketDescriptor(listenSocket))
+        fprintf(stderr, "couldn't listen: %s\n", qPrintable(mServer.errorString()));
+}
+
+void HandshakeServer::onNewConnection(int socketDescriptor)
+{
+    QSslSocket *socket = new QSslSocket(this);
+    connect(socket, SIGNAL(encrypted()), SLOT(onEncrypted()));
+    connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+    connect(socket, SIGNAL(error(QAbstractSocket::SocketError)), socket, SLOT(deleteLater()));
+
+    if (!socket->setSocketDescriptor(socketDescriptor)) {
+        delete socket;
+        return;
+    }
+
+    SyncTls::configure(socket, QByteArray());
+    socket->startServerEncryption();
+}
+
+void HandshakeServer::onEncrypted()
+{
+    QSslSocket *socket = static_cast<QSslSocket *>(sender());
+
+    if (!SyncTls::isPinned(socket->peerCertificate())) {
+        fprintf(stderr, "server: client certificate isn't pinned\n");
+        socket->abort();
+    }
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HANDSHAKESERVER_H
+#define HANDSHAKESERVER_H
+
+// Qt
+#include <QObject>
+
+// Us
+#include "syncserver.h"
+
+/*! Accepts connections and encrypts them the way syncd does, then waits
+ * for the client to hang up.
+ */
+class HandshakeServer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit HandshakeServer(int listenSocket, QObject *parent = 0);
+
+private slots:
+    void onNewConnection(int socketDescriptor);
+    void onEncrypted();
+
+private:
+    SyncServer mServer;
+};
+
+#endif // HANDSHAKESERVER_H
@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures how long TLS handshakes between syncd nodes take over loopback,
+// with a full handshake for every connection, and resuming the session of
+// the previous connection to the same peer, as syncd does when it
+// reconnects.
+//
+// The server runs in its own process, configured like syncd (see SyncTls).
+// Both sides use the same certificate, which is trusted as our own, so a
+// self-signed one will do; src/synctls.h shows how to make one.
+//
+// Resumption needs Qt 5.2 or later; with older versions both modes do full
+// handshakes.
+//
+// Usage: syncd-bench-tlshandshake --certificate FILE --key FILE
+//            [--connections N]
+
+// Qt
+#include <QCoreApplication>
+#include <QFile>
+#include <QFileInfo>
+#include <QHostAddress>
+#include <QSettings>
+#include <QSslSocket>
+#include <QVector>
+
+// Posix
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Us
+#include "benchmarkprocess.h"
+#include "handshakeserver.h"
+#include "synctls.h"
+
+// the id the client keeps the server's session under
+static const char serverNodeId[] = "tlshandshake-server";
+
+struct Options
+{
+    Options() : connections(200) {}
+
+    QString certificate;
+    QString key;
+    int connections;
+};
+
+struct HandshakeTimes
+{
+    HandshakeTimes() : failures(0) {}
+
+    QVector<qint64> microseconds;
+    int failures;
+};
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "usage: %s --certificate FILE --key FILE [--connections N]\n", program);
+    exit(2);
+}
+
+static bool parseOptions(int argc, char **argv, Options *options)
+{
+    for (int i = 1; i < argc; ++i) {
+        const QByteArray name = argv[i];
+        if (i + 1 >= argc)
+            return false;
+
+        const QByteArray value = argv[++i];
+        bool ok = true;
+
+        // the nodes change directory, so make the paths absolute
+        if (name == "--certificate")
+            options->certificate = QFileInfo(QFile::decodeName(value)).absoluteFilePath();
+        else if (name == "--key")
+            options->key = QFileInfo(QFile::decodeName(value)).absoluteFilePath();
+        else if (name == "--connections")
+            options->connections = value.toInt(&ok);
+        else
+            return false;
+
+        if (!ok)
+            return false;
+    }
+
+    return !options->certificate.isEmpty() && !options->key.isEmpty() && options->connections > 0;
+}
+
+// sets up a node in \a home, with TLS as syncd would use it
+static bool configureNode(const Options &options, const QByteArray &home)
+{
+    if (!BenchmarkProcess::isolate(home))
+        return false;
+
+    QSettings settings;
+    settings.setValue(QLatin1String("tls/certificate"), options.certificate);
+    settings.setValue(QLatin1String("tls/privateKey"), options.key);
+    settings.sync();
+
+    if (!SyncTls::isEnabled()) {
+        fprintf(stderr, "couldn't load the certificate or key\n");
+        return false;
+    }
+
+    return true;
+}
+
+static int runServer(int argc, char **argv, const Options &options, const QByteArray &home, int listenSocket)
+{
+    QCoreApplication a(argc, argv);
+    a.setOrganizationName(QLatin1String("saesu"));
+    a.setApplicationName(QLatin1String("syncd"));
+
+    if (!configureNode(options, home))
+        return 1;
+
+    HandshakeServer server(listenSocket);
+    return a.exec();
+}
+
+// returns the handshake time in microseconds, or -1 if it failed
+static qint64 handshake(quint16 port, bool resume)
+{
+    QSslSocket socket;
+    SyncTls::configure(&socket, resume ? QByteArray(serverNodeId) : QByteArray());
+
+    // blocking is fine here, as nothing else happens in the meantime
+    const qint64 start = BenchmarkProcess::monotonicTime();
+    socket.connectToHostEncrypted(QHostAddress(QHostAddress::LocalHost).toString(), port);
+    if (!socket.waitForEncrypted(10000))
+        return -1;
+    const qint64 end = BenchmarkProcess::monotonicTime();
+
+    if (!SyncTls::isPinned(socket.peerCertificate()))
+        return -1;
+
+    if (resume)
+        SyncTls::storeSession(&socket, serverNodeId);
+
+    socket.disconnectFromHost();
+    if (socket.state() != QAbstractSocket::UnconnectedState)
+        socket.waitForDisconnected(1000);
+
+    return (end - start) / 1000;
+}
+
+static HandshakeTimes measure(quint16 port, int connections, bool resume)
+{
+    HandshakeTimes times;
+
+    // not measured; when resuming, this is the full handshake whose session
+    // the others resume
+    handshake(port, resume);
+
+    for (int i = 0; i < connections; ++i) {
+        const qint64 microseconds = handshake(port, resume);
+        if (microseconds < 0)
+            times.failures++;
+        else
+            times.microseconds.append(microseconds);
+    }
+
+    qSort(times.microseconds);
+    return times;
+}
+
+static qint64 percentile(const QVector<qint64> &sorted, double fraction)
+{
+    if (sorted.isEmpty())
+        return 0;
+
+    return sorted.at(qMin(sorted.count() - 1, int(sorted.count() * fraction)));
+}
+
+static double mean(const QVector<qint64> &values)
+{
+    if (values.isEmpty())
+        return 0;
+
+    double sum = 0;
+    foreach (qint64 value, values)
+        sum += value;
+    return sum / values.count();
+}
+
+static void printTimes(const char *mode, const HandshakeTimes &times)
+{
+    printf("%-8s %8d %8d %10.1f %10lld %10lld %10lld\n", mode, times.microseconds.count(), times.failures,
+           mean(times.microseconds), percentile(times.microseconds, 0.5), percentile(times.microseconds, 0.99),
+           times.microseconds.isEmpty() ? 0 : times.microseconds.last());
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, &options))
+        usage(argv[0]);
+
+    char rootTemplate[] = "/tmp/syncd-bench-XXXXXX";
+    if (!mkdtemp(rootTemplate)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    const QByteArray root = rootTemplate;
+
+    quint16 port = 0;
+    const int listenSocket = BenchmarkProcess::listenOnLoopback(&port);
+    if (listenSocket < 0) {
+        perror("listen");
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+
+    if (pid == 0)
+        _exit(runServer(argc, argv, options, root + "/server", listenSocket));
+
+    close(listenSocket);
+
+    int result = 0;
+
+    {
+        QCoreApplication a(argc, argv);
+        a.setOrganizationName(QLatin1String("saesu"));
+        a.setApplicationName(QLatin1String("syncd"));
+
+        if (configureNode(options, root + "/client")) {
+            const HandshakeTimes full = measure(port, options.connections, false);
+            const HandshakeTimes resumed = measure(port, options.connections, true);
+
+            printf("connections=%d resumption=%s\n", options.connections,
+                   SyncTls::canResumeSessions() ? "available" : "unavailable");
+            printf("%-8s %8s %8s %10s %10s %10s %10s\n", "mode", "ok", "failed", "mean_us", "p50_us", "p99_us", "max_us");
+            printTimes("full", full);
+            printTimes("resumed", resumed);
+
+            if (!resumed.microseconds.isEmpty())
+                printf("resumed_speedup=%.2f\n", mean(full.microseconds) / mean(resumed.microseconds));
+
+            if (full.failures || resumed.failures)
+                result = 1;
+        } else {
+            result = 1;
+        }
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, 0, 0);
+    BenchmarkProcess::removeTree(QFile::decodeName(root));
+
+    return result;
+}
@@ -0,0 +1,9 @@
+TEMPLATE = app
+TARGET = syncd-bench-tlshandshake
+
+include(../common/common.pri)
+
+SOURCES += main.cpp \
+    handshakeserver.cpp
+
+HEADERS += handshakeserver.h
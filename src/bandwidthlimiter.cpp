@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QAtomicInt>
+#include <QMutex>
+#include <QSettings>
+
+// Posix
+#include <time.h>
+
+// Us
+#include "bandwidthlimiter.h"
+
+// bursts are a tenth of a second's worth, but always fit a few fragments
+static const qint64 minimumBurst = 64 * 1024;
+
+static const qint64 unlimitedAllowance = Q_INT64_C(0x3fffffffffffffff);
+
+TokenBucket::TokenBucket()
+    : mRate(0)
+    , mBurst(minimumBurst)
+    , mTokens(0)
+    , mLastRefill(0)
+{
+}
+
+qint64 TokenBucket::rate() const
+{
+    return mRate;
+}
+
+/*! Limits the bucket to \a bytesPerSecond, or lifts the limit if it is 0.
+ */
+void TokenBucket::setRate(qint64 bytesPerSecond)
+{
+    mRate = qMax<qint64>(bytesPerSecond, 0);
+    mBurst = qMax(mRate / 10, minimumBurst);
+    mTokens = qMin(mTokens, double(mBurst));
+}
+
+void TokenBucket::refill(qint64 now)
+{
+    mTokens = qMin(double(mBurst), mTokens + double(mRate) * (now - mLastRefill) / 1e6);
+    mLastRefill = now;
+}
+
+bool TokenBucket::hasTokens(qint64 now)
+{
+    return tokens(now) > 0;
+}
+
+/*! Returns how many bytes may be sent at \a now; negative while in debt.
+ */
+qint64 TokenBucket::tokens(qint64 now)
+{
+    if (!mRate)
+        return unlimitedAllowance;
+
+    refill(now);
+    return qint64(mTokens);
+}
+
+void TokenBucket::consume(qint64 bytes, qint64 now)
+{
+    if (!mRate)
+        return;
+
+    // all of it is owed, however far into debt that takes us, or sending
+    // more than was allowed at once would raise the average rate
+    refill(now);
+    mTokens -= bytes;
+}
+
+/*! Returns how long after \a now there will be tokens again, in microseconds.
+ */
+qint64 TokenBucket::delay(qint64 now)
+{
+    if (!mRate)
+        return 0;
+
+    refill(now);
+    if (mTokens > 0)
+        return 0;
+
+    return qint64((1 - mTokens) * 1e6 / mRate) + 1;
+}
+
+struct LimiterData
+{
+    LimiterData()
+        : peerRate(QSettings().value(QLatin1String("bandwidth/peerRate"), 0).toLongLong())
+    {
+        global.setRate(QSettings().value(QLatin1String("bandwidth/globalRate"), 0).toLongLong());
+        limited = global.rate() || peerRate;
+    }
+
+    // protects the rest; limited may be read without it, so connections
+    // don't lock at all unless a limit is set
+    QMutex lock;
+    QAtomicInt limited;
+    TokenBucket global;
+    qint64 peerRate;
+};
+
+Q_GLOBAL_STATIC(LimiterData, limiterData)
+
+/*! Returns a monotonic timestamp for the buckets, in microseconds.
+ */
+qint64 BandwidthLimiter::now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return qint64(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+qint64 BandwidthLimiter::globalRate()
+{
+    LimiterData *data = limiterData();
+
+    QMutexLocker locker(&data->lock);
+    return data->global.rate();
+}
+
+qint64 BandwidthLimiter::peerRate()
+{
+    LimiterData *data = limiterData();
+
+    QMutexLocker locker(&data->lock);
+    return data->peerRate;
+}
+
+/*! Limits all connections together to \a globalRate, and each one to
+ * \a peerRate, in bytes per second; 0 means unlimited. The limits are
+ * kept for the next time syncd starts.
+ */
+void BandwidthLimiter::setLimits(qint64 globalRate, qint64 peerRate)
+{
+    LimiterData *data = limiterData();
+
+    {
+        QMutexLocker locker(&data->lock);
+        data->global.setRate(globalRate);
+        data->peerRate = qMax<qint64>(peerRate, 0);
+        data->limited = data->global.rate() || data->peerRate;
+    }
+
+    QSettings settings;
+    settings.setValue(QLatin1String("bandwidth/globalRate"), qMax<qint64>(globalRate, 0));
+    settings.setValue(QLatin1String("bandwidth/peerRate"), qMax<qint64>(peerRate, 0));
+}
+
+/*! Returns how many bytes of file transfers the connection with bucket
+ * \a peer may send at \a now. Anything above 0 allows at least one frame.
+ */
+qint64 BandwidthLimiter::allowance(TokenBucket *peer, qint64 now)
+{
+    LimiterData *data = limiterData();
+    if (!data->limited)
+        return unlimitedAllowance;
+
+    QMutexLocker locker(&data->lock);
+    if (peer->rate() != data->peerRate)
+        peer->setRate(data->peerRate);
+
+    return qMin(peer->tokens(now), data->global.tokens(now));
+}
+
+/*! Counts \a bytes sent by the connection with bucket \a peer against the limits.
+ */
+void BandwidthLimiter::consume(TokenBucket *peer, qint64 bytes, qint64 now)
+{
+    LimiterData *data = limiterData();
+    if (!data->limited)
+        return;
+
+    QMutexLocker locker(&data->lock);
+    peer->consume(bytes, now);
+    data->global.consume(bytes, now);
+}
+
+/*! Returns how long the connection with bucket \a peer has to wait before
+ * it may send file transfers again, in microseconds.
+ */
+qint64 BandwidthLimiter::delay(TokenBucket *peer, qint64 now)
+{
+    LimiterData *data = limiterData();
+    if (!data->limited)
+        return 0;
+
+    QMutexLocker locker(&data->lock);
+    return qMax(peer->delay(now), data->global.delay(now));
+}
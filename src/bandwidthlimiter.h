@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BANDWIDTHLIMITER_H
+#define BANDWIDTHLIMITER_H
+
+// Qt
+#include <QtGlobal>
+
+/*! Limits a flow of bytes to a rate, allowing short bursts.
+ *
+ * Bytes may be sent whenever the bucket holds any tokens, taking it into
+ * debt; the debt is paid off before anything else is allowed out, so the
+ * rate holds on average. Times are in microseconds.
+ */
+class TokenBucket
+{
+public:
+    TokenBucket();
+
+    qint64 rate() const;
+    void setRate(qint64 bytesPerSecond);
+
+    bool hasTokens(qint64 now);
+    qint64 tokens(qint64 now);
+    void consume(qint64 bytes, qint64 now);
+    qint64 delay(qint64 now);
+
+private:
+    void refill(qint64 now);
+
+    // bytes per second, or 0 if unlimited
+    qint64 mRate;
+    qint64 mBurst;
+    double mTokens;
+    qint64 mLastRefill;
+};
+
+/*! Applies the bandwidth limits: one shared by every connection, and one
+ * for each peer.
+ *
+ * The limits are read from bandwidth/globalRate and bandwidth/peerRate, in
+ * bytes per second (0 for unlimited), and may be changed at runtime with
+ * setLimits(). Only file transfers wait for bandwidth; everything else is
+ * sent straight away, but still counts towards the limits.
+ */
+class BandwidthLimiter
+{
+public:
+    static qint64 now();
+
+    static qint64 globalRate();
+    static qint64 peerRate();
+    static void setLimits(qint64 globalRate, qint64 peerRate);
+
+    static qint64 allowance(TokenBucket *peer, qint64 now);
+    static void consume(TokenBucket *peer, qint64 bytes, qint64 now);
+    static qint64 delay(TokenBucket *peer, qint64 now);
+};
+
+#endif // BANDWIDTHLIMITER_H
@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QSettings>
+#include <QtEndian>
+
+// Saesu
+#include <sglobal.h>
+
+// Posix
+#include <sys/stat.h>
+
+// Us
+#include "blockindex.h"
+#include "syncmanagersynchroniser.h"
+
+Q_GLOBAL_STATIC(BlockIndex, blockIndex)
+
+// roughly what an entry costs, besides the buckets: a QHash node for a
+// block, and for a file its IndexedFile, name and QHash node
+static const qint64 blockEntrySize = 32;
+static const qint64 fileEntrySize = 256;
+
+static int maxBlocks()
+{
+    static const int blocks = QSettings().value(QLatin1String("index/maxBlocks"), 256 * 1024).toInt();
+    return blocks;
+}
+
+static quint64 digestKey(const QByteArray &blockHash)
+{
+    if (blockHash.size() < int(sizeof(quint64)))
+        return 0;
+
+    return qFromBigEndian<quint64>(reinterpret_cast<const uchar *>(blockHash.constData()));
+}
+
+static qint64 modificationTime(const QFileInfo &fileInfo)
+{
+    return qint64(fileInfo.lastModified().toTime_t());
+}
+
+/*! Returns the directories to index: index/roots, or else the ones the
+ * shared files are in.
+ */
+static QStringList indexRoots()
+{
+    QStringList roots;
+    foreach (const QString &fileName, SyncManagerSynchroniser::sharedFiles()) {
+        const QString directory = QFileInfo(fileName).absolutePath();
+        if (!roots.contains(directory))
+            roots.append(directory);
+    }
+
+    return QSettings().value(QLatin1String("index/roots"), roots).toStringList();
+}
+
+BlockIndex::BlockIndex()
+    : QThread()
+    , mParameters(TransferParameters::local())
+    , mRoots(indexRoots())
+    , mStopping(false)
+    , mInvalidFiles(0)
+{
+}
+
+BlockIndex::~BlockIndex()
+{
+    {
+        QMutexLocker locker(&mLock);
+        mStopping = true;
+        mWake.wakeAll();
+    }
+
+    wait();
+}
+
+/*! Returns the index, which has to be start()ed before it finds anything.
+ */
+BlockIndex *BlockIndex::instance()
+{
+    return blockIndex();
+}
+
+/*! Looks for a block hashing to \a blockHash under \a parameters, and
+ * returns true and its \a location if there is one.
+ */
+bool BlockIndex::find(const TransferParameters &parameters, const QByteArray &blockHash, BlockLocation *location)
+{
+    if (parameters.blockSize != mParameters.blockSize || parameters.algorithm != mParameters.algorithm)
+        return false;
+
+    IndexedFile file;
+    quint64 blockNumber;
+
+    {
+        QMutexLocker locker(&mLock);
+        QHash<quint64, quint64>::ConstIterator it = mBlocks.constFind(digestKey(blockHash));
+        if (it == mBlocks.constEnd())
+            return false;
+
+        file = mFiles.at(int(*it >> 32));
+        blockNumber = *it & 0xffffffff;
+    }
+
+    if (!file.valid)
+        return false;
+
+    const QFileInfo fileInfo(file.fileName);
+    if (fileInfo.size() != file.size || modificationTime(fileInfo) != file.lastModified) {
+        sDebug() << file.fileName << " changed since it was indexed";
+        indexFile(file.fileName);
+        return false;
+    }
+
+    location->fileName = file.fileName;
+    location->offset = qint64(blockNumber) * mParameters.blockSize;
+    return true;
+}
+
+/*! Forgets where the block hashing to \a blockHash is, after what was
+ * there turned out to be something else.
+ */
+void BlockIndex::remove(const QByteArray &blockHash)
+{
+    QMutexLocker locker(&mLock);
+    mBlocks.remove(digestKey(blockHash));
+    updateMemoryAccount();
+}
+
+/*! Queues \a fileName to be indexed, replacing whatever we knew about it.
+ */
+void BlockIndex::indexFile(const QString &fileName)
+{
+    const QString absoluteFileName = QFileInfo(fileName).absoluteFilePath();
+    QMutexLocker locker(&mLock);
+
+    // stop handing out its blocks until we've seen what's there now
+    QHash<QString, int>::ConstIterator it = mFileIds.constFind(absoluteFileName);
+    if (it != mFileIds.constEnd())
+        invalidate(*it);
+
+    if (!mQueue.contains(absoluteFileName))
+        mQueue.append(absoluteFileName);
+
+    mWake.wakeAll();
+}
+
+void BlockIndex::run()
+{
+    foreach (const QString &root, mRoots)
+        indexTree(root);
+
+    QMutexLocker locker(&mLock);
+    if (mStopping)
+        return;
+
+    sDebug() << "Indexed " << mBlocks.count() << " blocks in " << mFileIds.count() << " files";
+    locker.unlock();
+
+    QString fileName;
+    while (takeQueued(&fileName))
+        addFile(fileName);
+}
+
+/*! Indexes the regular files under \a root, without leaving its filesystem.
+ */
+void BlockIndex::indexTree(const QString &root)
+{
+    struct stat rootStat;
+    if (::stat(QFile::encodeName(root).constData(), &rootStat) != 0 || !S_ISDIR(rootStat.st_mode)) {
+        sDebug() << "Not indexing " << root << ", not a directory";
+        return;
+    }
+
+    sDebug() << "Indexing blocks under " << root;
+
+    QStringList directories(root);
+    while (!directories.isEmpty()) {
+        QDirIterator it(directories.takeLast(), QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot);
+        while (it.hasNext()) {
+            {
+                QMutexLocker locker(&mLock);
+                if (mStopping)
+                    return;
+            }
+
+            // lstat, so links are neither followed nor indexed
+            const QString entryName = it.next();
+            struct stat entryStat;
+            if (::lstat(QFile::encodeName(entryName).constData(), &entryStat) != 0 ||
+                entryStat.st_dev != rootStat.st_dev)
+                continue;
+
+            if (S_ISDIR(entryStat.st_mode))
+                directories.append(entryName);
+            else if (S_ISREG(entryStat.st_mode))
+                addFile(entryName);
+        }
+    }
+}
+
+/*! Waits for a file to be queued, and returns false once we're stopping.
+ */
+bool BlockIndex::takeQueued(QString *fileName)
+{
+    QMutexLocker locker(&mLock);
+
+    while (mQueue.isEmpty() && !mStopping)
+        mWake.wait(&mLock);
+
+    if (mStopping)
+        return false;
+
+    *fileName = mQueue.takeFirst();
+    return true;
+}
+
+void BlockIndex::addFile(const QString &fileName)
+{
+    {
+        // hashing files that can't be added is a waste of time
+        QMutexLocker locker(&mLock);
+        if (mBlocks.count() >= maxBlocks() && mInvalidFiles * 2 <= mFiles.count())
+            return;
+    }
+
+    QFile f(fileName);
+    if (!f.open(QIODevice::ReadOnly))
+        return;
+
+    // taken before reading, so a change while we read shows up as stale
+    const QFileInfo fileInfo(f);
+    IndexedFile file;
+    file.fileName = QFileInfo(fileName).absoluteFilePath();
+    file.size = fileInfo.size();
+    file.lastModified = modificationTime(fileInfo);
+    file.valid = true;
+
+    QByteArray fileHash;
+    QList<QByteArray> blockHashes;
+    if (!mParameters.hashFile(&f, &fileHash, &blockHashes))
+        return;
+
+    QMutexLocker locker(&mLock);
+
+    QHash<QString, int>::Iterator it = mFileIds.find(file.fileName);
+    if (it != mFileIds.end())
+        invalidate(*it);
+
+    if (mInvalidFiles * 2 > mFiles.count())
+        compact();
+
+    if (mBlocks.count() + blockHashes.count() > maxBlocks()) {
+        sDebug() << "No room in the index for " << file.fileName;
+        updateMemoryAccount();
+        return;
+    }
+
+    const quint64 fileId = quint64(mFiles.count());
+    mFiles.append(file);
+    mFileIds.insert(file.fileName, int(fileId));
+
+    for (int i = 0; i < blockHashes.count(); ++i)
+        mBlocks.insert(digestKey(blockHashes.at(i)), (fileId << 32) | quint64(i));
+
+    updateMemoryAccount();
+}
+
+/*! Stops handing out blocks of \a fileId; the caller holds mLock.
+ */
+void BlockIndex::invalidate(int fileId)
+{
+    if (!mFiles.at(fileId).valid)
+        return;
+
+    mFiles[fileId].valid = false;
+    mInvalidFiles++;
+}
+
+/*! Drops the files that aren't valid, and their blocks, renumbering the
+ * rest; the caller holds mLock.
+ */
+void BlockIndex::compact()
+{
+    QVector<int> newIds(mFiles.count(), -1);
+    QVector<IndexedFile> files;
+    files.reserve(mFiles.count() - mInvalidFiles);
+
+    mFileIds.clear();
+    for (int i = 0; i < mFiles.count(); ++i) {
+        if (!mFiles.at(i).valid)
+            continue;
+
+        newIds[i] = files.count();
+        mFileIds.insert(mFiles.at(i).fileName, files.count());
+        files.append(mFiles.at(i));
+    }
+
+    QHash<quint64, quint64>::Iterator it = mBlocks.begin();
+    while (it != mBlocks.end()) {
+        const int newId = newIds.at(int(*it >> 32));
+        if (newId == -1) {
+            it = mBlocks.erase(it);
+        } else {
+            *it = (quint64(newId) << 32) | (*it & 0xffffffff);
+            ++it;
+        }
+    }
+
+    sDebug() << "Dropped " << mFiles.count() - files.count() << " stale files from the index";
+    mFiles = files;
+    mInvalidFiles = 0;
+    mBlocks.squeeze();
+    updateMemoryAccount();
+}
+
+/*! Counts the index towards the memory budget; the caller holds mLock.
+ */
+void BlockIndex::updateMemoryAccount()
+{
+    mMemory.set(MemoryGovernor::Indexes, mBlocks.capacity() * qint64(sizeof(void *)) +
+                                         mBlocks.count() * blockEntrySize + mFiles.count() * fileEntrySize);
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BLOCKINDEX_H
+#define BLOCKINDEX_H
+
+// Qt
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QStringList>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+// Us
+#include "memorygovernor.h"
+#include "transferparameters.h"
+
+/*! Where a block can be found locally.
+ */
+struct BlockLocation
+{
+    BlockLocation() : offset(0) {}
+
+    QString fileName;
+    qint64 offset;
+};
+
+/*! Finds blocks of incoming files among the files we already have, so
+ * renamed, copied and duplicated files needn't be transferred again.
+ *
+ * Every regular file under the directories listed in index/roots (by
+ * default those holding the shared files) is hashed block by block, with
+ * our own transfer parameters, in a background thread at idle priority.
+ * Hidden files, such as partial transfers, symbolic links, and anything on
+ * another filesystem than its root (such as /proc) are left out. Files
+ * received later are added as they are committed.
+ *
+ * The index holds at most index/maxBlocks blocks (262144 by default, or
+ * 1GiB of files with 4KiB blocks), and files that don't fit are left out;
+ * what it takes is counted by the MemoryGovernor. Files that changed or
+ * went away are dropped from it once they make up half of those indexed.
+ *
+ * Only peers that use the same block size and hash algorithm as us can
+ * benefit. Locations are checked against the file's size and modification
+ * time before they are returned, and files that changed are indexed again.
+ * Digests are truncated to 64 bits to keep the index small, so callers
+ * must hash what they find, and remove() blocks that don't match.
+ */
+class BlockIndex : public QThread
+{
+public:
+    BlockIndex();
+    ~BlockIndex();
+
+    static BlockIndex *instance();
+
+    bool find(const TransferParameters &parameters, const QByteArray &blockHash, BlockLocation *location);
+    void remove(const QByteArray &blockHash);
+    void indexFile(const QString &fileName);
+
+protected:
+    void run();
+
+private:
+    struct IndexedFile
+    {
+        IndexedFile() : size(0), lastModified(0), valid(false) {}
+
+        QString fileName;
+        qint64 size;
+        qint64 lastModified;
+        bool valid;
+    };
+
+    void indexTree(const QString &root);
+    void addFile(const QString &fileName);
+    bool takeQueued(QString *fileName);
+    void invalidate(int fileId);
+    void compact();
+    void updateMemoryAccount();
+
+    const TransferParameters mParameters;
+    const QStringList mRoots;
+
+    // protects everything below
+    QMutex mLock;
+    QWaitCondition mWake;
+    bool mStopping;
+
+    // files to (re)index
+    QStringList mQueue;
+
+    // every file indexed, valid or not, by id, and how many aren't valid
+    QVector<IndexedFile> mFiles;
+    QHash<QString, int> mFileIds;
+    int mInvalidFiles;
+
+    // truncated digest -> (file id << 32) | block number
+    QHash<quint64, quint64> mBlocks;
+
+    MemoryAccount mMemory;
+};
+
+#endif // BLOCKINDEX_H
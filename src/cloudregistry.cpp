@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QCoreApplication>
+#include <QDesktopServices>
+#include <QDir>
+#include <QSet>
+
+// Saesu
+#include <sglobal.h>
+
+// Us
+#include "cloudregistry.h"
+#include "syncmanager.h"
+
+Q_GLOBAL_STATIC(CloudRegistry, cloudRegistryInstance)
+
+static QString cloudDatabasePath()
+{
+    // the clouds are stored in libsaesu's data location, not ours
+    QCoreApplication *a = QCoreApplication::instance();
+
+    QString orgName = a->organizationName();
+    QString appName = a->applicationName();
+
+    a->setOrganizationName(QLatin1String("saesu"));
+    a->setApplicationName(QLatin1String("clouds"));
+
+    QString databasePath = QDesktopServices::storageLocation(QDesktopServices::DataLocation);
+
+    a->setOrganizationName(orgName);
+    a->setApplicationName(appName);
+
+    return databasePath;
+}
+
+static bool isCloudDatabase(const QString &fileName)
+{
+    // sqlite creates these next to the database while writing
+    return !fileName.endsWith(QLatin1String("-journal")) &&
+           !fileName.endsWith(QLatin1String("-wal")) &&
+           !fileName.endsWith(QLatin1String("-shm"));
+}
+
+CloudRegistry::CloudRegistry()
+    : QObject()
+    , mDatabasePath(cloudDatabasePath())
+{
+    QDir databaseDir(mDatabasePath);
+    if (!databaseDir.exists())
+        databaseDir.mkpath(mDatabasePath);
+
+    // directory changes tend to come in bursts, so coalesce them
+    mRescanTimer.setSingleShot(true);
+    mRescanTimer.setInterval(100);
+    connect(&mRescanTimer, SIGNAL(timeout()), SLOT(rescan()));
+    connect(&mWatcher, SIGNAL(directoryChanged(QString)), &mRescanTimer, SLOT(start()));
+
+    mWatcher.addPath(mDatabasePath);
+    rescan();
+
+    sDebug() << "Watching " << mDatabasePath << " for clouds, found: " << mClouds;
+}
+
+CloudRegistry::~CloudRegistry()
+{
+}
+
+/*! Returns the registry; must first be called from the main thread.
+ */
+CloudRegistry *CloudRegistry::instance()
+{
+    return cloudRegistryInstance();
+}
+
+QStringList CloudRegistry::clouds() const
+{
+    QMutexLocker locker(&mLock);
+    return mClouds;
+}
+
+void CloudRegistry::rescan()
+{
+    QStringList databases;
+    foreach (const QString &fileName, QDir(mDatabasePath).entryList(QDir::Files)) {
+        if (isCloudDatabase(fileName))
+            databases.append(fileName);
+    }
+
+    const QSet<QString> current = databases.toSet();
+    QSet<QString> previous;
+
+    {
+        QMutexLocker locker(&mLock);
+        previous = mClouds.toSet();
+        mClouds = databases;
+    }
+
+    foreach (const QString &cloudName, current - previous) {
+        sDebug() << "Cloud added: " << cloudName;
+        SyncManager::instance(cloudName)->revive();
+        emit cloudAdded(cloudName);
+    }
+
+    foreach (const QString &cloudName, previous - current) {
+        sDebug() << "Cloud removed: " << cloudName;
+        SyncManager::instance(cloudName)->retire();
+        emit cloudRemoved(cloudName);
+    }
+}
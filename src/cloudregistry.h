@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUDREGISTRY_H
+#define CLOUDREGISTRY_H
+
+// Qt
+#include <QFileSystemWatcher>
+#include <QMutex>
+#include <QObject>
+#include <QStringList>
+#include <QTimer>
+
+/*! Keeps track of the clouds (databases) on this device.
+ *
+ * The clouds directory is scanned once on construction and then watched, so
+ * that clouds appearing or disappearing get a SyncManager instantiated or
+ * retired, and connected synchronisers are told about it.
+ *
+ * Lives on the main thread; clouds() may be called from any thread.
+ */
+class CloudRegistry : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CloudRegistry();
+    virtual ~CloudRegistry();
+
+    static CloudRegistry *instance();
+
+    QStringList clouds() const;
+
+signals:
+    void cloudAdded(const QString &cloudName);
+    void cloudRemoved(const QString &cloudName);
+
+private slots:
+    void rescan();
+
+private:
+    QString mDatabasePath;
+    QFileSystemWatcher mWatcher;
+    QTimer mRescanTimer;
+
+    mutable QMutex mLock;
+    QStringList mClouds;
+};
+
+#endif // CLOUDREGISTRY_H
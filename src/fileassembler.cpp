@@ -0,0 +1,486 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QDataStream>
+#include <QDir>
+#include <QFileInfo>
+
+// Saesu
+#include <sglobal.h>
+
+// Posix
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#if defined(Q_OS_LINUX)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// Us
+#include "fileassembler.h"
+
+// how much data to hold back before writing it out
+static const qint64 writeBehindLimit = 256 * 1024;
+
+// how often to record progress; blocks flushed in between are fetched again
+// if we're interrupted
+static const qint64 journalInterval = 1000;
+
+static const quint32 journalMagic = 0x53444a4e; // "SDJN"
+static const quint32 journalVersion = 2;
+
+/*! Returns how many blocks of \a blockSize bytes \a fileSize takes, without
+ * overflowing for sizes near the limit.
+ */
+static quint64 blockCountOf(quint64 fileSize, qint64 blockSize)
+{
+    return fileSize / quint64(blockSize) + (fileSize % quint64(blockSize) ? 1 : 0);
+}
+
+static QString temporaryFileName(const QString &fileName, const char *suffix)
+{
+    // must be on the same filesystem as the destination for rename() to be atomic
+    QFileInfo fi(fileName);
+    return fi.absoluteDir().absoluteFilePath(QLatin1String(".") + fi.fileName() + QLatin1String(suffix));
+}
+
+static bool syncFile(int fd)
+{
+#if defined(Q_OS_LINUX)
+    return fdatasync(fd) == 0;
+#else
+    return fsync(fd) == 0;
+#endif
+}
+
+/*! Copies \a length bytes at \a sourceOffset in \a sourceFd to
+ * \a destinationOffset in \a destinationFd, sharing the data between the
+ * two files rather than copying it where the filesystem allows.
+ */
+static bool copyRange(int sourceFd, qint64 sourceOffset, int destinationFd, qint64 destinationOffset, qint64 length)
+{
+#if defined(Q_OS_LINUX)
+#if defined(FICLONERANGE)
+    // btrfs and xfs can point both files at the same extents, which only
+    // works for ranges aligned to the filesystem's blocks
+    struct file_clone_range range;
+    range.src_fd = sourceFd;
+    range.src_offset = sourceOffset;
+    range.src_length = length;
+    range.dest_offset = destinationOffset;
+    if (ioctl(destinationFd, FICLONERANGE, &range) == 0)
+        return true;
+#endif
+
+#if defined(SYS_copy_file_range)
+    // copies within the kernel, and still shares extents where it can
+    loff_t in = sourceOffset;
+    loff_t out = destinationOffset;
+    while (length > 0) {
+        const long copied = syscall(SYS_copy_file_range, sourceFd, &in, destinationFd, &out, size_t(length), 0u);
+        if (copied < 0 && errno == EINTR)
+            continue;
+        if (copied <= 0)
+            break;
+
+        length -= copied;
+    }
+
+    if (length == 0)
+        return true;
+
+    sourceOffset = in;
+    destinationOffset = out;
+#endif
+#endif
+
+    char buffer[64 * 1024];
+    while (length > 0) {
+        const ssize_t readSize = pread(sourceFd, buffer, size_t(qMin<qint64>(length, sizeof(buffer))), sourceOffset);
+        if (readSize < 0 && errno == EINTR)
+            continue;
+        if (readSize <= 0)
+            return false;
+
+        ssize_t written = 0;
+        while (written < readSize) {
+            const ssize_t writeSize = pwrite(destinationFd, buffer + written, size_t(readSize - written),
+                                             destinationOffset + written);
+            if (writeSize < 0 && errno == EINTR)
+                continue;
+            if (writeSize <= 0)
+                return false;
+
+            written += writeSize;
+        }
+
+        sourceOffset += readSize;
+        destinationOffset += readSize;
+        length -= readSize;
+    }
+
+    return true;
+}
+
+FileAssembler::FileAssembler(const QString &fileName, quint64 fileSize,
+                             const QByteArray &fileHash, const TransferParameters &parameters)
+    : mFileName(fileName)
+    , mFileSize(fileSize)
+    , mBlockCount(blockCountOf(fileSize, parameters.blockSize))
+    , mFileHash(fileHash)
+    , mParameters(parameters)
+    , mFile(temporaryFileName(fileName, ".syncd-part"))
+    , mJournalFileName(temporaryFileName(fileName, ".syncd-journal"))
+    , mFinished(false)
+    , mBlocks(mBlockCount <= quint64(INT_MAX) ? int(mBlockCount) : 0)
+    , mBlocksWritten(0)
+    , mDurableBlocks(mBlocks.size())
+    , mPendingBytes(0)
+{
+}
+
+FileAssembler::~FileAssembler()
+{
+    if (mFinished || !mFile.isOpen())
+        return;
+
+    // keep what we have for next time
+    if (flush() && writeJournal())
+        sDebug() << "Interrupted transfer of " << mFileName << " at " << mBlocksWritten << "/" << blockCount() << " blocks";
+}
+
+/*! Creates the temporary file and reserves space for the whole file, or
+ * reopens it if an earlier transfer of the same file was interrupted.
+ */
+bool FileAssembler::open()
+{
+    // callers bound the size, but the bitmaps can't go past INT_MAX anyway
+    if (quint64(mBlocks.size()) != mBlockCount) {
+        sWarning() << "Can't receive " << mFileName << ", it has too many blocks: " << mBlockCount;
+        return false;
+    }
+
+    if (resume())
+        return true;
+
+    QFile::remove(mJournalFileName);
+
+    // unbuffered, as we do our own buffering
+    if (!mFile.open(QIODevice::ReadWrite | QIODevice::Truncate | QIODevice::Unbuffered)) {
+        sWarning() << "Couldn't create " << mFile.fileName() << ": " << mFile.errorString();
+        return false;
+    }
+
+    if (mFileSize == 0)
+        return true;
+
+#if defined(Q_OS_LINUX)
+    // reserve the blocks up front, so we don't fragment the file or run out
+    // of space halfway through
+    int error = posix_fallocate(mFile.handle(), 0, mFileSize);
+    if (error == 0)
+        return true;
+
+    sDebug() << "Couldn't preallocate " << mFile.fileName() << ", error " << error;
+#endif
+
+    return mFile.resize(mFileSize);
+}
+
+/*! Picks up an interrupted transfer from its journal.
+ */
+bool FileAssembler::resume()
+{
+    QFile journal(mJournalFileName);
+    if (!journal.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream(&journal);
+    quint32 magic;
+    quint32 version;
+    QByteArray fileHash;
+    quint64 fileSize;
+    qint64 blockSize;
+    qint32 algorithm;
+    QBitArray blocks;
+
+    stream >> magic >> version;
+    if (magic != journalMagic || version != journalVersion)
+        return false;
+
+    stream >> fileHash >> fileSize >> blockSize >> algorithm >> blocks;
+    if (stream.status() != QDataStream::Ok || fileHash != mFileHash ||
+        fileSize != mFileSize || blockSize != mParameters.blockSize ||
+        algorithm != mParameters.algorithm || blocks.size() != mBlocks.size()) {
+        sDebug() << "Journal for " << mFileName << " is for a different transfer, starting over";
+        return false;
+    }
+
+    if (!mFile.open(QIODevice::ReadWrite | QIODevice::Unbuffered) || (quint64)mFile.size() != mFileSize) {
+        mFile.close();
+        return false;
+    }
+
+    mBlocks = blocks;
+    mDurableBlocks = blocks;
+    mBlocksWritten = blocks.count(true);
+
+    sDebug() << "Resuming transfer of " << mFileName << " with " << mBlocksWritten << "/" << blockCount() << " blocks";
+    return true;
+}
+
+/*! Records which blocks are on disk, replacing the journal atomically.
+ */
+bool FileAssembler::writeJournal()
+{
+    QFile journal(mJournalFileName + QLatin1String(".new"));
+    if (!journal.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    {
+        QDataStream stream(&journal);
+        stream << journalMagic << journalVersion;
+        stream << mFileHash << mFileSize << mParameters.blockSize << qint32(mParameters.algorithm) << mDurableBlocks;
+    }
+
+    if (!journal.flush() || !syncFile(journal.handle()))
+        return false;
+
+    journal.close();
+
+    if (::rename(QFile::encodeName(journal.fileName()).constData(),
+                 QFile::encodeName(mJournalFileName).constData()) != 0)
+        return false;
+
+    mLastJournalWrite.start();
+    return true;
+}
+
+QString FileAssembler::fileName() const
+{
+    return mFileName;
+}
+
+TransferParameters FileAssembler::parameters() const
+{
+    return mParameters;
+}
+
+quint64 FileAssembler::blockCount() const
+{
+    return mBlockCount;
+}
+
+bool FileAssembler::hasBlock(quint64 blockNumber) const
+{
+    return blockNumber < blockCount() && mBlocks.testBit(blockNumber);
+}
+
+bool FileAssembler::isComplete() const
+{
+    return mBlocksWritten == blockCount();
+}
+
+/*! Returns roughly how much memory the transfer holds: its bitmaps, and
+ * the blocks waiting to be written.
+ */
+qint64 FileAssembler::memoryUsed() const
+{
+    return (mBlocks.size() + mDurableBlocks.size()) / 8 + mPendingBytes;
+}
+
+qint64 FileAssembler::expectedBlockLength(quint64 blockNumber) const
+{
+    return qMin<qint64>(mParameters.blockSize, mFileSize - blockNumber * mParameters.blockSize);
+}
+
+/*! Queues \a block for writing at \a blockNumber.
+ *
+ * Returns false if the block doesn't fit the file.
+ */
+bool FileAssembler::writeBlock(quint64 blockNumber, const QByteArray &block)
+{
+    if (blockNumber >= blockCount() || block.size() != expectedBlockLength(blockNumber)) {
+        sWarning() << "Rejecting block " << blockNumber << " of " << block.size() << " bytes for " << mFileName;
+        return false;
+    }
+
+    if (mBlocks.testBit(blockNumber))
+        return true; // already have it
+
+    mBlocks.setBit(blockNumber);
+    mBlocksWritten++;
+    mPending.insert(blockNumber, block);
+    mPendingBytes += block.size();
+
+    if (mPendingBytes >= writeBehindLimit)
+        return flush();
+
+    return true;
+}
+
+/*! Copies \a blockNumber from \a sourceFileName at \a sourceOffset, where
+ * a block hashing to \a blockHash was found locally.
+ *
+ * The copy is read back and hashed before the block counts as written, as
+ * the source may have changed since it was indexed. Returns false if it
+ * couldn't be copied, or doesn't match \a blockHash.
+ */
+bool FileAssembler::copyBlock(quint64 blockNumber, const QByteArray &blockHash, const QString &sourceFileName,
+                              qint64 sourceOffset)
+{
+    if (blockNumber >= blockCount())
+        return false;
+
+    if (mBlocks.testBit(blockNumber))
+        return true; // already have it
+
+    const int sourceFd = ::open(QFile::encodeName(sourceFileName).constData(), O_RDONLY);
+    if (sourceFd < 0)
+        return false;
+
+    const qint64 blockOffset = blockNumber * mParameters.blockSize;
+    const qint64 blockLength = expectedBlockLength(blockNumber);
+    const bool copied = copyRange(sourceFd, sourceOffset, mFile.handle(), blockOffset, blockLength);
+    ::close(sourceFd);
+
+    if (!copied) {
+        sDebug() << "Couldn't copy block " << blockNumber << " of " << mFileName << " from " << sourceFileName;
+        return false;
+    }
+
+    QByteArray block(int(blockLength), Qt::Uninitialized);
+    if (pread(mFile.handle(), block.data(), size_t(blockLength), blockOffset) != blockLength ||
+        mParameters.hashBlock(block.constData(), block.size()) != blockHash) {
+        sDebug() << "Block " << blockNumber << " copied from " << sourceFileName << " doesn't match";
+        return false;
+    }
+
+    mBlocks.setBit(blockNumber);
+    mBlocksWritten++;
+    mUnsynced.append(blockNumber);
+    return true;
+}
+
+/*! Writes out all pending blocks, one write per contiguous run, and syncs
+ * them to disk along with any copied blocks.
+ */
+bool FileAssembler::flush()
+{
+    if (mPending.isEmpty() && mUnsynced.isEmpty())
+        return true;
+
+    QMap<quint64, QByteArray>::ConstIterator it = mPending.constBegin();
+    while (it != mPending.constEnd()) {
+        const quint64 firstBlock = it.key();
+        quint64 nextBlock = firstBlock;
+        QByteArray run;
+
+        while (it != mPending.constEnd() && it.key() == nextBlock) {
+            run.append(it.value());
+            ++nextBlock;
+            ++it;
+        }
+
+        if (!mFile.seek(firstBlock * mParameters.blockSize) || mFile.write(run) != run.size()) {
+            sWarning() << "Couldn't write to " << mFile.fileName() << ": " << mFile.errorString();
+            return false;
+        }
+    }
+
+    if (!syncFile(mFile.handle())) {
+        sWarning() << "Couldn't sync " << mFile.fileName() << ", errno " << errno;
+        return false;
+    }
+
+    QMap<quint64, QByteArray>::ConstIterator pit = mPending.constBegin();
+    for (; pit != mPending.constEnd(); ++pit)
+        mDurableBlocks.setBit(pit.key());
+
+    foreach (quint64 blockNumber, mUnsynced)
+        mDurableBlocks.setBit(blockNumber);
+
+    mUnsynced.clear();
+    mPending.clear();
+    mPendingBytes = 0;
+
+    if (!mLastJournalWrite.isValid() || mLastJournalWrite.elapsed() >= journalInterval)
+        writeJournal();
+
+    return true;
+}
+
+/*! Verifies the assembled file, and moves it into place.
+ *
+ * Must only be called once every block has been written.
+ */
+bool FileAssembler::commit()
+{
+    Q_ASSERT(isComplete());
+
+    if (!flush())
+        return false;
+
+    QByteArray fileHash;
+
+    mFile.seek(0);
+    if (!mParameters.hashFile(&mFile, &fileHash) || fileHash != mFileHash) {
+        sWarning() << "Assembled " << mFileName << " doesn't match its hash, discarding";
+        discard();
+        return false;
+    }
+
+    mFile.close();
+
+    if (::rename(QFile::encodeName(mFile.fileName()).constData(),
+                 QFile::encodeName(mFileName).constData()) != 0) {
+        sWarning() << "Couldn't move " << mFile.fileName() << " into place, errno " << errno;
+        discard();
+        return false;
+    }
+
+    mFinished = true;
+    QFile::remove(mJournalFileName);
+
+#if defined(Q_OS_UNIX)
+    // make the rename itself durable
+    int dirFd = ::open(QFile::encodeName(QFileInfo(mFileName).absolutePath()).constData(), O_RDONLY);
+    if (dirFd != -1) {
+        fsync(dirFd);
+        ::close(dirFd);
+    }
+#endif
+
+    sDebug() << "Finished receiving " << mFileName;
+    return true;
+}
+
+/*! Throws away everything received so far, including the journal.
+ */
+void FileAssembler::discard()
+{
+    sDebug() << "Discarding transfer of " << mFileName;
+
+    mFinished = true;
+    mFile.close();
+    mFile.remove();
+    QFile::remove(mJournalFileName);
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILEASSEMBLER_H
+#define FILEASSEMBLER_H
+
+// Qt
+#include <QBitArray>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QList>
+#include <QMap>
+#include <QString>
+
+// Us
+#include "transferparameters.h"
+
+/*! Assembles an incoming file from its blocks.
+ *
+ * Blocks are collected in a temporary file next to the destination, which
+ * is preallocated to the final size. Writes are buffered and flushed in
+ * contiguous runs followed by a single sync, and once every block has
+ * arrived the result is verified against the file hash and atomically
+ * renamed over the destination, so a crash never leaves a torn file behind.
+ *
+ * Progress is recorded in a journal next to the temporary file, listing the
+ * blocks that are safely on disk. If the transfer is interrupted, the
+ * temporary file and journal are kept, and a later transfer of the same
+ * file (same hash, size and transfer parameters) picks up where it left off.
+ * Callers must only write blocks that have been verified.
+ */
+class FileAssembler
+{
+public:
+    explicit FileAssembler(const QString &fileName, quint64 fileSize,
+                           const QByteArray &fileHash, const TransferParameters &parameters);
+    ~FileAssembler();
+
+    bool open();
+
+    QString fileName() const;
+    TransferParameters parameters() const;
+    quint64 blockCount() const;
+    bool hasBlock(quint64 blockNumber) const;
+    bool isComplete() const;
+    qint64 memoryUsed() const;
+
+    bool writeBlock(quint64 blockNumber, const QByteArray &block);
+    bool copyBlock(quint64 blockNumber, const QByteArray &blockHash, const QString &sourceFileName,
+                   qint64 sourceOffset);
+    bool commit();
+    void discard();
+
+private:
+    bool resume();
+    bool flush();
+    bool writeJournal();
+    qint64 expectedBlockLength(quint64 blockNumber) const;
+
+    QString mFileName;
+    quint64 mFileSize;
+    quint64 mBlockCount;
+    QByteArray mFileHash;
+    TransferParameters mParameters;
+    QFile mFile;
+    QString mJournalFileName;
+    bool mFinished;
+
+    // blocks that have been written, whether they are still pending or not
+    QBitArray mBlocks;
+    quint64 mBlocksWritten;
+
+    // blocks that have been synced to disk, i.e. those we can journal
+    QBitArray mDurableBlocks;
+    QElapsedTimer mLastJournalWrite;
+
+    // write-behind queue, ordered so contiguous blocks are written together
+    QMap<quint64, QByteArray> mPending;
+    qint64 mPendingBytes;
+
+    // blocks copied straight into the file, which still need syncing
+    QList<quint64> mUnsynced;
+};
+
+#endif // FILEASSEMBLER_H
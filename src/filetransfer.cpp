@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QSettings>
+
+// Saesu
+#include <sglobal.h>
+
+// Us
+#include "filetransfer.h"
+#include "transfercoordinator.h"
+
+static int initialWindow()
+{
+    static const int window = QSettings().value(QLatin1String("transfer/initialWindow"), 8).toInt();
+    return qMax(window, 1);
+}
+
+static int maximumWindow()
+{
+    static const int window = QSettings().value(QLatin1String("transfer/maxWindow"), 256).toInt();
+    return qMax(window, initialWindow());
+}
+
+// how many delivery rate samples without growth end slow start
+static const int flatIntervalLimit = 3;
+
+TransferWindow::TransferWindow()
+    : mWindow(initialWindow())
+    , mSlowStart(true)
+    , mSmoothedRtt(-1)
+    , mRttVariance(0)
+    , mDeliveryRate(0)
+    , mLastDeliveryRate(0)
+    , mFlatIntervals(0)
+    , mIntervalStart(-1)
+    , mIntervalBlocks(0)
+{
+}
+
+int TransferWindow::size() const
+{
+    return qBound(1, (int)mWindow, maximumWindow());
+}
+
+/*! Returns how long to wait for a requested block before asking again, in
+ * milliseconds.
+ */
+qint64 TransferWindow::timeout() const
+{
+    if (mSmoothedRtt < 0)
+        return 3000; // no idea yet, be patient
+
+    return qMax<qint64>(1000, qint64(mSmoothedRtt + 4 * mRttVariance));
+}
+
+void TransferWindow::onBlockReceived(qint64 rtt, qint64 now)
+{
+    if (mSmoothedRtt < 0) {
+        mSmoothedRtt = rtt;
+        mRttVariance = rtt / 2.0;
+    } else {
+        mRttVariance = 0.75 * mRttVariance + 0.25 * qAbs(mSmoothedRtt - rtt);
+        mSmoothedRtt = 0.875 * mSmoothedRtt + 0.125 * rtt;
+    }
+
+    sampleDeliveryRate(now);
+
+    if (mSlowStart) {
+        mWindow += 1;
+    } else {
+        // keep the pipe full, with some headroom to notice if it got wider
+        const double bandwidthDelayProduct = mDeliveryRate * mSmoothedRtt;
+        mWindow = bandwidthDelayProduct * 1.25 + 2;
+    }
+
+    mWindow = qBound<double>(1, mWindow, maximumWindow());
+}
+
+void TransferWindow::onTimeout()
+{
+    mWindow = qMax<double>(1, mWindow / 2);
+    mSlowStart = false;
+}
+
+void TransferWindow::sampleDeliveryRate(qint64 now)
+{
+    if (mIntervalStart < 0) {
+        mIntervalStart = now;
+        mIntervalBlocks = 0;
+    }
+
+    mIntervalBlocks++;
+
+    // sample once per round trip
+    const qint64 elapsed = now - mIntervalStart;
+    if (elapsed < qMax<qint64>(qint64(mSmoothedRtt), 10))
+        return;
+
+    const double sample = mIntervalBlocks / double(elapsed);
+    mDeliveryRate = mDeliveryRate == 0 ? sample : 0.75 * mDeliveryRate + 0.25 * sample;
+
+    if (mSlowStart) {
+        if (sample < mLastDeliveryRate * 1.1)
+            mFlatIntervals++;
+        else
+            mFlatIntervals = 0;
+
+        if (mFlatIntervals >= flatIntervalLimit) {
+            sDebug() << "Delivery rate settled at " << mDeliveryRate * 1000 << " blocks/s, window " << mWindow;
+            mSlowStart = false;
+        }
+    }
+
+    mLastDeliveryRate = sample;
+    mIntervalStart = now;
+    mIntervalBlocks = 0;
+}
+
+FileTransfer::FileTransfer(const QSharedPointer<FileSwarm> &swarm)
+    : mSwarm(swarm)
+    , mFirstRequestTime(-1)
+    , mBytesReceived(0)
+{
+}
+
+FileTransfer::~FileTransfer()
+{
+    // whatever we were waiting for is up for grabs again
+    QList<quint64> inFlight = mInFlight.keys();
+    qSort(inFlight);
+    TransferCoordinator::leave(&mSwarm, this, inFlight);
+}
+
+FileSwarm *FileTransfer::swarm() const
+{
+    return mSwarm.data();
+}
+
+bool FileTransfer::isComplete() const
+{
+    return mSwarm->isComplete();
+}
+
+bool FileTransfer::isFinished() const
+{
+    return mSwarm->isFinished();
+}
+
+bool FileTransfer::hasRequestsInFlight() const
+{
+    return !mInFlight.isEmpty();
+}
+
+int FileTransfer::requestsInFlight() const
+{
+    return mInFlight.count();
+}
+
+/*! Returns how fast blocks have been arriving over this connection, from
+ * the first request until \a now, or 0 if none have.
+ */
+quint64 FileTransfer::bytesPerSecond(qint64 now) const
+{
+    if (mFirstRequestTime < 0 || !mBytesReceived)
+        return 0;
+
+    return mBytesReceived * 1000 / quint64(qMax<qint64>(now - mFirstRequestTime, 1));
+}
+
+/*! Returns the blocks that should be requested now, and considers them in
+ * flight from \a now on.
+ */
+QList<quint64> FileTransfer::takeRequests(qint64 now)
+{
+    QList<quint64> requests;
+
+    const int room = mWindow.size() - mInFlight.count();
+    if (room <= 0)
+        return requests;
+
+    foreach (quint64 blockNumber, mSwarm->claim(this, room, bytesPerSecond(now))) {
+        mInFlight.insert(blockNumber, now);
+        requests.append(blockNumber);
+    }
+
+    if (mFirstRequestTime < 0 && !requests.isEmpty())
+        mFirstRequestTime = now;
+
+    return requests;
+}
+
+/*! Verifies and stores \a block, and updates the window from its round
+ * trip time. Blocks that don't match their hash are requested again, from
+ * whichever connection gets to them first.
+ *
+ * Returns false if the block couldn't be stored.
+ */
+bool FileTransfer::blockReceived(quint64 blockNumber, const QByteArray &block, qint64 now)
+{
+    QHash<quint64, qint64>::Iterator it = mInFlight.find(blockNumber);
+    if (it != mInFlight.end()) {
+        mWindow.onBlockReceived(now - *it, now);
+        mInFlight.erase(it);
+    }
+
+    const QByteArray blockHash = mSwarm->expectedHash(blockNumber);
+    if (blockHash.isEmpty())
+        return true; // duplicate, or something we never asked for
+
+    // hashed without holding up the other connections
+    if (mSwarm->parameters().hashBlock(block.constData(), block.size()) != blockHash) {
+        sDebug() << "Block " << blockNumber << " of " << mSwarm->fileName() << " is corrupt, requesting again";
+        if (!mInFlight.contains(blockNumber))
+            mSwarm->release(QList<quint64>() << blockNumber);
+        return true;
+    }
+
+    mBytesReceived += block.size();
+    return mSwarm->storeBlock(blockNumber, block);
+}
+
+/*! Puts requests that have gone unanswered for too long back at the front
+ * of the swarm's pool, and shrinks the window.
+ *
+ * Returns true if any requests expired.
+ */
+bool FileTransfer::expireRequests(qint64 now)
+{
+    const qint64 timeout = mWindow.timeout();
+    QList<quint64> expired;
+
+    QHash<quint64, qint64>::Iterator it = mInFlight.begin();
+    while (it != mInFlight.end()) {
+        if (now - *it > timeout) {
+            expired.append(it.key());
+            it = mInFlight.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    if (expired.isEmpty())
+        return false;
+
+    sDebug() << expired.count() << " block requests for " << mSwarm->fileName() << " timed out";
+    qSort(expired);
+    mSwarm->release(expired);
+    mWindow.onTimeout();
+    return true;
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILETRANSFER_H
+#define FILETRANSFER_H
+
+// Qt
+#include <QHash>
+#include <QList>
+#include <QSharedPointer>
+#include <QString>
+
+class FileSwarm;
+
+/*! Decides how many block requests may be outstanding on a link.
+ *
+ * The window starts small and grows by one block for every block received
+ * (doubling once per round trip) until the measured delivery rate stops
+ * increasing. From then on it tracks the measured bandwidth-delay product,
+ * and it is halved whenever a request times out.
+ */
+class TransferWindow
+{
+public:
+    TransferWindow();
+
+    int size() const;
+    qint64 timeout() const;
+
+    void onBlockReceived(qint64 rtt, qint64 now);
+    void onTimeout();
+
+private:
+    void sampleDeliveryRate(qint64 now);
+
+    double mWindow;
+    bool mSlowStart;
+
+    // round trip time estimates, in milliseconds
+    double mSmoothedRtt;
+    double mRttVariance;
+
+    // delivery rate in blocks per millisecond
+    double mDeliveryRate;
+    double mLastDeliveryRate;
+    int mFlatIntervals;
+    qint64 mIntervalStart;
+    int mIntervalBlocks;
+};
+
+/*! Tracks one connection's part in receiving a file: which blocks it has
+ * requested from its peer and when, and how fast they are arriving.
+ *
+ * The blocks to fetch are claimed from the FileSwarm shared with any other
+ * connections receiving the same file. Received blocks are checked against
+ * the expected hash before they are stored.
+ */
+class FileTransfer
+{
+public:
+    explicit FileTransfer(const QSharedPointer<FileSwarm> &swarm);
+    ~FileTransfer();
+
+    FileSwarm *swarm() const;
+    bool isComplete() const;
+    bool isFinished() const;
+    bool hasRequestsInFlight() const;
+    int requestsInFlight() const;
+    quint64 bytesPerSecond(qint64 now) const;
+
+    QList<quint64> takeRequests(qint64 now);
+    bool blockReceived(quint64 blockNumber, const QByteArray &block, qint64 now);
+    bool expireRequests(qint64 now);
+
+private:
+    QSharedPointer<FileSwarm> mSwarm;
+    TransferWindow mWindow;
+
+    // outstanding requests, block number -> time requested
+    QHash<quint64, qint64> mInFlight;
+
+    // when the first block was requested, and how much has arrived since
+    qint64 mFirstRequestTime;
+    quint64 mBytesReceived;
+};
+
+#endif // FILETRANSFER_H
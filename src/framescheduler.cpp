@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Us
+#include "framescheduler.h"
+#include "syncmessages.h"
+
+// the most of a frame that is sent in one go; larger ones are fragmented
+static const int fragmentSize = 16 * 1024;
+
+static const int headerSize = sizeof(quint32);
+
+FrameScheduler::FrameScheduler()
+    : mCurrent(ObjectMetadataStream)
+    , mTurnStarted(false)
+{
+    // fragments per turn; object lists and requests are small, and let the
+    // peer get on with the rest of the sync
+    mQueues[ObjectMetadataStream].weight = 4;
+    mQueues[ObjectBodyStream].weight = 2;
+    mQueues[FileBulkStream].weight = 1;
+}
+
+/*! Returns the stream frames of the command \a token are sent on.
+ */
+FrameScheduler::Stream FrameScheduler::streamOf(quint8 token)
+{
+    switch (token) {
+    case SyncManagerSynchroniser::DeleteListCommand:
+    case SyncManagerSynchroniser::ObjectListCommand:
+    case SyncManagerSynchroniser::ObjectRequestCommand:
+        return ObjectMetadataStream;
+    case SyncManagerSynchroniser::ObjectReplyCommand:
+    case SyncManagerSynchroniser::ObjectStreamCommand:
+    case SyncManagerSynchroniser::ObjectChunkCommand:
+        return ObjectBodyStream;
+    case SyncManagerSynchroniser::FileHashReplyCommand:
+    case SyncManagerSynchroniser::FileBlockReplyCommand:
+        return FileBulkStream;
+    }
+
+    // the handshake, name declarations, and the small file commands the
+    // peer is waiting on
+    return ControlStream;
+}
+
+const char *FrameScheduler::streamName(int stream)
+{
+    switch (stream) {
+    case ControlStream: return "Control";
+    case ObjectMetadataStream: return "ObjectMetadata";
+    case ObjectBodyStream: return "ObjectBody";
+    case FileBulkStream: return "FileBulk";
+    }
+
+    return 0;
+}
+
+/*! Returns true if \a stream has to wait for the bandwidth limits.
+ */
+bool FrameScheduler::isShaped(Stream stream)
+{
+    return stream == FileBulkStream;
+}
+
+/*! Queues \a frame, as encoded by encodeMessage(), on its command's stream.
+ */
+void FrameScheduler::enqueue(const QByteArray &frame)
+{
+    Queue &queue = mQueues[streamOf(quint8(frame.at(headerSize)))];
+    queue.frames.enqueue(frame);
+    queue.bytes += frame.size();
+}
+
+bool FrameScheduler::isEmpty() const
+{
+    for (int i = 0; i < StreamCount; ++i) {
+        if (!mQueues[i].frames.isEmpty())
+            return false;
+    }
+
+    return true;
+}
+
+qint64 FrameScheduler::queuedBytes() const
+{
+    qint64 bytes = 0;
+    for (int i = 0; i < StreamCount; ++i)
+        bytes += mQueues[i].bytes;
+
+    return bytes;
+}
+
+qint64 FrameScheduler::queuedBytes(Stream stream) const
+{
+    return mQueues[stream].bytes;
+}
+
+/*! Returns the next frame to write, which is either a whole queued frame or
+ * a fragment of one, or an empty array if nothing is queued. Shaped streams
+ * are passed over unless \a shapedAllowed.
+ */
+QByteArray FrameScheduler::takeFrame(bool shapedAllowed)
+{
+    if (!mQueues[ControlStream].frames.isEmpty())
+        return takePiece(ControlStream);
+
+    bool eligible = false;
+    for (int i = ControlStream + 1; i < StreamCount; ++i) {
+        if (!mQueues[i].frames.isEmpty() && (shapedAllowed || !isShaped(Stream(i))))
+            eligible = true;
+    }
+
+    if (!eligible)
+        return QByteArray();
+
+    forever {
+        Queue &queue = mQueues[mCurrent];
+
+        if (!shapedAllowed && isShaped(Stream(mCurrent))) {
+            // waiting for bandwidth; keep its deficit for when it's allowed again
+        } else if (!queue.frames.isEmpty()) {
+            if (!mTurnStarted) {
+                queue.deficit += fragmentSize * queue.weight;
+                mTurnStarted = true;
+            }
+
+            const int cost = qMin(queue.frames.head().size() - headerSize - queue.offset, fragmentSize);
+            if (cost <= queue.deficit) {
+                queue.deficit -= cost;
+                return takePiece(Stream(mCurrent));
+            }
+        } else {
+            // idle streams don't save up
+            queue.deficit = 0;
+        }
+
+        mCurrent = mCurrent % (StreamCount - 1) + 1;
+        mTurnStarted = false;
+    }
+}
+
+/*! Takes the first frame queued on \a stream, or the next fragment of it.
+ */
+QByteArray FrameScheduler::takePiece(Stream stream)
+{
+    Queue &queue = mQueues[stream];
+    const int frameSize = queue.frames.head().size();
+
+    if (queue.offset == 0 && frameSize - headerSize <= fragmentSize) {
+        queue.bytes -= frameSize;
+        return queue.frames.dequeue();
+    }
+
+    FragmentMessage fragment;
+    fragment.stream = stream;
+    fragment.piece = queue.frames.head().mid(headerSize + queue.offset, fragmentSize);
+    queue.offset += fragment.piece.size();
+    queue.bytes -= fragment.piece.size();
+    fragment.final = headerSize + queue.offset == frameSize;
+
+    if (fragment.final) {
+        queue.bytes -= headerSize;
+        queue.frames.dequeue();
+        queue.offset = 0;
+    }
+
+    return encodeMessage(fragment).bytes;
+}
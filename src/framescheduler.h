@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FRAMESCHEDULER_H
+#define FRAMESCHEDULER_H
+
+// Qt
+#include <QByteArray>
+#include <QQueue>
+
+/*! Decides which of the frames waiting for a connection goes out next.
+ *
+ * Frames are queued on one of a few logical streams, chosen by their
+ * command. Control frames always go first; the others take turns by
+ * deficit round robin, weighted so that object sync keeps moving while
+ * files are being transferred. Within a stream, frames keep their order.
+ *
+ * Frames larger than a fragment are sent as FragmentCommands, so that a
+ * large object or file block can't hold up the other streams for long.
+ */
+class FrameScheduler
+{
+public:
+    enum Stream
+    {
+        ControlStream,
+        ObjectMetadataStream,
+        ObjectBodyStream,
+        FileBulkStream,
+        StreamCount
+    };
+
+    FrameScheduler();
+
+    static Stream streamOf(quint8 token);
+    static const char *streamName(int stream);
+    static bool isShaped(Stream stream);
+
+    void enqueue(const QByteArray &frame);
+    bool isEmpty() const;
+    qint64 queuedBytes() const;
+    qint64 queuedBytes(Stream stream) const;
+
+    QByteArray takeFrame(bool shapedAllowed = true);
+
+private:
+    struct Queue
+    {
+        Queue() : weight(1), deficit(0), offset(0), bytes(0) {}
+
+        QQueue<QByteArray> frames;
+        int weight;
+        qint64 deficit;
+
+        // how much of the first frame has already been sent as fragments
+        int offset;
+        qint64 bytes;
+    };
+
+    QByteArray takePiece(Stream stream);
+
+    Queue mQueues[StreamCount];
+    int mCurrent;
+    bool mTurnStarted;
+};
+
+#endif // FRAMESCHEDULER_H
@@ -16,9 +16,18 @@
 
 #include <QCoreApplication>
 #include <QDateTime>
+#include <QHostAddress>
 
+#include <sobject.h>
+
+#include "blockindex.h"
+#include "cloudregistry.h"
 #include "syncadvertiser.h"
 #include "filewatcher.h"
+#include "memorygovernor.h"
+#include "syncprotocol.h"
+#include "synctls.h"
+#include "synctrace.h"
 
 int main(int argc, char **argv)
 {
@@ -29,6 +38,27 @@ int main(int argc, char **argv)
     a.setOrganizationName(QLatin1String("saesu"));
     a.setApplicationName(QLatin1String("syncd"));
 
+    // for signals and invocations crossing into worker threads
+    qRegisterMetaType<QHostAddress>("QHostAddress");
+    qRegisterMetaType<QList<SObject> >("QList<SObject>");
+    qRegisterMetaType<QList<SObjectLocalId> >("QList<SObjectLocalId>");
+    qRegisterMetaType<SyncFrame>("SyncFrame");
+    qRegisterMetaType<QList<SyncFrame> >("QList<SyncFrame>");
+
+#ifdef SYNCD_TRACING
+    SyncTrace::installSignalHandler();
+#endif
+
+    // load the certificates and memory limits before any connection needs them
+    SyncTls::isEnabled();
+    MemoryGovernor::budget();
+
+    // find our clouds, and start loading them, before any peer asks for them
+    CloudRegistry::instance();
+
+    // look for blocks of incoming files among the ones we have, in the background
+    BlockIndex::instance()->start(QThread::IdlePriority);
+
     SyncAdvertiser storageAdvertiser;
     a.exec();
 }
@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QSettings>
+
+// Posix
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// Us
+#include "memorygovernor.h"
+
+// how stale the resident set size may be; reading it costs a system call
+// or three, and pressure is checked for every read from every peer
+static const qint64 residentSetSizeInterval = 250;
+
+/*! Returns the resident set size of this process in bytes, or 0 where
+ * it can't be found out.
+ */
+static qint64 readResidentSetSize()
+{
+#if defined(Q_OS_LINUX)
+    const int fd = ::open("/proc/self/statm", O_RDONLY);
+    if (fd == -1)
+        return 0;
+
+    char buffer[128];
+    const ssize_t length = ::read(fd, buffer, sizeof(buffer) - 1);
+    ::close(fd);
+    if (length <= 0)
+        return 0;
+    buffer[length] = '\0';
+
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    if (sscanf(buffer, "%lu %lu", &size, &resident) != 2)
+        return 0;
+
+    return qint64(resident) * sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+/*! The limits, read once on first use, and what is held against them.
+ */
+struct GovernorData
+{
+    GovernorData()
+    {
+        QSettings settings;
+        budget = qMax<qint64>(settings.value(QLatin1String("memory/budget"), 64 * 1024 * 1024).toLongLong(), 1024 * 1024);
+        residentSetSizeCeiling = qMax<qint64>(settings.value(QLatin1String("memory/rssCeiling"), 0).toLongLong(), 0);
+    }
+
+    qint64 budget;
+    qint64 residentSetSizeCeiling;
+    MetricGauge used[MemoryGovernor::CategoryCount];
+
+    QMutex residentSetSizeLock;
+    QElapsedTimer residentSetSizeClock;
+    MetricGauge residentSetSize;
+};
+
+Q_GLOBAL_STATIC(GovernorData, governorData)
+
+static MemoryGovernor::Pressure pressureOf(qint64 used, qint64 limit)
+{
+    if (limit <= 0)
+        return MemoryGovernor::Normal;
+    if (used >= limit)
+        return MemoryGovernor::Critical;
+    if (used >= limit / 4 * 3)
+        return MemoryGovernor::High;
+    return MemoryGovernor::Normal;
+}
+
+static const char *pressureName(MemoryGovernor::Pressure pressure)
+{
+    switch (pressure) {
+    case MemoryGovernor::Normal: return "normal";
+    case MemoryGovernor::High: return "high";
+    case MemoryGovernor::Critical: return "critical";
+    }
+
+    return 0;
+}
+
+qint64 MemoryGovernor::budget()
+{
+    return governorData()->budget;
+}
+
+/*! Returns the bytes held in all accounts.
+ */
+qint64 MemoryGovernor::used()
+{
+    qint64 total = 0;
+    for (int i = 0; i < CategoryCount; ++i)
+        total += used(Category(i));
+    return total;
+}
+
+qint64 MemoryGovernor::used(Category category)
+{
+    return governorData()->used[category].value();
+}
+
+/*! Returns the resident set size of the process, as of at most 250ms ago.
+ */
+qint64 MemoryGovernor::residentSetSize()
+{
+    GovernorData *data = governorData();
+
+    // whoever holds the lock is reading it already; theirs will do next time
+    if (!data->residentSetSizeLock.tryLock())
+        return data->residentSetSize.value();
+
+    if (!data->residentSetSizeClock.isValid() || data->residentSetSizeClock.elapsed() >= residentSetSizeInterval) {
+        data->residentSetSize.set(readResidentSetSize());
+        data->residentSetSizeClock.start();
+    }
+
+    data->residentSetSizeLock.unlock();
+    return data->residentSetSize.value();
+}
+
+/*! Returns how close we are to the budget or the resident set size
+ * ceiling, whichever is closer.
+ */
+MemoryGovernor::Pressure MemoryGovernor::pressure()
+{
+    GovernorData *data = governorData();
+    Pressure pressure = pressureOf(used(), data->budget);
+
+    if (pressure != Critical && data->residentSetSizeCeiling > 0)
+        pressure = qMax(pressure, pressureOf(residentSetSize(), data->residentSetSizeCeiling));
+
+    return pressure;
+}
+
+QVariantMap MemoryGovernor::toMap()
+{
+    GovernorData *data = governorData();
+
+    QVariantMap map;
+    map.insert(QLatin1String("budget"), data->budget);
+    map.insert(QLatin1String("used"), used());
+    map.insert(QLatin1String("receiveBuffers"), used(ReceiveBuffers));
+    map.insert(QLatin1String("sendQueues"), used(SendQueues));
+    map.insert(QLatin1String("objectBodies"), used(ObjectBodies));
+    map.insert(QLatin1String("pendingSaves"), used(PendingSaves));
+    map.insert(QLatin1String("indexes"), used(Indexes));
+    map.insert(QLatin1String("transfers"), used(Transfers));
+    map.insert(QLatin1String("residentSetSize"), residentSetSize());
+    map.insert(QLatin1String("rssCeiling"), data->residentSetSizeCeiling);
+    map.insert(QLatin1String("pressure"), QLatin1String(pressureName(pressure())));
+    return map;
+}
+
+void MemoryGovernor::add(Category category, qint64 bytes)
+{
+    governorData()->used[category].add(bytes);
+}
+
+MemoryAccount::~MemoryAccount()
+{
+    clear();
+}
+
+void MemoryAccount::add(MemoryGovernor::Category category, qint64 bytes)
+{
+    mBytes[category].add(bytes);
+    MemoryGovernor::add(category, bytes);
+}
+
+void MemoryAccount::set(MemoryGovernor::Category category, qint64 bytes)
+{
+    const qint64 delta = bytes - mBytes[category].value();
+    if (delta)
+        add(category, delta);
+}
+
+qint64 MemoryAccount::used() const
+{
+    qint64 total = 0;
+    for (int i = 0; i < MemoryGovernor::CategoryCount; ++i)
+        total += mBytes[i].value();
+    return total;
+}
+
+/*! Releases everything held in the account.
+ */
+void MemoryAccount::clear()
+{
+    for (int i = 0; i < MemoryGovernor::CategoryCount; ++i)
+        set(MemoryGovernor::Category(i), 0);
+}
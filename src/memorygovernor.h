@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEMORYGOVERNOR_H
+#define MEMORYGOVERNOR_H
+
+// Qt
+#include <QVariantMap>
+
+// Us
+#include "syncmetrics.h"
+
+/*! Keeps syncd within its memory budget, however its peers behave.
+ *
+ * Whatever holds data on behalf of peers accounts for it with a
+ * MemoryAccount: connections for what they have received but not yet
+ * processed, what is queued to be sent and the objects waiting to be
+ * streamed, clouds for the objects waiting to be saved and which peers
+ * have which versions, the BlockIndex for where blocks of our files are,
+ * and each FileSwarm for the blocks of an incoming file and where they are
+ * to come from. The total is
+ * weighed against memory/budget (64MiB by default) and, if
+ * memory/rssCeiling is set, the resident set size of the whole process is
+ * weighed against that, to give the pressure everyone else acts on:
+ *
+ *   High: three quarters of either is used; work that can be redone later
+ *   is shed, i.e. block requests from peers are dropped (they ask again
+ *   once the request expires), and incoming connections and files offered
+ *   by peers are refused.
+ *
+ *   Critical: all of either is used; connections also stop reading from
+ *   their peers, which the peers feel as TCP flow control, until enough
+ *   has been sent or saved.
+ *
+ * Everything may be used from any thread, and only reading the resident
+ * set size (on Linux, at most every 250ms) takes a lock.
+ */
+class MemoryGovernor
+{
+public:
+    enum Category
+    {
+        ReceiveBuffers,
+        SendQueues,
+        ObjectBodies,
+        PendingSaves,
+        Indexes,
+        Transfers,
+        CategoryCount
+    };
+
+    enum Pressure
+    {
+        Normal,
+        High,
+        Critical
+    };
+
+    static qint64 budget();
+    static qint64 used();
+    static qint64 used(Category category);
+    static qint64 residentSetSize();
+    static Pressure pressure();
+
+    static QVariantMap toMap();
+
+private:
+    friend class MemoryAccount;
+    static void add(Category category, qint64 bytes);
+};
+
+/*! Memory held by one owner, counted towards the MemoryGovernor's total
+ * until it is released, at the latest when the account is destroyed.
+ *
+ * add() may be used from any thread; set() only from one at a time.
+ */
+class MemoryAccount
+{
+public:
+    MemoryAccount() {}
+    ~MemoryAccount();
+
+    void add(MemoryGovernor::Category category, qint64 bytes);
+    void set(MemoryGovernor::Category category, qint64 bytes);
+    qint64 used() const;
+    void clear();
+
+private:
+    Q_DISABLE_COPY(MemoryAccount)
+
+    MetricGauge mBytes[MemoryGovernor::CategoryCount];
+};
+
+#endif // MEMORYGOVERNOR_H
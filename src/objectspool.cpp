@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QDataStream>
+#include <QDir>
+#include <QIODevice>
+
+// Saesu
+#include <sglobal.h>
+
+// Us
+#include "objectspool.h"
+
+/*! Counts the bytes written to it, and drops them.
+ */
+class ByteCounter : public QIODevice
+{
+public:
+    ByteCounter() : mCount(0) { QIODevice::open(QIODevice::WriteOnly); }
+
+    qint64 count() const { return mCount; }
+
+protected:
+    qint64 readData(char *, qint64) { return -1; }
+    qint64 writeData(const char *, qint64 length) { mCount += length; return length; }
+
+private:
+    qint64 mCount;
+};
+
+ObjectSpool::ObjectSpool(const QString &cloudName, const SObjectLocalId &id)
+    : mCloudName(cloudName)
+    , mId(id)
+    , mFile(QDir::tempPath() + QLatin1String("/syncd-object.XXXXXX"))
+    , mSize(0)
+    , mDone(0)
+{
+}
+
+ObjectSpool::~ObjectSpool()
+{
+}
+
+/*! Returns how many bytes \a object takes serialised, without keeping them.
+ */
+qint64 ObjectSpool::serialisedSize(const SObject &object)
+{
+    ByteCounter counter;
+    QDataStream stream(&counter);
+    stream << object;
+    return counter.count();
+}
+
+QString ObjectSpool::cloudName() const
+{
+    return mCloudName;
+}
+
+SObjectLocalId ObjectSpool::id() const
+{
+    return mId;
+}
+
+qint64 ObjectSpool::size() const
+{
+    return mSize;
+}
+
+/*! Serialises \a object into the spool, to be sent with readChunk().
+ */
+bool ObjectSpool::write(const SObject &object)
+{
+    if (!mFile.open()) {
+        sWarning() << "Couldn't create a spool for object " << mId << ": " << mFile.errorString();
+        return false;
+    }
+
+    QDataStream stream(&mFile);
+    stream << object;
+
+    if (stream.status() != QDataStream::Ok || !mFile.flush()) {
+        sWarning() << "Couldn't spool object " << mId << ": " << mFile.errorString();
+        return false;
+    }
+
+    mSize = mFile.size();
+    mDone = 0;
+    return mFile.seek(0);
+}
+
+/*! Returns the next up to \a maxSize bytes of the object, or an empty
+ * array if it couldn't be read.
+ */
+QByteArray ObjectSpool::readChunk(int maxSize)
+{
+    const QByteArray chunk = mFile.read(qMin<qint64>(maxSize, mSize - mDone));
+    mDone += chunk.size();
+    return chunk;
+}
+
+bool ObjectSpool::atEnd() const
+{
+    return mDone >= mSize;
+}
+
+/*! Prepares to receive an object of \a size serialised bytes.
+ */
+bool ObjectSpool::open(qint64 size)
+{
+    if (!mFile.open()) {
+        sWarning() << "Couldn't create a spool for object " << mId << ": " << mFile.errorString();
+        return false;
+    }
+
+    mSize = size;
+    mDone = 0;
+    return true;
+}
+
+/*! Adds the next \a piece of the object; fails if the object would grow
+ * past the announced size.
+ */
+bool ObjectSpool::append(const QByteArray &piece)
+{
+    if (mDone + piece.size() > mSize)
+        return false;
+
+    if (mFile.write(piece) != piece.size()) {
+        sWarning() << "Couldn't spool object " << mId << ": " << mFile.errorString();
+        return false;
+    }
+
+    mDone += piece.size();
+    return true;
+}
+
+bool ObjectSpool::isComplete() const
+{
+    return mDone == mSize;
+}
+
+/*! Deserialises the received object into \a object; false if it is malformed.
+ */
+bool ObjectSpool::read(SObject *object)
+{
+    if (!mFile.flush() || !mFile.seek(0))
+        return false;
+
+    QDataStream stream(&mFile);
+    stream >> *object;
+
+    return stream.status() == QDataStream::Ok && mFile.atEnd();
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OBJECTSPOOL_H
+#define OBJECTSPOOL_H
+
+// Qt
+#include <QByteArray>
+#include <QString>
+#include <QTemporaryFile>
+
+// Saesu
+#include <sobject.h>
+
+/*! An object being streamed to or from a peer in chunks, serialised into a
+ * temporary file so that only a chunk of it needs to be in memory at once.
+ *
+ * The sender serialises the object with write() and sends it on with
+ * readChunk(); the receiver open()s a spool of the announced size, and
+ * append()s the chunks until it isComplete(), then read()s the object back.
+ */
+class ObjectSpool
+{
+public:
+    ObjectSpool(const QString &cloudName, const SObjectLocalId &id);
+    ~ObjectSpool();
+
+    static qint64 serialisedSize(const SObject &object);
+
+    QString cloudName() const;
+    SObjectLocalId id() const;
+    qint64 size() const;
+
+    bool write(const SObject &object);
+    QByteArray readChunk(int maxSize);
+    bool atEnd() const;
+
+    bool open(qint64 size);
+    bool append(const QByteArray &piece);
+    bool isComplete() const;
+    bool read(SObject *object);
+
+private:
+    Q_DISABLE_COPY(ObjectSpool)
+
+    QString mCloudName;
+    SObjectLocalId mId;
+    QTemporaryFile mFile;
+    qint64 mSize;
+
+    // bytes read back out (sending) or appended (receiving) so far
+    qint64 mDone;
+};
+
+#endif // OBJECTSPOOL_H
@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QNetworkInterface>
+#include <QSet>
+#include <QSettings>
+#include <QTimer>
+
+// Saesu
+#include <sglobal.h>
+#include <bonjourserviceresolver.h>
+
+// Us
+#include "peerconnectionmanager.h"
+#include "syncmanagersynchroniser.h"
+#include "syncworkerpool.h"
+
+static int retryInterval()
+{
+    static const int interval = QSettings().value(QLatin1String("peers/retryInterval"), 1000).toInt();
+    return qMax(interval, 1);
+}
+
+static int maxRetryInterval()
+{
+    static const int interval = QSettings().value(QLatin1String("peers/maxRetryInterval"), 300000).toInt();
+    return qMax(interval, retryInterval());
+}
+
+static int maxHandshakes()
+{
+    static const int handshakes = QSettings().value(QLatin1String("peers/maxHandshakes"), 4).toInt();
+    return qMax(handshakes, 1);
+}
+
+PeerConnectionManager::PeerConnectionManager(SyncWorkerPool *workers, QObject *parent)
+    : QObject(parent)
+    , mWorkers(workers)
+    , mHandshakes(0)
+{
+}
+
+PeerConnectionManager::~PeerConnectionManager()
+{
+    foreach (Peer *peer, mPeers)
+        removePeer(peer);
+}
+
+/*! Starts connecting to peers in \a records we didn't know about, and
+ * disconnects from those that are no longer there. Connections to peers
+ * that are still there are left alone.
+ */
+void PeerConnectionManager::setRecords(const QList<BonjourRecord> &records)
+{
+    QSet<QString> serviceNames;
+
+    foreach (const BonjourRecord &record, records) {
+        serviceNames.insert(record.serviceName);
+        if (!mPeers.contains(record.serviceName))
+            addPeer(record);
+    }
+
+    foreach (Peer *peer, mPeers) {
+        if (!serviceNames.contains(peer->record.serviceName))
+            removePeer(peer);
+    }
+}
+
+PeerConnectionManager::Peer *PeerConnectionManager::peerFor(QObject *object) const
+{
+    foreach (Peer *peer, mPeers) {
+        if (object == peer->resolver || object == peer->retryTimer || object == peer->syncer)
+            return peer;
+    }
+
+    return 0;
+}
+
+void PeerConnectionManager::addPeer(const BonjourRecord &record)
+{
+    sDebug() << "Found " << record.serviceName;
+
+    Peer *peer = new Peer;
+    peer->record = record;
+
+    // a resolver only handles one record at a time
+    peer->resolver = new BonjourServiceResolver(this);
+    connect(peer->resolver, SIGNAL(bonjourRecordResolved(const QHostInfo &, int)),
+            SLOT(onResolved(const QHostInfo &, int)));
+
+    peer->retryTimer = new QTimer(this);
+    peer->retryTimer->setSingleShot(true);
+    connect(peer->retryTimer, SIGNAL(timeout()), SLOT(onRetryTimer()));
+
+    mPeers.insert(record.serviceName, peer);
+    peer->resolver->resolveBonjourRecord(record);
+}
+
+void PeerConnectionManager::removePeer(Peer *peer)
+{
+    sDebug() << "Lost " << peer->record.serviceName;
+
+    mPeers.remove(peer->record.serviceName);
+    mQueue.removeAll(peer);
+
+    if (peer->state == Connecting)
+        endHandshake(peer);
+
+    if (peer->state == Connected && mActivePeers.value(peer->nodeId) == peer)
+        mActivePeers.remove(peer->nodeId);
+
+    if (peer->syncer) {
+        // synchronisers live on worker threads, so never call them directly
+        disconnect(peer->syncer, 0, this, 0);
+        QMetaObject::invokeMethod(peer->syncer, "disconnectFromHost", Qt::QueuedConnection);
+        peer->syncer->deleteLater();
+    }
+
+    delete peer->resolver;
+    delete peer->retryTimer;
+    delete peer;
+
+    startHandshakes();
+}
+
+void PeerConnectionManager::onResolved(const QHostInfo &hostInfo, int port)
+{
+    Peer *peer = peerFor(sender());
+    if (!peer)
+        return;
+
+    foreach (const QHostAddress &address, QNetworkInterface::allAddresses()) {
+        if (hostInfo.addresses().contains(address)) {
+            peer->state = Idle; // that's us
+            return;
+        }
+    }
+
+    // TODO: handle this properly by queueing addresses and trying each of them until we find one that works
+    // TODO: this breaks ipv6 until we do
+    foreach (const QHostAddress &address, hostInfo.addresses()) {
+        if (address.protocol() == QAbstractSocket::IPv4Protocol) {
+            sDebug() << peer->record.serviceName << " is at " << address << ":" << port;
+            peer->address = address;
+            peer->port = port;
+
+            if (peer->state == Resolving)
+                enqueue(peer);
+            return;
+        }
+    }
+
+    peer->state = Idle;
+}
+
+void PeerConnectionManager::onRetryTimer()
+{
+    Peer *peer = peerFor(sender());
+    if (peer && peer->state == Waiting)
+        enqueue(peer);
+}
+
+void PeerConnectionManager::onHandshakeReceived(const QByteArray &peerNodeId)
+{
+    Peer *peer = peerFor(sender());
+    if (!peer || peer->state != Connecting)
+        return;
+
+    endHandshake(peer);
+    peer->failures = 0;
+
+    // we may have found the same peer more than once (e.g. it is
+    // multi-homed); whichever connection identified itself first wins
+    Peer *existing = mActivePeers.value(peerNodeId);
+    if (existing && existing != peer) {
+        sDebug() << "Already synchronising with " << peerNodeId << ", dropping duplicate connection";
+        peer->state = Idle;
+        QMetaObject::invokeMethod(peer->syncer, "disconnectFromHost", Qt::QueuedConnection);
+    } else {
+        peer->state = Connected;
+        peer->nodeId = peerNodeId;
+        mActivePeers.insert(peerNodeId, peer);
+        QMetaObject::invokeMethod(peer->syncer, "beginSync", Qt::QueuedConnection);
+    }
+
+    startHandshakes();
+}
+
+void PeerConnectionManager::onConnectionLost(bool retry)
+{
+    Peer *peer = peerFor(sender());
+    if (!peer)
+        return;
+
+    if (peer->state == Connecting)
+        endHandshake(peer);
+
+    if (peer->state == Connected && mActivePeers.value(peer->nodeId) == peer)
+        mActivePeers.remove(peer->nodeId);
+
+    if (peer->state == Idle || !retry) {
+        // the peer connects to us instead, or we already have it
+        peer->state = Idle;
+    } else {
+        peer->failures++;
+        scheduleRetry(peer);
+    }
+
+    startHandshakes();
+}
+
+/*! Waits before connecting to \a peer again, for longer the more attempts
+ * in a row have failed.
+ */
+void PeerConnectionManager::scheduleRetry(Peer *peer)
+{
+    const int exponent = qMin(peer->failures - 1, 20);
+    const qint64 backoff = qMin<qint64>(qint64(retryInterval()) << exponent, maxRetryInterval());
+
+    // at least half the backoff, so we still back off, but spread out so
+    // peers that went away together don't all come back at once
+    const qint64 delay = backoff / 2 + qrand() % (backoff / 2 + 1);
+
+    sDebug() << "Connecting to " << peer->record.serviceName << " again in " << delay << " ms, after "
+             << peer->failures << " failures";
+    peer->state = Waiting;
+    peer->retryTimer->start(int(delay));
+}
+
+void PeerConnectionManager::enqueue(Peer *peer)
+{
+    peer->state = Queued;
+    mQueue.append(peer);
+    startHandshakes();
+}
+
+/*! Connects to as many queued peers as there are handshake slots free.
+ */
+void PeerConnectionManager::startHandshakes()
+{
+    while (mHandshakes < maxHandshakes() && !mQueue.isEmpty()) {
+        Peer *peer = mQueue.takeFirst();
+
+        if (!peer->syncer) {
+            peer->syncer = new SyncManagerSynchroniser;
+            connect(peer->syncer, SIGNAL(handshakeReceived(QByteArray)), SLOT(onHandshakeReceived(QByteArray)));
+            connect(peer->syncer, SIGNAL(connectionLost(bool)), SLOT(onConnectionLost(bool)));
+            mWorkers->assign(peer->syncer);
+        }
+
+        peer->state = Connecting;
+        mHandshakes++;
+        QMetaObject::invokeMethod(peer->syncer, "connectToHost", Qt::QueuedConnection,
+                                  Q_ARG(QHostAddress, peer->address), Q_ARG(int, peer->port));
+    }
+}
+
+void PeerConnectionManager::endHandshake(Peer *peer)
+{
+    Q_ASSERT(peer->state == Connecting);
+    Q_UNUSED(peer);
+    mHandshakes--;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PEERCONNECTIONMANAGER_H
+#define PEERCONNECTIONMANAGER_H
+
+// Qt
+#include <QHash>
+#include <QHostAddress>
+#include <QHostInfo>
+#include <QList>
+#include <QObject>
+#include <QString>
+
+// Saesu
+#include <bonjourrecord.h>
+
+class BonjourServiceResolver;
+class QTimer;
+class SyncManagerSynchroniser;
+class SyncWorkerPool;
+
+/*! Owns the outgoing connections to the peers we find with Bonjour.
+ *
+ * Each peer gets one synchroniser, which is reused for every connection to
+ * it. A connection that fails or is lost is retried after an exponential
+ * backoff with jitter, from peers/retryInterval (1 second) doubling up to
+ * peers/maxRetryInterval (5 minutes), so unreachable or flapping peers cost
+ * next to nothing. The backoff is reset once a peer completes the
+ * handshake. At most peers/maxHandshakes (4) connections are being set up
+ * at any time; the rest wait their turn.
+ *
+ * Peers that would rather connect to us, and extra connections to a peer
+ * we are already synchronising with, are left alone until the peer's
+ * record changes.
+ */
+class PeerConnectionManager : public QObject
+{
+    Q_OBJECT
+public:
+    explicit PeerConnectionManager(SyncWorkerPool *workers, QObject *parent = 0);
+    virtual ~PeerConnectionManager();
+
+    void setRecords(const QList<BonjourRecord> &records);
+
+private slots:
+    void onResolved(const QHostInfo &hostInfo, int port);
+    void onRetryTimer();
+    void onHandshakeReceived(const QByteArray &peerNodeId);
+    void onConnectionLost(bool retry);
+
+private:
+    enum State
+    {
+        Resolving,
+        Waiting,
+        Queued,
+        Connecting,
+        Connected,
+        Idle
+    };
+
+    struct Peer
+    {
+        Peer() : port(0), state(Resolving), failures(0), resolver(0), retryTimer(0), syncer(0) {}
+
+        BonjourRecord record;
+        QHostAddress address;
+        int port;
+        State state;
+        int failures;
+        QByteArray nodeId;
+
+        BonjourServiceResolver *resolver;
+        QTimer *retryTimer;
+        SyncManagerSynchroniser *syncer;
+    };
+
+    Peer *peerFor(QObject *object) const;
+    void addPeer(const BonjourRecord &record);
+    void removePeer(Peer *peer);
+    void scheduleRetry(Peer *peer);
+    void enqueue(Peer *peer);
+    void startHandshakes();
+    void endHandshake(Peer *peer);
+
+    SyncWorkerPool *mWorkers;
+
+    // by service name
+    QHash<QString, Peer *> mPeers;
+
+    // peers waiting for a handshake slot, in order, and how many are in use
+    QList<Peer *> mQueue;
+    int mHandshakes;
+
+    // peers we are synchronising with, by node id
+    QHash<QByteArray, Peer *> mActivePeers;
+};
+
+#endif // PEERCONNECTIONMANAGER_H
@@ -0,0 +1,68 @@
+QT += network
+TEMPLATE = app
+TARGET = saesu-syncd
+DEPENDPATH += .
+
+unix:!mac {
+    LIBS += -ldns_sd
+}
+
+MOC_DIR = ./.moc/
+OBJECTS_DIR = ./.obj/
+
+# Input
+SOURCES += main.cpp \
+    syncadvertiser.cpp \
+    syncmanagersynchroniser.cpp \
+    syncmanager.cpp \
+    filewatcher.cpp \
+    syncserver.cpp \
+    syncworkerpool.cpp \
+    fileassembler.cpp \
+    filetransfer.cpp \
+    objectspool.cpp \
+    cloudregistry.cpp \
+    framescheduler.cpp \
+    transfercoordinator.cpp \
+    blockindex.cpp \
+    memorygovernor.cpp \
+    peerconnectionmanager.cpp \
+    bandwidthlimiter.cpp \
+    syncprotocol.cpp \
+    synctls.cpp \
+    syncmetrics.cpp \
+    syncstatistics.cpp \
+    transferparameters.cpp
+
+HEADERS += syncadvertiser.h \
+    syncmanagersynchroniser.h \
+    syncmanager.h \
+    filewatcher.h \
+    syncserver.h \
+    syncworkerpool.h \
+    fileassembler.h \
+    filetransfer.h \
+    objectspool.h \
+    cloudregistry.h \
+    framescheduler.h \
+    transfercoordinator.h \
+    blockindex.h \
+    memorygovernor.h \
+    peerconnectionmanager.h \
+    bandwidthlimiter.h \
+    syncprotocol.h \
+    syncmessages.h \
+    synctls.h \
+    syncmetrics.h \
+    syncstatistics.h \
+    transferparameters.h
+
+# spans of time spent synchronising, see synctrace.h
+CONFIG(tracing) {
+    DEFINES += SYNCD_TRACING
+    SOURCES += synctrace.cpp
+    HEADERS += synctrace.h
+}
+
+CONFIG += link_pkgconfig
+PKGCONFIG += saesu
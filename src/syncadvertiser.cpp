@@ -16,24 +16,37 @@
 
 // Qt
 #include <QCoreApplication>
-#include <QNetworkInterface>
+#include <QSettings>
 #include <QStringList>
+#include <QUuid>
 
 // Saesu
 #include <sglobal.h>
 #include <bonjourservicebrowser.h>
-#include <bonjourserviceresolver.h>
 #include <bonjourserviceregister.h>
 
+// Posix
+#include <unistd.h>
+
 // Us
+#include "bandwidthlimiter.h"
+#include "memorygovernor.h"
 #include "syncadvertiser.h"
 #include "syncmanagersynchroniser.h"
+#include "syncmetrics.h"
+#include "synctrace.h"
 
 SyncAdvertiser::SyncAdvertiser(QObject *parent)
     : QObject(parent)
+    , mPeerConnections(&mWorkers)
     , mPeerAdvertiser("saesu://peer-model")
+    , mMetricsChannel("saesu://sync-metrics")
+    , mControlChannel("saesu://sync-control")
 {
-    connect(&mServer, SIGNAL(newConnection()), SLOT(onNewConnection()));
+    // make sure the id is loaded before any worker thread asks for it
+    sDebug() << "Local node id is " << localNodeId();
+
+    connect(&mServer, SIGNAL(newSocketDescriptor(int)), SLOT(onNewConnection(int)));
 
     int portNo;
 
@@ -62,26 +75,61 @@ SyncAdvertiser::SyncAdvertiser(QObject *parent)
             this, SLOT(updateRecords(const QList<BonjourRecord> &)));
     bonjourBrowser->browseForServiceType(QLatin1String("_saesu._tcp"));
 
-    mBonjourResolver = new BonjourServiceResolver(this);
-    connect(mBonjourResolver, SIGNAL(bonjourRecordResolved(const QHostInfo &, int)),
-            this, SLOT(connectToServer(const QHostInfo &, int)));
+    // metrics are published every metrics/publishInterval milliseconds (0
+    // to only publish them when asked), and whenever requestMetrics() is
+    // sent on the channel. in builds with tracing, dumpTrace() writes out
+    // the trace, and its file name is sent back with traceDumped(QString)
+    connect(&mMetricsChannel, SIGNAL(received(QByteArray,QByteArray)),
+            SLOT(onMetricsMessage(QByteArray,QByteArray)));
+    connect(&mMetricsTimer, SIGNAL(timeout()), SLOT(publishMetrics()));
+
+    const int publishInterval = QSettings().value(QLatin1String("metrics/publishInterval"), 10000).toInt();
+    if (publishInterval > 0)
+        mMetricsTimer.start(publishInterval);
+
+    // setBandwidthLimits(qint64,qint64) changes the global and per-peer
+    // limits, in bytes per second, for running connections as well as new ones
+    connect(&mControlChannel, SIGNAL(received(QByteArray,QByteArray)),
+            SLOT(onControlMessage(QByteArray,QByteArray)));
 }
 
-void SyncAdvertiser::updateRecords(const QList<BonjourRecord> &list)
+/*! Returns the identifier of this syncd instance.
+ *
+ * The id is generated the first time syncd runs and persisted, so it remains
+ * stable across restarts and network changes.
+ */
+QByteArray SyncAdvertiser::localNodeId()
 {
-    // TODO: optimisation here would be to not drop any connections
-    // we should only open connections to *new* services
-    foreach (SyncManagerSynchroniser *syncer, mSyncers) {
-        syncer->disconnectFromHost();
-        syncer->deleteLater();
+    static QByteArray nodeId;
+
+    if (nodeId.isEmpty()) {
+        QSettings settings;
+        nodeId = settings.value(QLatin1String("nodeId")).toByteArray();
+
+        if (nodeId.isEmpty()) {
+            nodeId = QUuid::createUuid().toString().toLatin1();
+            settings.setValue(QLatin1String("nodeId"), nodeId);
+        }
     }
 
+    return nodeId;
+}
+
+/*! Returns the port peers connect to.
+ */
+quint16 SyncAdvertiser::serverPort() const
+{
+    return mServer.serverPort();
+}
+
+void SyncAdvertiser::updateRecords(const QList<BonjourRecord> &list)
+{
+    mPeerConnections.setRecords(list);
+
     QStringList peerNames;
 
-    foreach (const BonjourRecord &record, list) {
-        mBonjourResolver->resolveBonjourRecord(record);
+    foreach (const BonjourRecord &record, list)
         peerNames.append(record.serviceName);
-    }
 
     sDebug() << "Got peers: " << peerNames;
 
@@ -92,45 +140,74 @@ void SyncAdvertiser::updateRecords(const QList<BonjourRecord> &list)
     mPeerAdvertiser.sendMessage("peersAvailable(QStringList)", data);
 }
 
-void SyncAdvertiser::connectToServer(const QHostInfo &address, int port)
+void SyncAdvertiser::onNewConnection(int socketDescriptor)
 {
-    QNetworkInterface iface;
-
-    foreach (const QHostAddress &addr, iface.allAddresses()) {
-        foreach (const QHostAddress &remoteAddr, address.addresses()) {
-            if (remoteAddr == addr) {
-                return;
-            }
-        }
+    // the peer will connect again later; those we synchronise with already
+    // are worth more than a new one
+    if (MemoryGovernor::pressure() != MemoryGovernor::Normal) {
+        sDebug() << "Refusing a new connection, " << MemoryGovernor::used() << " bytes held";
+        SyncMetrics::process()->connectionsRefused.add(1);
+        ::close(socketDescriptor);
+        return;
     }
 
-    // TODO: handle this properly by queueing addresses and trying each of them until we find one that works
-    // TODO: this breaks ipv6 until we do
-    foreach (const QHostAddress &remoteAddr, address.addresses()) {
-        if (remoteAddr.protocol() == QAbstractSocket::IPv4Protocol) {
-            sDebug() << remoteAddr << " said hello, connecting back...";
-            SyncManagerSynchroniser *syncSocket = new SyncManagerSynchroniser(this);
-            connect(syncSocket, SIGNAL(destroyed()), SLOT(onDisconnected()));
-            syncSocket->connectToHost(remoteAddr, port);
-            mSyncers.append(syncSocket);
-            break;
-        }
-    }
+    sDebug() << "Got a new connection";
+    SyncManagerSynchroniser *syncSocket = new SyncManagerSynchroniser(socketDescriptor);
+    connect(syncSocket, SIGNAL(destroyed()), SLOT(onDisconnected()));
+    mWorkers.assign(syncSocket);
+    QMetaObject::invokeMethod(syncSocket, "acceptConnection", Qt::QueuedConnection);
+    mSyncers.append(syncSocket);
+}
+
+void SyncAdvertiser::onDisconnected()
+{
+    // the object is being destroyed, so only compare pointers
+    SyncManagerSynchroniser *mgr = static_cast<SyncManagerSynchroniser*>(sender());
+    mSyncers.removeAll(mgr);
+}
+
+/*! Sends a snapshot of SyncMetrics to everyone listening on the metrics channel.
+ */
+void SyncAdvertiser::publishMetrics()
+{
+    QByteArray data;
+    QDataStream ds(&data, QIODevice::WriteOnly);
+    ds << SyncMetrics::snapshot();
+
+    mMetricsChannel.sendMessage("metricsUpdated(QVariantMap)", data);
 }
 
-void SyncAdvertiser::onNewConnection()
+void SyncAdvertiser::onMetricsMessage(const QByteArray &message, const QByteArray &data)
 {
-    while (mServer.hasPendingConnections()) {
-        QTcpSocket *socket = mServer.nextPendingConnection();
-        sDebug() << "Got a new connection from " << socket->peerAddress();
-        SyncManagerSynchroniser *syncSocket = new SyncManagerSynchroniser(this, socket);
-        connect(syncSocket, SIGNAL(destroyed()), SLOT(onDisconnected()));
-        mSyncers.append(syncSocket);
+    Q_UNUSED(data);
+
+    if (message == "requestMetrics()") {
+        publishMetrics();
+#ifdef SYNCD_TRACING
+    } else if (message == "dumpTrace()") {
+        QByteArray reply;
+        QDataStream ds(&reply, QIODevice::WriteOnly);
+        ds << SyncTrace::dump();
+
+        mMetricsChannel.sendMessage("traceDumped(QString)", reply);
+#endif
     }
 }
 
-void SyncAdvertiser::onDisconnected()
+void SyncAdvertiser::onControlMessage(const QByteArray &message, const QByteArray &data)
 {
-    SyncManagerSynchroniser *mgr = static_cast<SyncManagerSynchroniser*>(sender());
-    mSyncers.removeAll(mgr);
+    if (message == "setBandwidthLimits(qint64,qint64)") {
+        QDataStream ds(data);
+        qint64 globalRate;
+        qint64 peerRate;
+        ds >> globalRate >> peerRate;
+
+        if (ds.status() != QDataStream::Ok) {
+            sWarning() << "Malformed bandwidth limits";
+            return;
+        }
+
+        sDebug() << "Limiting bandwidth to " << globalRate << " bytes/s, " << peerRate << " bytes/s per peer";
+        BandwidthLimiter::setLimits(globalRate, peerRate);
+    }
 }
@@ -18,13 +18,16 @@
 #define SYNCADVERTISER_H
 
 #include <QObject>
-#include <QTcpServer>
 #include <QHostInfo>
+#include <QTimer>
 
 #include <sipcchannel.h>
 #include <bonjourrecord.h>
 
-class BonjourServiceResolver;
+#include "peerconnectionmanager.h"
+#include "syncserver.h"
+#include "syncworkerpool.h"
+
 class SyncManagerSynchroniser;
 
 class SyncAdvertiser : public QObject
@@ -33,17 +36,31 @@ class SyncAdvertiser : public QObject
 public:
     explicit SyncAdvertiser(QObject *parent = 0);
 
+    static QByteArray localNodeId();
+
+    quint16 serverPort() const;
+
 private slots:
     void updateRecords(const QList<BonjourRecord> &list);
-    void connectToServer(const QHostInfo &address, int port);
-    void onNewConnection();
+    void onNewConnection(int socketDescriptor);
     void onDisconnected();
+    void publishMetrics();
+    void onMetricsMessage(const QByteArray &message, const QByteArray &data);
+    void onControlMessage(const QByteArray &message, const QByteArray &data);
 
 private:
-    BonjourServiceResolver *mBonjourResolver;
-    QTcpServer mServer;
+    SyncServer mServer;
+    SyncWorkerPool mWorkers;
+    PeerConnectionManager mPeerConnections;
+
+    // incoming connections; outgoing ones belong to mPeerConnections, which
+    // also picks one when we have several to the same peer (the accepting
+    // side just follows the initiator)
     QList<SyncManagerSynchroniser *> mSyncers;
     SIpcChannel mPeerAdvertiser;
+    SIpcChannel mMetricsChannel;
+    SIpcChannel mControlChannel;
+    QTimer mMetricsTimer;
 };
 
 #endif // SYNCADVERTISER_H
@@ -15,51 +15,210 @@
  */
 
 // Qt
+#include <QCoreApplication>
+#include <QMutex>
 #include <QObject>
+#include <QSettings>
+#include <QThread>
 
 // saesu
 #include <sobjectmanager.h>
 #include <sobjectfetchrequest.h>
 #include <sobjectremoverequest.h>
+#include <sobjectsaverequest.h>
 #include <sdeletelistfetchrequest.h>
 #include <sobjectlocalidfilter.h>
 
 // Us
+#include "objectspool.h"
+#include "syncadvertiser.h"
 #include "syncmanager.h"
+#include "syncmessages.h"
+#include "syncmetrics.h"
+#include "synctrace.h"
+
+// entries per ObjectListCommand or DeleteListCommand; each is well under a
+// hundred bytes, so even a whole cloud's list arrives in frames far below
+// memory/maxFrameSize, and other commands needn't wait behind one
+static const int listBatchSize = 1024;
+
+// roughly what knowledge of an object costs: its QHash node and version,
+// and for each node that has it, a QSet node and the node's id
+static const qint64 knowledgeEntrySize = 128;
+static const qint64 knownNodeEntrySize = 64;
 
 SyncManager::SyncManager(const QString &managerName)
      : QObject()
+     , mRetired(false)
+     , mLoadsPending(0)
+     , mLoadGeneration(0)
+     , mReady(false)
      , mManager(managerName)
      , mManagerName(managerName)
+     , mMetrics(SyncMetrics::cloud(managerName))
 {
-    connect(&mManager, SIGNAL(objectsAdded(QList<SObjectLocalId>)), SLOT(readObjects(QList<SObjectLocalId>)));
+    connect(&mManager, SIGNAL(objectsAdded(QList<SObjectLocalId>)), SLOT(onObjectsChanged(QList<SObjectLocalId>)));
     connect(&mManager, SIGNAL(objectsRemoved(QList<SObjectLocalId>)), SLOT(onObjectsRemoved(QList<SObjectLocalId>)));
-    connect(&mManager, SIGNAL(objectsUpdated(QList<SObjectLocalId>)), SLOT(readObjects(QList<SObjectLocalId>)));
+    connect(&mManager, SIGNAL(objectsUpdated(QList<SObjectLocalId>)), SLOT(onObjectsChanged(QList<SObjectLocalId>)));
+
+    mChangeTimer.setSingleShot(true);
+    mChangeTimer.setInterval(QSettings().value(QLatin1String("objects/coalesceInterval"), 50).toInt());
+    connect(&mChangeTimer, SIGNAL(timeout()), SLOT(flushChanges()));
 
-    readObjects(QList<SObjectLocalId>());
+    load();
+}
+
+SyncManager::~SyncManager()
+{
+}
+
+void SyncManager::load()
+{
+    {
+        QWriteLocker locker(&mLock);
+        mReady = false;
+    }
+
+    mLoadsPending = 2;
+    ++mLoadGeneration;
+    mLoadClock.start();
+
+    // onLoadFinished() must run after the results have been stored
+    SObjectFetchRequest *fetchRequest = readObjects(QList<SObjectLocalId>());
+    mLoadRequests.insert(fetchRequest, mLoadGeneration);
+    connect(fetchRequest, SIGNAL(finished()), SLOT(onLoadFinished()));
 
     SDeleteListFetchRequest *deleteFetchRequest = new SDeleteListFetchRequest;
+    mLoadRequests.insert(deleteFetchRequest, mLoadGeneration);
+    SYNC_TRACE_REQUEST(deleteFetchRequest, "storage", "fetchDeleteList", 0, 0);
     connect(deleteFetchRequest, SIGNAL(finished()), SLOT(onDeleteListRead()));
     connect(deleteFetchRequest, SIGNAL(finished()), deleteFetchRequest, SLOT(deleteLater()));
+    connect(deleteFetchRequest, SIGNAL(finished()), SLOT(onLoadFinished()));
     deleteFetchRequest->start(&mManager);
 }
 
-SyncManager::~SyncManager()
+/*! Returns true if \a request was made by a load() that has since been
+ * superseded, by retire() or another load().
+ */
+bool SyncManager::isStaleLoad(QObject *request) const
+{
+    QHash<QObject *, quint32>::ConstIterator it = mLoadRequests.find(request);
+    return it != mLoadRequests.end() && *it != mLoadGeneration;
+}
+
+void SyncManager::onLoadFinished()
+{
+    const bool stale = isStaleLoad(sender());
+    mLoadRequests.remove(sender());
+
+    if (stale || --mLoadsPending > 0 || mRetired)
+        return;
+
+    {
+        QWriteLocker locker(&mLock);
+        mReady = true;
+    }
+
+    mMetrics->loadMilliseconds.set(mLoadClock.elapsed());
+    emit ready(mManagerName);
+}
+
+/*! Returns true once the objects and delete list have been loaded from
+ * storage. May be called from any thread.
+ */
+bool SyncManager::isReady() const
+{
+    QReadLocker locker(&mLock);
+    return mReady;
+}
+
+/*! Drops everything cached for a cloud that has been removed.
+ *
+ * Instances are never deleted, as worker threads may still be using them.
+ */
+void SyncManager::retire()
+{
+    mRetired = true;
+    ++mLoadGeneration;
+
+    mChangeTimer.stop();
+    mChangedIds.clear();
+    mRemovedIds.clear();
+
+    {
+        QWriteLocker locker(&mLock);
+        mReady = false;
+        mObjects.clear();
+        mDeleteList.clear();
+        mDeleteListHash.clear();
+    }
+
+    QMutexLocker locker(&mKnowledgeLock);
+    mKnowledge.clear();
+    mKnowledgeMemory.clear();
+}
+
+/*! Loads a cloud again after it was retired.
+ */
+void SyncManager::revive()
+{
+    if (!mRetired)
+        return;
+
+    mRetired = false;
+    load();
+}
+
+typedef QHash<QString, SyncManager *> SyncManagerMap;
+Q_GLOBAL_STATIC(SyncManagerMap, managerMap)
+Q_GLOBAL_STATIC(QMutex, managerMapLock)
+Q_GLOBAL_STATIC(SyncManagerFactory, syncManagerFactory)
+
+SyncManagerFactory::SyncManagerFactory()
+    : QObject()
 {
+    moveToThread(QCoreApplication::instance()->thread());
+}
+
+SyncManager *SyncManagerFactory::create(const QString &managerName)
+{
+    return SyncManager::instance(managerName);
 }
 
 SyncManager *SyncManager::instance(const QString &managerName)
 {
-    static QHash<QString, SyncManager *> managerMap;
+    {
+        QMutexLocker locker(managerMapLock());
+        SyncManagerMap::ConstIterator it = managerMap()->find(managerName);
+        if (it != managerMap()->end())
+            return *it;
+    }
 
-    QHash<QString, SyncManager *>::ConstIterator it = managerMap.find(managerName);
-    if (it == managerMap.end()) {
-        SyncManager *manager = new SyncManager(managerName);
-        managerMap.insert(managerName, manager);
+    // storage must only be touched from the main thread, so have it create
+    // the instance for us if we're being called from a worker
+    if (QThread::currentThread() != QCoreApplication::instance()->thread()) {
+        SyncManager *manager = 0;
+        QMetaObject::invokeMethod(syncManagerFactory(), "create", Qt::BlockingQueuedConnection,
+                                  Q_RETURN_ARG(SyncManager*, manager),
+                                  Q_ARG(QString, managerName));
         return manager;
     }
 
-    return *it;
+    SyncManager *manager = new SyncManager(managerName);
+
+    QMutexLocker locker(managerMapLock());
+    managerMap()->insert(managerName, manager);
+    return manager;
+}
+
+/*! Creates the instances that worker threads are waiting for, from the
+ * main thread; it calls this while it waits for the workers, as the two
+ * would otherwise wait for each other.
+ */
+void SyncManager::serveWorkers()
+{
+    Q_ASSERT(QThread::currentThread() == QCoreApplication::instance()->thread());
+    QCoreApplication::sendPostedEvents(syncManagerFactory(), QEvent::MetaCall);
 }
 
 SObjectManager *SyncManager::manager()
@@ -67,7 +226,50 @@ SObjectManager *SyncManager::manager()
     return &mManager;
 }
 
-void SyncManager::readObjects(const QList<SObjectLocalId> &ids)
+CloudMetrics *SyncManager::metrics() const
+{
+    return mMetrics;
+}
+
+/*! Collects \a ids, which storage reports as added or updated, to be
+ * fetched once the coalescing window closes.
+ */
+void SyncManager::onObjectsChanged(const QList<SObjectLocalId> &ids)
+{
+    if (ids.isEmpty())
+        return;
+
+    foreach (const SObjectLocalId &id, ids)
+        mChangedIds.insert(id);
+
+    mMetrics->changesNotified.add(ids.count());
+
+    // the window starts with the first change, so a steady stream of
+    // changes can't hold the others back indefinitely
+    if (!mChangeTimer.isActive())
+        mChangeTimer.start();
+}
+
+/*! Announces the removals and fetches the changes collected in the
+ * coalescing window, each as a single batch.
+ */
+void SyncManager::flushChanges()
+{
+    if (!mRemovedIds.isEmpty()) {
+        const QList<SObjectLocalId> ids = mRemovedIds;
+        mRemovedIds.clear();
+        emit objectsDeleted(mManagerName, ids, encodeDeleteList(ids));
+    }
+
+    if (!mChangedIds.isEmpty()) {
+        const QList<SObjectLocalId> ids = mChangedIds.toList();
+        mChangedIds.clear();
+        mMetrics->changeBatchSize.record(ids.count());
+        readObjects(ids);
+    }
+}
+
+SObjectFetchRequest *SyncManager::readObjects(const QList<SObjectLocalId> &ids)
 {
     SObjectFetchRequest *fetchRequest = new SObjectFetchRequest;
 
@@ -77,88 +279,377 @@ void SyncManager::readObjects(const QList<SObjectLocalId> &ids)
         fetchRequest->setFilter(filter);
     }
 
+    SYNC_TRACE_REQUEST(fetchRequest, "storage", "fetch", "ids", ids.count());
     connect(fetchRequest, SIGNAL(finished()), SLOT(onObjectsRead()));
     connect(fetchRequest, SIGNAL(finished()), fetchRequest, SLOT(deleteLater()));
     fetchRequest->start(&mManager);
+    return fetchRequest;
 }
 
 void SyncManager::onObjectsRead()
 {
     SObjectFetchRequest *req = qobject_cast<SObjectFetchRequest*>(sender());
+    if (isStaleLoad(req))
+        return;
 
     QList<SObject> objects = req->objects();
 
-    foreach (const SObject &object, objects) {
-        mObjects.insert(object.id().localId(), object);
+    SYNC_TRACE_SPAN("storage", "objectsRead");
+    SYNC_TRACE_ARGUMENT("objects", objects.count());
+
+    {
+        QWriteLocker locker(&mLock);
+        foreach (const SObject &object, objects) {
+            mObjects.insert(object.id().localId(), object);
+        }
     }
 
-    emit objectsAddedOrUpdated(mManagerName, objects);
+    forgetOtherVersions(objects);
+
+    if (objects.count())
+        emit objectsAddedOrUpdated(mManagerName, objects, encodeObjectList(objects));
 }
 
 void SyncManager::onObjectsRemoved(const QList<SObjectLocalId> &ids)
 {
-    // don't clear the list here, we haven't got the full list
-    mDeleteList.append(ids);
+    {
+        // don't clear the list here, we haven't got the full list
+        QWriteLocker locker(&mLock);
+        mDeleteList.append(ids);
+
+        foreach (const SObjectLocalId &id, ids) {
+            mDeleteListHash.insert(id);
+        }
+    }
 
-    foreach (const SObjectLocalId &id, ids) {
-        mDeleteListHash.insert(id);
+    if (ids.isEmpty())
+        return;
+
+    // there's nothing left to fetch for objects changed and then removed
+    foreach (const SObjectLocalId &id, ids)
+        mChangedIds.remove(id);
+
+    {
+        QMutexLocker locker(&mSizesLock);
+        foreach (const SObjectLocalId &id, ids)
+            mSizes.remove(id);
     }
 
+    forget(ids);
 
-    emit objectsDeleted(mManagerName, ids);
+    mRemovedIds.append(ids);
+    if (!mChangeTimer.isActive())
+        mChangeTimer.start();
 }
 
 void SyncManager::onDeleteListRead()
 {
-    mDeleteList.clear();
     SDeleteListFetchRequest *req = qobject_cast<SDeleteListFetchRequest*>(sender());
+    if (isStaleLoad(req))
+        return;
+
+    QList<SObjectLocalId> deleteList = req->objectIds();
 
-    mDeleteList = req->objectIds();
+    {
+        QWriteLocker locker(&mLock);
+        mDeleteList = deleteList;
 
-    foreach (const SObjectLocalId &id, mDeleteList) {
-        mDeleteListHash.insert(id);
+        foreach (const SObjectLocalId &id, mDeleteList) {
+            mDeleteListHash.insert(id);
+        }
     }
 
-    emit objectsDeleted(mManagerName, mDeleteList);
+    if (deleteList.count())
+        emit objectsDeleted(mManagerName, deleteList, encodeDeleteList(deleteList));
 }
 
+/*! Marks \a ids as removed, and removes them from storage.
+ *
+ * May be called from any thread; the ids are considered removed immediately,
+ * the storage request is issued from the main thread.
+ */
 void SyncManager::ensureRemoved(const QList<SObjectLocalId> &ids)
 {
     QList<SObjectLocalId> notRemovedYet;
 
-    foreach (const SObjectLocalId &id, ids) {
-        if (mDeleteListHash.contains(id))
-            continue;
+    {
+        QWriteLocker locker(&mLock);
+
+        foreach (const SObjectLocalId &id, ids) {
+            if (mDeleteListHash.contains(id))
+                continue;
+
+            notRemovedYet.append(id);
+            mDeleteListHash.insert(id);
+        }
 
-        notRemovedYet.append(id);
-        mDeleteListHash.insert(id);
+        mDeleteList.append(notRemovedYet);
     }
 
     if (notRemovedYet.count() == 0)
         return; // no need to start an empty request
 
+    forget(notRemovedYet);
+
+    QMetaObject::invokeMethod(this, "removeObjects", Qt::AutoConnection,
+                              Q_ARG(QList<SObjectLocalId>, notRemovedYet));
+}
+
+void SyncManager::removeObjects(const QList<SObjectLocalId> &ids)
+{
+    mMetrics->objectsRemoved.add(ids.count());
+
     SObjectRemoveRequest *removeRequest = new SObjectRemoveRequest;
+    SYNC_TRACE_REQUEST(removeRequest, "storage", "remove", "objects", ids.count());
     connect(removeRequest, SIGNAL(finished()), removeRequest, SLOT(deleteLater()));
-    removeRequest->setObjectIds(notRemovedYet);
+    removeRequest->setObjectIds(ids);
     removeRequest->start(&mManager);
+}
+
+/*! Saves \a objects, which were received from a peer, to storage.
+ * \a size is roughly what they take up, such as the size of the command
+ * they came in.
+ *
+ * May be called from any thread; the storage request is issued from the main thread.
+ */
+void SyncManager::saveObjects(const QList<SObject> &objects, qint64 size)
+{
+    if (objects.count() == 0)
+        return;
+
+    // held until storage is done with them
+    mMemory.add(MemoryGovernor::PendingSaves, size);
+
+    QMetaObject::invokeMethod(this, "writeObjects", Qt::AutoConnection,
+                              Q_ARG(QList<SObject>, objects), Q_ARG(qint64, size));
+}
+
+void SyncManager::writeObjects(const QList<SObject> &objects, qint64 size)
+{
+    mMetrics->saveBatchSize.record(objects.count());
+    mMetrics->objectsSaved.add(objects.count());
+
+    SObjectSaveRequest *saveRequest = new SObjectSaveRequest;
+    SYNC_TRACE_REQUEST(saveRequest, "storage", "save", "objects", objects.count());
+    connect(saveRequest, SIGNAL(finished()), SLOT(onObjectsSaved()));
+    connect(saveRequest, SIGNAL(finished()), saveRequest, SLOT(deleteLater()));
+    mSaveSizes.insert(saveRequest, size);
+    foreach (const SObject &object, objects)
+        saveRequest->add(object);
+    saveRequest->setSaveHint(SObjectSaveRequest::ObjectFromSync);
+    saveRequest->start(&mManager);
+}
+
+void SyncManager::onObjectsSaved()
+{
+    mMemory.add(MemoryGovernor::PendingSaves, -mSaveSizes.take(sender()));
+}
+
+/*! Returns how many bytes \a object takes serialised, only serialising it
+ * the first time it is asked for each version.
+ *
+ * May be called from any thread.
+ */
+qint64 SyncManager::serialisedSize(const SObject &object) const
+{
+    const SObjectLocalId id = object.id().localId();
+    const ObjectVersion version(object);
+
+    {
+        QMutexLocker locker(&mSizesLock);
+        QHash<SObjectLocalId, ObjectSize>::ConstIterator it = mSizes.constFind(id);
+        if (it != mSizes.constEnd() && it->version == version)
+            return it->size;
+    }
+
+    const qint64 size = ObjectSpool::serialisedSize(object);
+
+    QMutexLocker locker(&mSizesLock);
+    ObjectSize &entry = mSizes[id];
+    entry.version = version;
+    entry.size = size;
+    return size;
+}
 
-    mDeleteList.append(notRemovedYet);
+/*! Records that \a nodeId has \a version of the object \a id, and
+ * optionally which node the version originated from.
+ *
+ * Knowledge of older versions than one we already know of, and of removed
+ * objects, is ignored; a newer version replaces what we knew.
+ */
+void SyncManager::markKnown(const SObjectLocalId &id, const ObjectVersion &version,
+                            const QByteArray &nodeId, const QByteArray &originNodeId)
+{
+    // nothing will be sent about it again, so there is nothing to remember
+    if (isRemoved(id))
+        return;
+
+    QMutexLocker locker(&mKnowledgeLock);
+
+    QHash<SObjectLocalId, ObjectKnowledge>::Iterator it = mKnowledge.find(id);
+    if (it == mKnowledge.end()) {
+        it = mKnowledge.insert(id, ObjectKnowledge());
+        it->version = version;
+        mKnowledgeMemory.add(MemoryGovernor::Indexes, knowledgeEntrySize);
+    } else if (!(it->version == version)) {
+        if (version.lastSaved < it->version.lastSaved)
+            return; // stale
+
+        mKnowledgeMemory.add(MemoryGovernor::Indexes, -it->nodeIds.count() * knownNodeEntrySize);
+        it->version = version;
+        it->originNodeId.clear();
+        it->nodeIds.clear();
+    }
+
+    const int known = it->nodeIds.count();
+    it->nodeIds.insert(nodeId);
+
+    if (!originNodeId.isEmpty()) {
+        it->nodeIds.insert(originNodeId);
+        if (it->originNodeId.isEmpty())
+            it->originNodeId = originNodeId;
+    }
+
+    mKnowledgeMemory.add(MemoryGovernor::Indexes, (it->nodeIds.count() - known) * knownNodeEntrySize);
+}
+
+/*! Drops what is known about \a ids, which have been removed.
+ */
+void SyncManager::forget(const QList<SObjectLocalId> &ids)
+{
+    QMutexLocker locker(&mKnowledgeLock);
+
+    foreach (const SObjectLocalId &id, ids) {
+        QHash<SObjectLocalId, ObjectKnowledge>::Iterator it = mKnowledge.find(id);
+        if (it == mKnowledge.end())
+            continue;
+
+        mKnowledgeMemory.add(MemoryGovernor::Indexes, -(knowledgeEntrySize + it->nodeIds.count() * knownNodeEntrySize));
+        mKnowledge.erase(it);
+    }
+}
+
+/*! Drops what is known about older versions of \a objects, which were
+ * changed here; objects saved from a peer come back from storage as the
+ * version the peer sent, so what we know of that is kept.
+ */
+void SyncManager::forgetOtherVersions(const QList<SObject> &objects)
+{
+    QList<SObjectLocalId> changed;
+
+    {
+        QMutexLocker locker(&mKnowledgeLock);
+        foreach (const SObject &object, objects) {
+            QHash<SObjectLocalId, ObjectKnowledge>::ConstIterator it = mKnowledge.constFind(object.id().localId());
+            if (it != mKnowledge.constEnd() && !(it->version == ObjectVersion(object)) &&
+                it->version.lastSaved <= object.lastSaved())
+                changed.append(it.key());
+        }
+    }
+
+    forget(changed);
+}
+
+/*! Returns true if \a nodeId is known to already have \a version of the object \a id.
+ */
+bool SyncManager::isKnown(const SObjectLocalId &id, const ObjectVersion &version, const QByteArray &nodeId) const
+{
+    QMutexLocker locker(&mKnowledgeLock);
+
+    QHash<SObjectLocalId, ObjectKnowledge>::ConstIterator it = mKnowledge.constFind(id);
+    return it != mKnowledge.constEnd() && it->version == version && it->nodeIds.contains(nodeId);
+}
+
+/*! Returns the node \a version of the object \a id was first made on, or an
+ * empty id if it wasn't received from a peer.
+ */
+QByteArray SyncManager::originOf(const SObjectLocalId &id, const ObjectVersion &version) const
+{
+    QMutexLocker locker(&mKnowledgeLock);
+
+    QHash<SObjectLocalId, ObjectKnowledge>::ConstIterator it = mKnowledge.constFind(id);
+    if (it == mKnowledge.constEnd() || !(it->version == version))
+        return QByteArray();
+
+    return it->originNodeId;
+}
+
+/*! Returns the ObjectListCommand frames for \a objects, listBatchSize
+ * objects to a frame.
+ */
+QList<SyncFrame> SyncManager::encodeObjectList(const QList<SObject> &objects) const
+{
+    const QByteArray &localNodeId = SyncAdvertiser::localNodeId();
+    QList<SyncFrame> frames;
+
+    for (int first = 0; first < objects.count(); first += listBatchSize) {
+        const int last = qMin(objects.count(), first + listBatchSize);
+
+        ObjectListMessage message;
+        message.cloudName = mManagerName;
+        message.objects.reserve(last - first);
+
+        for (int i = first; i < last; ++i)
+            message.objects.append(listEntry(objects.at(i), localNodeId));
+
+        frames.append(encodeMessage(message));
+    }
+
+    return frames;
+}
+
+ObjectListEntry SyncManager::listEntry(const SObject &obj, const QByteArray &localNodeId) const
+{
+    ObjectListEntry entry;
+    entry.id = obj.id().localId();
+    entry.hash = obj.hash();
+    entry.lastSaved = obj.lastSaved();
+
+    QByteArray originNodeId = originOf(entry.id, ObjectVersion(obj));
+    if (originNodeId.isEmpty())
+        originNodeId = localNodeId;
+
+    entry.originNodeId = QString::fromLatin1(originNodeId);
+    return entry;
+}
+
+/*! Returns the DeleteListCommand frames for \a ids, listBatchSize ids to
+ * a frame.
+ */
+QList<SyncFrame> SyncManager::encodeDeleteList(const QList<SObjectLocalId> &ids) const
+{
+    QList<SyncFrame> frames;
+
+    for (int first = 0; first < ids.count(); first += listBatchSize) {
+        DeleteListMessage message;
+        message.cloudName = mManagerName;
+        message.ids = ids.mid(first, listBatchSize);
+
+        frames.append(encodeMessage(message));
+    }
+
+    return frames;
 }
 
 bool SyncManager::isRemoved(const SObjectLocalId &id) const
 {
+    QReadLocker locker(&mLock);
     return mDeleteListHash.contains(id);
 }
 
 QList<SObjectLocalId> SyncManager::deleteList() const
 {
+    QReadLocker locker(&mLock);
     return mDeleteList;
 }
 
 QList<SObject> SyncManager::objects() const
 {
+    // build the list from a snapshot rather than holding the lock
+    const QHash<SObjectLocalId, SObject> snapshot = objectHash();
+
     QList<SObject> objectsList;
-    foreach (const SObject &obj, mObjects) {
+    foreach (const SObject &obj, snapshot) {
         objectsList.append(obj);
     }
 
@@ -167,5 +658,6 @@ QList<SObject> SyncManager::objects() const
 
 QHash<SObjectLocalId, SObject> SyncManager::objectHash() const
 {
+    QReadLocker locker(&mLock);
     return mObjects;
 }
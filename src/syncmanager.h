@@ -18,15 +18,76 @@
 #define SYNCMANAGER_H
 
 // Qt
+#include <QElapsedTimer>
+#include <QHash>
 #include <QObject>
 #include <QString>
 #include <QSet>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QTimer>
 
 // saesu
 #include <sobject.h>
 #include <sobjectmanager.h>
 #include <sobjectid.h>
 
+// Us
+#include "memorygovernor.h"
+#include "syncprotocol.h"
+
+class CloudMetrics;
+class SObjectFetchRequest;
+class SyncManager;
+
+struct ObjectListEntry;
+
+/*! Identifies one saved state of an object.
+ */
+struct ObjectVersion
+{
+    ObjectVersion() : lastSaved(0) {}
+    ObjectVersion(const QByteArray &h, qint64 ts) : hash(h), lastSaved(ts) {}
+    explicit ObjectVersion(const SObject &object) : hash(object.hash()), lastSaved(object.lastSaved()) {}
+
+    bool operator==(const ObjectVersion &other) const
+    {
+        return lastSaved == other.lastSaved && hash == other.hash;
+    }
+
+    QByteArray hash;
+    qint64 lastSaved;
+};
+
+/*! Creates SyncManager instances on the main thread on behalf of worker threads.
+ */
+class SyncManagerFactory : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SyncManagerFactory();
+
+public slots:
+    SyncManager *create(const QString &managerName);
+};
+
+/*! Tracks the objects and deletions of a single cloud.
+ *
+ * SyncManager instances live on the main thread, which is the only thread
+ * that talks to storage. The accessors and ensureRemoved()/saveObjects() may
+ * be used from any thread; the accessors return cheap, implicitly shared
+ * snapshots.
+ *
+ * Changes reported by storage are collected for objects/coalesceInterval
+ * milliseconds (50 by default) after the first one, then fetched and
+ * announced together, so an application saving objects in a loop costs
+ * one fetch and one frame per connection rather than one each.
+ *
+ * A cloud's objects and delete list are loaded in the background when its
+ * instance is created, which CloudRegistry does for every cloud at startup.
+ * Until both are loaded, isReady() returns false and the accessors return
+ * partial contents; ready() is emitted once they are complete.
+ */
 class SyncManager : public QObject
 {
     Q_OBJECT
@@ -35,6 +96,7 @@ public:
     virtual ~SyncManager();
 
     static SyncManager *instance(const QString &managerName);
+    static void serveWorkers();
 
     QList<SObject> objects() const;
 
@@ -43,27 +105,105 @@ public:
     QList<SObjectLocalId> deleteList() const;
 
     SObjectManager *manager();
+    CloudMetrics *metrics() const;
+
+    bool isReady() const;
 
     void ensureRemoved(const QList<SObjectLocalId> &ids);
 
+    void retire();
+    void revive();
+
     bool isRemoved(const SObjectLocalId &id) const;
 
+    void saveObjects(const QList<SObject> &objects, qint64 size);
+    qint64 serialisedSize(const SObject &object) const;
+
+    void markKnown(const SObjectLocalId &id, const ObjectVersion &version,
+                   const QByteArray &nodeId, const QByteArray &originNodeId = QByteArray());
+    bool isKnown(const SObjectLocalId &id, const ObjectVersion &version, const QByteArray &nodeId) const;
+    QByteArray originOf(const SObjectLocalId &id, const ObjectVersion &version) const;
+
+    QList<SyncFrame> encodeObjectList(const QList<SObject> &objects) const;
+    QList<SyncFrame> encodeDeleteList(const QList<SObjectLocalId> &ids) const;
+
 signals:
-    void objectsAddedOrUpdated(const QString &managerName, const QList<SObject> &objects);
-    void objectsDeleted(const QString &managerName, const QList<SObjectLocalId> &ids);
+    void ready(const QString &managerName);
+
+    // the frames are encoded once, and can be sent as-is by every connection
+    void objectsAddedOrUpdated(const QString &managerName, const QList<SObject> &objects, const QList<SyncFrame> &objectListFrames);
+    void objectsDeleted(const QString &managerName, const QList<SObjectLocalId> &ids, const QList<SyncFrame> &deleteListFrames);
 
 private slots:
-    void readObjects(const QList<SObjectLocalId> &ids);
+    void onObjectsChanged(const QList<SObjectLocalId> &ids);
+    void flushChanges();
+    SObjectFetchRequest *readObjects(const QList<SObjectLocalId> &ids);
     void onObjectsRead();
     void onDeleteListRead();
+    void onLoadFinished();
     void onObjectsRemoved(const QList<SObjectLocalId> &ids);
+    void removeObjects(const QList<SObjectLocalId> &ids);
+    void writeObjects(const QList<SObject> &objects, qint64 size);
+    void onObjectsSaved();
 
 private:
+    void load();
+    bool isStaleLoad(QObject *request) const;
+    ObjectListEntry listEntry(const SObject &obj, const QByteArray &localNodeId) const;
+    void forget(const QList<SObjectLocalId> &ids);
+    void forgetOtherVersions(const QList<SObject> &objects);
+
+    bool mRetired;
+
+    // storage requests load() is waiting for, and when it started; each
+    // load() or retire() starts a new generation, and requests made for an
+    // older one are ignored when they finish
+    int mLoadsPending;
+    quint32 mLoadGeneration;
+    QHash<QObject *, quint32> mLoadRequests;
+    QElapsedTimer mLoadClock;
+
+    // protects mReady, mObjects, mDeleteList and mDeleteListHash
+    mutable QReadWriteLock mLock;
+    bool mReady;
     QHash<SObjectLocalId, SObject> mObjects;
     SObjectManager mManager;
     QList<SObjectLocalId> mDeleteList;
     QSet<SObjectLocalId> mDeleteListHash;
+
+    // which nodes are known to have the latest version we've heard of for
+    // each object, and where that version came from; an entry goes when the
+    // object changes here or is removed
+    struct ObjectKnowledge
+    {
+        ObjectVersion version;
+        QByteArray originNodeId;
+        QSet<QByteArray> nodeIds;
+    };
+    mutable QMutex mKnowledgeLock;
+    QHash<SObjectLocalId, ObjectKnowledge> mKnowledge;
+    MemoryAccount mKnowledgeMemory;
+
+    // how large the version of each object last sent to a peer is serialised
+    struct ObjectSize
+    {
+        ObjectVersion version;
+        qint64 size;
+    };
+    mutable QMutex mSizesLock;
+    mutable QHash<SObjectLocalId, ObjectSize> mSizes;
     QString mManagerName; // TODO: this should perhaps be moved to SObjectManager
+    CloudMetrics *mMetrics;
+
+    // changes waiting for the coalescing window to close
+    QSet<SObjectLocalId> mChangedIds;
+    QList<SObjectLocalId> mRemovedIds;
+    QTimer mChangeTimer;
+
+    // objects received from peers until storage has saved them, and what
+    // each save request holds (main thread only)
+    MemoryAccount mMemory;
+    QHash<QObject *, qint64> mSaveSizes;
 };
 
 #endif // SYNCMANAGER_H
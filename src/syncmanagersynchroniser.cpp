@@ -15,177 +15,735 @@
  */
 
 // Qt
-#include <QTcpSocket>
+#include <QSslSocket>
 #include <QHostAddress>
+#include <QDateTime>
 #include <QDir>
-#include <QCoreApplication>
-#include <QDesktopServices>
+#include <QFile>
 #include <QtEndian>
-#include <QCryptographicHash>
+#include <QSettings>
+#include <QStringList>
+#include <QTimer>
 
 // Saesu
 #include <sobject.h>
 #include <sglobal.h> // XXX: move to sobject.h
-#include <sobjectsaverequest.h>
+
+// Posix
+#include <limits.h>
 
 // Us
+#include "blockindex.h"
+#include "cloudregistry.h"
+#include "filetransfer.h"
+#include "objectspool.h"
+#include "syncadvertiser.h"
 #include "syncmanager.h"
 #include "syncmanagersynchroniser.h"
+#include "syncmessages.h"
+#include "syncmetrics.h"
+#include "synctls.h"
+#include "synctrace.h"
+#include "transfercoordinator.h"
+#include "transferparameters.h"
+
+/*! Returns the files offered to peers, relative to the working directory.
+ */
+QStringList SyncManagerSynchroniser::sharedFiles()
+{
+    static const QStringList files = QSettings().value(QLatin1String("files/shared"),
+                                                       QStringList(QLatin1String("music.mp3"))).toStringList();
+    return files;
+}
 
-static const qint64 blockSize = 4096;
+// frames are only handed to the socket while it has less than this waiting
+// to be sent, so that the scheduler, not the socket's buffer, decides what
+// goes out next
+static const qint64 writeWatermark = 64 * 1024;
 
-SyncManagerSynchroniser::SyncManagerSynchroniser(QObject *parent, QTcpSocket *socket)
-    : QObject(parent)
-    , mBytesExpected(0)
+/*! Returns the size above which objects are streamed with
+ * ObjectStreamCommand rather than sent in a single ObjectReplyCommand.
+ */
+static qint64 objectStreamThreshold()
 {
-    if (socket) {
-        mIsOutgoing = false;
-        mSocket = socket;
-        mSocket->setParent(this); // make sure we take over
-        startSync(); // already connected, so send introduction
-    } else {
-        mSocket = new QTcpSocket(this);
-        mIsOutgoing = true;
+    static const qint64 threshold = QSettings().value(QLatin1String("objects/streamThreshold"), 64 * 1024).toLongLong();
+    return threshold;
+}
+
+/*! Returns the size of the largest object a peer may stream to us; peers
+ * announcing larger ones are disconnected. Received objects are read into
+ * memory to be saved, so it is at most half the memory budget.
+ */
+static qint64 maxObjectSize()
+{
+    static const qint64 size = QSettings().value(QLatin1String("objects/maxSize"), 256 * 1024 * 1024).toLongLong();
+    return qMax(qMin(size, MemoryGovernor::budget() / 2), objectStreamThreshold());
+}
+
+/*! Returns the size of the largest file we accept from a peer; space for
+ * the whole file is reserved as soon as its transfer starts.
+ */
+static quint64 maxFileSize()
+{
+    static const quint64 size = QSettings().value(QLatin1String("files/maxSize"), Q_UINT64_C(16) * 1024 * 1024 * 1024).toULongLong();
+    return size;
+}
+
+/*! Returns how many blocks a file we accept from a peer may have; each
+ * costs a few bits, and a hash while it is wanted, for the whole transfer.
+ */
+static quint64 maxFileBlocks()
+{
+    static const quint64 count = QSettings().value(QLatin1String("files/maxBlocks"), 4 * 1024 * 1024).toULongLong();
+    return qMin<quint64>(count, INT_MAX);
+}
+
+/*! Returns the directory, relative to the working directory, that peers
+ * may send us files other than our shared ones into (\c "." for anywhere
+ * beneath it); by default there is none.
+ */
+static QString receiveRoot()
+{
+    static const QString root = QSettings().value(QLatin1String("files/receiveRoot")).toString();
+    return root;
+}
+
+/*! Returns true if we take \a fileName, as a peer named it, from a peer:
+ * it is one we share, or a relative path inside receiveRoot() that doesn't
+ * step outside it.
+ */
+static bool isReceivable(const QString &fileName)
+{
+    if (SyncManagerSynchroniser::sharedFiles().contains(fileName))
+        return true;
+
+    if (receiveRoot().isEmpty() || fileName.isEmpty() || QDir::isAbsolutePath(fileName) ||
+        fileName.contains(QLatin1Char('\\')) || fileName.contains(QLatin1Char('\0')))
+        return false;
+
+    foreach (const QString &part, fileName.split(QLatin1Char('/'))) {
+        if (part.isEmpty() || part == QLatin1String(".") || part == QLatin1String(".."))
+            return false;
     }
 
-    connect(mSocket, SIGNAL(connected()), SLOT(startSync()));
+    // names are relative to the working directory, like shared ones
+    const QDir current = QDir::current();
+    const QString root = QDir::cleanPath(current.absoluteFilePath(receiveRoot()));
+    const QString path = QDir::cleanPath(current.absoluteFilePath(fileName));
+    return path.startsWith(root + QLatin1Char('/'));
+}
+
+// chunks of streamed objects fit in a frame that doesn't need fragmenting,
+// and only about one of them is queued per connection at a time
+static const int objectChunkSize = 16 * 1024 - 16;
+
+/*! Returns the largest command a peer may send, whole or in fragments;
+ * peers sending larger ones are disconnected. Object lists and file hash
+ * lists are the largest legitimate commands.
+ */
+static qint64 maxFrameSize()
+{
+    static const qint64 size = QSettings().value(QLatin1String("memory/maxFrameSize"), 16 * 1024 * 1024).toLongLong();
+    return qMax<qint64>(size, 1024 * 1024);
+}
+
+/*! Returns how much may be queued for a peer before the objects it asks
+ * for wait to be sent; block requests are dropped from half of it.
+ */
+static qint64 maxQueuedBytes()
+{
+    static const qint64 bytes = QSettings().value(QLatin1String("memory/maxQueuedBytes"), 4 * 1024 * 1024).toLongLong();
+    return qMax<qint64>(bytes, writeWatermark);
+}
+
+/*! Returns how long a peer may go without reading anything we send it
+ * while memory is short, before it is disconnected.
+ */
+static qint64 stallTimeout()
+{
+    static const qint64 timeout = QSettings().value(QLatin1String("memory/stallTimeout"), 60000).toLongLong();
+    return qMax<qint64>(timeout, 1000);
+}
+
+/*! Returns how many names a peer may declare in one session; peers
+ * declaring more are disconnected. Names are dropped with the session.
+ */
+static int maxPeerNames()
+{
+    static const int count = QSettings().value(QLatin1String("protocol/maxNames"), 64 * 1024).toInt();
+    return qMax(count, 1024);
+}
+
+// how much the socket may read ahead of us; the rest of a frame is read
+// as it arrives, so a large one doesn't need to be buffered twice
+static const qint64 socketReadBufferSize = 64 * 1024;
+
+// how often to check whether reading may resume
+static const int throttleInterval = 100;
+
+/*! Counts a frame of \a size bytes, including its header, against both
+ * \a connection and \a process.
+ */
+static void recordFrame(TrafficMetrics *connection, TrafficMetrics *process, quint8 token, int size)
+{
+    connection->record(token, size);
+    process->record(token, size);
+}
+
+/*! Creates a synchroniser for an incoming connection on \a socketDescriptor,
+ * or an outgoing connection if \a socketDescriptor is -1.
+ *
+ * Synchronisers are meant to be moved to a worker thread after construction;
+ * call acceptConnection() or connectToHost() once they are there.
+ */
+SyncManagerSynchroniser::SyncManagerSynchroniser(int socketDescriptor)
+    : QObject()
+    , mSocket(new QSslSocket(this))
+    , mSocketDescriptor(socketDescriptor)
+    , mBytesExpected(0)
+    , mCommandSize(0)
+    , mIsOutgoing(socketDescriptor == -1)
+    , mSyncStarted(false)
+    , mConnectionActive(false)
+    , mRetry(true)
+    , mHandshakeTimer(new QTimer(this))
+    , mTlsStarted(0)
+    , mTransferTimer(new QTimer(this))
+    , mShapingTimer(new QTimer(this))
+    , mOutgoingSpool(0)
+    , mIncomingSpool(0)
+    , mSpooledBytes(0)
+    , mReadingThrottled(false)
+    , mThrottleTimer(new QTimer(this))
+    , mLastWriteProgress(0)
+    , mMetrics(socketDescriptor == -1)
+{
+    mClock.start();
+
+    // once it's full, the peer is held back by TCP flow control
+    mSocket->setReadBufferSize(socketReadBufferSize);
+
+    mThrottleTimer->setSingleShot(true);
+    mThrottleTimer->setInterval(throttleInterval);
+    connect(mThrottleTimer, SIGNAL(timeout()), SLOT(onThrottleTimer()));
+
+    mShapingTimer->setSingleShot(true);
+    connect(mShapingTimer, SIGNAL(timeout()), SLOT(flushFrames()));
+
+    // covers connecting and encryption as well as the peer introducing itself
+    mHandshakeTimer->setSingleShot(true);
+    mHandshakeTimer->setInterval(QSettings().value(QLatin1String("peers/handshakeTimeout"), 10000).toInt());
+    connect(mHandshakeTimer, SIGNAL(timeout()), SLOT(onHandshakeTimeout()));
+
+    // checks for block requests that went unanswered
+    mTransferTimer->setInterval(250);
+    connect(mTransferTimer, SIGNAL(timeout()), SLOT(onTransferTimer()));
+
+    // with TLS, nothing is sent until the peer's certificate is checked
+    if (SyncTls::isEnabled())
+        connect(mSocket, SIGNAL(encrypted()), SLOT(onEncrypted()));
+    else
+        connect(mSocket, SIGNAL(connected()), SLOT(startSync()));
     connect(mSocket, SIGNAL(readyRead()), SLOT(onReadyRead()));
+    connect(mSocket, SIGNAL(bytesWritten(qint64)), SLOT(onBytesWritten()));
     connect(mSocket, SIGNAL(error(QAbstractSocket::SocketError)), SLOT(onError(QAbstractSocket::SocketError)));
     connect(mSocket, SIGNAL(disconnected()), SLOT(onDisconnected()));
 }
 
+SyncManagerSynchroniser::~SyncManagerSynchroniser()
+{
+    // incomplete transfers are journalled, and resumed on the next FileInfo
+    qDeleteAll(mIncomingFiles);
+
+    foreach (const QList<DeferredCommand *> &commands, mDeferredCommands)
+        qDeleteAll(commands);
+
+    delete mOutgoingSpool;
+    delete mIncomingSpool;
+}
+
 bool SyncManagerSynchroniser::isOutgoing() const
 {
     return mIsOutgoing;
 }
 
-void SyncManagerSynchroniser::sendCommand(quint8 token, const QByteArray &data)
+QByteArray SyncManagerSynchroniser::peerNodeId() const
 {
-    quint32 length = qToBigEndian<quint32>((quint32)data.length() + 1);
-    mSocket->write(reinterpret_cast<char *>(&length), sizeof(quint32));
-    mSocket->write(reinterpret_cast<char *>(&token), sizeof(quint8));
-    mSocket->write(data);
+    return mPeerNodeId;
 }
 
-void SyncManagerSynchroniser::startSync()
+/*! Returns the name of the command \a token, or 0 if there is no such command.
+ */
+const char *SyncManagerSynchroniser::commandName(int token)
 {
-    // as both sides advertise their presence, we end up with two connections: one outgoing from each side
-    // we can't stop those connections, because we don't know which interface the OS will route the connection
-    // from, so this is the only place we can know IPs.
-    //
-    // however, we also can't deal (in the sense of efficiency) with multiple connections performing
-    // the exact same synchronisation, so we need to force the peers to agree on a single connection.
-    // the easiest way to do this is to assume that the dominant connection will always be from the peer
-    // with the *LOWER* IP address.
-    const QHostAddress peerAddress = mSocket->peerAddress();
-    const QHostAddress localAddress = mSocket->localAddress();
-
-    sDebug() << (void*)this << "Got connected from " << peerAddress.toString() << " to " << localAddress.toString() << " direction is " << (isOutgoing() ? "outgoing" : "incoming");
-
-    if (QString::compare(peerAddress.toString(), localAddress.toString()) < 0 && !isOutgoing()) {
-        sDebug() << (void*)this << "Dropping redundant connection from " << peerAddress << " to " << localAddress;
-        mSocket->disconnectFromHost();
+    switch (token) {
+    case DeleteListCommand: return "DeleteList";
+    case ObjectListCommand: return "ObjectList";
+    case ObjectRequestCommand: return "ObjectRequest";
+    case ObjectReplyCommand: return "ObjectReply";
+    case CurrentTimeCommand: return "CurrentTime";
+    case FileInfoCommand: return "FileInfo";
+    case FileHashRequestCommand: return "FileHashRequest";
+    case FileHashReplyCommand: return "FileHashReply";
+    case FileBlockRequestCommand: return "FileBlockRequest";
+    case FileBlockReplyCommand: return "FileBlockReply";
+    case HelloCommand: return "Hello";
+    case DeclareNameCommand: return "DeclareName";
+    case FragmentCommand: return "Fragment";
+    case ObjectStreamCommand: return "ObjectStream";
+    case ObjectChunkCommand: return "ObjectChunk";
+    }
+
+    return 0;
+}
+
+void SyncManagerSynchroniser::acceptConnection()
+{
+    Q_ASSERT(!isOutgoing());
+
+    if (!mSocket->setSocketDescriptor(mSocketDescriptor)) {
+        sWarning() << "Couldn't take over incoming connection: " << mSocket->errorString();
+        deleteLater();
         return;
     }
 
-    sDebug() << "Opening file";
-    QCryptographicHash fileHash(QCryptographicHash::Sha1);
-    char buf[blockSize + 1]; // + 1 to not overwrite the block
-    *buf = 0;
-    bool error = false;
-    QList<QByteArray> blockHashes;
-    QFile f("music.mp3");
+    // the peer has as long to introduce itself (after TLS, if any) as we
+    // give peers we connect to
+    mHandshakeTimer->start();
 
-    f.open(QIODevice::ReadOnly);
+    if (SyncTls::isEnabled()) {
+        SyncTls::configure(mSocket, QByteArray());
+        mTlsStarted = mClock.nsecsElapsed();
+        mSocket->startServerEncryption();
+        return;
+    }
+
+    startSync(); // already connected, so send introduction
+}
+
+/*! Queues \a frame for the peer, first declaring any names it uses that the
+ * peer hasn't been told about yet.
+ *
+ * Declarations go out on the control stream, which always goes first, so
+ * they reach the peer before the frame does.
+ */
+void SyncManagerSynchroniser::writeFrame(const SyncFrame &frame)
+{
+    queueFrame(frame);
+    flushFrames();
+}
+
+/*! Sends \a frames, in order.
+ */
+void SyncManagerSynchroniser::writeFrames(const QList<SyncFrame> &frames)
+{
+    foreach (const SyncFrame &frame, frames)
+        queueFrame(frame);
+
+    flushFrames();
+}
+
+/*! Queues \a frame like writeFrame() does, without sending anything yet.
+ */
+void SyncManagerSynchroniser::queueFrame(const SyncFrame &frame)
+{
+    if (frame.bytes.isEmpty())
+        return; // couldn't be encoded
+
+    for (QHash<quint32, QString>::ConstIterator it = frame.names.constBegin(); it != frame.names.constEnd(); ++it) {
+        if (mDeclaredNames.contains(it.key()))
+            continue;
+
+        DeclareNameMessage declaration;
+        declaration.handle = it.key();
+        declaration.name = it.value();
+
+        mScheduler.enqueue(encodeMessage(declaration).bytes);
+        mDeclaredNames.insert(it.key());
+    }
+
+    mScheduler.enqueue(frame.bytes);
+}
 
-    while (!f.atEnd()) {
-        QCryptographicHash blockHash(QCryptographicHash::Sha1);
-        qint64 readBlockSize = f.read(buf, blockSize);
+/*! Hands queued frames to the socket, in the order the scheduler picks,
+ * until it has enough to be getting on with.
+ *
+ * File transfers only go out while the bandwidth limits allow; if they are
+ * all that is left, we come back once there is bandwidth for them again.
+ */
+void SyncManagerSynchroniser::flushFrames()
+{
+    const qint64 now = BandwidthLimiter::now();
+    qint64 allowance = BandwidthLimiter::allowance(&mPeerBucket, now);
+    qint64 written = 0;
+
+    while (mSocket->bytesToWrite() < writeWatermark) {
+        sendObjects();
 
-        if (readBlockSize == -1) {
-            sDebug() << "Error!";
-            error = true;
+        const QByteArray frame = mScheduler.takeFrame(allowance > 0);
+        if (frame.isEmpty())
             break;
-        } else if (readBlockSize < blockSize) {
-            sDebug() << "Didn't read a full block, near EOF?";
-            sDebug() << "Read a block of " << readBlockSize << " bytes";
-        }
 
-        blockHash.addData(buf, readBlockSize);
-        fileHash.addData(buf, readBlockSize);
-        blockHashes.append(blockHash.result());
+        mSocket->write(frame);
+        recordFrame(&mMetrics.sent, &SyncMetrics::process()->sent, frame.at(sizeof(quint32)), frame.size());
+        written += frame.size();
+        allowance -= frame.size();
     }
 
-    // TODO: check for empty file
-    if (!error) {
-        sDebug() << "No error! :)";
-        sDebug() << "File contains " << blockHashes.count() << " hashes";
-        sDebug() << "File hash is " << fileHash.result().toHex();
+    BandwidthLimiter::consume(&mPeerBucket, written, now);
 
-        {
-            // send file overview
-            QByteArray data;
-            QDataStream stream(&data, QIODevice::WriteOnly);
-            stream << QString("music.mp3");
-            stream << (quint64)f.size();
-            stream << fileHash.result();
-
-            sendCommand(FileInfoCommand, data);
+    if (!mScheduler.isEmpty() && mSocket->bytesToWrite() < writeWatermark && !mShapingTimer->isActive()) {
+        const qint64 delay = BandwidthLimiter::delay(&mPeerBucket, now);
+        mShapingTimer->start(qMax<qint64>(delay / 1000, 1));
+    }
+
+    mMetrics.bytesToWrite.set(mSocket->bytesToWrite());
+    for (int i = 0; i < FrameScheduler::StreamCount; ++i)
+        mMetrics.queuedBytes[i].set(mScheduler.queuedBytes(FrameScheduler::Stream(i)));
+    updateMemoryAccount();
+}
+
+/*! Queues the objects the peer asked for that had to wait: the next
+ * chunks of the one being streamed, or the next one. Only about a chunk's
+ * worth is queued at a time, so the rest stays spooled, or shared with the
+ * cloud's copy.
+ */
+void SyncManagerSynchroniser::sendObjects()
+{
+    while (mScheduler.queuedBytes(FrameScheduler::ObjectBodyStream) < objectChunkSize) {
+        if (!mOutgoingSpool) {
+            if (mOutgoingObjects.isEmpty())
+                return;
+
+            const OutgoingObject outgoing = mOutgoingObjects.dequeue();
+            mMemory.add(MemoryGovernor::ObjectBodies, -qint64(sizeof(OutgoingObject)));
+            const SObjectLocalId id = outgoing.object.id().localId();
+
+            if (outgoing.size > objectStreamThreshold()) {
+                mOutgoingSpool = new ObjectSpool(outgoing.cloudName, id);
+
+                if (!mOutgoingSpool->write(outgoing.object)) {
+                    // better a memory spike than leaving the peer without it
+                    delete mOutgoingSpool;
+                    mOutgoingSpool = 0;
+                }
+            }
+
+            if (!mOutgoingSpool) {
+                ObjectReplyMessage reply;
+                reply.cloudName = outgoing.cloudName;
+                reply.id = id;
+                reply.object = outgoing.object;
+                queueFrame(encodeMessage(reply));
+                continue;
+            }
+
+            SYNC_TRACE_SPAN("session", "streamObject");
+            SYNC_TRACE_ARGUMENT("bytes", mOutgoingSpool->size());
+            sDebug() << (void*)this << "Streaming object " << id << " of " << mOutgoingSpool->size() << " bytes";
+
+            ObjectStreamMessage header;
+            header.cloudName = outgoing.cloudName;
+            header.id = id;
+            header.size = mOutgoingSpool->size();
+            queueFrame(encodeMessage(header));
+
+            SyncMetrics::process()->objectsStreamedOut.add(1);
+        }
+
+        ObjectChunkMessage chunk;
+        chunk.piece = mOutgoingSpool->readChunk(objectChunkSize);
+        queueFrame(encodeMessage(chunk));
+
+        // an empty chunk tells the peer to give up on the object
+        if (chunk.piece.isEmpty() || mOutgoingSpool->atEnd()) {
+            if (chunk.piece.isEmpty())
+                sWarning() << "Couldn't read back spooled object " << mOutgoingSpool->id();
+
+            delete mOutgoingSpool;
+            mOutgoingSpool = 0;
         }
     }
+}
 
-    sDebug() << "Finished reading file";
+void SyncManagerSynchroniser::onBytesWritten()
+{
+    mLastWriteProgress = mClock.elapsed();
+    flushFrames();
+
+    // what was sent may have been enough to read again
+    if (mReadingThrottled && !isReadingThrottled())
+        onReadyRead();
+}
+
+/*! Returns the bytes waiting to be sent to the peer, in the scheduler and
+ * the socket.
+ */
+qint64 SyncManagerSynchroniser::sendQueueBytes() const
+{
+    return mScheduler.queuedBytes() + mSocket->bytesToWrite();
+}
+
+/*! Returns true if we should stop reading from the peer for now, as
+ * memory is critically short, and checks again in a while if so.
+ *
+ * A peer that is slow to read what we send it is not reason enough: the
+ * peer may be waiting for us to read in turn. Its requests are only
+ * answered as it catches up, and cost little until then.
+ */
+bool SyncManagerSynchroniser::isReadingThrottled()
+{
+    if (MemoryGovernor::pressure() != MemoryGovernor::Critical) {
+        if (mReadingThrottled)
+            sDebug() << (void*)this << "Reading from the peer again";
+
+        mReadingThrottled = false;
+        return false;
+    }
+
+    if (!mReadingThrottled) {
+        sDebug() << (void*)this << "Not reading from the peer, " << sendQueueBytes() << " bytes queued, "
+                 << MemoryGovernor::used() << " bytes held overall";
+        mReadingThrottled = true;
+        mLastWriteProgress = mClock.elapsed();
+        SyncMetrics::process()->readsThrottled.add(1);
+    }
+
+    if (!mThrottleTimer->isActive())
+        mThrottleTimer->start();
+    return true;
+}
+
+/*! Resumes reading if we may, or drops a peer that has stopped reading what
+ * we send it altogether, as what is queued for it isn't going anywhere.
+ */
+void SyncManagerSynchroniser::onThrottleTimer()
+{
+    const bool backlogged = sendQueueBytes() > 0 || !mOutgoingObjects.isEmpty();
+    if (mReadingThrottled && backlogged && mClock.elapsed() - mLastWriteProgress > stallTimeout()) {
+        sWarning() << "Peer " << mPeerNodeId << " hasn't read anything for " << stallTimeout()
+                   << " ms, dropping it and the " << sendQueueBytes() << " bytes queued for it";
+        SyncMetrics::process()->connectionsStalled.add(1);
+        abortConnection();
+        return;
+    }
+
+    onReadyRead();
+}
 
-     // TODO: listen for cloud add/remove
-    QString databasePath;
-    QCoreApplication *a = QCoreApplication::instance();
+/*! Tells MemoryGovernor how much the connection's buffers hold; the
+ * objects waiting for it are accounted for as they come and go.
+ */
+void SyncManagerSynchroniser::updateMemoryAccount()
+{
+    qint64 received = mSocket->bytesAvailable() + mIncomingFrame.size();
+    for (int i = 0; i < FrameScheduler::StreamCount; ++i)
+        received += mPartialFrames[i].size();
+
+    mMemory.set(MemoryGovernor::ReceiveBuffers, received);
+    mMemory.set(MemoryGovernor::SendQueues, sendQueueBytes());
+
+    // shared with deferred commands and queued objects, so only the change
+    const qint64 spooled = (mOutgoingSpool ? mOutgoingSpool->size() : 0) +
+                           (mIncomingSpool ? mIncomingSpool->size() : 0);
+    mMemory.add(MemoryGovernor::ObjectBodies, spooled - mSpooledBytes);
+    mSpooledBytes = spooled;
+}
+
+void SyncManagerSynchroniser::startSync()
+{
+    SYNC_TRACE_SPAN("session", "startSync");
 
-    QString orgName = a->organizationName();
-    QString appName = a->applicationName();
+    sDebug() << (void*)this << "Got connected from " << mSocket->peerAddress().toString() << " to " << mSocket->localAddress().toString() << " direction is " << (isOutgoing() ? "outgoing" : "incoming");
+
+    // introduce ourselves; nothing else is sent until the peer is known
+    HelloMessage hello;
+    hello.version = syncProtocolVersion;
+    hello.nodeId = SyncAdvertiser::localNodeId();
+    writeFrame(encodeMessage(hello));
+}
 
-    a->setOrganizationName(QLatin1String("saesu"));
-    a->setApplicationName(QLatin1String("clouds"));
+void SyncManagerSynchroniser::beginSync()
+{
+    if (mSyncStarted)
+        return;
 
-    databasePath = QDesktopServices::storageLocation(QDesktopServices::DataLocation);
-    QDir databaseDir(databasePath);
+    mSyncStarted = true;
+    sDebug() << (void*)this << "Starting synchronisation with " << mPeerNodeId;
 
-    QStringList databases = databaseDir.entryList(QDir::Files);
+    SYNC_TRACE_SPAN("session", "beginSync");
 
     {
         // send current time
-        QByteArray data;
-        QDataStream stream(&data, QIODevice::WriteOnly);
-        stream << (qint64)QDateTime::currentMSecsSinceEpoch();
+        CurrentTimeMessage currentTime;
+        currentTime.currentTime = QDateTime::currentMSecsSinceEpoch();
+        writeFrame(encodeMessage(currentTime));
+    }
+
+    const TransferParameters parameters = TransferParameters::local();
+    foreach (const QString &fileName, sharedFiles()) {
+        QFile f(fileName);
+        QByteArray fileHash;
+
+        if (!f.open(QIODevice::ReadOnly) || !parameters.hashFile(&f, &fileHash)) {
+            sDebug() << "Couldn't read shared file " << fileName << ": " << f.errorString();
+            continue;
+        }
+
+        sDebug() << "File hash of " << fileName << " is " << fileHash.toHex();
 
-        sendCommand(CurrentTimeCommand, data);
+        // send file overview
+        FileInfoMessage fileInfo;
+        fileInfo.fileName = fileName;
+        fileInfo.fileSize = f.size();
+        fileInfo.fileHash = fileHash;
+        fileInfo.blockSize = parameters.blockSize;
+        fileInfo.hashAlgorithm = parameters.algorithm;
+        writeFrame(encodeMessage(fileInfo));
+    }
+
+    CloudRegistry *registry = CloudRegistry::instance();
+    connect(registry, SIGNAL(cloudAdded(QString)), SLOT(onCloudAdded(QString)), Qt::UniqueConnection);
+    connect(registry, SIGNAL(cloudRemoved(QString)), SLOT(onCloudRemoved(QString)), Qt::UniqueConnection);
+
+    foreach (const QString &cloudName, registry->clouds())
+        onCloudAdded(cloudName);
+}
+
+/*! Starts synchronising \a cloudName with the peer, once it is loaded.
+ */
+void SyncManagerSynchroniser::onCloudAdded(const QString &cloudName)
+{
+    if (waitForCloud(cloudName)) {
+        mUnannouncedClouds.insert(cloudName);
+        return;
     }
 
-    foreach (const QString &database, databases) {
-        connect(SyncManager::instance(database),
-                SIGNAL(objectsAddedOrUpdated(QString,QList<SObject>)),
-                SLOT(sendObjectList(QString,QList<SObject>)),
-                Qt::UniqueConnection);
-        connect(SyncManager::instance(database),
-                SIGNAL(objectsDeleted(QString,QList<SObjectLocalId>)),
-                SLOT(sendDeleteList(QString,QList<SObjectLocalId>)),
-                Qt::UniqueConnection);
-        sendObjectList(database, SyncManager::instance(database)->objects());
+    announceCloud(cloudName);
+}
+
+/*! Sends the peer our object list for \a cloudName, and keeps it up to date.
+ *
+ * Must only be called once the cloud is ready, as the list would otherwise
+ * be incomplete, and the objects missing from it not sent until they change.
+ */
+void SyncManagerSynchroniser::announceCloud(const QString &cloudName)
+{
+    SyncManager *manager = SyncManager::instance(cloudName);
+
+    connect(manager,
+            SIGNAL(objectsAddedOrUpdated(QString,QList<SObject>,QList<SyncFrame>)),
+            SLOT(onObjectsChanged(QString,QList<SObject>,QList<SyncFrame>)),
+            Qt::UniqueConnection);
+    connect(manager,
+            SIGNAL(objectsDeleted(QString,QList<SObjectLocalId>,QList<SyncFrame>)),
+            SLOT(onObjectsDeleted(QString,QList<SObjectLocalId>,QList<SyncFrame>)),
+            Qt::UniqueConnection);
+    sendObjectList(cloudName, manager->objects());
+}
+
+void SyncManagerSynchroniser::onCloudRemoved(const QString &cloudName)
+{
+    disconnect(SyncManager::instance(cloudName), 0, this, 0);
+
+    mLoadingClouds.remove(cloudName);
+    mUnannouncedClouds.remove(cloudName);
+    qDeleteAll(mDeferredCommands.take(cloudName));
+}
+
+/*! Returns true if \a cloudName is still being loaded, or commands about it
+ * are still waiting, in which case onCloudReady() is called once it's loaded.
+ */
+bool SyncManagerSynchroniser::waitForCloud(const QString &cloudName)
+{
+    if (mLoadingClouds.contains(cloudName))
+        return true;
+
+    SyncManager *manager = SyncManager::instance(cloudName);
+    if (manager->isReady())
+        return false;
+
+    sDebug() << (void*)this << "Waiting for cloud " << cloudName << " to be loaded";
+    mLoadingClouds.insert(cloudName);
+    connect(manager, SIGNAL(ready(QString)), SLOT(onCloudReady(QString)), Qt::UniqueConnection);
+
+    // it may have finished loading before we connected
+    if (manager->isReady())
+        QMetaObject::invokeMethod(this, "onCloudReady", Qt::QueuedConnection, Q_ARG(QString, cloudName));
+
+    return true;
+}
+
+/*! Announces \a cloudName if it was added while loading, then processes the
+ * commands about it that arrived in the meantime, in order.
+ */
+void SyncManagerSynchroniser::onCloudReady(const QString &cloudName)
+{
+    SyncManager *manager = SyncManager::instance(cloudName);
+    if (!mLoadingClouds.contains(cloudName) || !manager->isReady())
+        return;
+
+    disconnect(manager, SIGNAL(ready(QString)), this, SLOT(onCloudReady(QString)));
+    mLoadingClouds.remove(cloudName);
+
+    if (mUnannouncedClouds.remove(cloudName))
+        announceCloud(cloudName);
+
+    const QList<DeferredCommand *> commands = mDeferredCommands.take(cloudName);
+    sDebug() << (void*)this << "Cloud " << cloudName << " loaded, processing " << commands.count() << " waiting commands";
+
+    foreach (DeferredCommand *command, commands) {
+        command->run(this);
+        delete command;
     }
 }
 
 void SyncManagerSynchroniser::sendDeleteList(const QString &managerName, const QList<SObjectLocalId> &ids)
 {
     sDebug() << (void*)this << "Sending delete list of " << ids.count() << " items";
-    QByteArray data;
-    QDataStream stream(&data, QIODevice::WriteOnly);
-    stream << managerName;
-    stream << (quint32)ids.count();
+    writeFrames(SyncManager::instance(managerName)->encodeDeleteList(ids));
+}
+
+void SyncManagerSynchroniser::onObjectsDeleted(const QString &cloudName, const QList<SObjectLocalId> &ids, const QList<SyncFrame> &deleteListFrames)
+{
+    Q_UNUSED(cloudName);
+    sDebug() << (void*)this << "Forwarding delete list of " << ids.count() << " items";
+    writeFrames(deleteListFrames);
+}
+
+/*! Forwards a local change notification, leaving out versions the peer
+ * already has (e.g. because it sent them to us in the first place).
+ *
+ * \a objectListFrames are the notification encoded once for all connections;
+ * it is only re-encoded for peers that already know some of the objects.
+ */
+void SyncManagerSynchroniser::onObjectsChanged(const QString &cloudName, const QList<SObject> &objects, const QList<SyncFrame> &objectListFrames)
+{
+    SYNC_TRACE_SPAN("session", "forwardObjectList");
+    SYNC_TRACE_ARGUMENT("objects", objects.count());
+
+    SyncManager *manager = SyncManager::instance(cloudName);
+    QList<SObject> unknownObjects;
 
-    foreach (const SObjectLocalId &localId, ids) {
-        stream << localId;
+    foreach (const SObject &obj, objects) {
+        if (!manager->isKnown(obj.id().localId(), ObjectVersion(obj), mPeerNodeId))
+            unknownObjects.append(obj);
+    }
+
+    if (unknownObjects.count() != objects.count()) {
+        sDebug() << (void*)this << "Not echoing " << objects.count() - unknownObjects.count() << " items back to " << mPeerNodeId;
+        sendObjectList(cloudName, unknownObjects);
+        return;
     }
-    
-    sendCommand(DeleteListCommand, data);
+
+    if (objects.isEmpty())
+        return;
+
+    sDebug() << (void*)this << "Forwarding object list of " << objects.count() << " items";
+    writeFrames(objectListFrames);
+
+    foreach (const SObject &obj, objects)
+        manager->markKnown(obj.id().localId(), ObjectVersion(obj), mPeerNodeId);
 }
 
 void SyncManagerSynchroniser::sendObjectList(const QString &cloudName, const QList<SObject> &objects)
@@ -195,90 +753,87 @@ void SyncManagerSynchroniser::sendObjectList(const QString &cloudName, const QLi
     if (!objects.count())
         return;
 
-    QByteArray data;
-    QDataStream stream(&data, QIODevice::WriteOnly);
-    stream << cloudName;
-    stream << (quint32)objects.count();
+    SYNC_TRACE_SPAN("session", "sendObjectList");
+    SYNC_TRACE_ARGUMENT("objects", objects.count());
 
-    foreach (const SObject &obj, objects) {
-        stream << obj.id().localId();
-        stream << obj.hash();
-        stream << obj.lastSaved();
-    }
+    SyncManager *manager = SyncManager::instance(cloudName);
+    writeFrames(manager->encodeObjectList(objects));
 
-    sendCommand(ObjectListCommand, data);
+    // we never need to tell them about these versions again
+    foreach (const SObject &obj, objects)
+        manager->markKnown(obj.id().localId(), ObjectVersion(obj), mPeerNodeId);
 }
 
 void SyncManagerSynchroniser::onReadyRead()
 {
-    while (mSocket->bytesAvailable() >= sizeof(quint32)) {
+    while (!isReadingThrottled()) {
         if (mBytesExpected == 0) {
+            if (mSocket->bytesAvailable() < qint64(sizeof(quint32)))
+                break;
+
             // read header
             mSocket->read(reinterpret_cast<char *>(&mBytesExpected), sizeof(mBytesExpected));
             mBytesExpected = qFromBigEndian<quint32>(mBytesExpected);
+
+            if (mBytesExpected > maxFrameSize()) {
+                sWarning() << "Peer " << mSocket->peerAddress().toString() << " sent a command of "
+                           << mBytesExpected << " bytes, more than memory/maxFrameSize; disconnecting";
+                abortConnection();
+                return;
+            }
         }
 
-        if (mSocket->bytesAvailable() < mBytesExpected)
-            return;
+        // take what there is of the frame, so the socket can read on
+        if (quint32(mIncomingFrame.size()) < mBytesExpected) {
+            if (mSocket->bytesAvailable() == 0)
+                break;
 
-        // read mBytesExpected bytes and process it
-        QByteArray bytes = mSocket->read(mBytesExpected);
-        Q_ASSERT((quint32)bytes.length() == mBytesExpected);
+            mIncomingFrame.append(mSocket->read(mBytesExpected - mIncomingFrame.size()));
+            if (quint32(mIncomingFrame.size()) < mBytesExpected)
+                continue;
+        }
 
-        processData(bytes);
+        const QByteArray bytes = mIncomingFrame;
+        mIncomingFrame.clear();
         mBytesExpected = 0;
+        recordFrame(&mMetrics.received, &SyncMetrics::process()->received,
+                    bytes.isEmpty() ? 0xff : bytes.at(0), sizeof(quint32) + bytes.length());
+
+        processData(bytes);
     }
+
+    mMetrics.bytesUnread.set(mSocket->bytesAvailable() + mIncomingFrame.size());
+    updateMemoryAccount();
 }
 
-void SyncManagerSynchroniser::processDeleteList(QDataStream &stream)
+void SyncManagerSynchroniser::processDeleteList(const DeleteListMessage &message)
 {
-    QString cloudName;
-    stream >> cloudName;
-
-    // sending a message, find message
-
-    quint32 itemCount;
-    stream >> itemCount;
-
-    sDebug() << (void*)this << "Processing a delete list of " << itemCount << " items";
-    QList<SObjectLocalId> ids;
-
-    for (quint32 i = 0; i < itemCount; ++i) {
-        SObjectLocalId uuid;
-        
-        stream >> uuid;
-        ids.append(uuid);
-    }
-
-    SyncManager::instance(cloudName)->ensureRemoved(ids);
+    sDebug() << (void*)this << "Processing a delete list of " << message.ids.count() << " items";
+    SyncManager::instance(message.cloudName.value)->ensureRemoved(message.ids);
 }
 
-void SyncManagerSynchroniser::processObjectList(QDataStream &stream)
+void SyncManagerSynchroniser::processObjectList(const ObjectListMessage &message)
 {
-    QString cloudName;
-    stream >> cloudName;
+    const QString &cloudName = message.cloudName.value;
 
     // sending a message, find message
-    QHash<SObjectLocalId, SObject> objects = SyncManager::instance(cloudName)->objectHash();
+    SyncManager *manager = SyncManager::instance(cloudName);
+    QHash<SObjectLocalId, SObject> objects = manager->objectHash();
 
-    quint32 itemCount;
-    stream >> itemCount;
+    sDebug() << (void*)this << "Processing an object list of " << message.objects.count() << " items";
 
-    sDebug() << (void*)this << "Processing an object list of " << itemCount << " items";
+    foreach (const ObjectListEntry &entry, message.objects) {
+        const SObjectLocalId &uuid = entry.id;
+        const QByteArray &itemHash = entry.hash;
+        const qint64 itemTS = entry.lastSaved;
 
-    for (quint32 i = 0; i < itemCount; ++i) {
-        SObjectLocalId uuid;
-        QByteArray itemHash;
-        qint64 itemTS;
-
-        stream >> uuid;
-        stream >> itemHash;
-        stream >> itemTS;
+        // neither they nor the node the change came from need to hear of it again
+        manager->markKnown(uuid, ObjectVersion(itemHash, itemTS), mPeerNodeId, entry.originNodeId.value.toLatin1());
 
         bool requestItem = false;
 
         // TODO: batch requests in groups
-        if (SyncManager::instance(cloudName)->isRemoved(uuid)) {
+        if (manager->isRemoved(uuid)) {
             sDebug() << (void*)this << "Ignoring deleted UUID " << uuid;
             sendDeleteList(cloudName, QList<SObjectLocalId>() << uuid);
             continue;
@@ -299,24 +854,23 @@ void SyncManagerSynchroniser::processObjectList(QDataStream &stream)
         }
 
         // TODO: batch requests in groups
-        if (requestItem) {
-            QByteArray sendingData;
-            QDataStream sendingStream(&sendingData, QIODevice::WriteOnly);
-
-            sendingStream << cloudName;
-            sendingStream << uuid;
-            sendCommand(ObjectRequestCommand, sendingData);
+        if (requestItem && !mRequestedObjects[cloudName].contains(uuid)) {
+            ObjectRequestMessage request;
+            request.cloudName = cloudName;
+            request.id = uuid;
+            writeFrame(encodeMessage(request));
+
+            mRequestedObjects[cloudName].insert(uuid);
+            mMetrics.objectRequestsOutstanding.add(1);
+            manager->metrics()->objectsRequested.add(1);
         }
     }
 }
 
-void SyncManagerSynchroniser::processObjectRequest(QDataStream &stream)
+void SyncManagerSynchroniser::processObjectRequest(const ObjectRequestMessage &message)
 {
-    QString cloudName;
-    stream >> cloudName;
-
-    SObjectLocalId uuid;
-    stream >> uuid;
+    const QString &cloudName = message.cloudName.value;
+    const SObjectLocalId &uuid = message.id;
 
     QHash<SObjectLocalId, SObject> objects = SyncManager::instance(cloudName)->objectHash();
     QHash<SObjectLocalId, SObject>::ConstIterator cit = objects.find(uuid);
@@ -327,29 +881,54 @@ void SyncManagerSynchroniser::processObjectRequest(QDataStream &stream)
 
     sDebug() << (void*)this << "Object request for " << uuid << " recieved; sending";
 
-    QByteArray sendingData;
-    QDataStream sendingStream(&sendingData, QIODevice::WriteOnly);
+    // too large to hold serialised, or the peer is behind on reading what
+    // we already sent it; sendObjects() sends it once there is room, in
+    // chunks if need be, and until then it is shared with the cloud's copy
+    const qint64 size = SyncManager::instance(cloudName)->serialisedSize(*cit);
+    if (size > objectStreamThreshold() || !mOutgoingObjects.isEmpty() || sendQueueBytes() > maxQueuedBytes()) {
+        OutgoingObject outgoing;
+        outgoing.cloudName = cloudName;
+        outgoing.object = *cit;
+        outgoing.size = size;
+        mOutgoingObjects.enqueue(outgoing);
+        mMemory.add(MemoryGovernor::ObjectBodies, sizeof(OutgoingObject));
+
+        SyncManager::instance(cloudName)->markKnown(uuid, ObjectVersion(*cit), mPeerNodeId);
+        SyncManager::instance(cloudName)->metrics()->objectsSent.add(1);
+        flushFrames();
+        return;
+    }
+
+    ObjectReplyMessage reply;
+    reply.cloudName = cloudName;
+    reply.id = uuid;
 
-    sendingStream << cloudName;
-    sendingStream << uuid;
-    
     // TODO: this won't correctly serialise hash/modified timestamp; we need to
     // change how we save SObject instances in the db (stop using stream operators)
     // and then change the stream operators to persist the _WHOLE_ object
-    sendingStream << *(cit);
-    sendCommand(ObjectReplyCommand, sendingData);
+    reply.object = *cit;
+    writeFrame(encodeMessage(reply));
+
+    SyncManager::instance(cloudName)->markKnown(uuid, ObjectVersion(*cit), mPeerNodeId);
+    SyncManager::instance(cloudName)->metrics()->objectsSent.add(1);
 }
 
-void SyncManagerSynchroniser::processObjectReply(QDataStream &stream)
+void SyncManagerSynchroniser::processObjectReply(const ObjectReplyMessage &message)
 {
-    QString cloudName;
-    stream >> cloudName;
+    const QString &cloudName = message.cloudName.value;
+    const SObjectLocalId &uuid = message.id;
+    const SObject &remoteItem = message.object;
+
+    if (!takeObjectRequest(cloudName, uuid)) {
+        sDebug() << (void*)this << "Ignoring " << uuid << ", which we didn't ask for";
+        return;
+    }
+
+    // whatever happens, they have this version, so don't send it back to them
+    SyncManager::instance(cloudName)->markKnown(uuid, ObjectVersion(remoteItem), mPeerNodeId);
+
+    SyncManager::instance(cloudName)->metrics()->objectsReceived.add(1);
 
-    SObjectLocalId uuid;
-    SObject remoteItem;
-    stream >> uuid;
-    stream >> remoteItem;
-    
     if (SyncManager::instance(cloudName)->isRemoved(uuid)) {
         sDebug() << (void*)this << "Ignoring deleted UUID " << uuid;
         return;
@@ -385,12 +964,10 @@ void SyncManagerSynchroniser::processObjectReply(QDataStream &stream)
                 // in the case of two connected clients, A and B,
                 // A may add an item, send a change notification (via object list) to B
                 // B will request the item, add it, which will trigger a
-                // local create notification on B, which will then result in a remote notification
-                // to A.
-                //
-                // This is actually desired (if slightly annoying) behaviour, because it allows
-                // items to propegate around the mesh more fully, as an instant notification,
-                // (think of situations where B actually has more than one other syncd connected)
+                // local create notification on B. B forwards that notification to its
+                // other peers, so the item propagates around the mesh, but not back to A:
+                // every version is tagged with the node it originated from, and each
+                // SyncManager remembers which nodes are known to have which version.
                 //
                 // Of course, we could get here in the case that two items both hash to the same
                 // sha1, but let's just hope that never ever happens.
@@ -411,21 +988,155 @@ void SyncManagerSynchroniser::processObjectReply(QDataStream &stream)
 
     if (saveItem) {
         // TODO: batch saving
-        SObjectSaveRequest *saveRequest = new SObjectSaveRequest;
-        connect(saveRequest, SIGNAL(finished()), saveRequest, SLOT(deleteLater()));
-        saveRequest->add(remoteItem);
-        saveRequest->setSaveHint(SObjectSaveRequest::ObjectFromSync);
-        saveRequest->start(SyncManager::instance(cloudName)->manager());
+        SyncManager::instance(cloudName)->saveObjects(QList<SObject>() << remoteItem, mCommandSize);
     }
 }
 
-void SyncManagerSynchroniser::processCurrentTime(QDataStream &stream)
+/*! Starts receiving an object the peer streams in chunks.
+ */
+void SyncManagerSynchroniser::processObjectStream(const ObjectStreamMessage &message)
 {
-    qint64 currentTime;
-    stream >> currentTime;
+    const QString &cloudName = message.cloudName.value;
 
-    qint64 delta = currentTime - QDateTime::currentMSecsSinceEpoch();
-    if (delta < 0)
+    if (mIncomingSpool) {
+        sDebug() << (void*)this << "Object " << mIncomingSpool->id() << " was cut short";
+        takeObjectRequest(mIncomingSpool->cloudName(), mIncomingSpool->id());
+        delete mIncomingSpool;
+        mIncomingSpool = 0;
+    }
+
+    if (message.size > quint64(maxObjectSize())) {
+        sWarning() << "Peer " << mSocket->peerAddress().toString() << " streamed an object of "
+                   << message.size << " bytes, more than objects/maxSize; disconnecting";
+        abortConnection();
+        return;
+    }
+
+    // its chunks are ignored
+    if (!mRequestedObjects.value(cloudName).contains(message.id)) {
+        sDebug() << (void*)this << "Ignoring stream of " << message.id << ", which we didn't ask for";
+        return;
+    }
+
+    mIncomingSpool = new ObjectSpool(cloudName, message.id);
+    if (!mIncomingSpool->open(qint64(message.size))) {
+        takeObjectRequest(cloudName, message.id);
+        delete mIncomingSpool;
+        mIncomingSpool = 0;
+    }
+}
+
+/*! Spools the next piece of the object being streamed to us, and handles
+ * the object like an ObjectReplyCommand once it is complete.
+ */
+void SyncManagerSynchroniser::processObjectChunk(const ObjectChunkMessage &message)
+{
+    if (!mIncomingSpool)
+        return;
+
+    if (message.piece.isEmpty() || !mIncomingSpool->append(message.piece)) {
+        sDebug() << (void*)this << "Giving up on streamed object " << mIncomingSpool->id();
+        takeObjectRequest(mIncomingSpool->cloudName(), mIncomingSpool->id());
+        delete mIncomingSpool;
+        mIncomingSpool = 0;
+        return;
+    }
+
+    if (!mIncomingSpool->isComplete())
+        return;
+
+    ObjectReplyMessage reply;
+    reply.cloudName = mIncomingSpool->cloudName();
+    reply.id = mIncomingSpool->id();
+    const qint64 size = mIncomingSpool->size();
+    const bool valid = mIncomingSpool->read(&reply.object);
+
+    delete mIncomingSpool;
+    mIncomingSpool = 0;
+
+    if (!valid) {
+        sDebug() << (void*)this << "Ignoring malformed streamed object " << reply.id;
+        takeObjectRequest(reply.cloudName.value, reply.id);
+        return;
+    }
+
+    SyncMetrics::process()->objectsStreamedIn.add(1);
+    handle<ObjectReplyMessage, &SyncManagerSynchroniser::processObjectReply>(reply, size);
+}
+
+/*! Forgets that we asked the peer for \a id in \a cloudName, once it is
+ * here or won't come; returns false if we didn't ask for it.
+ */
+bool SyncManagerSynchroniser::takeObjectRequest(const QString &cloudName, const SObjectLocalId &id)
+{
+    QHash<QString, QSet<SObjectLocalId> >::Iterator it = mRequestedObjects.find(cloudName);
+    if (it == mRequestedObjects.end() || !it->remove(id))
+        return false;
+
+    if (it->isEmpty())
+        mRequestedObjects.erase(it);
+
+    mMetrics.objectRequestsOutstanding.add(-1);
+    return true;
+}
+
+void SyncManagerSynchroniser::processHello(const HelloMessage &message)
+{
+    if (!mPeerNodeId.isEmpty()) {
+        sDebug() << (void*)this << "Ignoring repeated hello from " << mPeerNodeId;
+        return;
+    }
+
+    if (message.version != syncProtocolVersion) {
+        sWarning() << "Peer " << mSocket->peerAddress() << " speaks protocol version " << message.version << ", we speak " << syncProtocolVersion;
+        mSocket->disconnectFromHost();
+        return;
+    }
+
+    mPeerNodeId = message.nodeId;
+    mMetrics.setPeerNodeId(mPeerNodeId);
+
+    const QByteArray &localNodeId = SyncAdvertiser::localNodeId();
+    if (mPeerNodeId.isEmpty() || mPeerNodeId == localNodeId) {
+        sDebug() << (void*)this << "Dropping connection to ourselves (or an anonymous peer)";
+        mRetry = false;
+        mSocket->disconnectFromHost();
+        return;
+    }
+
+    // as both sides advertise their presence, we end up with (at least) two
+    // connections to every peer: one outgoing from each side, and possibly
+    // more on multi-homed hosts. we can't deal (in the sense of efficiency)
+    // with multiple connections performing the exact same synchronisation, so
+    // both peers agree to only use connections initiated by the node with the
+    // *LOWER* node id. both sides reach the same decision independently.
+    const QByteArray &initiatorNodeId = isOutgoing() ? localNodeId : mPeerNodeId;
+    if (initiatorNodeId != qMin(localNodeId, mPeerNodeId)) {
+        sDebug() << (void*)this << "Dropping redundant connection with " << mPeerNodeId;
+        mRetry = false;
+        mSocket->disconnectFromHost();
+        return;
+    }
+
+    mHandshakeTimer->stop();
+
+    // only the initiator knows about all of its connections to this peer, so
+    // it decides which one to use; the accepting side waits for CurrentTimeCommand
+    if (isOutgoing()) {
+        mExpectedNodeId = mPeerNodeId;
+        if (SyncTls::isEnabled())
+            SyncTls::storeSession(mSocket, mExpectedNodeId);
+
+        emit handshakeReceived(mPeerNodeId);
+    }
+}
+
+void SyncManagerSynchroniser::processCurrentTime(const CurrentTimeMessage &message)
+{
+    const qint64 currentTime = message.currentTime;
+
+    qint64 delta = currentTime - QDateTime::currentMSecsSinceEpoch();
+    if (delta < 0)
         delta *= -1;
 
     if (delta > 3000) {
@@ -435,289 +1146,710 @@ void SyncManagerSynchroniser::processCurrentTime(QDataStream &stream)
     } else if (delta > 0) {
         sDebug() << (void*)this << "Synchronisation delta with " << mSocket->peerAddress() << " is " << delta;
     }
+
+    // the initiator has chosen this connection, so follow suit
+    if (!isOutgoing() && !mPeerNodeId.isEmpty())
+        beginSync();
 }
 
-void SyncManagerSynchroniser::processFileInfo(QDataStream &stream)
+void SyncManagerSynchroniser::processFileInfo(const FileInfoMessage &message)
 {
-    QString theirFileName;
-    quint64 theirFileSize;
-    QByteArray theirFileHash;
-
-    stream >> theirFileName;
-    stream >> theirFileSize;
-    stream >> theirFileHash;
+    const QString &theirFileName = message.fileName.value;
+    const quint64 theirFileSize = message.fileSize;
+    const QByteArray &theirFileHash = message.fileHash.value;
 
     sDebug() << "Got a file info for: " << theirFileName << "; file is " <<
         theirFileSize << " bytes, hash is " << theirFileHash.toHex();
 
-    // TODO: cache hashes for blocks and files
-    char buf[blockSize + 1]; // + 1 to not overwrite the block
-    *buf = 0;
-    QCryptographicHash fileHash(QCryptographicHash::Sha1);
-    QFile f(theirFileName);
-    f.open(QIODevice::ReadOnly);
+    // the name is used as a local path from here on
+    if (!isReceivable(theirFileName)) {
+        sWarning() << "Ignoring " << theirFileName << " from " << mSocket->peerAddress().toString()
+                   << ", it isn't shared and isn't inside files/receiveRoot";
+        return;
+    }
 
-    while (!f.atEnd()) {
-        qint64 readBlockSize = f.read(buf, blockSize);
+    TransferParameters theirParameters(message.blockSize, QCryptographicHash::Sha1);
+    if (message.hashAlgorithm <= QCryptographicHash::Sha1)
+        theirParameters.algorithm = QCryptographicHash::Algorithm(message.hashAlgorithm);
 
-        if (readBlockSize == -1) {
-            sDebug() << "Error!";
-            break;
-        } else if (readBlockSize < blockSize) {
-            sDebug() << "Didn't read a full block, near EOF?";
-            sDebug() << "Read a block of " << readBlockSize << " bytes";
-        }
+    if (message.hashAlgorithm > QCryptographicHash::Sha1 || message.blockSize > quint64(theirParameters.blockSize) ||
+        !theirParameters.isValid()) {
+        sDebug() << "Ignoring " << theirFileName << ", announced with block size " << message.blockSize
+                 << " and hash algorithm " << message.hashAlgorithm;
+        return;
+    }
 
-        fileHash.addData(buf, readBlockSize);
+    const quint64 blockSize = quint64(theirParameters.blockSize);
+    const quint64 theirBlockCount = theirFileSize / blockSize + (theirFileSize % blockSize ? 1 : 0);
+    if (theirFileSize > maxFileSize() || theirBlockCount > maxFileBlocks()) {
+        sWarning() << "Ignoring " << theirFileName << " from " << mSocket->peerAddress().toString() << ", "
+                   << theirFileSize << " bytes in " << theirBlockCount << " blocks is more than files/maxSize ("
+                   << maxFileSize() << ") or files/maxBlocks (" << maxFileBlocks() << ") allow";
+        return;
     }
 
-    if (theirFileSize != f.size() &&
-        theirFileHash != fileHash.result()) {
+    // TODO: cache hashes for blocks and files
+    QFile f(theirFileName);
+    QByteArray ourFileHash;
+    if (f.open(QIODevice::ReadOnly) && theirFileSize == (quint64)f.size())
+        theirParameters.hashFile(&f, &ourFileHash);
+
+    if (theirFileSize != (quint64)f.size() ||
+        theirFileHash != ourFileHash) {
         sDebug() << "File differs: " << theirFileName;
         sDebug() << "   OUR SIZE: " << f.size() << "; theirs: " << theirFileSize;
-        sDebug() << "   OUR HASH: " << fileHash.result().toHex() << "; theirs: " << theirFileHash;
+        sDebug() << "   OUR HASH: " << ourFileHash.toHex() << "; theirs: " << theirFileHash.toHex();
+
+        if (FileTransfer *existing = mIncomingFiles.value(theirFileName)) {
+            if (!existing->isFinished()) {
+                sDebug() << "Already receiving " << theirFileName;
+                return;
+            }
+
+            dropIncomingFile(theirFileName);
+        }
+
+        // other connections may be offered the same file, in which case we
+        // share the work with them
+        QSharedPointer<FileSwarm> swarm = TransferCoordinator::join(theirFileName, theirFileSize, theirFileHash, theirParameters);
+        if (!swarm)
+            return;
+
+        FileTransfer *transfer = new FileTransfer(swarm);
+        mIncomingFiles.insert(theirFileName, transfer);
+        connect(swarm.data(), SIGNAL(blocksAvailable()), SLOT(onSwarmUpdated()));
+        connect(swarm.data(), SIGNAL(finished()), SLOT(onSwarmUpdated()));
+
+        if (swarm->isComplete()) {
+            // empty file, or everything arrived before an interruption
+            finishIncomingFile(theirFileName);
+            return;
+        }
+
+        if (swarm->hashesComplete()) {
+            // joining late; the other peers have told us all we need
+            requestBlocks(theirFileName, transfer);
+            return;
+        }
 
         {
             // send hash request
-            QByteArray data;
-            QDataStream stream(&data, QIODevice::WriteOnly);
-            stream << QString(theirFileName);
-
-            sendCommand(FileHashRequestCommand, data);
+            FileHashRequestMessage request;
+            request.fileName = theirFileName;
+            writeFrame(encodeMessage(request));
         }
     }
 }
 
-void SyncManagerSynchroniser::processFileHashRequest(QDataStream &stream)
+void SyncManagerSynchroniser::processFileHashRequest(const FileHashRequestMessage &message)
 {
-    QString theirFileName;
-    stream >> theirFileName;
+    const QString &theirFileName = message.fileName.value;
 
     sDebug() << "Recieved a hash request for " << theirFileName;
-    char buf[blockSize + 1]; // + 1 to not overwrite the block
-    *buf = 0;
-    bool error = false;
-    QFile f(theirFileName);
-    quint64 blockId = 0;
-
-    f.open(QIODevice::ReadOnly);
 
-    while (!f.atEnd()) {
-        QCryptographicHash blockHash(QCryptographicHash::Sha1);
-        qint64 readBlockSize = f.read(buf, blockSize);
+    if (!sharedFiles().contains(theirFileName)) {
+        sDebug() << "Ignoring hash request for " << theirFileName << ", not shared";
+        return;
+    }
 
-        if (readBlockSize == -1) {
-            sDebug() << "Error!";
-            error = true;
-            break;
-        } else if (readBlockSize < blockSize) {
-            sDebug() << "Didn't read a full block, near EOF?";
-            sDebug() << "Read a block of " << readBlockSize << " bytes";
-        }
+    const TransferParameters parameters = TransferParameters::local();
+    QByteArray buf(int(parameters.blockSize), Qt::Uninitialized);
+    QFile f(theirFileName);
+    quint64 blockId = 0;
+    qint64 readBlockSize;
 
-        blockHash.addData(buf, readBlockSize);
+    if (!f.open(QIODevice::ReadOnly)) {
+        sDebug() << "Couldn't open " << theirFileName << ": " << f.errorString();
+        return;
+    }
 
-        {
-            // send file overview
-            QByteArray data;
-            QDataStream stream(&data, QIODevice::WriteOnly);
-            stream << theirFileName;
-            stream << blockId;
-            stream << blockHash.result();
-
-            sendCommand(FileHashReplyCommand, data);
-        }
+    while ((readBlockSize = f.read(buf.data(), parameters.blockSize)) > 0) {
+        // send block hash
+        FileHashReplyMessage reply;
+        reply.fileName = theirFileName;
+        reply.blockNumber = blockId;
+        reply.blockHash = parameters.hashBlock(buf.constData(), int(readBlockSize));
+        writeFrame(encodeMessage(reply));
 
         blockId++;
     }
 
+    if (readBlockSize < 0)
+        sDebug() << "Error reading " << theirFileName << ": " << f.errorString();
+
     sDebug() << "Finished reading file";
 }
 
-void SyncManagerSynchroniser::processFileHashReply(QDataStream &stream)
+void SyncManagerSynchroniser::processFileHashReply(const FileHashReplyMessage &message)
 {
-    QString theirFileName;
-    quint64 theirBlockNumber;
-    QByteArray theirBlockHash;
-
-    stream >> theirFileName;
-    stream >> theirBlockNumber;
-    stream >> theirBlockHash;
+    const QString &theirFileName = message.fileName.value;
+    const quint64 theirBlockNumber = message.blockNumber;
+    const QByteArray &theirBlockHash = message.blockHash.value;
 
     sDebug() << "Got a hash reply for " << theirFileName << " block number "
              <<  theirBlockNumber << " with hash " << theirBlockHash.toHex();
 
-    char buf[blockSize + 1]; // + 1 to not overwrite the block
-    *buf = 0;
+    FileTransfer *transfer = mIncomingFiles.value(theirFileName);
+    if (!transfer) {
+        sDebug() << "Ignoring hash reply for " << theirFileName << ", not receiving it";
+        return;
+    }
+
+    FileSwarm *swarm = transfer->swarm();
+    if (!swarm->needsBlock(theirBlockNumber))
+        return; // received before an interruption, or another peer told us about it
+
+    // blocks we already have locally are copied into the new file, so only
+    // the differing ones need to go over the wire
+    const TransferParameters parameters = swarm->parameters();
+    QByteArray buf(int(parameters.blockSize), Qt::Uninitialized);
+    qint64 readBlockSize = -1;
     QFile f(theirFileName);
-    if (!f.open(QIODevice::ReadOnly)) {
+    if (f.open(QIODevice::ReadOnly) && f.seek(parameters.blockSize * theirBlockNumber)) {
+        readBlockSize = f.read(buf.data(), parameters.blockSize);
+    } else {
         // couldn't open file! probably doesn't exist
-        // TODO: proper error checking would be grand
         sDebug() << "Requesting chunk " << theirBlockNumber << "for presumably nonexistent file " << theirFileName;
-        
-        {
-            // send file overview
-            QByteArray data;
-            QDataStream stream(&data, QIODevice::WriteOnly);
-            stream << theirFileName;
-            stream << theirBlockNumber;
-
-            sendCommand(FileBlockRequestCommand, data);
-        }
     }
-    f.seek(blockSize * theirBlockNumber);
 
-    QCryptographicHash blockHash(QCryptographicHash::Sha1);
-    qint64 readBlockSize = f.read(buf, blockSize);
+    bool haveBlock = false;
+    if (readBlockSize > 0) {
+        const QByteArray ourBlockHash = parameters.hashBlock(buf.constData(), int(readBlockSize));
 
-    if (readBlockSize == -1) {
-        sDebug() << "Error!";
-        return;
-    } else if (readBlockSize < blockSize) {
-        sDebug() << "Didn't read a full block, near EOF?";
-        sDebug() << "Read a block of " << readBlockSize << " bytes";
+        if (ourBlockHash == theirBlockHash) {
+            buf.resize(int(readBlockSize));
+            haveBlock = swarm->writeLocalBlock(theirBlockNumber, buf);
+        } else {
+            sDebug() << "Differing block hash for " << theirFileName << " id " << theirBlockNumber;
+            sDebug() << "   THEIRS: " << theirBlockHash.toHex();
+            sDebug() << "   OURS: " << ourBlockHash.toHex();
+        }
     }
 
-    blockHash.addData(buf, readBlockSize);
-
-    if (blockHash.result() != theirBlockHash) {
-        sDebug() << "Differing block hash for " << theirFileName << " id " << theirBlockNumber;
-        sDebug() << "   THEIRS: " << theirBlockHash.toHex();
-        sDebug() << "   OURS: " << blockHash.result().toHex();
-
-        {
-            // send file overview
-            QByteArray data;
-            QDataStream stream(&data, QIODevice::WriteOnly);
-            stream << theirFileName;
-            stream << theirBlockNumber;
+    // the block may still be somewhere else, if files were moved or copied
+    BlockLocation location;
+    if (!haveBlock && BlockIndex::instance()->find(parameters, theirBlockHash, &location)) {
+        if (swarm->copyLocalBlock(theirBlockNumber, theirBlockHash, location.fileName, location.offset)) {
+            sDebug() << "Copied block " << theirBlockNumber << " of " << theirFileName << " from " << location.fileName;
+            haveBlock = true;
 
-            sendCommand(FileBlockRequestCommand, data);
+            ProcessMetrics *metrics = SyncMetrics::process();
+            metrics->blocksReused.add(1);
+            metrics->blockBytesReused.add(qMin<qint64>(parameters.blockSize, swarm->fileSize() - theirBlockNumber * parameters.blockSize));
+        } else {
+            // changed without us noticing, or only its truncated digest matched
+            BlockIndex::instance()->remove(theirBlockHash);
         }
     }
+
+    if (!haveBlock) {
+        swarm->addWanted(theirBlockNumber, theirBlockHash);
+        requestBlocks(theirFileName, transfer);
+    } else if (transfer->isComplete()) {
+        finishIncomingFile(theirFileName);
+    }
 }
 
-void SyncManagerSynchroniser::processFileBlockRequest(QDataStream &stream)
+void SyncManagerSynchroniser::processFileBlockRequest(const FileBlockRequestMessage &message)
 {
-    QString theirFileName;
-    quint64 theirBlockNumber;
-
-    stream >> theirFileName;
-    stream >> theirBlockNumber;
+    const QString &theirFileName = message.fileName.value;
+    const quint64 theirBlockNumber = message.blockNumber;
 
     sDebug() << "Got a block request for " << theirFileName << " block number "
              <<  theirBlockNumber;
 
-    char buf[blockSize + 1]; // + 1 to not overwrite the block
-    *buf = 0;
+    if (!sharedFiles().contains(theirFileName)) {
+        sDebug() << "Ignoring block request for " << theirFileName << ", not shared";
+        return;
+    }
+
+    // bulk data can wait; the peer asks again once the request expires, and
+    // slows down while they do
+    if (sendQueueBytes() > maxQueuedBytes() / 2 || MemoryGovernor::pressure() != MemoryGovernor::Normal) {
+        sDebug() << "Dropping block request for " << theirFileName << " to save memory";
+        SyncMetrics::process()->blockRequestsShed.add(1);
+        return;
+    }
+
+    const TransferParameters parameters = TransferParameters::local();
+    QByteArray buf(int(parameters.blockSize), Qt::Uninitialized);
     QFile f(theirFileName);
     f.open(QIODevice::ReadOnly);
-    f.seek(blockSize * theirBlockNumber);
+    f.seek(parameters.blockSize * theirBlockNumber);
 
-    qint64 readBlockSize = f.read(buf, blockSize);
+    qint64 readBlockSize = f.read(buf.data(), parameters.blockSize);
 
     if (readBlockSize == -1) {
         sDebug() << "Error!";
         return;
-    } else if (readBlockSize < blockSize) {
+    } else if (readBlockSize < parameters.blockSize) {
         sDebug() << "Didn't read a full block, near EOF?";
         sDebug() << "Read a block of " << readBlockSize << " bytes";
     }
 
     {
-        // send file overview
-        QByteArray data;
-        QDataStream stream(&data, QIODevice::WriteOnly);
-        stream << theirFileName;
-        stream << theirBlockNumber;
-        stream << QByteArray(buf, (int)readBlockSize);
+        // send block
+        FileBlockReplyMessage reply;
+        reply.fileName = theirFileName;
+        reply.blockNumber = theirBlockNumber;
+        reply.block = QByteArray::fromRawData(buf.constData(), (int)readBlockSize);
+        writeFrame(encodeMessage(reply));
+    }
+
+    mMetrics.blocksSent.add(1);
+    mMetrics.blockBytesSent.add(readBlockSize);
+}
+
+void SyncManagerSynchroniser::processFileBlockReply(const FileBlockReplyMessage &message)
+{
+    const QString &theirFileName = message.fileName.value;
+    const quint64 theirBlockNumber = message.blockNumber;
+    const QByteArray &theirBlock = message.block;
+
+    sDebug() << "Got a block for " << theirFileName << theirBlockNumber << " of size " << theirBlock.count() << " bytes";
+
+    mMetrics.blocksReceived.add(1);
+    mMetrics.blockBytesReceived.add(theirBlock.size());
+
+    FileTransfer *transfer = mIncomingFiles.value(theirFileName);
+    if (!transfer) {
+        sDebug() << "Ignoring block for " << theirFileName << ", not receiving it";
+        return;
+    }
 
-        sendCommand(FileBlockReplyCommand, data);
+    if (!transfer->blockReceived(theirBlockNumber, theirBlock, mClock.elapsed())) {
+        sWarning() << "Couldn't store block " << theirBlockNumber << " of " << theirFileName << ", abandoning transfer";
+        dropIncomingFile(theirFileName);
+        return;
     }
+
+    if (transfer->isComplete())
+        finishIncomingFile(theirFileName);
+    else
+        requestBlocks(theirFileName, transfer);
 }
 
-void SyncManagerSynchroniser::processFileBlockReply(QDataStream &stream)
+/*! Requests as many of the blocks wanted for \a fileName as its window allows.
+ */
+void SyncManagerSynchroniser::requestBlocks(const QString &fileName, FileTransfer *transfer)
 {
-    QString theirFileName;
-    quint64 theirBlockNumber;
-    QByteArray theirBlock;
+    foreach (quint64 blockNumber, transfer->takeRequests(mClock.elapsed())) {
+        FileBlockRequestMessage request;
+        request.fileName = fileName;
+        request.blockNumber = blockNumber;
+        writeFrame(encodeMessage(request));
+    }
 
-    stream >> theirFileName;
-    stream >> theirBlockNumber;
-    stream >> theirBlock;
+    if (transfer->hasRequestsInFlight() && !mTransferTimer->isActive())
+        mTransferTimer->start();
 
-    sDebug() << "Got a block for " << theirFileName << theirBlockNumber << " of size " << theirBlock.count() << " bytes";
+    updateBlockRequestsOutstanding();
+}
 
-    QFile f(theirFileName);
-    f.open(QIODevice::ReadWrite);
-    f.seek(blockSize * theirBlockNumber);
+void SyncManagerSynchroniser::onTransferTimer()
+{
+    const qint64 now = mClock.elapsed();
+    bool inFlight = false;
+
+    QHash<QString, FileTransfer *>::ConstIterator it = mIncomingFiles.constBegin();
+    for (; it != mIncomingFiles.constEnd(); ++it) {
+        if ((*it)->expireRequests(now))
+            requestBlocks(it.key(), *it);
+
+        inFlight = inFlight || (*it)->hasRequestsInFlight();
+    }
+
+    if (!inFlight)
+        mTransferTimer->stop();
+}
+
+/*! Picks up blocks that became available to fetch through another
+ * connection, and lets go of files another connection has finished.
+ */
+void SyncManagerSynchroniser::onSwarmUpdated()
+{
+    foreach (const QString &fileName, mIncomingFiles.keys()) {
+        FileTransfer *transfer = mIncomingFiles.value(fileName);
+
+        if (transfer->isFinished())
+            dropIncomingFile(fileName);
+        else if (transfer->isComplete())
+            finishIncomingFile(fileName);
+        else
+            requestBlocks(fileName, transfer);
+    }
+}
+
+void SyncManagerSynchroniser::updateBlockRequestsOutstanding()
+{
+    int outstanding = 0;
+    foreach (const FileTransfer *transfer, mIncomingFiles)
+        outstanding += transfer->requestsInFlight();
+
+    mMetrics.blockRequestsOutstanding.set(outstanding);
+}
+
+/*! Commits \a fileName, unless another connection receiving it beat us to it.
+ */
+void SyncManagerSynchroniser::finishIncomingFile(const QString &fileName)
+{
+    FileTransfer *transfer = mIncomingFiles.value(fileName);
+    if (!transfer)
+        return;
+
+    FileSwarm *swarm = transfer->swarm();
+    switch (swarm->commit()) {
+    case FileSwarm::Committed: {
+        ProcessMetrics *metrics = SyncMetrics::process();
+        metrics->filesReceived.add(1);
+
+        // over every connection that helped
+        const quint64 bytesPerSecond = swarm->bytesPerSecond();
+        if (bytesPerSecond)
+            metrics->fileThroughput.record(bytesPerSecond);
+
+        sDebug() << "Received " << fileName << " from " << swarm->sourceCount() << " peers";
+        TransferCoordinator::forget(swarm);
+        BlockIndex::instance()->indexFile(fileName);
+        break;
+    }
+    case FileSwarm::CommitFailed:
+        sWarning() << "Transfer of " << fileName << " failed";
+        TransferCoordinator::forget(swarm);
+        break;
+    case FileSwarm::AlreadyFinished:
+        break;
+    }
+
+    dropIncomingFile(fileName);
+}
+
+/*! Stops taking part in receiving \a fileName.
+ */
+void SyncManagerSynchroniser::dropIncomingFile(const QString &fileName)
+{
+    FileTransfer *transfer = mIncomingFiles.take(fileName);
+    if (!transfer)
+        return;
+
+    disconnect(transfer->swarm(), 0, this, 0);
+    delete transfer;
+    updateBlockRequestsOutstanding();
+}
 
-    f.write(theirBlock);
+// the cloud a command is about, if any
+template <typename Message> static QString cloudNameOf(const Message &) { return QString(); }
+static QString cloudNameOf(const DeleteListMessage &message) { return message.cloudName.value; }
+static QString cloudNameOf(const ObjectListMessage &message) { return message.cloudName.value; }
+static QString cloudNameOf(const ObjectRequestMessage &message) { return message.cloudName.value; }
+static QString cloudNameOf(const ObjectReplyMessage &message) { return message.cloudName.value; }
+
+template <typename Message, void (SyncManagerSynchroniser::*Handler)(const Message &)>
+class SyncManagerSynchroniser::DeferredMessage : public SyncManagerSynchroniser::DeferredCommand
+{
+public:
+    DeferredMessage(MemoryAccount *account, qint64 size, const Message &message)
+        : DeferredCommand(account, size)
+        , mMessage(message)
+    {
+    }
+
+    void run(SyncManagerSynchroniser *synchroniser)
+    {
+        synchroniser->mCommandSize = size();
+        (synchroniser->*Handler)(mMessage);
+    }
+
+private:
+    Message mMessage;
+};
+
+/*! Decodes a \c Message from \a reader and handle()s it.
+ */
+template <typename Message, void (SyncManagerSynchroniser::*Handler)(const Message &)>
+void SyncManagerSynchroniser::dispatch(WireReader &reader)
+{
+    SYNC_TRACE_SPAN("command", commandName(Message::Token));
+
+    Message message;
+    const int size = reader.bytesLeft();
+
+    if (!decodeMessage(reader, mPeerNames, message)) {
+        sDebug() << (void*)this << "Ignoring malformed command " << int(Message::Token);
+        return;
+    }
+
+    handle<Message, Handler>(message, size);
 }
 
+/*! Passes \a message to \c Handler, or holds it back if the cloud it is
+ * about hasn't been loaded yet. \a size is roughly what it takes up.
+ */
+template <typename Message, void (SyncManagerSynchroniser::*Handler)(const Message &)>
+void SyncManagerSynchroniser::handle(const Message &message, qint64 size)
+{
+    const QString cloudName = cloudNameOf(message);
+    if (!cloudName.isEmpty() && waitForCloud(cloudName)) {
+        mDeferredCommands[cloudName].append(new DeferredMessage<Message, Handler>(&mMemory, size, message));
+        SyncManager::instance(cloudName)->metrics()->commandsDeferred.add(1);
+        return;
+    }
+
+    mCommandSize = size;
+    (this->*Handler)(message);
+}
+
+/*! Maps command tokens to their handlers.
+ */
+class CommandTable
+{
+public:
+    CommandTable()
+    {
+        qMemSet(handlers, 0, sizeof(handlers));
+
+        add<DeleteListMessage, &SyncManagerSynchroniser::processDeleteList>();
+        add<ObjectListMessage, &SyncManagerSynchroniser::processObjectList>();
+        add<ObjectRequestMessage, &SyncManagerSynchroniser::processObjectRequest>();
+        add<ObjectReplyMessage, &SyncManagerSynchroniser::processObjectReply>();
+        add<CurrentTimeMessage, &SyncManagerSynchroniser::processCurrentTime>();
+        add<FileInfoMessage, &SyncManagerSynchroniser::processFileInfo>();
+        add<FileHashRequestMessage, &SyncManagerSynchroniser::processFileHashRequest>();
+        add<FileHashReplyMessage, &SyncManagerSynchroniser::processFileHashReply>();
+        add<FileBlockRequestMessage, &SyncManagerSynchroniser::processFileBlockRequest>();
+        add<FileBlockReplyMessage, &SyncManagerSynchroniser::processFileBlockReply>();
+        add<HelloMessage, &SyncManagerSynchroniser::processHello>();
+        add<DeclareNameMessage, &SyncManagerSynchroniser::processDeclareName>();
+        add<FragmentMessage, &SyncManagerSynchroniser::processFragment>();
+        add<ObjectStreamMessage, &SyncManagerSynchroniser::processObjectStream>();
+        add<ObjectChunkMessage, &SyncManagerSynchroniser::processObjectChunk>();
+    }
+
+    SyncManagerSynchroniser::CommandHandler handlers[256];
+
+private:
+    template <typename Message, void (SyncManagerSynchroniser::*Handler)(const Message &)> void add()
+    {
+        handlers[Message::Token] = &SyncManagerSynchroniser::dispatch<Message, Handler>;
+    }
+};
+
+Q_GLOBAL_STATIC(CommandTable, commandTable)
+
 void SyncManagerSynchroniser::processData(const QByteArray &bytes)
 {
-    QDataStream stream(bytes);
+    if (bytes.isEmpty())
+        return;
 
-    quint8 command;
-    stream >> command;
+    const quint8 command = bytes.at(0);
 
-    switch (command) {
-        case CurrentTimeCommand:
-            processCurrentTime(stream);
-            break;
-        case DeleteListCommand:
-            processDeleteList(stream);
-            break;
-        case ObjectListCommand:
-            processObjectList(stream);
-            break;
-        case ObjectRequestCommand:
-            processObjectRequest(stream);
-            break;
-        case ObjectReplyCommand:
-            processObjectReply(stream);
-            break;
-        case FileInfoCommand:
-            processFileInfo(stream);
-            break;
-        case FileHashRequestCommand:
-            processFileHashRequest(stream);
-            break;
-        case FileHashReplyCommand:
-            processFileHashReply(stream);
-            break;
-        case FileBlockRequestCommand:
-            processFileBlockRequest(stream);
-            break;
-        case FileBlockReplyCommand:
-            processFileBlockReply(stream);
-        default:
-            break;
+    if (!mSyncStarted && command != HelloCommand && command != CurrentTimeCommand) {
+        sDebug() << (void*)this << "Ignoring command " << command << " before handshake completed";
+        return;
     }
+
+    CommandHandler handler = commandTable()->handlers[command];
+    if (!handler) {
+        sDebug() << (void*)this << "Ignoring unknown command " << command;
+        return;
+    }
+
+    WireReader reader(bytes, sizeof(quint8));
+    (this->*handler)(reader);
+}
+
+void SyncManagerSynchroniser::processDeclareName(const DeclareNameMessage &message)
+{
+    if (message.handle > 0xffffffff || message.name.isEmpty()) {
+        sDebug() << (void*)this << "Ignoring malformed name declaration";
+        return;
+    }
+
+    if (!mPeerNames.contains(quint32(message.handle)) && mPeerNames.count() >= maxPeerNames()) {
+        sWarning() << "Peer " << mSocket->peerAddress().toString() << " declared more than " << maxPeerNames() << " names";
+        abortConnection();
+        return;
+    }
+
+    mPeerNames.insert(quint32(message.handle), message.name);
+}
+
+void SyncManagerSynchroniser::processFragment(const FragmentMessage &message)
+{
+    if (message.stream >= FrameScheduler::StreamCount) {
+        sDebug() << (void*)this << "Ignoring fragment on unknown stream " << message.stream;
+        return;
+    }
+
+    QByteArray &partialFrame = mPartialFrames[message.stream];
+    if (partialFrame.size() + message.piece.size() > maxFrameSize()) {
+        sWarning() << "Peer " << mSocket->peerAddress().toString() << " sent a fragmented command of over "
+                   << maxFrameSize() << " bytes, more than memory/maxFrameSize; disconnecting";
+        abortConnection();
+        return;
+    }
+
+    partialFrame.append(message.piece);
+
+    if (!message.final)
+        return;
+
+    const QByteArray bytes = partialFrame;
+    partialFrame.clear();
+
+    if (!bytes.isEmpty() && quint8(bytes.at(0)) == FragmentCommand) {
+        sDebug() << (void*)this << "Ignoring fragmented fragment";
+        return;
+    }
+
+    processData(bytes);
 }
 
+/*! Connects to the peer at \a address and \a port, which may be done again
+ * after connectionLost() to reconnect.
+ */
 void SyncManagerSynchroniser::connectToHost(const QHostAddress &address, int port)
 {
+    Q_ASSERT(isOutgoing());
+
     sDebug() << (void*)this << "Connecting to " << address;
+    mConnectionActive = true;
+    mRetry = true;
+    mHandshakeTimer->start();
+
+    if (SyncTls::isEnabled()) {
+        // offers the session from the last connection to the same peer
+        SyncTls::configure(mSocket, mExpectedNodeId);
+        mTlsStarted = mClock.nsecsElapsed();
+        mSocket->connectToHostEncrypted(address.toString(), port);
+        return;
+    }
+
     mSocket->connectToHost(address, port);
 }
 
 void SyncManagerSynchroniser::onError(QAbstractSocket::SocketError error)
 {
     sDebug() << (void*)this << "Had an error: " << error;
+    abortConnection();
+}
 
-    if (error == QAbstractSocket::RemoteHostClosedError && isOutgoing()) {
-        // try reconnect
-        mSocket->connectToHost(mSocket->peerAddress(), mSocket->peerPort());
-    } else {
+void SyncManagerSynchroniser::onDisconnected()
+{
+    sDebug() << (void*)this << "Connection closed";
+
+    if (isOutgoing())
+        connectionClosed();
+    else
         deleteLater();
+}
+
+void SyncManagerSynchroniser::onHandshakeTimeout()
+{
+    sDebug() << (void*)this << "Peer didn't introduce itself in time, giving up";
+    abortConnection();
+}
+
+/*! Introduces us once the connection is encrypted, if the peer's
+ * certificate is one we trust.
+ */
+void SyncManagerSynchroniser::onEncrypted()
+{
+    const qint64 handshakeMicroseconds = (mClock.nsecsElapsed() - mTlsStarted) / 1000;
+    SyncMetrics::process()->tlsHandshakes.add(1);
+    SyncMetrics::process()->tlsHandshakeMicroseconds.record(handshakeMicroseconds);
+
+    const QSslCertificate certificate = mSocket->peerCertificate();
+    if (!SyncTls::isPinned(certificate)) {
+        sWarning() << "Dropping connection from " << mSocket->peerAddress().toString()
+                   << ", its certificate " << SyncTls::fingerprint(certificate).toHex() << " isn't pinned";
+        abortConnection();
+        return;
     }
+
+    sDebug() << (void*)this << "Encrypted in " << handshakeMicroseconds << " us";
+    startSync();
 }
 
-void SyncManagerSynchroniser::onDisconnected()
+/*! Drops the connection at once. An outgoing synchroniser is kept, and
+ * whoever connected it decides whether and when to try again; an incoming
+ * one goes with its connection.
+ */
+void SyncManagerSynchroniser::abortConnection()
 {
-    sDebug() << (void*)this << "Connection closed";
-    deleteLater();
+    mSocket->abort();
+
+    if (isOutgoing())
+        connectionClosed();
+    else
+        deleteLater();
+}
+
+/*! Clears up after an outgoing connection, so the synchroniser can be used
+ * for the next one, and reports it lost (once).
+ */
+void SyncManagerSynchroniser::connectionClosed()
+{
+    if (!mConnectionActive)
+        return;
+
+    mConnectionActive = false;
+    mHandshakeTimer->stop();
+    resetSession();
+
+    emit connectionLost(mRetry);
+}
+
+/*! Forgets everything about the peer's session; the next connection starts
+ * from the handshake.
+ */
+void SyncManagerSynchroniser::resetSession()
+{
+    mBytesExpected = 0;
+    mIncomingFrame.clear();
+    mSyncStarted = false;
+    mPeerNodeId.clear();
+    mMetrics.setPeerNodeId(QByteArray());
+    mDeclaredNames.clear();
+    mPeerNames.clear();
+
+    mScheduler = FrameScheduler();
+    for (int i = 0; i < FrameScheduler::StreamCount; ++i)
+        mPartialFrames[i].clear();
+    mShapingTimer->stop();
+
+    // interrupted transfers are journalled, and resumed on the next FileInfo
+    foreach (const QString &fileName, mIncomingFiles.keys())
+        dropIncomingFile(fileName);
+    mTransferTimer->stop();
+
+    foreach (const QList<DeferredCommand *> &commands, mDeferredCommands)
+        qDeleteAll(commands);
+    mDeferredCommands.clear();
+
+    mMemory.add(MemoryGovernor::ObjectBodies, -qint64(mOutgoingObjects.count() * sizeof(OutgoingObject)));
+    mOutgoingObjects.clear();
+    delete mOutgoingSpool;
+    mOutgoingSpool = 0;
+    delete mIncomingSpool;
+    mIncomingSpool = 0;
+    mLoadingClouds.clear();
+    mUnannouncedClouds.clear();
+
+    // stop following the clouds until the next session begins
+    CloudRegistry *registry = CloudRegistry::instance();
+    disconnect(registry, 0, this, 0);
+    foreach (const QString &cloudName, registry->clouds())
+        disconnect(SyncManager::instance(cloudName), 0, this, 0);
+
+    mReadingThrottled = false;
+    mThrottleTimer->stop();
+
+    mRequestedObjects.clear();
+    mMetrics.objectRequestsOutstanding.set(0);
+    mMetrics.bytesToWrite.set(0);
+    for (int i = 0; i < FrameScheduler::StreamCount; ++i)
+        mMetrics.queuedBytes[i].set(0);
+    updateMemoryAccount();
 }
 
@@ -19,99 +19,318 @@
 
 // Qt
 #include <QObject>
-#include <QTcpSocket>
+#include <QSslSocket>
+#include <QElapsedTimer>
+#include <QQueue>
+#include <QSet>
+#include <QStringList>
 
 // Saesu
 class SCloudStorage;
 #include "sobject.h"
 
+// Us
+#include "bandwidthlimiter.h"
+#include "framescheduler.h"
+#include "memorygovernor.h"
+#include "syncmetrics.h"
+#include "syncprotocol.h"
+
+class FileTransfer;
+class ObjectSpool;
+class QTimer;
+
+struct HelloMessage;
+struct DeclareNameMessage;
+struct CurrentTimeMessage;
+struct DeleteListMessage;
+struct ObjectListMessage;
+struct ObjectRequestMessage;
+struct ObjectReplyMessage;
+struct FileInfoMessage;
+struct FileHashRequestMessage;
+struct FileHashReplyMessage;
+struct FileBlockRequestMessage;
+struct FileBlockReplyMessage;
+struct FragmentMessage;
+struct ObjectStreamMessage;
+struct ObjectChunkMessage;
+
 class SyncManagerSynchroniser : public QObject
 {
     Q_OBJECT
 public:
-    explicit SyncManagerSynchroniser(QObject *parent, QTcpSocket *socket = 0);
+    explicit SyncManagerSynchroniser(int socketDescriptor = -1);
+    virtual ~SyncManagerSynchroniser();
 
     bool isOutgoing() const;
+    QByteArray peerNodeId() const;
+
+    static const char *commandName(int token);
+    static QStringList sharedFiles();
+
+signals:
+    // only emitted for outgoing connections; whoever made the connection
+    // calls beginSync() once it has made sure it is the only one to the peer
+    void handshakeReceived(const QByteArray &peerNodeId);
+
+    // an outgoing connection ended; it may be connected again with
+    // connectToHost(), unless the peer wants to be the one to connect
+    void connectionLost(bool retry);
 
 public slots:
+    void acceptConnection();
     void connectToHost(const QHostAddress &address, int port);
+    void beginSync();
     void processData(const QByteArray &bytes);
     void disconnectFromHost() { mSocket->disconnectFromHost(); }
 
-    // command processing
-    void processCurrentTime(QDataStream &stream);
-    void processDeleteList(QDataStream &stream);
-    void processObjectList(QDataStream &stream);
-    void processObjectRequest(QDataStream &stream);
-    void processObjectReply(QDataStream &stream);
-    void processFileInfo(QDataStream &stream);
-    void processFileHashRequest(QDataStream &stream);
-    void processFileHashReply(QDataStream &stream);
-    void processFileBlockRequest(QDataStream &stream);
-    void processFileBlockReply(QDataStream &stream);
-
 private slots:
     void onReadyRead();
+    void onBytesWritten();
     void onError(QAbstractSocket::SocketError error);
     void onDisconnected();
+    void onHandshakeTimeout();
+    void onEncrypted();
     void startSync();
+    void onCloudAdded(const QString &cloudName);
+    void onCloudRemoved(const QString &cloudName);
+    void onCloudReady(const QString &cloudName);
     void sendDeleteList(const QString &managerName, const QList<SObjectLocalId> &ids);
+    void onObjectsChanged(const QString &cloudName, const QList<SObject> &objects, const QList<SyncFrame> &objectListFrames);
+    void onObjectsDeleted(const QString &cloudName, const QList<SObjectLocalId> &ids, const QList<SyncFrame> &deleteListFrames);
     void sendObjectList(const QString &cloudName, const QList<SObject> &objects);
-    void sendCommand(quint8 token, const QByteArray &data);
+    void writeFrame(const SyncFrame &frame);
+    void writeFrames(const QList<SyncFrame> &frames);
+    void flushFrames();
+    void onTransferTimer();
+    void onSwarmUpdated();
+    void onThrottleTimer();
 
 private:
-    QTcpSocket *mSocket;
+    friend class CommandTable;
+    typedef void (SyncManagerSynchroniser::*CommandHandler)(WireReader &reader);
+
+    template <typename Message, void (SyncManagerSynchroniser::*Handler)(const Message &)>
+    void dispatch(WireReader &reader);
+    template <typename Message, void (SyncManagerSynchroniser::*Handler)(const Message &)>
+    void handle(const Message &message, qint64 size);
+
+    // a decoded command, held back until the cloud it is about is loaded;
+    // the size of its frame is held against the connection's memory account
+    class DeferredCommand
+    {
+    public:
+        DeferredCommand(MemoryAccount *account, qint64 size) : mAccount(account), mSize(size)
+        {
+            mAccount->add(MemoryGovernor::ObjectBodies, mSize);
+        }
+        virtual ~DeferredCommand() { mAccount->add(MemoryGovernor::ObjectBodies, -mSize); }
+        virtual void run(SyncManagerSynchroniser *synchroniser) = 0;
+
+        qint64 size() const { return mSize; }
+
+    private:
+        MemoryAccount *mAccount;
+        qint64 mSize;
+    };
+
+    template <typename Message, void (SyncManagerSynchroniser::*Handler)(const Message &)>
+    class DeferredMessage;
+
+    bool waitForCloud(const QString &cloudName);
+    void announceCloud(const QString &cloudName);
+
+    // command processing
+    void processHello(const HelloMessage &message);
+    void processCurrentTime(const CurrentTimeMessage &message);
+    void processDeleteList(const DeleteListMessage &message);
+    void processObjectList(const ObjectListMessage &message);
+    void processObjectRequest(const ObjectRequestMessage &message);
+    void processObjectReply(const ObjectReplyMessage &message);
+    void processFileInfo(const FileInfoMessage &message);
+    void processFileHashRequest(const FileHashRequestMessage &message);
+    void processFileHashReply(const FileHashReplyMessage &message);
+    void processFileBlockRequest(const FileBlockRequestMessage &message);
+    void processFileBlockReply(const FileBlockReplyMessage &message);
+    void processDeclareName(const DeclareNameMessage &message);
+    void processFragment(const FragmentMessage &message);
+    void processObjectStream(const ObjectStreamMessage &message);
+    void processObjectChunk(const ObjectChunkMessage &message);
+    bool takeObjectRequest(const QString &cloudName, const SObjectLocalId &id);
+
+    void requestBlocks(const QString &fileName, FileTransfer *transfer);
+    void finishIncomingFile(const QString &fileName);
+    void dropIncomingFile(const QString &fileName);
+    void updateBlockRequestsOutstanding();
+    void connectionClosed();
+    void resetSession();
+    void queueFrame(const SyncFrame &frame);
+    void sendObjects();
+    qint64 sendQueueBytes() const;
+    bool isReadingThrottled();
+    void updateMemoryAccount();
+    void abortConnection();
+
+    QSslSocket *mSocket;
+    int mSocketDescriptor;
     quint32 mBytesExpected;
+    QByteArray mIncomingFrame;
+
+    // the size of the frame of the command being handled
+    qint64 mCommandSize;
     bool mIsOutgoing;
+    bool mSyncStarted;
+    QByteArray mPeerNodeId;
+
+    // outgoing connections only: the node id the peer had on the previous
+    // connection, whose TLS session we offer when reconnecting
+    QByteArray mExpectedNodeId;
+
+    // outgoing connections only: whether one is being made or in use, and
+    // whether to try again once it's over. how long the handshake may take
+    // applies to incoming connections too
+    bool mConnectionActive;
+    bool mRetry;
+    QTimer *mHandshakeTimer;
+
+    // when the TLS handshake started, on mClock
+    qint64 mTlsStarted;
+
+    // clouds still being loaded from storage, those of them we are yet to
+    // send our object list for, and the commands about them from the peer
+    QSet<QString> mLoadingClouds;
+    QSet<QString> mUnannouncedClouds;
+    QHash<QString, QList<DeferredCommand *> > mDeferredCommands;
+
+    // interned names we have declared to the peer, and those it declared to us
+    QSet<quint32> mDeclaredNames;
+    QHash<quint32, QString> mPeerNames;
+
+    // frames waiting to be written, and commands the peer is sending us
+    // in fragments, by stream
+    FrameScheduler mScheduler;
+    QByteArray mPartialFrames[FrameScheduler::StreamCount];
 
+    // our share of the bandwidth limits, and the timer that wakes us once
+    // there is bandwidth again for the file transfers waiting on it
+    TokenBucket mPeerBucket;
+    QTimer *mShapingTimer;
+
+    // objects the peer asked for that are too large for one frame, or that
+    // wait for it to read what we sent before, the one being streamed to
+    // the peer, and the one being streamed to us
+    struct OutgoingObject
+    {
+        QString cloudName;
+        SObject object;
+        qint64 size;
+    };
+    QQueue<OutgoingObject> mOutgoingObjects;
+    ObjectSpool *mOutgoingSpool;
+    ObjectSpool *mIncomingSpool;
+
+    // what the spools hold, charged to MemoryGovernor as object bodies:
+    // they may well be on tmpfs, and a received object is read back whole
+    qint64 mSpooledBytes;
+
+    // objects we asked the peer for, by cloud name; it may only send those
+    QHash<QString, QSet<SObjectLocalId> > mRequestedObjects;
+
+    // files being received, by name
+    QHash<QString, FileTransfer *> mIncomingFiles;
+    QTimer *mTransferTimer;
+    QElapsedTimer mClock;
+
+    // whether we have stopped reading from the peer to save memory, the
+    // timer that checks whether we may start again, and when the peer last
+    // took anything we sent it, on mClock
+    bool mReadingThrottled;
+    QTimer *mThrottleTimer;
+    qint64 mLastWriteProgress;
+
+    // what the connection holds on to, for MemoryGovernor
+    MemoryAccount mMemory;
+
+    ConnectionMetrics mMetrics;
+
+public:
     // expected handshake proceedure:
+    // exchange HelloCommand, drop redundant connections by node id
     // exchange auth (TBD)
     // exchange CurrentTimeCommand, abort if excessive delta
     // exchange DeleteListCommand(s), delete objects as appropriate
     // exchange ObjectListCommand(s), interleave with ObjectRequestCommand(s)
-    // reply with ObjectReplyCommand instances
+    // reply with ObjectReplyCommand instances (or stream larger objects)
+    //
+    // every command is framed as a big endian quint32 length (covering the
+    // token and payload), a quint8 token, then the payload. commands are
+    // queued on prioritised streams (see FrameScheduler), and larger ones
+    // are sent in fragments. each command's payload is declared as a struct
+    // in syncmessages.h; fields are encoded as follows (see WireWriter):
+    //   varint: unsigned LEB128
+    //   svarint: zigzag encoded varint
+    //   bytes: varint length, followed by the raw bytes
+    //   string: bytes, in UTF-8
+    //   name: varint handle, declared with DeclareNameCommand first
+    //   digest: 20 raw bytes, zero padded if the hash is shorter
+    //   saesu types: QDataStream operators
 
     enum CommandTokens
     {
         // listing all deleted object ids
-        // QString <cloudName>
-        // quint32 <objectCount>
+        // name: <cloudName>
+        // varint: <objectCount>
         // for objectCount iterations
         //   SObjectLocalId deletedId
         DeleteListCommand = 0x0,
 
         // listing all objects and metadata
-        // QString: <cloudName>
-        // quint32: <objectCount>
+        // the full list is sent when synchronisation starts; after that, only
+        // changed objects are sent, leaving out versions the peer is known to
+        // have already. lists of either kind are split into commands of at
+        // most 1024 entries, so none comes near memory/maxFrameSize
+        //
+        // name: <cloudName>
+        // varint: <objectCount>
         // for count iterations:
-        //  QByteArray: object uuid
-        //  QString: object hash
-        //  quint64: object timestamp
+        //  SObjectLocalId: object uuid
+        //  bytes: object hash
+        //  svarint: object timestamp
+        //  name: node id of the node this version originated from
         ObjectListCommand = 0x1,
 
-        // QString: <cloudName>
-        // QByteArray: object uuid to request
+        // name: <cloudName>
+        // SObjectLocalId: object uuid to request
         ObjectRequestCommand = 0x2,
 
-        // QString: <cloudName>
-        // QByteArray <uuid>
-        // SCloudItem <item>, see libsaesu for exact formatting
+        // name: <cloudName>
+        // SObjectLocalId <uuid>
+        // SObject <item>, see libsaesu for exact formatting
         ObjectReplyCommand = 0x3,
 
         // used to inform the other side as to what the time is from our point of view
         // if the time delta is excessive, synchronisation will be halted
-        // qint64: milliseconds since the epoch
+        // svarint: milliseconds since the epoch
         CurrentTimeCommand = 0x4,
 
         // Gives information about a file to a peer.
         // Peers may then issue FileHashRequestCommand if their version of the
-        // file doesn't match.
+        // file doesn't match. A peer already receiving the same file from
+        // someone else may skip straight to FileBlockRequestCommand, using
+        // the block hashes it got from them.
         //
         // TBD: how to point out exactly where this file is?
         //
-        // QString: <fileName>
-        // quint64: fileSize
-        // QByteArray: hash of the file, in sha-1
+        // The sender picks the block size and hash algorithm used for the
+        // file (see TransferParameters); all further commands about it use
+        // those.
+        //
+        // name: <fileName>
+        // varint: fileSize
+        // digest: hash of the file
+        // varint: block size
+        // varint: hash algorithm, as QCryptographicHash::Algorithm
         FileInfoCommand = 0x5,
 
         // Request the hash information for a given file.
@@ -121,33 +340,38 @@ private:
         //
         // TBD: how to point out exactly where this file is?
         //
-        // QString: <fileName>
+        // name: <fileName>
         FileHashRequestCommand = 0x6,
 
         // Many of these may be sent in response to a single FileHashRequestCommand.
         //
-        // One is sent for each 'block' of a file. A block is 4096 bytes of a
-        // file, and a 'block number' indicates which block is being referred
-        // to, starting at 0. Thus, block 4 would be 4 * 4096 = 16384 bytes into
-        // a file, but is actually the 5th 'block'.
+        // One is sent for each 'block' of a file. A block is as many bytes of
+        // a file as the block size given in FileInfoCommand, and a 'block
+        // number' indicates which block is being referred to, starting at 0.
+        // Thus, with 4096 byte blocks, block 4 would be 4 * 4096 = 16384 bytes
+        // into a file, but is actually the 5th 'block'.
         //
         // If the peer does not have a matching hash for this block, it may
         // request this block using FileBlockRequestCommand.
         //
         // TBD: how to point out exactly where this file is?
         //
-        // QString: <fileName>
-        // quint64: blockNumber
-        // QByteArray: hash of the block number
+        // name: <fileName>
+        // varint: blockNumber
+        // digest: hash of the block number
         FileHashReplyCommand = 0x7,
 
         // Request the given block number.
         // The peer will then reply with a FileBlockReplyCommand for this block.
         //
+        // Receivers keep a window of these outstanding per file, and request
+        // a block again if no reply arrives in time, so replies may arrive
+        // out of order or more than once.
+        //
         // TBD: how to point out exactly where this file is?
         //
-        // QString: <fileName>
-        // quint64: blockNumber
+        // name: <fileName>
+        // varint: blockNumber
         FileBlockRequestCommand = 0x8,
 
         // FileBlockReplyCommand is sent in response to FileBlockRequestCommand.
@@ -155,10 +379,68 @@ private:
         //
         // TBD: how to point out exactly where this file is?
         //
-        // QString: <fileName>
-        // quint64: blockNumber
-        // QByteArray: block
-        FileBlockReplyCommand = 0x10
+        // name: <fileName>
+        // varint: blockNumber
+        // bytes: block
+        FileBlockReplyCommand = 0x10,
+
+        // The first command sent by both sides of every connection, used to
+        // identify the peer before any synchronisation work is done.
+        //
+        // Only connections initiated by the node with the lower node id are
+        // kept; the initiating side additionally drops any further connections
+        // to a peer it is already synchronising with. The accepting side does
+        // not start synchronising until it has seen the initiator's
+        // CurrentTimeCommand. Peers speaking a different protocol version are
+        // disconnected.
+        //
+        // varint: protocol version
+        // bytes: node id of the sender
+        HelloCommand = 0x11,
+
+        // Tells the peer what a name handle stands for. Sent once per handle
+        // and connection, before the first command using it.
+        //
+        // varint: handle
+        // string: name
+        DeclareNameCommand = 0x12,
+
+        // A piece of a larger command, sent in pieces so that it doesn't hold
+        // up smaller ones. The token and payload of the command (without its
+        // length) are split into pieces of up to 16KiB, and sent in order on
+        // one stream. Fragments of different streams may be interleaved, but
+        // each stream only has one command in pieces at a time. The command
+        // is processed when its final piece arrives.
+        //
+        // Streams are 0: control, 1: object metadata, 2: object bodies and
+        // 3: file bulk; see FrameScheduler.
+        //
+        // varint: stream
+        // varint: 1 for the final piece, 0 otherwise
+        // bytes: piece
+        FragmentCommand = 0x13,
+
+        // Sent instead of ObjectReplyCommand for objects larger than
+        // objects/streamThreshold (64KiB by default), so that neither side
+        // has to hold the serialised object in memory. The SObject, as it
+        // would be in ObjectReplyCommand, follows in ObjectChunkCommands on
+        // the same stream; objects are streamed one at a time, though
+        // ObjectReplyCommands may come in between the chunks. Only objects
+        // that were asked for are accepted, whether streamed or not, and
+        // peers streaming one larger than objects/maxSize (256MiB by
+        // default, but no more than half of memory/budget) are disconnected.
+        //
+        // name: <cloudName>
+        // SObjectLocalId <uuid>
+        // varint: size of the serialised SObject
+        ObjectStreamCommand = 0x14,
+
+        // The next piece of the object being streamed; the object is
+        // complete once all of its bytes have arrived. An empty piece means
+        // the sender couldn't go on, and the object won't be sent.
+        //
+        // bytes: piece
+        ObjectChunkCommand = 0x15
     };
 };
 
@@ -0,0 +1,472 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYNCMESSAGES_H
+#define SYNCMESSAGES_H
+
+// Qt
+#include <QHash>
+#include <QList>
+#include <QString>
+
+// Saesu
+#include <sglobal.h>
+#include <sobject.h>
+
+// Us
+#include "syncmanagersynchroniser.h"
+#include "syncprotocol.h"
+
+// Each command is declared once, as a struct listing its fields in wire
+// order in fields(). Encoders, decoders and size estimates are all
+// generated from that list, so a new command only needs a struct, a token
+// and a handler.
+//
+// Field types map to the encodings documented with CommandTokens:
+//   quint64: varint
+//   qint64: svarint
+//   QByteArray: bytes
+//   QString: string
+//   SyncName: name
+//   SyncDigest: digest
+//   SObjectLocalId, SObject: saesu types
+//   QList<T>: varint count, then each element
+//   any other struct: its own fields()
+
+/*! A string sent as an interned handle.
+ */
+struct SyncName
+{
+    SyncName() {}
+    SyncName(const QString &v) : value(v) {}
+
+    QString value;
+};
+
+/*! A digest, sent raw at syncDigestSize bytes; shorter ones come back
+ * padded with zeros, which TransferParameters pads its own to match.
+ *
+ * Only for file and block hashes: object hashes are whatever libsaesu makes
+ * them, so they are sent as bytes, and compared as they are.
+ */
+struct SyncDigest
+{
+    SyncDigest() {}
+    SyncDigest(const QByteArray &v) : value(v) {}
+
+    QByteArray value;
+};
+
+struct HelloMessage
+{
+    enum { Token = SyncManagerSynchroniser::HelloCommand };
+
+    quint64 version;
+    QByteArray nodeId;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.version);
+        v(m.nodeId);
+    }
+};
+
+struct DeclareNameMessage
+{
+    enum { Token = SyncManagerSynchroniser::DeclareNameCommand };
+
+    quint64 handle;
+    QString name;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.handle);
+        v(m.name);
+    }
+};
+
+struct CurrentTimeMessage
+{
+    enum { Token = SyncManagerSynchroniser::CurrentTimeCommand };
+
+    qint64 currentTime;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.currentTime);
+    }
+};
+
+struct DeleteListMessage
+{
+    enum { Token = SyncManagerSynchroniser::DeleteListCommand };
+
+    SyncName cloudName;
+    QList<SObjectLocalId> ids;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.cloudName);
+        v(m.ids);
+    }
+};
+
+struct ObjectListEntry
+{
+    SObjectLocalId id;
+    QByteArray hash;
+    qint64 lastSaved;
+    SyncName originNodeId;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.id);
+        v(m.hash);
+        v(m.lastSaved);
+        v(m.originNodeId);
+    }
+};
+
+struct ObjectListMessage
+{
+    enum { Token = SyncManagerSynchroniser::ObjectListCommand };
+
+    SyncName cloudName;
+    QList<ObjectListEntry> objects;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.cloudName);
+        v(m.objects);
+    }
+};
+
+struct ObjectRequestMessage
+{
+    enum { Token = SyncManagerSynchroniser::ObjectRequestCommand };
+
+    SyncName cloudName;
+    SObjectLocalId id;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.cloudName);
+        v(m.id);
+    }
+};
+
+struct ObjectReplyMessage
+{
+    enum { Token = SyncManagerSynchroniser::ObjectReplyCommand };
+
+    SyncName cloudName;
+    SObjectLocalId id;
+    SObject object;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.cloudName);
+        v(m.id);
+        v(m.object);
+    }
+};
+
+struct FileInfoMessage
+{
+    enum { Token = SyncManagerSynchroniser::FileInfoCommand };
+
+    SyncName fileName;
+    quint64 fileSize;
+    SyncDigest fileHash;
+    quint64 blockSize;
+    quint64 hashAlgorithm;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.fileName);
+        v(m.fileSize);
+        v(m.fileHash);
+        v(m.blockSize);
+        v(m.hashAlgorithm);
+    }
+};
+
+struct FileHashRequestMessage
+{
+    enum { Token = SyncManagerSynchroniser::FileHashRequestCommand };
+
+    SyncName fileName;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.fileName);
+    }
+};
+
+struct FileHashReplyMessage
+{
+    enum { Token = SyncManagerSynchroniser::FileHashReplyCommand };
+
+    SyncName fileName;
+    quint64 blockNumber;
+    SyncDigest blockHash;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.fileName);
+        v(m.blockNumber);
+        v(m.blockHash);
+    }
+};
+
+struct FileBlockRequestMessage
+{
+    enum { Token = SyncManagerSynchroniser::FileBlockRequestCommand };
+
+    SyncName fileName;
+    quint64 blockNumber;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.fileName);
+        v(m.blockNumber);
+    }
+};
+
+struct FileBlockReplyMessage
+{
+    enum { Token = SyncManagerSynchroniser::FileBlockReplyCommand };
+
+    SyncName fileName;
+    quint64 blockNumber;
+    QByteArray block;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.fileName);
+        v(m.blockNumber);
+        v(m.block);
+    }
+};
+
+struct FragmentMessage
+{
+    enum { Token = SyncManagerSynchroniser::FragmentCommand };
+
+    quint64 stream;
+    quint64 final;
+    QByteArray piece;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.stream);
+        v(m.final);
+        v(m.piece);
+    }
+};
+
+struct ObjectStreamMessage
+{
+    enum { Token = SyncManagerSynchroniser::ObjectStreamCommand };
+
+    SyncName cloudName;
+    SObjectLocalId id;
+    quint64 size;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.cloudName);
+        v(m.id);
+        v(m.size);
+    }
+};
+
+struct ObjectChunkMessage
+{
+    enum { Token = SyncManagerSynchroniser::ObjectChunkCommand };
+
+    QByteArray piece;
+
+    template <typename V, typename M> static void fields(V &v, M &m)
+    {
+        v(m.piece);
+    }
+};
+
+/*! Estimates the encoded size of a message, so its frame can be allocated
+ * up front. Exact for everything but strings and saesu types.
+ */
+class MessageSizer
+{
+public:
+    MessageSizer() : mSize(0) {}
+
+    int size() const { return mSize; }
+
+    void operator()(quint64 value) { mSize += WireWriter::varintSize(value); }
+    void operator()(qint64 value) { mSize += WireWriter::varintSize((quint64(value) << 1) ^ quint64(value >> 63)); }
+    void operator()(const QByteArray &bytes) { mSize += WireWriter::varintSize(bytes.size()) + bytes.size(); }
+    void operator()(const QString &string) { mSize += WireWriter::varintSize(string.size() * 3) + string.size() * 3; }
+    void operator()(const SyncName &) { mSize += WireWriter::varintSize(0xffffffff); }
+    void operator()(const SyncDigest &) { mSize += syncDigestSize; }
+    void operator()(const SObjectLocalId &) { mSize += streamedSizeHint; }
+    void operator()(const SObject &) { mSize += streamedSizeHint; }
+
+    template <typename T> void operator()(const QList<T> &list)
+    {
+        mSize += WireWriter::varintSize(list.count());
+        foreach (const T &item, list)
+            (*this)(item);
+    }
+
+    template <typename T> void operator()(const T &record)
+    {
+        T::fields(*this, record);
+    }
+
+private:
+    enum { streamedSizeHint = 32 };
+
+    int mSize;
+};
+
+/*! Writes the fields of a message to a WireWriter.
+ */
+class MessageEncoder
+{
+public:
+    explicit MessageEncoder(WireWriter &writer) : mWriter(writer) {}
+
+    void operator()(quint64 value) { mWriter.writeVarint(value); }
+    void operator()(qint64 value) { mWriter.writeSignedVarint(value); }
+    void operator()(const QByteArray &bytes) { mWriter.writeBytes(bytes); }
+    void operator()(const QString &string) { mWriter.writeString(string); }
+    void operator()(const SyncName &name) { mWriter.writeName(name.value); }
+    void operator()(const SyncDigest &digest) { mWriter.writeDigest(digest.value); }
+    void operator()(const SObjectLocalId &id) { mWriter.writeStreamed(id); }
+    void operator()(const SObject &object) { mWriter.writeStreamed(object); }
+
+    template <typename T> void operator()(const QList<T> &list)
+    {
+        mWriter.writeVarint(list.count());
+        foreach (const T &item, list)
+            (*this)(item);
+    }
+
+    template <typename T> void operator()(const T &record)
+    {
+        T::fields(*this, record);
+    }
+
+private:
+    WireWriter &mWriter;
+};
+
+/*! Reads the fields of a message from a WireReader, resolving names against
+ * those the peer declared.
+ */
+class MessageDecoder
+{
+public:
+    MessageDecoder(WireReader &reader, const QHash<quint32, QString> &names)
+        : mReader(reader)
+        , mNames(names)
+    {}
+
+    void operator()(quint64 &value) { value = mReader.readVarint(); }
+    void operator()(qint64 &value) { value = mReader.readSignedVarint(); }
+    void operator()(QByteArray &bytes) { bytes = mReader.readBytes(); }
+    void operator()(QString &string) { string = mReader.readString(); }
+    void operator()(SObjectLocalId &id) { mReader.readStreamed(id); }
+    void operator()(SObject &object) { mReader.readStreamed(object); }
+    void operator()(SyncDigest &digest) { digest.value = mReader.readDigest(); }
+
+    void operator()(SyncName &name)
+    {
+        const quint32 handle = mReader.readName();
+        if (!mReader.isValid())
+            return;
+
+        QHash<quint32, QString>::ConstIterator it = mNames.constFind(handle);
+        if (it == mNames.constEnd()) {
+            // the peer never told us what this is
+            mReader.invalidate();
+            return;
+        }
+
+        name.value = *it;
+    }
+
+    template <typename T> void operator()(QList<T> &list)
+    {
+        const quint64 count = mReader.readVarint();
+
+        // every element takes at least a byte, so don't trust larger counts
+        if (count > quint64(mReader.bytesLeft())) {
+            mReader.invalidate();
+            return;
+        }
+
+        list.reserve(int(count));
+        for (quint64 i = 0; i < count && mReader.isValid(); ++i) {
+            list.append(T());
+            (*this)(list.last());
+        }
+    }
+
+    template <typename T> void operator()(T &record)
+    {
+        T::fields(*this, record);
+    }
+
+private:
+    WireReader &mReader;
+    const QHash<quint32, QString> &mNames;
+};
+
+/*! Returns the frame for \a message, or an empty frame if a field couldn't
+ * be encoded; writing an empty frame sends nothing.
+ */
+template <typename Message> SyncFrame encodeMessage(const Message &message)
+{
+    MessageSizer sizer;
+    Message::fields(sizer, message);
+
+    WireWriter writer(Message::Token, sizer.size());
+    MessageEncoder encoder(writer);
+    Message::fields(encoder, message);
+
+    if (!writer.isValid()) {
+        sWarning() << "Couldn't encode command " << int(Message::Token);
+        return SyncFrame();
+    }
+
+    return writer.finish();
+}
+
+/*! Reads \a message from \a reader, which must hold exactly one message.
+ *
+ * Returns false if the payload was malformed or used undeclared names.
+ */
+template <typename Message> bool decodeMessage(WireReader &reader, const QHash<quint32, QString> &names, Message &message)
+{
+    MessageDecoder decoder(reader, names);
+    Message::fields(decoder, message);
+
+    return reader.isValid() && reader.atEnd();
+}
+
+#endif // SYNCMESSAGES_H
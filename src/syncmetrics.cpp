@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QDateTime>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QVariantList>
+
+// Us
+#include "memorygovernor.h"
+#include "syncmanagersynchroniser.h"
+#include "syncmetrics.h"
+
+static int bucketOf(quint64 value)
+{
+    return value ? 64 - __builtin_clzll(value) : 0;
+}
+
+// the largest value counted in bucket
+static quint64 bucketLimit(int bucket)
+{
+    return bucket >= 64 ? Q_UINT64_C(0xffffffffffffffff) : (Q_UINT64_C(1) << bucket) - 1;
+}
+
+void MetricHistogram::record(quint64 value)
+{
+    mBuckets[bucketOf(value)].add(1);
+    mSum.add(value);
+    mCount.add(1);
+}
+
+/*! Returns the count, sum, upper bounds of some percentiles and the buckets
+ * up to the largest one used.
+ */
+QVariantMap MetricHistogram::toMap() const
+{
+    quint64 buckets[BucketCount];
+    quint64 count = 0;
+    int used = 0;
+
+    // buckets may change as we read them, so count what we actually saw
+    for (int i = 0; i < BucketCount; ++i) {
+        buckets[i] = mBuckets[i].value();
+        count += buckets[i];
+        if (buckets[i])
+            used = i + 1;
+    }
+
+    QVariantMap map;
+    map.insert(QLatin1String("count"), count);
+    map.insert(QLatin1String("sum"), mSum.value());
+
+    static const int percentiles[] = { 50, 90, 99 };
+    for (unsigned p = 0; p < sizeof(percentiles) / sizeof(*percentiles); ++p) {
+        const quint64 rank = (count * percentiles[p] + 99) / 100;
+        quint64 seen = 0;
+        int bucket = 0;
+
+        while (bucket < used - 1 && seen + buckets[bucket] < rank)
+            seen += buckets[bucket++];
+
+        map.insert(QString::fromLatin1("p%1").arg(percentiles[p]), count ? bucketLimit(bucket) : 0);
+    }
+
+    map.insert(QLatin1String("max"), used ? bucketLimit(used - 1) : 0);
+
+    QVariantList bucketList;
+    for (int i = 0; i < used; ++i)
+        bucketList.append(buckets[i]);
+    map.insert(QLatin1String("buckets"), bucketList);
+
+    return map;
+}
+
+void TrafficMetrics::record(quint8 token, quint64 bytes)
+{
+    const int slot = qMin<int>(token, TokenCount - 1);
+    mFrames[slot].add(1);
+    mBytes[slot].add(bytes);
+}
+
+quint64 TrafficMetrics::frames() const
+{
+    quint64 total = 0;
+    for (int i = 0; i < TokenCount; ++i)
+        total += mFrames[i].value();
+    return total;
+}
+
+quint64 TrafficMetrics::bytes() const
+{
+    quint64 total = 0;
+    for (int i = 0; i < TokenCount; ++i)
+        total += mBytes[i].value();
+    return total;
+}
+
+/*! Returns frames and bytes for each command seen, by name.
+ */
+QVariantMap TrafficMetrics::toMap() const
+{
+    QVariantMap map;
+
+    for (int i = 0; i < TokenCount; ++i) {
+        const quint64 frames = mFrames[i].value();
+        if (!frames)
+            continue;
+
+        QVariantMap command;
+        command.insert(QLatin1String("frames"), frames);
+        command.insert(QLatin1String("bytes"), mBytes[i].value());
+        const char *name = SyncManagerSynchroniser::commandName(i);
+        map.insert(QLatin1String(name ? name : "Other"), command);
+    }
+
+    return map;
+}
+
+struct MetricsRegistry
+{
+    // protects connections and the peer node ids in them, and clouds
+    QMutex lock;
+    QList<ConnectionMetrics *> connections;
+    QHash<QString, CloudMetrics *> clouds;
+    ProcessMetrics process;
+};
+
+Q_GLOBAL_STATIC(MetricsRegistry, metricsRegistry)
+
+ConnectionMetrics::ConnectionMetrics(bool outgoing)
+    : mOutgoing(outgoing)
+{
+    SyncMetrics::addConnection(this);
+}
+
+ConnectionMetrics::~ConnectionMetrics()
+{
+    SyncMetrics::removeConnection(this);
+}
+
+void ConnectionMetrics::setPeerNodeId(const QByteArray &peerNodeId)
+{
+    QMutexLocker locker(&metricsRegistry()->lock);
+    mPeerNodeId = peerNodeId;
+}
+
+ProcessMetrics *SyncMetrics::process()
+{
+    return &metricsRegistry()->process;
+}
+
+/*! Returns the metrics of \a cloudName, which remain valid for the rest of
+ * the process' life; look them up once and keep them.
+ */
+CloudMetrics *SyncMetrics::cloud(const QString &cloudName)
+{
+    MetricsRegistry *registry = metricsRegistry();
+    QMutexLocker locker(&registry->lock);
+
+    CloudMetrics *&metrics = registry->clouds[cloudName];
+    if (!metrics)
+        metrics = new CloudMetrics;
+
+    return metrics;
+}
+
+void SyncMetrics::addConnection(ConnectionMetrics *connection)
+{
+    MetricsRegistry *registry = metricsRegistry();
+    QMutexLocker locker(&registry->lock);
+    registry->connections.append(connection);
+}
+
+void SyncMetrics::removeConnection(ConnectionMetrics *connection)
+{
+    MetricsRegistry *registry = metricsRegistry();
+    QMutexLocker locker(&registry->lock);
+    registry->connections.removeAll(connection);
+}
+
+/*! Returns the current value of every metric, as maps that can be sent
+ * over IPC as they are.
+ */
+QVariantMap SyncMetrics::snapshot()
+{
+    MetricsRegistry *registry = metricsRegistry();
+    const ProcessMetrics &process = registry->process;
+
+    QVariantMap processMap;
+    processMap.insert(QLatin1String("sent"), process.sent.toMap());
+    processMap.insert(QLatin1String("received"), process.received.toMap());
+    processMap.insert(QLatin1String("bytesHashed"), process.bytesHashed.value());
+    processMap.insert(QLatin1String("hashingNanoseconds"), process.hashingNanoseconds.value());
+    processMap.insert(QLatin1String("blockHashNanoseconds"), process.blockHashNanoseconds.toMap());
+    processMap.insert(QLatin1String("filesReceived"), process.filesReceived.value());
+    processMap.insert(QLatin1String("fileThroughput"), process.fileThroughput.toMap());
+    processMap.insert(QLatin1String("blocksReused"), process.blocksReused.value());
+    processMap.insert(QLatin1String("blockBytesReused"), process.blockBytesReused.value());
+    processMap.insert(QLatin1String("objectsStreamedOut"), process.objectsStreamedOut.value());
+    processMap.insert(QLatin1String("objectsStreamedIn"), process.objectsStreamedIn.value());
+    processMap.insert(QLatin1String("tlsHandshakes"), process.tlsHandshakes.value());
+    processMap.insert(QLatin1String("tlsHandshakeMicroseconds"), process.tlsHandshakeMicroseconds.toMap());
+    processMap.insert(QLatin1String("readsThrottled"), process.readsThrottled.value());
+    processMap.insert(QLatin1String("connectionsStalled"), process.connectionsStalled.value());
+    processMap.insert(QLatin1String("blockRequestsShed"), process.blockRequestsShed.value());
+    processMap.insert(QLatin1String("connectionsRefused"), process.connectionsRefused.value());
+
+    QVariantList connectionList;
+    QVariantMap cloudMap;
+
+    {
+        QMutexLocker locker(&registry->lock);
+
+        foreach (const ConnectionMetrics *connection, registry->connections) {
+            QVariantMap map;
+            map.insert(QLatin1String("peerNodeId"), connection->mPeerNodeId);
+            map.insert(QLatin1String("outgoing"), connection->mOutgoing);
+            map.insert(QLatin1String("sent"), connection->sent.toMap());
+            map.insert(QLatin1String("received"), connection->received.toMap());
+            map.insert(QLatin1String("bytesToWrite"), connection->bytesToWrite.value());
+            map.insert(QLatin1String("bytesUnread"), connection->bytesUnread.value());
+
+            QVariantMap queuedBytes;
+            for (int i = 0; i < FrameScheduler::StreamCount; ++i)
+                queuedBytes.insert(QLatin1String(FrameScheduler::streamName(i)), connection->queuedBytes[i].value());
+            map.insert(QLatin1String("queuedBytes"), queuedBytes);
+            map.insert(QLatin1String("objectRequestsOutstanding"), connection->objectRequestsOutstanding.value());
+            map.insert(QLatin1String("blockRequestsOutstanding"), connection->blockRequestsOutstanding.value());
+            map.insert(QLatin1String("blocksSent"), connection->blocksSent.value());
+            map.insert(QLatin1String("blockBytesSent"), connection->blockBytesSent.value());
+            map.insert(QLatin1String("blocksReceived"), connection->blocksReceived.value());
+            map.insert(QLatin1String("blockBytesReceived"), connection->blockBytesReceived.value());
+            connectionList.append(map);
+        }
+
+        QHash<QString, CloudMetrics *>::ConstIterator it = registry->clouds.constBegin();
+        for (; it != registry->clouds.constEnd(); ++it) {
+            const CloudMetrics *cloud = *it;
+
+            QVariantMap map;
+            map.insert(QLatin1String("objectsRequested"), cloud->objectsRequested.value());
+            map.insert(QLatin1String("objectsReceived"), cloud->objectsReceived.value());
+            map.insert(QLatin1String("objectsSent"), cloud->objectsSent.value());
+            map.insert(QLatin1String("objectsRemoved"), cloud->objectsRemoved.value());
+            map.insert(QLatin1String("objectsSaved"), cloud->objectsSaved.value());
+            map.insert(QLatin1String("saveBatchSize"), cloud->saveBatchSize.toMap());
+            map.insert(QLatin1String("changesNotified"), cloud->changesNotified.value());
+            map.insert(QLatin1String("changeBatchSize"), cloud->changeBatchSize.toMap());
+            map.insert(QLatin1String("loadMilliseconds"), cloud->loadMilliseconds.value());
+            map.insert(QLatin1String("commandsDeferred"), cloud->commandsDeferred.value());
+            cloudMap.insert(it.key(), map);
+        }
+    }
+
+    QVariantMap map;
+    map.insert(QLatin1String("time"), QDateTime::currentMSecsSinceEpoch());
+    map.insert(QLatin1String("process"), processMap);
+    map.insert(QLatin1String("connections"), connectionList);
+    map.insert(QLatin1String("clouds"), cloudMap);
+    map.insert(QLatin1String("memory"), MemoryGovernor::toMap());
+    return map;
+}
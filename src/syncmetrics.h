@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYNCMETRICS_H
+#define SYNCMETRICS_H
+
+// Qt
+#include <QByteArray>
+#include <QString>
+#include <QVariantMap>
+
+// Us
+#include "framescheduler.h"
+
+/*! A count that any thread may add to without taking a lock.
+ */
+class MetricCounter
+{
+public:
+    MetricCounter() : mValue(0) {}
+
+    void add(quint64 amount) { __sync_fetch_and_add(&mValue, amount); }
+    quint64 value() const { return __sync_fetch_and_add(const_cast<quint64 *>(&mValue), 0); }
+
+private:
+    Q_DISABLE_COPY(MetricCounter)
+    quint64 mValue;
+};
+
+/*! A level (e.g. a queue depth) that any thread may change without taking a lock.
+ */
+class MetricGauge
+{
+public:
+    MetricGauge() : mValue(0) {}
+
+    void set(qint64 value) { __sync_lock_test_and_set(&mValue, value); }
+    void add(qint64 amount) { __sync_fetch_and_add(&mValue, amount); }
+    qint64 value() const { return __sync_fetch_and_add(const_cast<qint64 *>(&mValue), 0); }
+
+private:
+    Q_DISABLE_COPY(MetricGauge)
+    qint64 mValue;
+};
+
+/*! Counts values in power of two buckets, without taking a lock.
+ *
+ * Bucket 0 holds zeroes, and bucket n values of n bits, so percentiles are
+ * only accurate to within a factor of two; that is enough to see where time
+ * goes, and recording stays a handful of instructions.
+ */
+class MetricHistogram
+{
+public:
+    enum { BucketCount = 65 };
+
+    MetricHistogram() {}
+
+    void record(quint64 value);
+    QVariantMap toMap() const;
+
+private:
+    Q_DISABLE_COPY(MetricHistogram)
+
+    MetricCounter mCount;
+    MetricCounter mSum;
+    MetricCounter mBuckets[BucketCount];
+};
+
+/*! Frames and bytes, including frame headers, by command token.
+ */
+class TrafficMetrics
+{
+public:
+    // tokens past the last known command are counted together
+    enum { TokenCount = 0x17 };
+
+    TrafficMetrics() {}
+
+    void record(quint8 token, quint64 bytes);
+    quint64 frames() const;
+    quint64 bytes() const;
+    QVariantMap toMap() const;
+
+private:
+    Q_DISABLE_COPY(TrafficMetrics)
+
+    MetricCounter mFrames[TokenCount];
+    MetricCounter mBytes[TokenCount];
+};
+
+/*! What one connection is doing. Recorded by its synchroniser, on its
+ * worker thread; exists for as long as the synchroniser does.
+ */
+class ConnectionMetrics
+{
+public:
+    explicit ConnectionMetrics(bool outgoing);
+    ~ConnectionMetrics();
+
+    void setPeerNodeId(const QByteArray &peerNodeId);
+
+    TrafficMetrics sent;
+    TrafficMetrics received;
+
+    // bytes written to the socket but not yet sent, and received but not
+    // yet processed
+    MetricGauge bytesToWrite;
+    MetricGauge bytesUnread;
+
+    // bytes waiting in each of the scheduler's streams
+    MetricGauge queuedBytes[FrameScheduler::StreamCount];
+
+    MetricGauge objectRequestsOutstanding;
+    MetricGauge blockRequestsOutstanding;
+
+    MetricCounter blocksSent;
+    MetricCounter blockBytesSent;
+    MetricCounter blocksReceived;
+    MetricCounter blockBytesReceived;
+
+private:
+    Q_DISABLE_COPY(ConnectionMetrics)
+    friend class SyncMetrics;
+
+    const bool mOutgoing;
+    QByteArray mPeerNodeId;
+};
+
+/*! What is happening to one cloud, over all connections.
+ */
+class CloudMetrics
+{
+public:
+    CloudMetrics() {}
+
+    MetricCounter objectsRequested;
+    MetricCounter objectsReceived;
+    MetricCounter objectsSent;
+    MetricCounter objectsRemoved;
+    MetricCounter objectsSaved;
+    MetricHistogram saveBatchSize;
+
+    // ids storage told us had changed, and how many were fetched at once
+    MetricCounter changesNotified;
+    MetricHistogram changeBatchSize;
+
+    // how long loading the cloud from storage took, and how many commands
+    // from peers had to wait for it
+    MetricGauge loadMilliseconds;
+    MetricCounter commandsDeferred;
+
+private:
+    Q_DISABLE_COPY(CloudMetrics)
+};
+
+/*! Totals over everything this process does.
+ */
+class ProcessMetrics
+{
+public:
+    ProcessMetrics() {}
+
+    TrafficMetrics sent;
+    TrafficMetrics received;
+
+    // CPU time spent hashing files for transfer, and how long each block took
+    MetricCounter bytesHashed;
+    MetricCounter hashingNanoseconds;
+    MetricHistogram blockHashNanoseconds;
+
+    // bytes per second of each file received, from its first block request
+    MetricCounter filesReceived;
+    MetricHistogram fileThroughput;
+
+    // blocks of incoming files found in other local files, not transferred
+    MetricCounter blocksReused;
+    MetricCounter blockBytesReused;
+
+    // objects sent in chunks through a spool file, and received that way
+    MetricCounter objectsStreamedOut;
+    MetricCounter objectsStreamedIn;
+
+    // TLS handshakes completed, and how long each took
+    MetricCounter tlsHandshakes;
+    MetricHistogram tlsHandshakeMicroseconds;
+
+    // what was held back or given up to stay within the memory budget:
+    // times a connection stopped reading, peers dropped for not reading
+    // what we sent them, block requests dropped and connections refused
+    MetricCounter readsThrottled;
+    MetricCounter connectionsStalled;
+    MetricCounter blockRequestsShed;
+    MetricCounter connectionsRefused;
+
+private:
+    Q_DISABLE_COPY(ProcessMetrics)
+};
+
+/*! Runtime metrics of syncd, for the whole process, each cloud and each
+ * connection.
+ *
+ * Recording never locks, so it is cheap enough to leave on; only creating
+ * and removing connections and clouds, and taking a snapshot(), do.
+ */
+class SyncMetrics
+{
+public:
+    static ProcessMetrics *process();
+    static CloudMetrics *cloud(const QString &cloudName);
+
+    static QVariantMap snapshot();
+
+private:
+    friend class ConnectionMetrics;
+
+    static void addConnection(ConnectionMetrics *connection);
+    static void removeConnection(ConnectionMetrics *connection);
+};
+
+#endif // SYNCMETRICS_H
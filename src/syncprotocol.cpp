@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QHash>
+#include <QReadWriteLock>
+#include <QtEndian>
+
+// Posix
+#include <string.h>
+
+// Us
+#include "syncprotocol.h"
+
+// names interned before the table is emptied and starts over
+static const int maxInternedNames = 64 * 1024;
+
+struct NameTableData
+{
+    NameTableData() : nextHandle(0) {}
+
+    QReadWriteLock lock;
+    QHash<QString, quint32> handles;
+    quint32 nextHandle;
+};
+
+Q_GLOBAL_STATIC(NameTableData, nameTable)
+
+quint32 SyncNameTable::intern(const QString &name)
+{
+    NameTableData *table = nameTable();
+
+    {
+        QReadLocker locker(&table->lock);
+        QHash<QString, quint32>::ConstIterator it = table->handles.constFind(name);
+        if (it != table->handles.constEnd())
+            return *it;
+    }
+
+    QWriteLocker locker(&table->lock);
+    QHash<QString, quint32>::ConstIterator it = table->handles.constFind(name);
+    if (it != table->handles.constEnd())
+        return *it;
+
+    if (table->handles.count() >= maxInternedNames)
+        table->handles.clear();
+
+    const quint32 handle = table->nextHandle++;
+    table->handles.insert(name, handle);
+    return handle;
+}
+
+static const int headerSize = sizeof(quint32) + sizeof(quint8);
+
+WireWriter::WireWriter(quint8 token, int sizeHint)
+    : mValid(true)
+    , mBuffer(0)
+    , mStream(0)
+{
+    mFrame.bytes.reserve(headerSize + sizeHint);
+
+    // length is filled in by finish()
+    const char header[headerSize] = { 0, 0, 0, 0, (char)token };
+    mFrame.bytes.append(header, headerSize);
+}
+
+WireWriter::~WireWriter()
+{
+    delete mStream;
+    delete mBuffer;
+}
+
+QDataStream &WireWriter::stream()
+{
+    if (!mStream) {
+        mBuffer = new QBuffer(&mFrame.bytes);
+        mBuffer->open(QIODevice::WriteOnly | QIODevice::Append);
+        mStream = new QDataStream(mBuffer);
+    }
+
+    return *mStream;
+}
+
+/*! Returns how many bytes writeVarint() takes for \a value.
+ */
+int WireWriter::varintSize(quint64 value)
+{
+    int length = 1;
+
+    while (value >= 0x80) {
+        value >>= 7;
+        ++length;
+    }
+
+    return length;
+}
+
+void WireWriter::writeVarint(quint64 value)
+{
+    char buf[10];
+    int length = 0;
+
+    while (value >= 0x80) {
+        buf[length++] = char((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    buf[length++] = char(value);
+
+    mFrame.bytes.append(buf, length);
+}
+
+void WireWriter::writeSignedVarint(qint64 value)
+{
+    writeVarint((quint64(value) << 1) ^ quint64(value >> 63));
+}
+
+void WireWriter::writeBytes(const QByteArray &bytes)
+{
+    writeVarint(bytes.size());
+    mFrame.bytes.append(bytes);
+}
+
+void WireWriter::writeString(const QString &string)
+{
+    writeBytes(string.toUtf8());
+}
+
+void WireWriter::writeName(const QString &name)
+{
+    const quint32 handle = SyncNameTable::intern(name);
+    mFrame.names.insert(handle, name);
+
+    writeVarint(handle);
+}
+
+/*! Writes \a digest as syncDigestSize bytes, padding it with zeros if it is
+ * shorter (MD4 and MD5 digests are).
+ *
+ * Returns false, and marks the writer invalid, if it is longer.
+ */
+bool WireWriter::writeDigest(const QByteArray &digest)
+{
+    if (digest.size() > syncDigestSize) {
+        mValid = false;
+        return false;
+    }
+
+    mFrame.bytes.append(digest);
+    if (digest.size() < syncDigestSize)
+        mFrame.bytes.append(QByteArray(syncDigestSize - digest.size(), 0));
+    return true;
+}
+
+bool WireWriter::isValid() const
+{
+    return mValid;
+}
+
+/*! Completes the frame. The writer must not be used afterwards.
+ */
+SyncFrame WireWriter::finish()
+{
+    delete mStream;
+    mStream = 0;
+    delete mBuffer;
+    mBuffer = 0;
+
+    const quint32 length = qToBigEndian<quint32>(mFrame.bytes.size() - sizeof(quint32));
+    memcpy(mFrame.bytes.data(), &length, sizeof(quint32));
+
+    return mFrame;
+}
+
+WireReader::WireReader(const QByteArray &data, int offset)
+    : mData(data)
+    , mPos(offset)
+    , mValid(offset <= data.size())
+    , mBuffer(0)
+    , mStream(0)
+{
+}
+
+WireReader::~WireReader()
+{
+    delete mStream;
+    delete mBuffer;
+}
+
+QDataStream &WireReader::stream()
+{
+    if (!mStream) {
+        mBuffer = new QBuffer(&mData);
+        mBuffer->open(QIODevice::ReadOnly);
+        mStream = new QDataStream(mBuffer);
+    }
+
+    return *mStream;
+}
+
+bool WireReader::isValid() const
+{
+    return mValid;
+}
+
+bool WireReader::atEnd() const
+{
+    return mPos >= mData.size();
+}
+
+int WireReader::bytesLeft() const
+{
+    return mData.size() - mPos;
+}
+
+void WireReader::invalidate()
+{
+    mValid = false;
+}
+
+quint64 WireReader::readVarint()
+{
+    quint64 value = 0;
+
+    for (int shift = 0; mValid && shift < 64; shift += 7) {
+        if (mPos >= mData.size())
+            break;
+
+        const quint8 byte = mData.at(mPos++);
+
+        // the tenth byte holds only the top bit; anything more overflows
+        if (shift == 63 && byte > 1)
+            break;
+
+        value |= quint64(byte & 0x7f) << shift;
+
+        if (!(byte & 0x80))
+            return value;
+    }
+
+    mValid = false;
+    return 0;
+}
+
+qint64 WireReader::readSignedVarint()
+{
+    const quint64 value = readVarint();
+    return qint64(value >> 1) ^ -qint64(value & 1);
+}
+
+QByteArray WireReader::readBytes()
+{
+    const quint64 length = readVarint();
+
+    if (!mValid || length > quint64(bytesLeft())) {
+        mValid = false;
+        return QByteArray();
+    }
+
+    QByteArray bytes(mData.constData() + mPos, int(length));
+    mPos += int(length);
+    return bytes;
+}
+
+QString WireReader::readString()
+{
+    const quint64 length = readVarint();
+
+    if (!mValid || length > quint64(bytesLeft())) {
+        mValid = false;
+        return QString();
+    }
+
+    QString string = QString::fromUtf8(mData.constData() + mPos, int(length));
+    mPos += int(length);
+    return string;
+}
+
+quint32 WireReader::readName()
+{
+    const quint64 handle = readVarint();
+    if (handle > 0xffffffff) {
+        mValid = false;
+        return 0;
+    }
+
+    return quint32(handle);
+}
+
+QByteArray WireReader::readDigest()
+{
+    if (!mValid || bytesLeft() < syncDigestSize) {
+        mValid = false;
+        return QByteArray();
+    }
+
+    QByteArray digest(mData.constData() + mPos, syncDigestSize);
+    mPos += syncDigestSize;
+    return digest;
+}
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYNCPROTOCOL_H
+#define SYNCPROTOCOL_H
+
+// Qt
+#include <QBuffer>
+#include <QByteArray>
+#include <QDataStream>
+#include <QHash>
+#include <QList>
+#include <QMetaType>
+#include <QString>
+
+// bump whenever the encoding of any command changes
+static const quint32 syncProtocolVersion = 6;
+
+// digests are sent raw at this size, SHA-1's; shorter ones are padded
+static const int syncDigestSize = 20;
+
+/*! A complete frame, ready to be written to a peer, along with the interned
+ * names it refers to, by handle.
+ *
+ * Frames are immutable once built, so a single frame can be shared by any
+ * number of connections; each connection declares the names to its peer
+ * before the first frame that uses them.
+ */
+struct SyncFrame
+{
+    QByteArray bytes;
+    QHash<quint32, QString> names;
+};
+
+Q_DECLARE_METATYPE(SyncFrame)
+Q_DECLARE_METATYPE(QList<SyncFrame>)
+
+/*! Maps names that are sent over and over (cloud names, file names, node
+ * ids) to small integer handles. Handles are process-wide, so frames using
+ * them can be shared between connections.
+ *
+ * Peers can make us send names of their choosing (the files they offer),
+ * so the table is emptied once it holds 64K names. Handles are never
+ * reused, so those already declared to peers stay valid; frames carry
+ * their names, so they can still be declared after the table forgets them.
+ * Names a peer declares are kept by its connection, limited to
+ * protocol/maxNames, and forgotten along with each session, as are the
+ * handles we have declared to it.
+ */
+class SyncNameTable
+{
+public:
+    static quint32 intern(const QString &name);
+};
+
+/*! Builds a frame for a single command.
+ *
+ * Integers are written as (zigzag) varints, byte arrays and strings as a
+ * varint length followed by the raw bytes (strings in UTF-8), digests as
+ * syncDigestSize raw bytes, and names as their interned handle. saesu
+ * types that only have QDataStream operators are written with those.
+ *
+ * A value that can't be encoded (a digest longer than syncDigestSize)
+ * isn't written, and marks the writer invalid; check isValid() before
+ * sending the frame.
+ *
+ * Everything but the saesu types is appended straight to the frame, so if
+ * \a sizeHint covers the payload, building a frame allocates only once.
+ */
+class WireWriter
+{
+public:
+    explicit WireWriter(quint8 token, int sizeHint = 0);
+    ~WireWriter();
+
+    void writeVarint(quint64 value);
+    void writeSignedVarint(qint64 value);
+    void writeBytes(const QByteArray &bytes);
+    void writeString(const QString &string);
+    void writeName(const QString &name);
+    bool writeDigest(const QByteArray &digest);
+
+    template <typename T> void writeStreamed(const T &value)
+    {
+        QDataStream &s = stream();
+        mBuffer->seek(mFrame.bytes.size());
+        s << value;
+    }
+
+    bool isValid() const;
+    SyncFrame finish();
+
+    static int varintSize(quint64 value);
+
+private:
+    Q_DISABLE_COPY(WireWriter)
+
+    QDataStream &stream();
+
+    SyncFrame mFrame;
+    bool mValid;
+
+    // only created if a saesu type is written
+    QBuffer *mBuffer;
+    QDataStream *mStream;
+};
+
+/*! Reads the fields of a frame payload, as written by WireWriter, starting
+ * at \a offset into \a data.
+ *
+ * Reading past the end of the payload, or a malformed field, marks the
+ * reader as invalid and yields default values from then on; check
+ * isValid() before acting on anything read.
+ */
+class WireReader
+{
+public:
+    explicit WireReader(const QByteArray &data, int offset = 0);
+    ~WireReader();
+
+    bool isValid() const;
+    bool atEnd() const;
+    int bytesLeft() const;
+    void invalidate();
+
+    quint64 readVarint();
+    qint64 readSignedVarint();
+    QByteArray readBytes();
+    QString readString();
+    quint32 readName();
+    QByteArray readDigest();
+
+    template <typename T> void readStreamed(T &value)
+    {
+        if (!mValid)
+            return;
+
+        QDataStream &s = stream();
+        mBuffer->seek(mPos);
+        s >> value;
+        mPos = mBuffer->pos();
+        mValid = s.status() == QDataStream::Ok;
+    }
+
+private:
+    Q_DISABLE_COPY(WireReader)
+
+    QDataStream &stream();
+
+    QByteArray mData;
+    int mPos;
+    bool mValid;
+
+    // only created if a saesu type is read
+    QBuffer *mBuffer;
+    QDataStream *mStream;
+};
+
+#endif // SYNCPROTOCOL_H
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYNCSERVER_H
+#define SYNCSERVER_H
+
+// Qt
+#include <QTcpServer>
+
+/*! Hands out socket descriptors for incoming connections instead of
+ * QTcpSocket instances, so that the sockets can be created directly in the
+ * worker thread that will service them.
+ */
+class SyncServer : public QTcpServer
+{
+    Q_OBJECT
+public:
+    explicit SyncServer(QObject *parent = 0);
+
+signals:
+    void newSocketDescriptor(int socketDescriptor);
+
+protected:
+    void incomingConnection(int socketDescriptor);
+};
+
+#endif // SYNCSERVER_H
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Us
+#include "syncmetrics.h"
+#include "syncstatistics.h"
+
+SyncStatistics::SyncStatistics()
+    : framesSent(0)
+    , bytesSent(0)
+    , framesReceived(0)
+    , bytesReceived(0)
+    , bytesHashed(0)
+    , hashingNanoseconds(0)
+{
+}
+
+SyncStatistics SyncStatistics::total()
+{
+    const ProcessMetrics *process = SyncMetrics::process();
+
+    SyncStatistics total;
+    total.framesSent = process->sent.frames();
+    total.bytesSent = process->sent.bytes();
+    total.framesReceived = process->received.frames();
+    total.bytesReceived = process->received.bytes();
+    total.bytesHashed = process->bytesHashed.value();
+    total.hashingNanoseconds = process->hashingNanoseconds.value();
+    return total;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYNCSTATISTICS_H
+#define SYNCSTATISTICS_H
+
+// Qt
+#include <QtGlobal>
+
+/*! Totals of the traffic over all connections in this process, including
+ * frame headers, and of the CPU time spent hashing files for transfer.
+ *
+ * A summary of SyncMetrics::process(), for the benchmarks.
+ */
+struct SyncStatistics
+{
+    SyncStatistics();
+
+    quint64 framesSent;
+    quint64 bytesSent;
+    quint64 framesReceived;
+    quint64 bytesReceived;
+    quint64 bytesHashed;
+    quint64 hashingNanoseconds;
+
+    static SyncStatistics total();
+};
+
+#endif // SYNCSTATISTICS_H
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QSet>
+#include <QSettings>
+#include <QSslCertificate>
+#include <QSslConfiguration>
+#include <QSslKey>
+#include <QSslSocket>
+#include <QStringList>
+
+// Saesu
+#include <sglobal.h>
+
+// Us
+#include "synctls.h"
+
+static QByteArray readFile(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        sWarning() << "Couldn't read " << fileName << ": " << file.errorString();
+        return QByteArray();
+    }
+
+    return file.readAll();
+}
+
+/*! The settings, read once on first use and never changed after, and, where
+ * Qt can resume sessions, the session cache.
+ */
+struct TlsData
+{
+    TlsData()
+        : enabled(false)
+    {
+        QSettings settings;
+        const QString certificateFile = settings.value(QLatin1String("tls/certificate")).toString();
+        const QString keyFile = settings.value(QLatin1String("tls/privateKey")).toString();
+
+        if (certificateFile.isEmpty() || keyFile.isEmpty())
+            return;
+
+        if (!QSslSocket::supportsSsl()) {
+            sWarning() << "TLS is configured, but not supported by this build of Qt";
+            return;
+        }
+
+        certificate = QSslCertificate(readFile(certificateFile), QSsl::Pem);
+        privateKey = QSslKey(readFile(keyFile), QSsl::Rsa, QSsl::Pem);
+
+        if (certificate.isNull() || privateKey.isNull()) {
+            sWarning() << "Couldn't load the TLS certificate " << certificateFile << " or key " << keyFile;
+            return;
+        }
+
+        pins.insert(SyncTls::fingerprint(certificate));
+        foreach (const QString &pin, settings.value(QLatin1String("tls/pinnedCertificates")).toStringList())
+            pins.insert(QByteArray::fromHex(pin.toLatin1()));
+
+        enabled = true;
+        sDebug() << "TLS enabled, our fingerprint is " << SyncTls::fingerprint(certificate).toHex()
+                 << ", " << pins.count() << " pinned";
+    }
+
+    bool enabled;
+    QSslCertificate certificate;
+    QSslKey privateKey;
+    QSet<QByteArray> pins;
+
+#if QT_VERSION >= 0x050200
+    // session tickets of outgoing connections, by peer node id
+    QMutex sessionLock;
+    QHash<QByteArray, QByteArray> sessions;
+#endif
+};
+
+Q_GLOBAL_STATIC(TlsData, tlsData)
+
+/*! Returns true if connections are to be encrypted; first called from the
+ * main thread, so the settings are loaded before any connection is made.
+ */
+bool SyncTls::isEnabled()
+{
+    return tlsData()->enabled;
+}
+
+/*! Returns true if this build of Qt lets sessions be resumed, which needs
+ * Qt 5.2 or later; otherwise configure() and storeSession() leave sessions
+ * alone.
+ */
+bool SyncTls::canResumeSessions()
+{
+#if QT_VERSION >= 0x050200
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*! Sets \a socket up with our certificate, and, for an outgoing connection
+ * to \a peerNodeId, offers the session kept from the previous connection
+ * to it.
+ */
+void SyncTls::configure(QSslSocket *socket, const QByteArray &peerNodeId)
+{
+    TlsData *d = tlsData();
+    QSslConfiguration configuration = socket->sslConfiguration();
+
+    configuration.setLocalCertificate(d->certificate);
+    configuration.setPrivateKey(d->privateKey);
+
+    // ask for the peer's certificate, but let isPinned() decide whether it
+    // is acceptable; setting the authorities explicitly also keeps Qt from
+    // loading the system's, which is slow
+    configuration.setPeerVerifyMode(QSslSocket::QueryPeer);
+    configuration.setCaCertificates(QList<QSslCertificate>() << d->certificate);
+
+#if QT_VERSION >= 0x050200
+    configuration.setSslOption(QSsl::SslOptionDisableSessionTickets, false);
+    configuration.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+
+    if (!peerNodeId.isEmpty()) {
+        QMutexLocker locker(&d->sessionLock);
+        configuration.setSessionTicket(d->sessions.value(peerNodeId));
+    }
+#else
+    Q_UNUSED(peerNodeId);
+#endif
+
+    socket->setSslConfiguration(configuration);
+}
+
+/*! Keeps the session of \a socket, an outgoing connection to \a peerNodeId,
+ * for the next connection to it.
+ */
+void SyncTls::storeSession(QSslSocket *socket, const QByteArray &peerNodeId)
+{
+#if QT_VERSION >= 0x050200
+    const QByteArray ticket = socket->sslConfiguration().sessionTicket();
+    if (ticket.isEmpty() || peerNodeId.isEmpty())
+        return;
+
+    TlsData *d = tlsData();
+    QMutexLocker locker(&d->sessionLock);
+    d->sessions.insert(peerNodeId, ticket);
+#else
+    Q_UNUSED(socket);
+    Q_UNUSED(peerNodeId);
+#endif
+}
+
+QByteArray SyncTls::fingerprint(const QSslCertificate &certificate)
+{
+    return certificate.digest(QCryptographicHash::Sha1);
+}
+
+/*! Returns true if \a certificate is one we trust.
+ */
+bool SyncTls::isPinned(const QSslCertificate &certificate)
+{
+    if (certificate.isNull())
+        return false;
+
+    return tlsData()->pins.contains(fingerprint(certificate));
+}
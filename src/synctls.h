@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYNCTLS_H
+#define SYNCTLS_H
+
+// Qt
+#include <QByteArray>
+
+class QSslCertificate;
+class QSslSocket;
+
+/*! Encrypts and authenticates the connections between peers.
+ *
+ * TLS is used once tls/certificate and tls/privateKey name a PEM
+ * certificate and unencrypted PEM key; every node on the network must then
+ * have one, as nodes with and without TLS can't talk to each other.
+ * Certificates are expected to be self-signed: peers are authenticated by
+ * pinning, so only certificates whose SHA-1 fingerprint (in hex) is listed
+ * in tls/pinnedCertificates, or which are the same as our own, are
+ * accepted. To try it out locally, create one with
+ *
+ *     openssl req -x509 -newkey rsa:2048 -nodes -days 365 -subj /CN=syncd \
+ *         -keyout syncd.key -out syncd.pem
+ *
+ * and give it to every node.
+ *
+ * No certificate authority is ever consulted, and the fingerprints are
+ * read once, so checking a peer is a lookup and never blocks the event
+ * loop of the worker thread doing it.
+ *
+ * Peers reconnect often, so the sessions of outgoing connections are kept
+ * by the node id the connection was made to, and offered when connecting
+ * to that node again to skip the full handshake. This is Qt 5 only: it
+ * needs Qt 5.2 or later, which exposes sessions, and with Qt 4 every
+ * connection does a full handshake (see canResumeSessions()).
+ */
+class SyncTls
+{
+public:
+    static bool isEnabled();
+    static bool canResumeSessions();
+
+    static void configure(QSslSocket *socket, const QByteArray &peerNodeId);
+    static void storeSession(QSslSocket *socket, const QByteArray &peerNodeId);
+
+    static QByteArray fingerprint(const QSslCertificate &certificate);
+    static bool isPinned(const QSslCertificate &certificate);
+};
+
+#endif // SYNCTLS_H
@@ -0,0 +1,362 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QByteArray>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QList>
+#include <QMutex>
+#include <QSettings>
+#include <QSocketNotifier>
+#include <QThread>
+
+// Saesu
+#include <sglobal.h>
+
+// Posix
+#include <signal.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Us
+#include "synctrace.h"
+
+static const int defaultEventsPerThread = 128 * 1024;
+static const int minimumEventsPerThread = 1024;
+
+struct TraceEvent
+{
+    const char *category;
+    const char *name;
+    const char *argumentName;
+    qint64 argument;
+    qint64 start;
+    qint64 end;
+    bool async;
+};
+
+/*! The most recent events of one thread. Only that thread adds to it, but
+ * any thread may read it.
+ */
+class TraceBuffer
+{
+public:
+    TraceBuffer(int threadId, const QByteArray &threadName, int capacity)
+        : mThreadId(threadId)
+        , mThreadName(threadName)
+        , mCapacity(capacity)
+        , mEvents(new TraceEvent[capacity])
+        , mHead(0)
+    {
+    }
+
+    int threadId() const { return mThreadId; }
+    QByteArray threadName() const { return mThreadName; }
+
+    // fill in the event returned by next(), then publish() it
+    TraceEvent *next() { return &mEvents[mHead % mCapacity]; }
+    void publish() { __sync_fetch_and_add(&mHead, 1); }
+
+    QList<TraceEvent> events() const;
+
+private:
+    Q_DISABLE_COPY(TraceBuffer)
+
+    quint64 head() const { return __sync_fetch_and_add(const_cast<quint64 *>(&mHead), 0); }
+
+    const int mThreadId;
+    const QByteArray mThreadName;
+    const quint64 mCapacity;
+    TraceEvent *mEvents;
+    quint64 mHead;
+};
+
+/*! Returns a copy of the events in the buffer, oldest first.
+ */
+QList<TraceEvent> TraceBuffer::events() const
+{
+    const quint64 head = this->head();
+    quint64 first = head > mCapacity ? head - mCapacity : 0;
+
+    QList<TraceEvent> events;
+    for (quint64 i = first; i < head; ++i)
+        events.append(mEvents[i % mCapacity]);
+
+    // the owner kept going while we copied, so the oldest events may have
+    // been overwritten (or be half way there) by now
+    const quint64 after = this->head();
+    const quint64 valid = after + 1 > mCapacity ? after + 1 - mCapacity : 0;
+    while (first < valid && !events.isEmpty()) {
+        events.removeFirst();
+        ++first;
+    }
+
+    return events;
+}
+
+struct TraceRegistry
+{
+    TraceRegistry()
+        : eventsPerThread(qMax(QSettings().value(QLatin1String("trace/eventsPerThread"),
+                                                 defaultEventsPerThread).toInt(),
+                               minimumEventsPerThread))
+        , nextThreadId(1)
+    {
+    }
+
+    // protects buffers and nextThreadId; buffers are never deleted, as
+    // worker threads live as long as the process does
+    QMutex lock;
+    QList<TraceBuffer *> buffers;
+    const int eventsPerThread;
+    int nextThreadId;
+};
+
+Q_GLOBAL_STATIC(TraceRegistry, traceRegistry)
+
+static __thread TraceBuffer *currentBuffer = 0;
+
+static TraceBuffer *threadBuffer()
+{
+    if (currentBuffer)
+        return currentBuffer;
+
+    TraceRegistry *registry = traceRegistry();
+    QMutexLocker locker(&registry->lock);
+
+    const int threadId = registry->nextThreadId++;
+    QThread *thread = QThread::currentThread();
+    QByteArray threadName = thread->objectName().toUtf8();
+
+    if (thread == QCoreApplication::instance()->thread())
+        threadName = "main";
+    else if (threadName.isEmpty())
+        threadName = "thread " + QByteArray::number(threadId);
+
+    currentBuffer = new TraceBuffer(threadId, threadName, registry->eventsPerThread);
+    registry->buffers.append(currentBuffer);
+    return currentBuffer;
+}
+
+TraceSpan::TraceSpan(const char *category, const char *name)
+    : mCategory(category)
+    , mName(name)
+    , mArgumentName(0)
+    , mArgument(0)
+    , mStart(SyncTrace::now())
+{
+}
+
+TraceSpan::~TraceSpan()
+{
+    SyncTrace::record(mCategory, mName, mStart, SyncTrace::now(), mArgumentName, mArgument, false);
+}
+
+/*! Attaches \a value, called \a name, to the span; e.g. how many objects
+ * it handled.
+ */
+void TraceSpan::setArgument(const char *name, qint64 value)
+{
+    mArgumentName = name;
+    mArgument = value;
+}
+
+TraceRequest::TraceRequest(QObject *request, const char *category, const char *name,
+                           const char *argumentName, qint64 argument)
+    : QObject(request)
+    , mCategory(category)
+    , mName(name)
+    , mArgumentName(argumentName)
+    , mArgument(argument)
+    , mStart(SyncTrace::now())
+{
+    connect(request, SIGNAL(finished()), SLOT(finish()));
+}
+
+void TraceRequest::finish()
+{
+    SyncTrace::record(mCategory, mName, mStart, SyncTrace::now(), mArgumentName, mArgument, true);
+}
+
+/*! Returns a monotonic timestamp, in nanoseconds.
+ */
+qint64 SyncTrace::now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return qint64(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+/*! Adds a span from \a start to \a end to the current thread's buffer.
+ *
+ * Asynchronous spans may overlap others on the same thread, e.g. storage
+ * requests, which finish some time after the code starting them returned.
+ */
+void SyncTrace::record(const char *category, const char *name, qint64 start, qint64 end,
+                       const char *argumentName, qint64 argument, bool async)
+{
+    TraceBuffer *buffer = threadBuffer();
+
+    TraceEvent *event = buffer->next();
+    event->category = category;
+    event->name = name;
+    event->argumentName = argumentName;
+    event->argument = argument;
+    event->start = start;
+    event->end = end;
+    event->async = async;
+
+    buffer->publish();
+}
+
+static QByteArray microseconds(qint64 nanoseconds)
+{
+    return QByteArray::number(nanoseconds / 1000.0, 'f', 3);
+}
+
+static void appendEvent(QByteArray *out, bool *first, const QByteArray &event)
+{
+    if (!*first)
+        out->append(",\n");
+
+    out->append(event);
+    *first = false;
+}
+
+/*! Writes every buffered span to a new file in trace/directory (by default,
+ * the temporary directory) as Chrome trace event JSON.
+ *
+ * Returns the name of the file, or an empty string if it couldn't be written.
+ */
+QString SyncTrace::dump()
+{
+    const QString directory = QSettings().value(QLatin1String("trace/directory"), QDir::tempPath()).toString();
+    const QString fileName = QDir(directory).filePath(QString::fromLatin1("syncd-trace-%1-%2.json")
+        .arg(getpid())
+        .arg(QDateTime::currentDateTime().toString(QLatin1String("yyyyMMdd-hhmmss"))));
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        sWarning() << "Couldn't write trace to " << fileName << ": " << file.errorString();
+        return QString();
+    }
+
+    QList<TraceBuffer *> buffers;
+    {
+        TraceRegistry *registry = traceRegistry();
+        QMutexLocker locker(&registry->lock);
+        buffers = registry->buffers;
+    }
+
+    const QByteArray pid = QByteArray::number(getpid());
+    quint64 asyncId = 0;
+    bool first = true;
+
+    file.write("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    foreach (const TraceBuffer *buffer, buffers) {
+        const QByteArray process = "\"pid\":" + pid + ",\"tid\":" + QByteArray::number(buffer->threadId());
+        QByteArray out;
+
+        QByteArray threadName = buffer->threadName();
+        threadName.replace('\\', "\\\\").replace('"', "\\\"");
+        appendEvent(&out, &first, "{\"ph\":\"M\",\"name\":\"thread_name\"," + process +
+                                  ",\"args\":{\"name\":\"" + threadName + "\"}}");
+
+        foreach (const TraceEvent &event, buffer->events()) {
+            const QByteArray common = "\"cat\":\"" + QByteArray(event.category) +
+                                      "\",\"name\":\"" + QByteArray(event.name) + "\"," + process;
+            QByteArray arguments;
+            if (event.argumentName)
+                arguments = ",\"args\":{\"" + QByteArray(event.argumentName) + "\":" +
+                            QByteArray::number(event.argument) + "}";
+
+            if (!event.async) {
+                appendEvent(&out, &first, "{\"ph\":\"X\"," + common + ",\"ts\":" + microseconds(event.start) +
+                                          ",\"dur\":" + microseconds(event.end - event.start) + arguments + "}");
+                continue;
+            }
+
+            const QByteArray id = ",\"id\":" + QByteArray::number(++asyncId);
+            appendEvent(&out, &first, "{\"ph\":\"b\"," + common + id + ",\"ts\":" + microseconds(event.start) +
+                                      arguments + "}");
+            appendEvent(&out, &first, "{\"ph\":\"e\"," + common + id + ",\"ts\":" + microseconds(event.end) + "}");
+        }
+
+        file.write(out);
+    }
+
+    file.write("\n]}\n");
+
+    if (file.error() != QFile::NoError) {
+        sWarning() << "Couldn't write trace to " << fileName << ": " << file.errorString();
+        return QString();
+    }
+
+    return fileName;
+}
+
+static int signalSockets[2];
+
+static void onTraceSignal(int)
+{
+    // only async-signal-safe calls in here; the notifier does the rest
+    const char signal = 1;
+    const ssize_t written = ::write(signalSockets[0], &signal, sizeof(signal));
+    Q_UNUSED(written);
+}
+
+/*! Makes SIGUSR1 write out the trace. Must be called from the main thread,
+ * after the application is created.
+ */
+void SyncTrace::installSignalHandler()
+{
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, signalSockets) != 0) {
+        sWarning() << "Couldn't create a socket pair for SIGUSR1, traces can only be requested over IPC";
+        return;
+    }
+
+    new TraceSignalNotifier(signalSockets[1], QCoreApplication::instance());
+
+    struct sigaction action;
+    qMemSet(&action, 0, sizeof(action));
+    action.sa_handler = onTraceSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, 0);
+}
+
+TraceSignalNotifier::TraceSignalNotifier(int socket, QObject *parent)
+    : QObject(parent)
+    , mNotifier(new QSocketNotifier(socket, QSocketNotifier::Read, this))
+{
+    connect(mNotifier, SIGNAL(activated(int)), SLOT(onSignal()));
+}
+
+void TraceSignalNotifier::onSignal()
+{
+    char signal;
+    const ssize_t received = ::read(mNotifier->socket(), &signal, sizeof(signal));
+    Q_UNUSED(received);
+
+    const QString fileName = SyncTrace::dump();
+    if (!fileName.isEmpty())
+        sWarning() << "Trace written to " << fileName;
+}
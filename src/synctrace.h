@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYNCTRACE_H
+#define SYNCTRACE_H
+
+// Spans of time spent synchronising, for finding out where a slow sync
+// went. Only built with CONFIG+=tracing (which defines SYNCD_TRACING);
+// otherwise the macros below expand to nothing.
+//
+// Spans are kept in a ring buffer per thread, and written out as Chrome
+// trace event JSON (open it in chrome://tracing) on SIGUSR1, or when
+// dumpTrace() is sent on saesu://sync-metrics.
+//
+// Names and categories must be string literals, or otherwise live forever.
+
+#ifdef SYNCD_TRACING
+
+// Qt
+#include <QObject>
+#include <QString>
+
+class QSocketNotifier;
+
+/*! Records the time from its construction to its destruction as a span on
+ * the current thread.
+ */
+class TraceSpan
+{
+public:
+    TraceSpan(const char *category, const char *name);
+    ~TraceSpan();
+
+    void setArgument(const char *name, qint64 value);
+
+private:
+    Q_DISABLE_COPY(TraceSpan)
+
+    const char *mCategory;
+    const char *mName;
+    const char *mArgumentName;
+    qint64 mArgument;
+    qint64 mStart;
+};
+
+/*! Records the time from its construction until \a request (a storage
+ * request) finishes, as an asynchronous span.
+ */
+class TraceRequest : public QObject
+{
+    Q_OBJECT
+public:
+    TraceRequest(QObject *request, const char *category, const char *name,
+                 const char *argumentName, qint64 argument);
+
+private slots:
+    void finish();
+
+private:
+    const char *mCategory;
+    const char *mName;
+    const char *mArgumentName;
+    qint64 mArgument;
+    qint64 mStart;
+};
+
+/*! Writes the trace out when SIGUSR1 arrives; see SyncTrace::installSignalHandler().
+ */
+class TraceSignalNotifier : public QObject
+{
+    Q_OBJECT
+public:
+    explicit TraceSignalNotifier(int socket, QObject *parent = 0);
+
+private slots:
+    void onSignal();
+
+private:
+    QSocketNotifier *mNotifier;
+};
+
+class SyncTrace
+{
+public:
+    static qint64 now();
+    static void record(const char *category, const char *name, qint64 start, qint64 end,
+                       const char *argumentName, qint64 argument, bool async);
+
+    static QString dump();
+    static void installSignalHandler();
+};
+
+#define SYNC_TRACE_SPAN(category, name) TraceSpan syncTraceSpan(category, name)
+#define SYNC_TRACE_ARGUMENT(name, value) syncTraceSpan.setArgument(name, value)
+#define SYNC_TRACE_REQUEST(request, category, name, argumentName, argument) \
+    new TraceRequest(request, category, name, argumentName, argument)
+
+#else
+
+#define SYNC_TRACE_SPAN(category, name) do {} while (0)
+#define SYNC_TRACE_ARGUMENT(name, value) do {} while (0)
+#define SYNC_TRACE_REQUEST(request, category, name, argumentName, argument) do {} while (0)
+
+#endif // SYNCD_TRACING
+
+#endif // SYNCTRACE_H
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QThread>
+#include <QMutexLocker>
+
+// Saesu
+#include <sglobal.h>
+
+// Us
+#include "syncmanager.h"
+#include "syncworkerpool.h"
+
+SyncWorkerPool::SyncWorkerPool(QObject *parent)
+    : QObject(parent)
+{
+    int threadCount = qMax(QThread::idealThreadCount(), 1);
+    sDebug() << "Starting " << threadCount << " worker threads";
+
+    for (int i = 0; i < threadCount; ++i) {
+        QThread *thread = new QThread(this);
+        thread->start();
+        mThreads.append(thread);
+        mThreadLoad.insert(thread, 0);
+    }
+}
+
+/*! Deletes the objects still assigned, each on its own thread, then stops
+ * the threads.
+ *
+ * Workers may be waiting for the main thread to create a SyncManager for
+ * them (see SyncManager::instance()), so it keeps doing that while it waits
+ * for them, rather than blocking on threads that are blocked on it.
+ */
+SyncWorkerPool::~SyncWorkerPool()
+{
+    {
+        QMutexLocker locker(&mLock);
+
+        // an object being destroyed right now waits for the lock in
+        // onObjectDestroyed(), and its destructor drops the event
+        foreach (QObject *object, mAssignments.keys())
+            QMetaObject::invokeMethod(object, "deleteLater", Qt::QueuedConnection);
+
+        while (!mAssignments.isEmpty()) {
+            locker.unlock();
+            SyncManager::serveWorkers();
+            locker.relock();
+
+            if (!mAssignments.isEmpty())
+                mEmptied.wait(&mLock, 10);
+        }
+    }
+
+    foreach (QThread *thread, mThreads) {
+        thread->quit();
+        thread->wait();
+    }
+}
+
+/*! Moves \a object to the least loaded worker thread.
+ *
+ * \a object must not have a parent, and should not be touched directly from
+ * the calling thread afterwards; use queued invocations instead.
+ */
+void SyncWorkerPool::assign(QObject *object)
+{
+    QMutexLocker locker(&mLock);
+
+    QThread *target = mThreads.first();
+    foreach (QThread *thread, mThreads) {
+        if (mThreadLoad.value(thread) < mThreadLoad.value(target))
+            target = thread;
+    }
+
+    mThreadLoad[target]++;
+    mAssignments.insert(object, target);
+
+    // destroyed() is emitted from the worker thread, so don't queue it: the
+    // object may be long gone by the time the event is delivered
+    connect(object, SIGNAL(destroyed(QObject*)), SLOT(onObjectDestroyed(QObject*)), Qt::DirectConnection);
+    object->moveToThread(target);
+}
+
+void SyncWorkerPool::onObjectDestroyed(QObject *object)
+{
+    QMutexLocker locker(&mLock);
+
+    QThread *thread = mAssignments.take(object);
+    if (thread)
+        mThreadLoad[thread]--;
+
+    if (mAssignments.isEmpty())
+        mEmptied.wakeAll();
+}
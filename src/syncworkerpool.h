@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYNCWORKERPOOL_H
+#define SYNCWORKERPOOL_H
+
+// Qt
+#include <QObject>
+#include <QList>
+#include <QHash>
+#include <QMutex>
+#include <QWaitCondition>
+
+class QThread;
+
+/*! Spreads objects (i.e. connections) across a fixed set of worker threads,
+ * so that the work done for one peer doesn't stall any other.
+ */
+class SyncWorkerPool : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SyncWorkerPool(QObject *parent = 0);
+    virtual ~SyncWorkerPool();
+
+    void assign(QObject *object);
+
+private slots:
+    void onObjectDestroyed(QObject *object);
+
+private:
+    QList<QThread *> mThreads;
+    QHash<QThread *, int> mThreadLoad;
+    QHash<QObject *, QThread *> mAssignments;
+    QMutex mLock;
+    QWaitCondition mEmptied;
+};
+
+#endif // SYNCWORKERPOOL_H
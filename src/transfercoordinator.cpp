@@ -0,0 +1,491 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QWeakPointer>
+
+// Saesu
+#include <sglobal.h>
+
+// Us
+#include "fileassembler.h"
+#include "transfercoordinator.h"
+
+// bounds on how many blocks a connection claims from the pool at once
+static const int minimumRun = 16;
+static const int maximumRun = 1024;
+
+// roughly what an entry in mBlockHashes costs: the node, and the digest
+static const qint64 blockHashEntrySize = 64;
+
+FileSwarm::FileSwarm(FileAssembler *assembler, quint64 fileSize, const QByteArray &fileHash)
+    : QObject()
+    , mFileName(assembler->fileName())
+    , mFileSize(fileSize)
+    , mFileHash(fileHash)
+    , mParameters(assembler->parameters())
+    , mBlockCount(assembler->blockCount())
+    , mAssembler(assembler)
+    , mFinished(false)
+    , mHashesKnown(0)
+    , mBytesReceived(0)
+{
+    // blocks kept from an interrupted transfer need no hashes
+    for (quint64 i = 0; i < mBlockCount; ++i) {
+        if (mAssembler->hasBlock(i))
+            mHashesKnown++;
+    }
+
+    updateMemoryAccount();
+}
+
+FileSwarm::~FileSwarm()
+{
+    delete mAssembler;
+}
+
+QString FileSwarm::fileName() const
+{
+    return mFileName;
+}
+
+quint64 FileSwarm::fileSize() const
+{
+    return mFileSize;
+}
+
+TransferParameters FileSwarm::parameters() const
+{
+    return mParameters;
+}
+
+/*! Returns true if this is the transfer of a file of \a fileSize bytes
+ * hashing to \a fileHash, cut up according to \a parameters.
+ */
+bool FileSwarm::matches(quint64 fileSize, const QByteArray &fileHash, const TransferParameters &parameters) const
+{
+    return mFileSize == fileSize && mFileHash == fileHash &&
+           mParameters.blockSize == parameters.blockSize && mParameters.algorithm == parameters.algorithm;
+}
+
+bool FileSwarm::isComplete() const
+{
+    QMutexLocker locker(&mLock);
+
+    // only a complete file is committed, and the assembler is busy then
+    return mFinished || mAssembler->isComplete();
+}
+
+bool FileSwarm::isFinished() const
+{
+    QMutexLocker locker(&mLock);
+    return mFinished;
+}
+
+/*! Returns true if we know the hash of every block we don't have yet, so
+ * connections joining the transfer needn't ask their peers for them.
+ */
+bool FileSwarm::hashesComplete() const
+{
+    QMutexLocker locker(&mLock);
+    return mHashesKnown >= mBlockCount;
+}
+
+/*! Returns how many connections have fetched blocks of the file.
+ */
+int FileSwarm::sourceCount() const
+{
+    QMutexLocker locker(&mLock);
+    return mSources.count();
+}
+
+/*! Returns how fast blocks have been arriving over all connections
+ * together, or 0 if none have.
+ */
+quint64 FileSwarm::bytesPerSecond() const
+{
+    QMutexLocker locker(&mLock);
+    if (!mClock.isValid() || !mBytesReceived)
+        return 0;
+
+    return mBytesReceived * 1000 / quint64(qMax<qint64>(mClock.elapsed(), 1));
+}
+
+/*! Returns true if \a blockNumber is neither here nor known to be wanted.
+ */
+bool FileSwarm::needsBlock(quint64 blockNumber) const
+{
+    QMutexLocker locker(&mLock);
+    return !mFinished && blockNumber < mBlockCount &&
+           !mAssembler->hasBlock(blockNumber) && !mBlockHashes.contains(blockNumber);
+}
+
+/*! Stores \a block, which was found in our own copy of the file.
+ *
+ * Returns false if it couldn't be stored.
+ */
+bool FileSwarm::writeLocalBlock(quint64 blockNumber, const QByteArray &block)
+{
+    QMutexLocker locker(&mLock);
+    if (mFinished)
+        return false;
+    if (mAssembler->hasBlock(blockNumber))
+        return true;
+
+    if (!mAssembler->writeBlock(blockNumber, block))
+        return false;
+
+    localBlockAdded(blockNumber);
+    updateMemoryAccount();
+    return true;
+}
+
+/*! Copies \a blockNumber, which hashes to \a blockHash, from \a sourceFileName
+ * at \a sourceOffset, where another file we have contains the same block.
+ *
+ * Returns false if it couldn't be copied, or turned out to be different.
+ */
+bool FileSwarm::copyLocalBlock(quint64 blockNumber, const QByteArray &blockHash, const QString &sourceFileName,
+                               qint64 sourceOffset)
+{
+    QMutexLocker locker(&mLock);
+    if (mFinished)
+        return false;
+    if (mAssembler->hasBlock(blockNumber))
+        return true;
+
+    if (!mAssembler->copyBlock(blockNumber, blockHash, sourceFileName, sourceOffset))
+        return false;
+
+    localBlockAdded(blockNumber);
+    updateMemoryAccount();
+    return true;
+}
+
+void FileSwarm::localBlockAdded(quint64 blockNumber)
+{
+    // another peer's hash may have got here first; if so, it was counted then
+    if (!mBlockHashes.remove(blockNumber))
+        mHashesKnown++;
+}
+
+/*! Marks \a blockNumber, whose content hashes to \a blockHash, as needing
+ * to be fetched from a peer.
+ */
+void FileSwarm::addWanted(quint64 blockNumber, const QByteArray &blockHash)
+{
+    bool wasEmpty;
+
+    {
+        QMutexLocker locker(&mLock);
+        if (mFinished || blockNumber >= mBlockCount || mAssembler->hasBlock(blockNumber))
+            return;
+
+        QHash<quint64, QByteArray>::ConstIterator it = mBlockHashes.constFind(blockNumber);
+        if (it != mBlockHashes.constEnd()) {
+            if (*it != blockHash)
+                sWarning() << "Peers disagree on the hash of block " << blockNumber << " of " << mFileName;
+            return;
+        }
+
+        mBlockHashes.insert(blockNumber, blockHash);
+        mHashesKnown++;
+
+        wasEmpty = mPool.isEmpty();
+        mPool.append(blockNumber);
+        updateMemoryAccount();
+    }
+
+    if (wasEmpty)
+        emit blocksAvailable();
+}
+
+/*! Returns up to \a count blocks for \a source to request, which has been
+ * receiving \a bytesPerSecond. They are its to fetch until they are
+ * released or it leaves.
+ */
+QList<quint64> FileSwarm::claim(FileTransfer *source, int count, quint64 bytesPerSecond)
+{
+    QMutexLocker locker(&mLock);
+    QList<quint64> blocks;
+
+    if (mFinished)
+        return blocks;
+
+    if (!mClock.isValid())
+        mClock.start();
+
+    Source *s = &mSources[source];
+    s->bytesPerSecond = bytesPerSecond;
+
+    while (blocks.count() < count) {
+        if (s->assigned.isEmpty() && !assignRun(s))
+            break;
+
+        // copied from our own file, or already fetched, in the meantime
+        const quint64 blockNumber = s->assigned.takeFirst();
+        if (mBlockHashes.contains(blockNumber))
+            blocks.append(blockNumber);
+    }
+
+    updateMemoryAccount();
+    return blocks;
+}
+
+/*! Gives \a source a contiguous run of blocks to fetch, from the pool if
+ * there are any left, otherwise from the connection with the largest
+ * backlog. Returns false if there is nothing left to give.
+ */
+bool FileSwarm::assignRun(Source *source)
+{
+    if (!mPool.isEmpty()) {
+        const quint64 blocksPerSecond = source->bytesPerSecond / quint64(mParameters.blockSize);
+        const int run = qMin(int(qBound<quint64>(minimumRun, blocksPerSecond, maximumRun)), mPool.count());
+
+        source->assigned = mPool.mid(0, run);
+        mPool.erase(mPool.begin(), mPool.begin() + run);
+        return true;
+    }
+
+    Source *victim = 0;
+    QHash<FileTransfer *, Source>::Iterator it = mSources.begin();
+    for (; it != mSources.end(); ++it) {
+        if (&*it != source && it->assigned.count() > 1 &&
+            (!victim || it->assigned.count() > victim->assigned.count()))
+            victim = &*it;
+    }
+
+    if (!victim)
+        return false;
+
+    // split the backlog in proportion to how fast each of us has been going,
+    // taking the end of it so both keep working on contiguous runs
+    const quint64 totalRate = source->bytesPerSecond + victim->bytesPerSecond;
+    const double share = totalRate ? double(source->bytesPerSecond) / totalRate : 0.5;
+    const int backlog = victim->assigned.count();
+    const int steal = qBound(1, int(backlog * share), backlog - 1);
+
+    source->assigned = victim->assigned.mid(backlog - steal);
+    victim->assigned.erase(victim->assigned.end() - steal, victim->assigned.end());
+    return true;
+}
+
+/*! Puts \a blocks, which timed out or arrived corrupt, back at the front
+ * of the pool.
+ */
+void FileSwarm::release(const QList<quint64> &blocks)
+{
+    bool wasEmpty;
+
+    {
+        QMutexLocker locker(&mLock);
+        wasEmpty = releaseLocked(blocks);
+    }
+
+    if (wasEmpty)
+        emit blocksAvailable();
+}
+
+/*! Returns true if the pool was empty before \a blocks were put back.
+ */
+bool FileSwarm::releaseLocked(const QList<quint64> &blocks)
+{
+    QList<quint64> wanted;
+    foreach (quint64 blockNumber, blocks) {
+        if (mBlockHashes.contains(blockNumber))
+            wanted.append(blockNumber);
+    }
+
+    if (mFinished || wanted.isEmpty())
+        return false;
+
+    const bool wasEmpty = mPool.isEmpty();
+    mPool = wanted + mPool;
+    updateMemoryAccount();
+    return wasEmpty;
+}
+
+/*! Counts what the swarm holds towards the memory budget; the caller holds
+ * mLock.
+ */
+void FileSwarm::updateMemoryAccount()
+{
+    qint64 assigned = 0;
+    foreach (const Source &source, mSources)
+        assigned += source.assigned.count();
+
+    // a finished swarm's assembler belongs to commit(), and is about to go
+    const qint64 assembled = mFinished ? 0 : mAssembler->memoryUsed();
+    mMemory.set(MemoryGovernor::Transfers, assembled +
+                                           mBlockHashes.count() * blockHashEntrySize +
+                                           (mPool.count() + assigned) * qint64(sizeof(quint64)));
+}
+
+/*! Returns the blocks assigned to \a source, and those it still had in
+ * flight, to the pool.
+ */
+void FileSwarm::removeSource(FileTransfer *source, const QList<quint64> &inFlight)
+{
+    bool wasEmpty;
+
+    {
+        QMutexLocker locker(&mLock);
+        const QList<quint64> assigned = mSources.take(source).assigned;
+        wasEmpty = releaseLocked(inFlight + assigned);
+        updateMemoryAccount();
+    }
+
+    if (wasEmpty)
+        emit blocksAvailable();
+}
+
+/*! Returns the hash \a blockNumber should have, or an empty array if it
+ * isn't wanted (any more).
+ */
+QByteArray FileSwarm::expectedHash(quint64 blockNumber) const
+{
+    QMutexLocker locker(&mLock);
+    return mBlockHashes.value(blockNumber);
+}
+
+/*! Stores \a block, which has been checked against expectedHash().
+ *
+ * Returns false if it couldn't be stored.
+ */
+bool FileSwarm::storeBlock(quint64 blockNumber, const QByteArray &block)
+{
+    QMutexLocker locker(&mLock);
+
+    QHash<quint64, QByteArray>::Iterator it = mBlockHashes.find(blockNumber);
+    if (mFinished || it == mBlockHashes.end())
+        return true; // another connection got it first
+
+    const QByteArray blockHash = *it;
+    mBlockHashes.erase(it);
+
+    if (!mAssembler->writeBlock(blockNumber, block)) {
+        // leave it for another connection to try
+        mBlockHashes.insert(blockNumber, blockHash);
+        mPool.prepend(blockNumber);
+        return false;
+    }
+
+    mBytesReceived += block.size();
+    updateMemoryAccount();
+    return true;
+}
+
+/*! Verifies the complete file and moves it into place. Only the first
+ * connection to call this does so; the others get AlreadyFinished.
+ *
+ * Verifying means hashing the whole file, so it is done without holding
+ * mLock; once mFinished is set, nothing else touches the assembler.
+ */
+FileSwarm::CommitResult FileSwarm::commit()
+{
+    {
+        QMutexLocker locker(&mLock);
+        if (mFinished)
+            return AlreadyFinished;
+
+        mFinished = true;
+        mPool.clear();
+        updateMemoryAccount();
+    }
+
+    const CommitResult result = mAssembler->commit() ? Committed : CommitFailed;
+
+    emit finished();
+    return result;
+}
+
+struct SwarmRegistry
+{
+    // lock order: this, then the swarms'
+    QMutex lock;
+    QHash<QString, QWeakPointer<FileSwarm> > swarms;
+};
+
+Q_GLOBAL_STATIC(SwarmRegistry, swarmRegistry)
+
+/*! Returns the transfer of \a fileName to take part in, starting it if
+ * necessary, or a null pointer if the file can't be received right now.
+ */
+QSharedPointer<FileSwarm> TransferCoordinator::join(const QString &fileName, quint64 fileSize,
+                                                    const QByteArray &fileHash, const TransferParameters &parameters)
+{
+    SwarmRegistry *registry = swarmRegistry();
+    QMutexLocker locker(&registry->lock);
+
+    QSharedPointer<FileSwarm> swarm = registry->swarms.value(fileName).toStrongRef();
+    if (swarm && !swarm->isFinished()) {
+        if (!swarm->matches(fileSize, fileHash, parameters)) {
+            sDebug() << "Already receiving another version of " << fileName;
+            return QSharedPointer<FileSwarm>();
+        }
+
+        sDebug() << "Joining the transfer of " << fileName;
+        return swarm;
+    }
+
+    // like incoming connections, a new transfer can wait for the peer to
+    // offer the file again
+    if (MemoryGovernor::pressure() != MemoryGovernor::Normal) {
+        sDebug() << "Not receiving " << fileName << ", " << MemoryGovernor::used() << " bytes held";
+        return QSharedPointer<FileSwarm>();
+    }
+
+    FileAssembler *assembler = new FileAssembler(fileName, fileSize, fileHash, parameters);
+    if (!assembler->open()) {
+        delete assembler;
+        return QSharedPointer<FileSwarm>();
+    }
+
+    swarm = QSharedPointer<FileSwarm>(new FileSwarm(assembler, fileSize, fileHash));
+    registry->swarms.insert(fileName, swarm);
+    return swarm;
+}
+
+/*! Takes \a source out of \a swarm, returning the blocks it had \a inFlight
+ * and was yet to request, and clears \a swarm.
+ *
+ * The last connection to leave destroys the swarm, and we hold the registry
+ * lock while it does, so the file can't be reopened before it is closed.
+ */
+void TransferCoordinator::leave(QSharedPointer<FileSwarm> *swarm, FileTransfer *source, const QList<quint64> &inFlight)
+{
+    SwarmRegistry *registry = swarmRegistry();
+    QMutexLocker locker(&registry->lock);
+
+    if (!*swarm)
+        return;
+
+    (*swarm)->removeSource(source, inFlight);
+    swarm->clear();
+}
+
+/*! Stops connections from joining \a swarm, which has finished, so that
+ * later versions of its file can be received.
+ */
+void TransferCoordinator::forget(FileSwarm *swarm)
+{
+    SwarmRegistry *registry = swarmRegistry();
+    QMutexLocker locker(&registry->lock);
+
+    QHash<QString, QWeakPointer<FileSwarm> >::Iterator it = registry->swarms.find(swarm->fileName());
+    if (it != registry->swarms.end() && it->data() == swarm)
+        registry->swarms.erase(it);
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TRANSFERCOORDINATOR_H
+#define TRANSFERCOORDINATOR_H
+
+// Qt
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QSharedPointer>
+#include <QString>
+
+// Us
+#include "memorygovernor.h"
+#include "transferparameters.h"
+
+class FileAssembler;
+class FileTransfer;
+
+/*! The state of one incoming file shared by every connection that is
+ * fetching it: its blocks, their expected hashes, and which connection is
+ * to fetch which of them.
+ *
+ * Wanted blocks start out in a common pool. A connection claims a run of
+ * them at a time, about a second's worth at the rate it has been managing,
+ * so faster peers take larger ranges. Once the pool is empty, a connection
+ * that runs dry takes over part of the largest backlog of another, in
+ * proportion to their rates. Blocks that time out or arrive corrupt go back
+ * to the pool for any connection to pick up.
+ *
+ * May be used from any thread.
+ */
+class FileSwarm : public QObject
+{
+    Q_OBJECT
+public:
+    enum CommitResult
+    {
+        Committed,
+        CommitFailed,
+        AlreadyFinished
+    };
+
+    FileSwarm(FileAssembler *assembler, quint64 fileSize, const QByteArray &fileHash);
+    ~FileSwarm();
+
+    QString fileName() const;
+    quint64 fileSize() const;
+    TransferParameters parameters() const;
+    bool matches(quint64 fileSize, const QByteArray &fileHash, const TransferParameters &parameters) const;
+
+    bool isComplete() const;
+    bool isFinished() const;
+    bool hashesComplete() const;
+    int sourceCount() const;
+    quint64 bytesPerSecond() const;
+
+    bool needsBlock(quint64 blockNumber) const;
+    bool writeLocalBlock(quint64 blockNumber, const QByteArray &block);
+    bool copyLocalBlock(quint64 blockNumber, const QByteArray &blockHash, const QString &sourceFileName,
+                        qint64 sourceOffset);
+    void addWanted(quint64 blockNumber, const QByteArray &blockHash);
+
+    QList<quint64> claim(FileTransfer *source, int count, quint64 bytesPerSecond);
+    void release(const QList<quint64> &blocks);
+    void removeSource(FileTransfer *source, const QList<quint64> &inFlight);
+
+    QByteArray expectedHash(quint64 blockNumber) const;
+    bool storeBlock(quint64 blockNumber, const QByteArray &block);
+
+    CommitResult commit();
+
+signals:
+    // wanted blocks became available after the pool had run dry
+    void blocksAvailable();
+
+    // the file has been committed or given up on
+    void finished();
+
+private:
+    struct Source
+    {
+        Source() : bytesPerSecond(0) {}
+
+        // blocks this source is to fetch next, in order
+        QList<quint64> assigned;
+        quint64 bytesPerSecond;
+    };
+
+    void localBlockAdded(quint64 blockNumber);
+    bool assignRun(Source *source);
+    bool releaseLocked(const QList<quint64> &blocks);
+    void updateMemoryAccount();
+
+    // protects everything but the constants below
+    mutable QMutex mLock;
+
+    const QString mFileName;
+    const quint64 mFileSize;
+    const QByteArray mFileHash;
+    const TransferParameters mParameters;
+    const quint64 mBlockCount;
+
+    FileAssembler *mAssembler;
+    bool mFinished;
+
+    // expected hashes of the blocks still to be fetched, and how many blocks
+    // we have either got or know the hash of
+    QHash<quint64, QByteArray> mBlockHashes;
+    quint64 mHashesKnown;
+
+    // wanted blocks nobody has claimed yet, in order
+    QList<quint64> mPool;
+    QHash<FileTransfer *, Source> mSources;
+
+    // from the first claim, for the throughput of the whole swarm
+    QElapsedTimer mClock;
+    quint64 mBytesReceived;
+
+    // what the above and the assembler hold on to, for MemoryGovernor
+    MemoryAccount mMemory;
+};
+
+/*! Makes connections that are offered the same file fetch it together.
+ *
+ * Files are recognised by name, size, hash and transfer parameters; a
+ * connection offered a file that is already being received joins the
+ * FileSwarm for it, and the blocks are split between the peers. Another
+ * version of a file that is being received is ignored until the current
+ * one is finished. No new transfers are started while memory is short.
+ */
+class TransferCoordinator
+{
+public:
+    static QSharedPointer<FileSwarm> join(const QString &fileName, quint64 fileSize,
+                                          const QByteArray &fileHash, const TransferParameters &parameters);
+    static void leave(QSharedPointer<FileSwarm> *swarm, FileTransfer *source, const QList<quint64> &inFlight);
+    static void forget(FileSwarm *swarm);
+};
+
+#endif // TRANSFERCOORDINATOR_H
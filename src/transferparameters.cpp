@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Qt
+#include <QIODevice>
+#include <QSettings>
+
+// Saesu
+#include <sglobal.h>
+
+// Posix
+#include <time.h>
+
+// Us
+#include "syncmetrics.h"
+#include "syncprotocol.h"
+#include "synctrace.h"
+#include "transferparameters.h"
+
+static const qint64 defaultBlockSize = 4096;
+static const qint64 minimumBlockSize = 512;
+static const qint64 maximumBlockSize = 1024 * 1024;
+
+static qint64 threadCpuTime()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return qint64(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+static void recordHashing(qint64 bytes, qint64 nanoseconds)
+{
+    ProcessMetrics *metrics = SyncMetrics::process();
+    metrics->bytesHashed.add(bytes);
+    metrics->hashingNanoseconds.add(nanoseconds);
+    metrics->blockHashNanoseconds.record(nanoseconds);
+}
+
+static QCryptographicHash::Algorithm algorithmFromName(const QString &name)
+{
+    if (name == QLatin1String("md4"))
+        return QCryptographicHash::Md4;
+    if (name == QLatin1String("md5"))
+        return QCryptographicHash::Md5;
+
+    if (name != QLatin1String("sha1"))
+        sWarning() << "Unknown hash algorithm " << name << ", using sha1";
+    return QCryptographicHash::Sha1;
+}
+
+TransferParameters::TransferParameters()
+    : blockSize(defaultBlockSize)
+    , algorithm(QCryptographicHash::Sha1)
+{
+}
+
+TransferParameters::TransferParameters(qint64 blockSize, QCryptographicHash::Algorithm algorithm)
+    : blockSize(blockSize)
+    , algorithm(algorithm)
+{
+}
+
+/*! Returns the parameters this node uses for the files it shares.
+ */
+TransferParameters TransferParameters::local()
+{
+    static const TransferParameters parameters(
+        qBound(minimumBlockSize,
+               QSettings().value(QLatin1String("transfer/blockSize"), defaultBlockSize).toLongLong(),
+               maximumBlockSize),
+        algorithmFromName(QSettings().value(QLatin1String("transfer/hashAlgorithm"),
+                                            QLatin1String("sha1")).toString()));
+    return parameters;
+}
+
+/*! Returns true if these are parameters we are prepared to use, e.g. if a
+ * peer announced them.
+ */
+bool TransferParameters::isValid() const
+{
+    return blockSize >= minimumBlockSize && blockSize <= maximumBlockSize &&
+           (algorithm == QCryptographicHash::Md4 ||
+            algorithm == QCryptographicHash::Md5 ||
+            algorithm == QCryptographicHash::Sha1);
+}
+
+/*! Pads \a digest the way it comes back from the wire, so ours and the
+ * peer's compare equal (see WireWriter::writeDigest()).
+ */
+static QByteArray wireDigest(const QByteArray &digest)
+{
+    if (digest.size() >= syncDigestSize)
+        return digest;
+
+    return digest + QByteArray(syncDigestSize - digest.size(), 0);
+}
+
+QByteArray TransferParameters::hashBlock(const char *data, int length) const
+{
+    const qint64 start = threadCpuTime();
+    const QByteArray hash = wireDigest(QCryptographicHash::hash(QByteArray::fromRawData(data, length), algorithm));
+    recordHashing(length, threadCpuTime() - start);
+    return hash;
+}
+
+/*! Hashes the rest of \a file into \a fileHash, and, if \a blockHashes is
+ * given, appends the hash of each block to it.
+ *
+ * Returns false if the file couldn't be read.
+ */
+bool TransferParameters::hashFile(QIODevice *file, QByteArray *fileHash, QList<QByteArray> *blockHashes) const
+{
+    SYNC_TRACE_SPAN("files", "hashFile");
+
+    QCryptographicHash hash(algorithm);
+    QByteArray buffer(int(blockSize), Qt::Uninitialized);
+    qint64 readSize;
+
+    while ((readSize = file->read(buffer.data(), blockSize)) > 0) {
+        // only the hashing is timed, not the reading
+        const qint64 start = threadCpuTime();
+
+        hash.addData(buffer.constData(), int(readSize));
+        if (blockHashes)
+            blockHashes->append(wireDigest(QCryptographicHash::hash(QByteArray::fromRawData(buffer.constData(), int(readSize)), algorithm)));
+
+        recordHashing(blockHashes ? readSize * 2 : readSize, threadCpuTime() - start);
+    }
+
+    SYNC_TRACE_ARGUMENT("bytes", file->pos());
+
+    if (readSize < 0)
+        return false;
+
+    *fileHash = wireDigest(hash.result());
+    return true;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TRANSFERPARAMETERS_H
+#define TRANSFERPARAMETERS_H
+
+// Qt
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QList>
+
+class QIODevice;
+
+/*! How a file is cut into blocks and hashed for transfer.
+ *
+ * The sending side picks these from its settings (transfer/blockSize and
+ * transfer/hashAlgorithm) and announces them along with the file; the
+ * receiving side uses whatever it was told. Time spent hashing is counted
+ * in SyncMetrics::process().
+ */
+class TransferParameters
+{
+public:
+    TransferParameters();
+    TransferParameters(qint64 blockSize, QCryptographicHash::Algorithm algorithm);
+
+    static TransferParameters local();
+
+    bool isValid() const;
+
+    QByteArray hashBlock(const char *data, int length) const;
+    bool hashFile(QIODevice *file, QByteArray *fileHash, QList<QByteArray> *blockHashes = 0) const;
+
+    qint64 blockSize;
+    QCryptographicHash::Algorithm algorithm;
+};
+
+#endif // TRANSFERPARAMETERS_H
@@ -1,26 +1,12 @@
-QT += network
-TEMPLATE = app
-TARGET = saesu-syncd
-DEPENDPATH += .
+TEMPLATE = subdirs
+SUBDIRS = src
 
-unix:!mac {
-    LIBS += -ldns_sd
+# the benchmarks and tests build against a stand-in for libsaesu, so they
+# aren't built by default; pass CONFIG+=benchmarks or CONFIG+=tests to qmake
+CONFIG(benchmarks) {
+    SUBDIRS += benchmarks
 }
 
-MOC_DIR = ./.moc/
-OBJECTS_DIR = ./.obj/
-
-# Input
-SOURCES += src/main.cpp \
-    src/syncadvertiser.cpp \
-    src/syncmanagersynchroniser.cpp \
-    src/syncmanager.cpp \
-    src/filewatcher.cpp
-
-HEADERS += src/syncadvertiser.h \
-    src/syncmanagersynchroniser.h \
-    src/syncmanager.h \
-    src/filewatcher.h
-
-CONFIG += link_pkgconfig
-PKGCONFIG += saesu
+CONFIG(tests) {
+    SUBDIRS += tests
+}
@@ -0,0 +1,11 @@
+TEMPLATE = app
+TARGET = tst_fileassembler
+
+QT += testlib
+
+include(../../benchmarks/common/common.pri)
+
+SOURCES += tst_fileassembler.cpp \
+    ../../benchmarks/common/localnode.cpp
+
+HEADERS += ../../benchmarks/common/localnode.h
@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Checks that an interrupted FileAssembler leaves a journal a later one
+// resumes from, that a journal for a different transfer or a damaged one
+// is ignored, and that resumed data which no longer matches is caught by
+// the final hash check.
+
+// Qt
+#include <QBuffer>
+#include <QDir>
+#include <QFile>
+#include <QtTest>
+
+// Posix
+#include <unistd.h>
+
+// Us
+#include "benchmarkprocess.h"
+#include "fileassembler.h"
+#include "transferparameters.h"
+
+static const qint64 blockSize = 4096;
+
+class tst_FileAssembler : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void init();
+    void resume();
+    void differentTransferStartsOver();
+    void damagedJournalStartsOver();
+    void changedDataCaught();
+
+private:
+    static QByteArray contents(char seed);
+    static QByteArray fileHash(const QByteArray &data, const TransferParameters &parameters);
+    static QByteArray block(const QByteArray &data, quint64 blockNumber);
+    static QString temporaryFileName(const char *suffix);
+    static QByteArray readFile(const QString &fileName);
+
+    QByteArray mData;
+    TransferParameters mParameters;
+    QByteArray mHash;
+};
+
+static const char destination[] = "received.bin";
+
+void tst_FileAssembler::initTestCase()
+{
+    BenchmarkProcess::isolate(QDir::tempPath().toLocal8Bit() + "/tst_fileassembler-" + QByteArray::number(getpid()));
+
+    // ten whole blocks and a short one
+    mData = contents('a');
+    mParameters = TransferParameters(blockSize, QCryptographicHash::Sha1);
+    mHash = fileHash(mData, mParameters);
+}
+
+void tst_FileAssembler::init()
+{
+    QFile::remove(QLatin1String(destination));
+    QFile::remove(temporaryFileName(".syncd-part"));
+    QFile::remove(temporaryFileName(".syncd-journal"));
+}
+
+QByteArray tst_FileAssembler::contents(char seed)
+{
+    QByteArray data;
+    for (int i = 0; i < 10 * blockSize + 1000; ++i)
+        data.append(char(seed + i * 7 % 251));
+    return data;
+}
+
+QByteArray tst_FileAssembler::fileHash(const QByteArray &data, const TransferParameters &parameters)
+{
+    QBuffer buffer;
+    buffer.setData(data);
+    buffer.open(QIODevice::ReadOnly);
+
+    QByteArray hash;
+    parameters.hashFile(&buffer, &hash);
+    return hash;
+}
+
+QByteArray tst_FileAssembler::block(const QByteArray &data, quint64 blockNumber)
+{
+    return data.mid(int(blockNumber * blockSize), int(blockSize));
+}
+
+QString tst_FileAssembler::temporaryFileName(const char *suffix)
+{
+    return QLatin1String(".") + QLatin1String(destination) + QLatin1String(suffix);
+}
+
+QByteArray tst_FileAssembler::readFile(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    return file.readAll();
+}
+
+void tst_FileAssembler::resume()
+{
+    {
+        FileAssembler assembler(QLatin1String(destination), mData.size(), mHash, mParameters);
+        QVERIFY(assembler.open());
+        QCOMPARE(assembler.blockCount(), quint64(11));
+
+        QVERIFY(assembler.writeBlock(0, block(mData, 0)));
+        QVERIFY(assembler.writeBlock(1, block(mData, 1)));
+        QVERIFY(assembler.writeBlock(5, block(mData, 5)));
+        QVERIFY(assembler.writeBlock(10, block(mData, 10)));
+
+        // interrupted
+    }
+
+    QVERIFY(QFile::exists(temporaryFileName(".syncd-journal")));
+    QVERIFY(!QFile::exists(QLatin1String(destination)));
+
+    FileAssembler assembler(QLatin1String(destination), mData.size(), mHash, mParameters);
+    QVERIFY(assembler.open());
+    QVERIFY(assembler.hasBlock(0));
+    QVERIFY(assembler.hasBlock(1));
+    QVERIFY(!assembler.hasBlock(2));
+    QVERIFY(assembler.hasBlock(5));
+    QVERIFY(assembler.hasBlock(10));
+    QVERIFY(!assembler.isComplete());
+
+    for (quint64 i = 0; i < assembler.blockCount(); ++i) {
+        if (!assembler.hasBlock(i))
+            QVERIFY(assembler.writeBlock(i, block(mData, i)));
+    }
+
+    QVERIFY(assembler.isComplete());
+    QVERIFY(assembler.commit());
+
+    QCOMPARE(readFile(QLatin1String(destination)), mData);
+    QVERIFY(!QFile::exists(temporaryFileName(".syncd-part")));
+    QVERIFY(!QFile::exists(temporaryFileName(".syncd-journal")));
+}
+
+void tst_FileAssembler::differentTransferStartsOver()
+{
+    {
+        FileAssembler assembler(QLatin1String(destination), mData.size(), mHash, mParameters);
+        QVERIFY(assembler.open());
+        QVERIFY(assembler.writeBlock(0, block(mData, 0)));
+    }
+
+    // another version of the file
+    const QByteArray other = contents('b');
+    {
+        FileAssembler assembler(QLatin1String(destination), other.size(), fileHash(other, mParameters), mParameters);
+        QVERIFY(assembler.open());
+        QVERIFY(!assembler.hasBlock(0));
+    }
+
+    // the same file, cut up differently
+    const TransferParameters parameters(2 * blockSize, QCryptographicHash::Sha1);
+    FileAssembler assembler(QLatin1String(destination), mData.size(), fileHash(mData, parameters), parameters);
+    QVERIFY(assembler.open());
+    QVERIFY(!assembler.hasBlock(0));
+}
+
+void tst_FileAssembler::damagedJournalStartsOver()
+{
+    {
+        FileAssembler assembler(QLatin1String(destination), mData.size(), mHash, mParameters);
+        QVERIFY(assembler.open());
+        QVERIFY(assembler.writeBlock(0, block(mData, 0)));
+    }
+
+    const QByteArray journal = readFile(temporaryFileName(".syncd-journal"));
+    QVERIFY(!journal.isEmpty());
+
+    QFile file(temporaryFileName(".syncd-journal"));
+    QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    file.write(journal.left(journal.size() / 2));
+    file.close();
+
+    FileAssembler assembler(QLatin1String(destination), mData.size(), mHash, mParameters);
+    QVERIFY(assembler.open());
+    QVERIFY(!assembler.hasBlock(0));
+}
+
+void tst_FileAssembler::changedDataCaught()
+{
+    {
+        FileAssembler assembler(QLatin1String(destination), mData.size(), mHash, mParameters);
+        QVERIFY(assembler.open());
+        for (quint64 i = 1; i < assembler.blockCount(); ++i)
+            QVERIFY(assembler.writeBlock(i, block(mData, i)));
+    }
+
+    // something scribbles over the partial file while we're away
+    QFile file(temporaryFileName(".syncd-part"));
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QVERIFY(file.seek(blockSize));
+    file.write(QByteArray(16, 'x'));
+    file.close();
+
+    FileAssembler assembler(QLatin1String(destination), mData.size(), mHash, mParameters);
+    QVERIFY(assembler.open());
+    QVERIFY(assembler.hasBlock(1));
+    QVERIFY(assembler.writeBlock(0, block(mData, 0)));
+    QVERIFY(assembler.isComplete());
+
+    QVERIFY(!assembler.commit());
+    QVERIFY(!QFile::exists(QLatin1String(destination)));
+    QVERIFY(!QFile::exists(temporaryFileName(".syncd-part")));
+    QVERIFY(!QFile::exists(temporaryFileName(".syncd-journal")));
+}
+
+QTEST_MAIN(tst_FileAssembler)
+#include "tst_fileassembler.moc"
@@ -0,0 +1,11 @@
+TEMPLATE = app
+TARGET = tst_framescheduler
+
+QT += testlib
+
+include(../../benchmarks/common/common.pri)
+
+SOURCES += tst_framescheduler.cpp \
+    ../../benchmarks/common/localnode.cpp
+
+HEADERS += ../../benchmarks/common/localnode.h
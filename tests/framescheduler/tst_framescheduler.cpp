@@ -0,0 +1,282 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Checks that FrameScheduler sends small frames whole and large ones as
+// fragments that reassemble, per stream, into the original frames, and
+// that control frames and other streams get a turn in between.
+
+// Qt
+#include <QtTest>
+
+// Saesu
+#include <sobject.h>
+
+// Us
+#include "framescheduler.h"
+#include "syncmanagersynchroniser.h"
+#include "syncmessages.h"
+#include "syncprotocol.h"
+
+// the length in front of every frame
+static const int lengthSize = sizeof(quint32);
+
+class tst_FrameScheduler : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void smallFrameWhole();
+    void largeFrameFragmented();
+    void controlFirst();
+    void metadataOvertakesBulk();
+    void streamsInterleave();
+    void shapedHeldBack();
+
+private:
+    static SyncFrame blockReply(quint64 blockNumber, int size);
+    static bool reassemble(const QByteArray &sent, QByteArray *partial, QByteArray *frame, quint64 *stream);
+};
+
+SyncFrame tst_FrameScheduler::blockReply(quint64 blockNumber, int size)
+{
+    FileBlockReplyMessage message;
+    message.fileName = QString::fromLatin1("music.mp3");
+    message.blockNumber = blockNumber;
+    message.block = QByteArray(size, char('a' + blockNumber % 26));
+    return encodeMessage(message);
+}
+
+/*! Collects \a sent, which must be a fragment, into \a partial, the way
+ * the receiving synchroniser does. Returns true, with the command (without
+ * its length) in \a frame, once the fragment was the final one.
+ */
+bool tst_FrameScheduler::reassemble(const QByteArray &sent, QByteArray *partial, QByteArray *frame, quint64 *stream)
+{
+    FragmentMessage fragment;
+    WireReader reader(sent, lengthSize + sizeof(quint8));
+    if (quint8(sent.at(lengthSize)) != SyncManagerSynchroniser::FragmentCommand ||
+        !decodeMessage(reader, QHash<quint32, QString>(), fragment))
+        return false;
+
+    *stream = fragment.stream;
+    partial->append(fragment.piece);
+    if (!fragment.final)
+        return false;
+
+    *frame = *partial;
+    partial->clear();
+    return true;
+}
+
+void tst_FrameScheduler::smallFrameWhole()
+{
+    FrameScheduler scheduler;
+    const SyncFrame frame = blockReply(0, 1024);
+
+    scheduler.enqueue(frame.bytes);
+    QCOMPARE(scheduler.queuedBytes(), qint64(frame.bytes.size()));
+    QCOMPARE(scheduler.takeFrame(), frame.bytes);
+    QVERIFY(scheduler.isEmpty());
+    QCOMPARE(scheduler.queuedBytes(), qint64(0));
+    QVERIFY(scheduler.takeFrame().isEmpty());
+}
+
+void tst_FrameScheduler::largeFrameFragmented()
+{
+    FrameScheduler scheduler;
+    const SyncFrame frame = blockReply(1, 100 * 1024);
+    scheduler.enqueue(frame.bytes);
+
+    QByteArray partial;
+    QByteArray reassembled;
+    quint64 stream = FrameScheduler::StreamCount;
+    int fragments = 0;
+
+    while (!scheduler.isEmpty()) {
+        const QByteArray sent = scheduler.takeFrame();
+        QVERIFY(!sent.isEmpty());
+
+        // a fragment's piece, and its own header, stay well under a frame
+        QVERIFY(sent.size() <= 16 * 1024 + 32);
+        ++fragments;
+
+        if (reassemble(sent, &partial, &reassembled, &stream))
+            QVERIFY(scheduler.isEmpty());
+    }
+
+    QVERIFY(fragments > 1);
+    QCOMPARE(stream, quint64(FrameScheduler::FileBulkStream));
+    QCOMPARE(reassembled, frame.bytes.mid(lengthSize));
+    QCOMPARE(scheduler.queuedBytes(), qint64(0));
+
+    FileBlockReplyMessage message;
+    WireReader reader(reassembled, sizeof(quint8));
+    QVERIFY(decodeMessage(reader, frame.names, message));
+    QCOMPARE(message.blockNumber, quint64(1));
+    QCOMPARE(message.block.size(), 100 * 1024);
+}
+
+void tst_FrameScheduler::controlFirst()
+{
+    FrameScheduler scheduler;
+    const SyncFrame bulk = blockReply(2, 64 * 1024);
+    scheduler.enqueue(bulk.bytes);
+
+    QByteArray partial;
+    QByteArray reassembled;
+    quint64 stream;
+    QVERIFY(!reassemble(scheduler.takeFrame(), &partial, &reassembled, &stream));
+
+    // jumps in halfway through the bulk frame
+    DeclareNameMessage declaration;
+    declaration.handle = 1;
+    declaration.name = QLatin1String("music.mp3");
+    const QByteArray control = encodeMessage(declaration).bytes;
+    scheduler.enqueue(control);
+    QCOMPARE(scheduler.takeFrame(), control);
+
+    bool done = false;
+    while (!scheduler.isEmpty())
+        done = reassemble(scheduler.takeFrame(), &partial, &reassembled, &stream);
+
+    QVERIFY(done);
+    QCOMPARE(reassembled, bulk.bytes.mid(lengthSize));
+}
+
+void tst_FrameScheduler::metadataOvertakesBulk()
+{
+    FrameScheduler scheduler;
+    const SyncFrame bulk = blockReply(3, 200 * 1024);
+    scheduler.enqueue(bulk.bytes);
+
+    QByteArray partial;
+    QByteArray reassembled;
+    quint64 stream;
+    QVERIFY(!reassemble(scheduler.takeFrame(), &partial, &reassembled, &stream));
+    QVERIFY(!reassemble(scheduler.takeFrame(), &partial, &reassembled, &stream));
+
+    ObjectListMessage list;
+    list.cloudName = QString::fromLatin1("cloud");
+    const QByteArray metadata = encodeMessage(list).bytes;
+    for (int i = 0; i < 8; ++i)
+        scheduler.enqueue(metadata);
+
+    // the object lists go within a turn, not after the rest of the block
+    int bulkBefore = 0;
+    int metadataSeen = 0;
+    bool done = false;
+
+    while (!scheduler.isEmpty()) {
+        const QByteArray sent = scheduler.takeFrame();
+        if (sent == metadata) {
+            ++metadataSeen;
+            continue;
+        }
+
+        if (metadataSeen < 8)
+            ++bulkBefore;
+
+        done = reassemble(sent, &partial, &reassembled, &stream);
+    }
+
+    QCOMPARE(metadataSeen, 8);
+    QVERIFY(bulkBefore <= 1);
+    QVERIFY(done);
+    QCOMPARE(reassembled, bulk.bytes.mid(lengthSize));
+}
+
+void tst_FrameScheduler::streamsInterleave()
+{
+    FrameScheduler scheduler;
+
+    SObject object;
+    object.setId(SObjectId(SObjectLocalId("object")));
+    object.setPayload(QByteArray(200 * 1024, 'o'));
+    object.setLastSaved(1);
+
+    ObjectReplyMessage reply;
+    reply.cloudName = QString::fromLatin1("cloud");
+    reply.id = object.id().localId();
+    reply.object = object;
+    const SyncFrame body = encodeMessage(reply);
+
+    const SyncFrame first = blockReply(4, 200 * 1024);
+    const SyncFrame second = blockReply(5, 200 * 1024);
+    scheduler.enqueue(first.bytes);
+    scheduler.enqueue(second.bytes);
+    scheduler.enqueue(body.bytes);
+
+    // fragments of different streams arrive interleaved, so the receiving
+    // side keeps a partial frame for each
+    QByteArray partial[FrameScheduler::StreamCount];
+    QList<QByteArray> reassembled[FrameScheduler::StreamCount];
+    int bulkBeforeBody = 0;
+
+    while (!scheduler.isEmpty()) {
+        const QByteArray sent = scheduler.takeFrame();
+
+        FragmentMessage fragment;
+        WireReader reader(sent, lengthSize + sizeof(quint8));
+        QVERIFY(decodeMessage(reader, QHash<quint32, QString>(), fragment));
+        QVERIFY(fragment.stream < quint64(FrameScheduler::StreamCount));
+
+        if (fragment.stream == quint64(FrameScheduler::FileBulkStream) &&
+            reassembled[FrameScheduler::ObjectBodyStream].isEmpty())
+            ++bulkBeforeBody;
+
+        QByteArray frame;
+        quint64 stream;
+        if (reassemble(sent, &partial[fragment.stream], &frame, &stream))
+            reassembled[stream].append(frame);
+    }
+
+    // the object doesn't wait for both blocks, nor the blocks for it
+    QVERIFY(bulkBeforeBody > 0);
+    QVERIFY(bulkBeforeBody < 2 * 200 * 1024 / (16 * 1024));
+
+    QCOMPARE(reassembled[FrameScheduler::ObjectBodyStream].count(), 1);
+    QCOMPARE(reassembled[FrameScheduler::ObjectBodyStream].at(0), body.bytes.mid(lengthSize));
+
+    // within a stream, frames keep their order
+    QCOMPARE(reassembled[FrameScheduler::FileBulkStream].count(), 2);
+    QCOMPARE(reassembled[FrameScheduler::FileBulkStream].at(0), first.bytes.mid(lengthSize));
+    QCOMPARE(reassembled[FrameScheduler::FileBulkStream].at(1), second.bytes.mid(lengthSize));
+}
+
+void tst_FrameScheduler::shapedHeldBack()
+{
+    FrameScheduler scheduler;
+    const SyncFrame bulk = blockReply(5, 1024);
+    scheduler.enqueue(bulk.bytes);
+
+    // waiting for bandwidth
+    QVERIFY(scheduler.takeFrame(false).isEmpty());
+    QVERIFY(!scheduler.isEmpty());
+
+    DeclareNameMessage declaration;
+    declaration.handle = 1;
+    declaration.name = QLatin1String("music.mp3");
+    const QByteArray control = encodeMessage(declaration).bytes;
+    scheduler.enqueue(control);
+    QCOMPARE(scheduler.takeFrame(false), control);
+
+    QCOMPARE(scheduler.takeFrame(true), bulk.bytes);
+    QVERIFY(scheduler.isEmpty());
+}
+
+QTEST_MAIN(tst_FrameScheduler)
+#include "tst_framescheduler.moc"
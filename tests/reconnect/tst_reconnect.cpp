@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Checks that an outgoing synchroniser can be used for more than one
+// connection: each time it reconnects, the peer introducing itself again
+// must complete the handshake.
+
+// Qt
+#include <QDir>
+#include <QHostAddress>
+#include <QSignalSpy>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QtTest>
+
+// Posix
+#include <unistd.h>
+
+// Us
+#include "benchmarkprocess.h"
+#include "localnode.h"
+#include "syncmanagersynchroniser.h"
+#include "syncmessages.h"
+
+// sorts above our id, so our outgoing connections are the ones kept
+static const char peerNodeId[] = "node-peer";
+
+class tst_Reconnect : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void secondHandshake();
+
+private:
+    QTcpSocket *acceptPeer(QTcpServer *server);
+    static bool waitFor(QSignalSpy *spy, int count);
+};
+
+void tst_Reconnect::initTestCase()
+{
+    BenchmarkProcess::isolate(QDir::tempPath().toLocal8Bit() + "/tst_reconnect-" + QByteArray::number(getpid()));
+    BenchmarkProcess::registerMetaTypes();
+    LocalNode::setId("node-local");
+}
+
+/*! Accepts the synchroniser's connection to \a server, and introduces the
+ * peer on it.
+ */
+QTcpSocket *tst_Reconnect::acceptPeer(QTcpServer *server)
+{
+    // the synchroniser connects from our event loop, so we can't block
+    for (int waited = 0; !server->hasPendingConnections() && waited < 5000; waited += 10)
+        QTest::qWait(10);
+
+    if (!server->hasPendingConnections())
+        return 0;
+
+    QTcpSocket *socket = server->nextPendingConnection();
+
+    HelloMessage hello;
+    hello.version = syncProtocolVersion;
+    hello.nodeId = peerNodeId;
+    socket->write(encodeMessage(hello).bytes);
+    return socket;
+}
+
+bool tst_Reconnect::waitFor(QSignalSpy *spy, int count)
+{
+    for (int waited = 0; spy->count() < count && waited < 5000; waited += 10)
+        QTest::qWait(10);
+
+    return spy->count() >= count;
+}
+
+void tst_Reconnect::secondHandshake()
+{
+    QTcpServer server;
+    QVERIFY(server.listen(QHostAddress::LocalHost));
+
+    SyncManagerSynchroniser syncer;
+    QSignalSpy handshakes(&syncer, SIGNAL(handshakeReceived(QByteArray)));
+    QSignalSpy losses(&syncer, SIGNAL(connectionLost(bool)));
+
+    syncer.connectToHost(QHostAddress(QHostAddress::LocalHost), server.serverPort());
+    QTcpSocket *first = acceptPeer(&server);
+    QVERIFY(first);
+    QVERIFY(waitFor(&handshakes, 1));
+    QCOMPARE(syncer.peerNodeId(), QByteArray(peerNodeId));
+
+    // the peer goes away, and the synchroniser forgets it was ever there
+    first->disconnectFromHost();
+    QVERIFY(waitFor(&losses, 1));
+    QVERIFY(losses.at(0).at(0).toBool());
+    QVERIFY(syncer.peerNodeId().isEmpty());
+    delete first;
+
+    syncer.connectToHost(QHostAddress(QHostAddress::LocalHost), server.serverPort());
+    QTcpSocket *second = acceptPeer(&server);
+    QVERIFY(second);
+    QVERIFY(waitFor(&handshakes, 2));
+    QCOMPARE(handshakes.at(1).at(0).toByteArray(), QByteArray(peerNodeId));
+    QCOMPARE(syncer.peerNodeId(), QByteArray(peerNodeId));
+    delete second;
+}
+
+QTEST_MAIN(tst_Reconnect)
+#include "tst_reconnect.moc"
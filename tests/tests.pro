@@ -0,0 +1,8 @@
+# Tests for syncd; they build against the same stand-in for libsaesu as the
+# benchmarks (see benchmarks/common).
+TEMPLATE = subdirs
+SUBDIRS = reconnect \
+    wireformat \
+    framescheduler \
+    tokenbucket \
+    fileassembler
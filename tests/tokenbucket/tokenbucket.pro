@@ -0,0 +1,11 @@
+TEMPLATE = app
+TARGET = tst_tokenbucket
+
+QT += testlib
+
+include(../../benchmarks/common/common.pri)
+
+SOURCES += tst_tokenbucket.cpp \
+    ../../benchmarks/common/localnode.cpp
+
+HEADERS += ../../benchmarks/common/localnode.h
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Checks that TokenBucket keeps the whole debt of a send larger than its
+// tokens, makes callers wait until it is paid off, and so holds the rate
+// on average however large the sends are.
+
+// Qt
+#include <QtTest>
+
+// Us
+#include "bandwidthlimiter.h"
+
+// a second, in the microseconds buckets count in
+static const qint64 second = 1000000;
+
+class tst_TokenBucket : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void unlimited();
+    void burstCapped();
+    void debtKept();
+    void delayPaysOffDebt();
+    void averageRate();
+};
+
+void tst_TokenBucket::unlimited()
+{
+    TokenBucket bucket;
+    QCOMPARE(bucket.rate(), qint64(0));
+
+    bucket.consume(Q_INT64_C(1) << 40, second);
+    QVERIFY(bucket.hasTokens(second));
+    QCOMPARE(bucket.delay(second), qint64(0));
+}
+
+void tst_TokenBucket::burstCapped()
+{
+    // a tenth of a second's worth, but never less than 64KiB
+    TokenBucket slow;
+    slow.setRate(100 * 1000);
+    QCOMPARE(slow.tokens(100 * second), qint64(64 * 1024));
+
+    TokenBucket fast;
+    fast.setRate(10 * 1000 * 1000);
+    QCOMPARE(fast.tokens(100 * second), qint64(1000 * 1000));
+}
+
+void tst_TokenBucket::debtKept()
+{
+    TokenBucket bucket;
+    bucket.setRate(100 * 1000);
+
+    const qint64 burst = bucket.tokens(10 * second);
+    QVERIFY(bucket.hasTokens(10 * second));
+
+    // far more than a burst at once; all of it is owed
+    bucket.consume(10 * burst, 10 * second);
+    QCOMPARE(bucket.tokens(10 * second), -9 * burst);
+    QVERIFY(!bucket.hasTokens(10 * second));
+
+    // still in debt after a burst's worth of time...
+    const qint64 burstTime = burst * second / bucket.rate();
+    QVERIFY(!bucket.hasTokens(10 * second + burstTime));
+
+    // ...and only out of it once all of it has been earned back
+    QVERIFY(!bucket.hasTokens(10 * second + 9 * burstTime - second / 100));
+    QVERIFY(bucket.hasTokens(10 * second + 9 * burstTime + second / 100));
+}
+
+void tst_TokenBucket::delayPaysOffDebt()
+{
+    TokenBucket bucket;
+    bucket.setRate(100 * 1000);
+
+    const qint64 now = 10 * second;
+    bucket.consume(bucket.tokens(now) + 200 * 1000, now);
+
+    // two seconds' worth owed
+    const qint64 delay = bucket.delay(now);
+    QVERIFY(delay >= 2 * second);
+    QVERIFY(delay <= 2 * second + second / 100);
+
+    QVERIFY(!bucket.hasTokens(now + delay - second / 100));
+    QVERIFY(bucket.hasTokens(now + delay));
+    QCOMPARE(bucket.delay(now + delay), qint64(0));
+}
+
+void tst_TokenBucket::averageRate()
+{
+    TokenBucket bucket;
+    bucket.setRate(1000 * 1000);
+
+    // sends much larger than a burst, as soon as each is allowed
+    const qint64 sendSize = 4 * 1000 * 1000;
+    const qint64 start = 10 * second;
+    const qint64 end = start + 60 * second;
+    qint64 sent = 0;
+
+    for (qint64 now = start; now < end; now += qMax<qint64>(bucket.delay(now), 1000)) {
+        if (bucket.hasTokens(now)) {
+            bucket.consume(sendSize, now);
+            sent += sendSize;
+        }
+    }
+
+    // at most the rate, plus the first burst and the send that overshot
+    QVERIFY(sent <= 60 * bucket.rate() + 1000 * 1000 + sendSize);
+    QVERIFY(sent >= 60 * bucket.rate() - sendSize);
+}
+
+QTEST_MAIN(tst_TokenBucket)
+#include "tst_tokenbucket.moc"
@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2010-2011 Robin Burchell
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Checks that the wire format round trips, and that hostile input is
+// rejected rather than believed: overlong varints, list counts larger than
+// the payload, names that were never declared, cut short digests, and
+// peers declaring more names than protocol/maxNames allows.
+
+// Qt
+#include <QCryptographicHash>
+#include <QDir>
+#include <QHostAddress>
+#include <QSettings>
+#include <QSignalSpy>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QtTest>
+
+// Posix
+#include <unistd.h>
+
+// Us
+#include "benchmarkprocess.h"
+#include "localnode.h"
+#include "syncmanagersynchroniser.h"
+#include "syncmessages.h"
+#include "syncprotocol.h"
+
+// the length and command token in front of every payload
+static const int payloadOffset = sizeof(quint32) + sizeof(quint8);
+
+// sorts above our id, so our outgoing connection is the one kept
+static const char peerNodeId[] = "node-peer";
+
+// the least protocol/maxNames can be set to
+static const int maxNames = 1024;
+
+/*! Decodes the frame \a bytes into \a message, with the peer having
+ * declared \a names.
+ */
+template <typename Message> static bool decode(const QByteArray &bytes, const QHash<quint32, QString> &names,
+                                               Message *message)
+{
+    WireReader reader(bytes, payloadOffset);
+    return decodeMessage(reader, names, *message);
+}
+
+class tst_WireFormat : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void roundTrip();
+    void shortDigestPadded();
+    void oversizeDigest();
+    void varintLimits();
+    void varintOverflow();
+    void listCountBeyondPayload();
+    void undeclaredName();
+    void truncatedDigest();
+    void trailingBytes();
+    void tooManyNames();
+
+private:
+    static FileInfoMessage fileInfo();
+    QTcpSocket *acceptPeer(QTcpServer *server);
+    static bool waitFor(QSignalSpy *spy, int count);
+};
+
+void tst_WireFormat::initTestCase()
+{
+    BenchmarkProcess::isolate(QDir::tempPath().toLocal8Bit() + "/tst_wireformat-" + QByteArray::number(getpid()));
+    BenchmarkProcess::registerMetaTypes();
+    LocalNode::setId("node-local");
+
+    // read once, by the first connection
+    QSettings settings;
+    settings.setValue(QLatin1String("protocol/maxNames"), maxNames);
+    settings.sync();
+}
+
+FileInfoMessage tst_WireFormat::fileInfo()
+{
+    FileInfoMessage message;
+    message.fileName = QString::fromLatin1("music.mp3");
+    message.fileSize = Q_UINT64_C(5000000000);
+    message.fileHash = QCryptographicHash::hash("music", QCryptographicHash::Sha1);
+    message.blockSize = 64 * 1024;
+    message.hashAlgorithm = QCryptographicHash::Sha1;
+    return message;
+}
+
+void tst_WireFormat::roundTrip()
+{
+    const FileInfoMessage sent = fileInfo();
+    const SyncFrame frame = encodeMessage(sent);
+    QCOMPARE(quint8(frame.bytes.at(sizeof(quint32))), quint8(SyncManagerSynchroniser::FileInfoCommand));
+
+    FileInfoMessage received;
+    QVERIFY(decode(frame.bytes, frame.names, &received));
+    QCOMPARE(received.fileName.value, sent.fileName.value);
+    QCOMPARE(received.fileSize, sent.fileSize);
+    QCOMPARE(received.fileHash.value, sent.fileHash.value);
+    QCOMPARE(received.blockSize, sent.blockSize);
+    QCOMPARE(received.hashAlgorithm, sent.hashAlgorithm);
+}
+
+void tst_WireFormat::shortDigestPadded()
+{
+    FileInfoMessage sent = fileInfo();
+    sent.fileHash = QCryptographicHash::hash("music", QCryptographicHash::Md5);
+    const SyncFrame frame = encodeMessage(sent);
+
+    FileInfoMessage received;
+    QVERIFY(decode(frame.bytes, frame.names, &received));
+    QCOMPARE(received.fileHash.value, sent.fileHash.value + QByteArray(syncDigestSize - sent.fileHash.value.size(), 0));
+}
+
+void tst_WireFormat::oversizeDigest()
+{
+    FileInfoMessage sent = fileInfo();
+    sent.fileHash = QByteArray(syncDigestSize + 12, 'x');
+
+    // not truncated into something that looks valid
+    QVERIFY(encodeMessage(sent).bytes.isEmpty());
+}
+
+void tst_WireFormat::varintLimits()
+{
+    WireWriter writer(SyncManagerSynchroniser::CurrentTimeCommand);
+    writer.writeVarint(0);
+    writer.writeVarint(Q_UINT64_C(0xffffffffffffffff));
+    writer.writeSignedVarint(Q_INT64_C(-0x7fffffffffffffff) - 1);
+    const SyncFrame frame = writer.finish();
+
+    WireReader reader(frame.bytes, payloadOffset);
+    QCOMPARE(reader.readVarint(), Q_UINT64_C(0));
+    QCOMPARE(reader.readVarint(), Q_UINT64_C(0xffffffffffffffff));
+    QCOMPARE(reader.readSignedVarint(), Q_INT64_C(-0x7fffffffffffffff) - 1);
+    QVERIFY(reader.isValid());
+    QVERIFY(reader.atEnd());
+}
+
+void tst_WireFormat::varintOverflow()
+{
+    // more continuation bytes than 64 bits need
+    QByteArray tooLong(11, char(0x80));
+    tooLong.append(char(0));
+    WireReader longReader(tooLong);
+    longReader.readVarint();
+    QVERIFY(!longReader.isValid());
+
+    // ten bytes, but the last has more than the top bit
+    QByteArray tooBig(9, char(0xff));
+    tooBig.append(char(0x02));
+    WireReader bigReader(tooBig);
+    bigReader.readVarint();
+    QVERIFY(!bigReader.isValid());
+
+    // cut short
+    WireReader shortReader(QByteArray(1, char(0x80)));
+    shortReader.readVarint();
+    QVERIFY(!shortReader.isValid());
+
+    // and once invalid, nothing more is read
+    QCOMPARE(shortReader.readVarint(), Q_UINT64_C(0));
+    QVERIFY(shortReader.readBytes().isEmpty());
+}
+
+void tst_WireFormat::listCountBeyondPayload()
+{
+    WireWriter writer(SyncManagerSynchroniser::ObjectListCommand);
+    writer.writeName(QLatin1String("cloud"));
+    writer.writeVarint(Q_UINT64_C(1) << 40);
+    const SyncFrame huge = writer.finish();
+
+    // must fail before trying to reserve the list
+    ObjectListMessage message;
+    QVERIFY(!decode(huge.bytes, huge.names, &message));
+
+    WireWriter shortWriter(SyncManagerSynchroniser::ObjectListCommand);
+    shortWriter.writeName(QLatin1String("cloud"));
+    shortWriter.writeVarint(3);
+    shortWriter.writeVarint(0);
+    const SyncFrame cut = shortWriter.finish();
+
+    ObjectListMessage shortMessage;
+    QVERIFY(!decode(cut.bytes, cut.names, &shortMessage));
+}
+
+void tst_WireFormat::undeclaredName()
+{
+    const SyncFrame frame = encodeMessage(fileInfo());
+
+    FileInfoMessage message;
+    QVERIFY(!decode(frame.bytes, QHash<quint32, QString>(), &message));
+
+    // a handle that was declared, but for something else
+    QHash<quint32, QString> others;
+    others.insert(frame.names.constBegin().key() + 1, QLatin1String("other"));
+    QVERIFY(!decode(frame.bytes, others, &message));
+}
+
+void tst_WireFormat::truncatedDigest()
+{
+    FileHashReplyMessage sent;
+    sent.fileName = QString::fromLatin1("music.mp3");
+    sent.blockNumber = 7;
+    sent.blockHash = QCryptographicHash::hash("block", QCryptographicHash::Sha1);
+    const SyncFrame frame = encodeMessage(sent);
+
+    // the digest is the last field
+    for (int missing = 1; missing <= syncDigestSize; ++missing) {
+        FileHashReplyMessage received;
+        QVERIFY(!decode(frame.bytes.left(frame.bytes.size() - missing), frame.names, &received));
+    }
+}
+
+void tst_WireFormat::trailingBytes()
+{
+    const SyncFrame frame = encodeMessage(fileInfo());
+
+    FileInfoMessage message;
+    QVERIFY(!decode(frame.bytes + QByteArray(1, 0), frame.names, &message));
+}
+
+/*! Accepts the synchroniser's connection to \a server, and introduces the
+ * peer on it.
+ */
+QTcpSocket *tst_WireFormat::acceptPeer(QTcpServer *server)
+{
+    // the synchroniser connects from our event loop, so we can't block
+    for (int waited = 0; !server->hasPendingConnections() && waited < 5000; waited += 10)
+        QTest::qWait(10);
+
+    if (!server->hasPendingConnections())
+        return 0;
+
+    QTcpSocket *socket = server->nextPendingConnection();
+
+    HelloMessage hello;
+    hello.version = syncProtocolVersion;
+    hello.nodeId = peerNodeId;
+    socket->write(encodeMessage(hello).bytes);
+    return socket;
+}
+
+bool tst_WireFormat::waitFor(QSignalSpy *spy, int count)
+{
+    for (int waited = 0; spy->count() < count && waited < 5000; waited += 10)
+        QTest::qWait(10);
+
+    return spy->count() >= count;
+}
+
+void tst_WireFormat::tooManyNames()
+{
+    QTcpServer server;
+    QVERIFY(server.listen(QHostAddress::LocalHost));
+
+    SyncManagerSynchroniser syncer;
+    QSignalSpy handshakes(&syncer, SIGNAL(handshakeReceived(QByteArray)));
+    QSignalSpy losses(&syncer, SIGNAL(connectionLost(bool)));
+
+    syncer.connectToHost(QHostAddress(QHostAddress::LocalHost), server.serverPort());
+    QTcpSocket *peer = acceptPeer(&server);
+    QVERIFY(peer);
+    QVERIFY(waitFor(&handshakes, 1));
+    syncer.beginSync();
+
+    // up to the limit is fine, and declaring a name again doesn't count
+    for (int handle = 1; handle <= maxNames; ++handle) {
+        DeclareNameMessage declaration;
+        declaration.handle = handle;
+        declaration.name = QString::fromLatin1("name-%1").arg(handle);
+        peer->write(encodeMessage(declaration).bytes);
+    }
+
+    DeclareNameMessage again;
+    again.handle = 1;
+    again.name = QLatin1String("name-1");
+    peer->write(encodeMessage(again).bytes);
+
+    QTest::qWait(500);
+    QCOMPARE(losses.count(), 0);
+
+    DeclareNameMessage oneMore;
+    oneMore.handle = maxNames + 1;
+    oneMore.name = QLatin1String("one-more");
+    peer->write(encodeMessage(oneMore).bytes);
+
+    QVERIFY(waitFor(&losses, 1));
+    delete peer;
+}
+
+QTEST_MAIN(tst_WireFormat)
+#include "tst_wireformat.moc"